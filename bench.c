@@ -0,0 +1,599 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SDL2/SDL.h>
+
+#include "renderer.h"
+#include "bench.h"
+
+#define BN_RUNS 16 /* Timings are the best of this many */
+
+#define BN_CULL_OBJECTS 100000
+/* Objects are scattered through a cube this wide around the camera, which reaches its far plane */
+#define BN_FIELD_SIZE   60.0f
+
+#define BN_OCCLUDERS       32
+#define BN_OCCLUDER_SCALE  1.5f
+#define BN_OCCLUDER_SPREAD 12.0f /* Half the width the occluders take in front of the camera */
+
+#define BN_BVH_OBJECTS     1000000
+#define BN_BVH_WORLD       1000.0f /* Wide and deep; the height is a twentieth of it */
+#define BN_BVH_QUERIES     200
+#define BN_BVH_QUERY_SIZE  10.0f   /* Box side and sphere radius */
+#define BN_BVH_RAY_LENGTH  100.0f
+#define BN_BVH_MOVE        0.01f   /* Moved back and forth by this, so refits don't rebuild */
+
+/* Sections of a level, each behind the one before, with an occlusion test around each */
+#define BN_QUEUE_SECTIONS 5
+#define BN_QUEUE_OBJECTS  12 /* Per section */
+#define BN_QUEUE_DEPTH    8.0f
+#define BN_QUEUE_FRAMES   3  /* Counts are read after the last, once they cover a whole frame */
+
+#define BN_CUBE_TRIANGLES 12
+
+/* The vector path culling and occluder rasterization take, as renderer.c was compiled with */
+#if defined(__AVX__) && !defined(RD_NO_SIMD)
+#define BN_CULL_PATH "AVX, 8 objects per step"
+#elif defined(__SSE__) && !defined(RD_NO_SIMD)
+#define BN_CULL_PATH "SSE, 4 objects per step"
+#else
+#define BN_CULL_PATH "scalar"
+#endif
+
+static const rdVertex bnCubeVertices[] = {
+	{ -0.5f, -0.5f, -0.5f }, {  0.5f, -0.5f, -0.5f }, {  0.5f,  0.5f, -0.5f },
+	{ -0.5f,  0.5f, -0.5f }, { -0.5f, -0.5f,  0.5f }, {  0.5f, -0.5f,  0.5f },
+	{  0.5f,  0.5f,  0.5f }, { -0.5f,  0.5f,  0.5f }
+};
+
+static const rdIndex bnCubeIndices[] = {
+	0, 2, 1, 0, 3, 2, 4, 5, 6, 4, 6, 7, 0, 1, 5, 0, 5, 4,
+	3, 6, 2, 3, 7, 6, 0, 4, 7, 0, 7, 3, 1, 2, 6, 1, 6, 5
+};
+
+static int       bn_BenchCull(int numObjects);
+static int       bn_BenchOccluders(int numObjects);
+static int       bn_BenchBvh(int numObjects);
+static int       bn_BenchQueue(void);
+static void      bn_DrawSection(rdCullList *list, rdObject **objects, const int *kinds,
+                                rdShadowMap *sm, int queued);
+static double    bn_BenchBvhQueries(rdBvh *bvh, rdObject **outObjects, int maxObjects, int shape,
+                                    unsigned int *seed, double *outFound);
+static rdObject *bn_CreateField(rdObject **outObjects, int numObjects, rdObjectType objectType,
+                                const rdVertex *min, const rdVertex *max, float scale,
+                                unsigned int *seed);
+static void      bn_DestroyField(rdObject **objects, int numObjects);
+static float     bn_Random(unsigned int *seed);
+static double    bn_Seconds(void);
+
+int bn_Main(int argc, char **argv)
+{
+	int ok;
+
+	if (argc < 2 || strncmp(argv[1], "--bench", 7) != 0)
+		return 0;
+
+	if (strcmp(argv[1], "--bench-cull") == 0) {
+		ok = bn_BenchCull(argc > 2 ? atoi(argv[2]) : BN_CULL_OBJECTS);
+	} else if (strcmp(argv[1], "--bench-occluders") == 0) {
+		ok = bn_BenchOccluders(argc > 2 ? atoi(argv[2]) : BN_CULL_OBJECTS);
+	} else if (strcmp(argv[1], "--bench-bvh") == 0) {
+		ok = bn_BenchBvh(argc > 2 ? atoi(argv[2]) : BN_BVH_OBJECTS);
+	} else if (strcmp(argv[1], "--bench-queue") == 0) {
+		ok = bn_BenchQueue();
+	} else {
+		fprintf(stderr, "Usage: %s --bench-cull [objects]\n"
+		                "       %s --bench-occluders [objects]\n"
+		                "       %s --bench-bvh [objects]\n"
+		                "       %s --bench-queue\n", argv[0], argv[0], argv[0], argv[0]);
+		ok = 0;
+	}
+
+	return ok ? 1 : -1;
+}
+
+/* Frustum culling of a field of cubes through rd_CullObjects, from the default camera at the
+ * centre. Build with P3D_SIMD set to AVX, SSE or SCALAR to compare the paths. */
+static int bn_BenchCull(int numObjects)
+{
+	const rdVertex min = { -BN_FIELD_SIZE / 2.0f, -BN_FIELD_SIZE / 2.0f, -BN_FIELD_SIZE / 2.0f };
+	const rdVertex max = {  BN_FIELD_SIZE / 2.0f,  BN_FIELD_SIZE / 2.0f,  BN_FIELD_SIZE / 2.0f };
+
+	rdObject      **objects;
+	rdCullList     *list;
+	unsigned char  *visible;
+	unsigned int    seed = 1;
+	double          best = 0.0;
+	int             numVisible = 0;
+
+	if (numObjects < 1)
+		numObjects = 1;
+
+	objects = malloc(numObjects * sizeof (*objects));
+	visible = malloc(numObjects);
+	list    = rd_CreateCullList(numObjects);
+	if (objects == NULL || visible == NULL || list == NULL ||
+	    bn_CreateField(objects, numObjects, RD_OBJECT_EXTERIOR, &min, &max, 1.0f, &seed) == NULL) {
+		fprintf(stderr, "Error: couldn't create %d objects\n", numObjects);
+		if (list != NULL)
+			rd_DestroyCullList(list);
+		free(objects);
+		free(visible);
+		return 0;
+	}
+
+	for (int i = 0; i < numObjects; i++)
+		rd_AddToCullList(list, objects[i]);
+
+	rd_ResetDefaultCamera();
+
+	for (int run = 0; run < BN_RUNS; run++) {
+		double start = bn_Seconds(), elapsed;
+
+		numVisible = rd_CullObjects(list, visible);
+
+		elapsed = bn_Seconds() - start;
+		if (run == 0 || elapsed < best)
+			best = elapsed;
+	}
+
+	printf("Cull path: %s\n", BN_CULL_PATH);
+	printf("%d objects, %d visible: %8.1f us  %6.2f ns per object  %8.1f us per 100k objects\n",
+	       numObjects, numVisible, best * 1e6, best * 1e9 / numObjects,
+	       best * 1e6 * 100000.0 / numObjects);
+
+	rd_DestroyCullList(list);
+	bn_DestroyField(objects, numObjects);
+	free(objects);
+	free(visible);
+
+	return 1;
+}
+
+/* Interior blocks in front of the camera hide part of a field of cubes behind them. The blocks are
+ * rasterized with rd_RasterizeOccluders, then the cubes inside the frustum are tested against the
+ * buffer with rd_CullOccludedObjects; each is timed on its own. */
+static int bn_BenchOccluders(int numObjects)
+{
+	/* The default camera looks down +z */
+	const rdVertex occluderMin = { -BN_OCCLUDER_SPREAD, -BN_OCCLUDER_SPREAD / 2.0f,  4.0f };
+	const rdVertex occluderMax = {  BN_OCCLUDER_SPREAD,  BN_OCCLUDER_SPREAD / 2.0f, 12.0f };
+	const rdVertex min         = { -BN_FIELD_SIZE / 3.0f, -BN_FIELD_SIZE / 6.0f, 12.0f };
+	const rdVertex max         = {  BN_FIELD_SIZE / 3.0f,  BN_FIELD_SIZE / 6.0f, 30.0f };
+
+	rdObject      *occluders[BN_OCCLUDERS];
+	rdObject     **objects;
+	rdCullList    *list;
+	unsigned char *inFrustum, *visible;
+	unsigned int   seed = 1;
+	double         bestRaster = 0.0, bestTest = 0.0;
+	int            numInFrustum, numVisible = 0;
+
+	if (numObjects < 1)
+		numObjects = 1;
+
+	objects   = malloc(numObjects * sizeof (*objects));
+	inFrustum = malloc(numObjects);
+	visible   = malloc(numObjects);
+	list      = rd_CreateCullList(numObjects);
+	if (objects == NULL || inFrustum == NULL || visible == NULL || list == NULL ||
+	    bn_CreateField(objects, numObjects, RD_OBJECT_EXTERIOR, &min, &max, 1.0f,
+	                   &seed) == NULL) {
+		fprintf(stderr, "Error: couldn't create %d objects\n", numObjects);
+		if (list != NULL)
+			rd_DestroyCullList(list);
+		free(objects);
+		free(inFrustum);
+		free(visible);
+		return 0;
+	}
+
+	if (bn_CreateField(occluders, BN_OCCLUDERS, RD_OBJECT_INTERIOR, &occluderMin, &occluderMax,
+	                   BN_OCCLUDER_SCALE, &seed) == NULL) {
+		fprintf(stderr, "Error: couldn't create %d occluders\n", BN_OCCLUDERS);
+		rd_DestroyCullList(list);
+		bn_DestroyField(objects, numObjects);
+		free(objects);
+		free(inFrustum);
+		free(visible);
+		return 0;
+	}
+
+	for (int i = 0; i < numObjects; i++)
+		rd_AddToCullList(list, objects[i]);
+
+	rd_ResetDefaultCamera();
+	numInFrustum = rd_CullObjects(list, inFrustum);
+
+	for (int run = 0; run < BN_RUNS; run++) {
+		double start, elapsed;
+
+		/* The queue empties with every rasterization */
+		for (int i = 0; i < BN_OCCLUDERS; i++)
+			rd_AddOccluder(occluders[i]);
+
+		start = bn_Seconds();
+		rd_RasterizeOccluders();
+		elapsed = bn_Seconds() - start;
+		if (run == 0 || elapsed < bestRaster)
+			bestRaster = elapsed;
+
+		memcpy(visible, inFrustum, numObjects);
+
+		start = bn_Seconds();
+		numVisible = rd_CullOccludedObjects(list, visible);
+		elapsed = bn_Seconds() - start;
+		if (run == 0 || elapsed < bestTest)
+			bestTest = elapsed;
+	}
+
+	printf("Raster path: %s\n", BN_CULL_PATH);
+	printf("%d occluders, %d triangles: %8.1f us  %6.2f M triangles/s\n", BN_OCCLUDERS,
+	       BN_OCCLUDERS * BN_CUBE_TRIANGLES, bestRaster * 1e6,
+	       BN_OCCLUDERS * BN_CUBE_TRIANGLES / bestRaster * 1e-6);
+	printf("%d objects tested, %d hidden: %8.1f us  %6.2f ns per object\n", numInFrustum,
+	       numInFrustum - numVisible, bestTest * 1e6,
+	       numInFrustum > 0 ? bestTest * 1e9 / numInFrustum : 0.0);
+
+	rd_DestroyCullList(list);
+	bn_DestroyField(occluders, BN_OCCLUDERS);
+	bn_DestroyField(objects, numObjects);
+	free(objects);
+	free(inFrustum);
+	free(visible);
+
+	return 1;
+}
+
+/* Cubes of 0.2 to 2 units over a flat world, as many as a large level streams in. Builds the BVH
+ * over them, refits it after moving more and more of them, and queries it. */
+static int bn_BenchBvh(int numObjects)
+{
+	const rdVertex min = { -BN_BVH_WORLD / 2.0f, 0.0f,                  -BN_BVH_WORLD / 2.0f };
+	const rdVertex max = {  BN_BVH_WORLD / 2.0f, BN_BVH_WORLD / 20.0f,  BN_BVH_WORLD / 2.0f };
+
+	static const char *const shapes[] = { "box", "sphere", "ray", "frustum" };
+
+	rdObject   **objects, **found;
+	rdBvh       *bvh;
+	unsigned int seed = 1;
+	double       start, elapsed;
+
+	if (numObjects < 1)
+		numObjects = 1;
+
+	objects = malloc(numObjects * sizeof (*objects));
+	found   = malloc(numObjects * sizeof (*found));
+	bvh     = rd_CreateBvh();
+	if (objects == NULL || found == NULL || bvh == NULL ||
+	    bn_CreateField(objects, numObjects, RD_OBJECT_EXTERIOR, &min, &max, 1.0f, &seed) == NULL) {
+		fprintf(stderr, "Error: couldn't create %d objects\n", numObjects);
+		if (bvh != NULL)
+			rd_DestroyBvh(bvh);
+		free(objects);
+		free(found);
+		return 0;
+	}
+
+	for (int i = 0; i < numObjects; i++) {
+		rd_ScaleObject(objects[i], 0.2f + 1.8f * bn_Random(&seed));
+		rd_AddToBvh(bvh, objects[i]);
+	}
+
+	start = bn_Seconds();
+	rd_UpdateBvh(bvh);
+	printf("%d objects: build %8.1f ms\n", numObjects, (bn_Seconds() - start) * 1e3);
+
+	/* Powers of ten up to a tenth of the objects, then all of them */
+	for (int numMoved = 100; numMoved <= numObjects;
+	     numMoved = numMoved * 10 > numObjects / 10 && numMoved < numObjects ?
+	                numObjects : numMoved * 10) {
+		double best = 0.0, moves = 0.0;
+
+		for (int run = 0; run < BN_RUNS; run++) {
+			const float step = run % 2 == 0 ? BN_BVH_MOVE : -BN_BVH_MOVE;
+			const int   first = numMoved < numObjects ?
+			                    (int) (bn_Random(&seed) * (numObjects - numMoved)) : 0;
+
+			start = bn_Seconds();
+			for (int i = first; i < first + numMoved; i++)
+				rd_MoveObject(objects[i], step, 0.0f, step);
+			moves += bn_Seconds() - start;
+
+			start = bn_Seconds();
+			rd_UpdateBvh(bvh);
+			elapsed = bn_Seconds() - start;
+			if (run == 0 || elapsed < best)
+				best = elapsed;
+		}
+
+		printf("refit after %7d moves: %8.3f ms  (the moves themselves %8.3f ms)\n", numMoved,
+		       best * 1e3, moves / BN_RUNS * 1e3);
+	}
+
+	for (int shape = 0; shape < 4; shape++) {
+		double numFound;
+
+		elapsed = bn_BenchBvhQueries(bvh, found, numObjects, shape, &seed, &numFound);
+		printf("%-7s query: %8.2f us  %8.1f found\n", shapes[shape], elapsed * 1e6, numFound);
+	}
+
+	rd_DestroyBvh(bvh);
+	bn_DestroyField(objects, numObjects);
+	free(objects);
+	free(found);
+
+	return 1;
+}
+
+/* Average time of a query of the shape (box, sphere, ray or the camera's frustum) from random
+ * points in the world. The ray is cast level, in a random direction. */
+static double bn_BenchBvhQueries(rdBvh *bvh, rdObject **outObjects, int maxObjects, int shape,
+                                 unsigned int *seed, double *outFound)
+{
+	double total = 0.0;
+	int    numFound = 0;
+
+	for (int i = 0; i < BN_BVH_QUERIES; i++) {
+		const float x   = (bn_Random(seed) - 0.5f) * BN_BVH_WORLD;
+		const float y   = bn_Random(seed) * BN_BVH_WORLD / 20.0f;
+		const float z   = (bn_Random(seed) - 0.5f) * BN_BVH_WORLD;
+		const float yaw = bn_Random(seed) * 360.0f;
+		const float r   = BN_BVH_QUERY_SIZE;
+
+		double start;
+
+		if (shape == 3) {
+			rd_PositionDefaultCamera(x, y, z);
+			rd_OrientDefaultCamera(yaw, 0.0f);
+		}
+
+		start = bn_Seconds();
+		if (shape == 0) {
+			numFound += rd_QueryBvhBox(bvh, x - r / 2.0f, y - r / 2.0f, z - r / 2.0f,
+			                           x + r / 2.0f, y + r / 2.0f, z + r / 2.0f, outObjects,
+			                           maxObjects);
+		} else if (shape == 1) {
+			numFound += rd_QueryBvhSphere(bvh, x, y, z, r, outObjects, maxObjects);
+		} else if (shape == 2) {
+			const float dirX = cosf(yaw * 0.017453293f), dirZ = sinf(yaw * 0.017453293f);
+
+			numFound += rd_RaycastBvh(bvh, x, y, z, dirX, 0.0f, dirZ, BN_BVH_RAY_LENGTH,
+			                          NULL) != NULL;
+		} else {
+			numFound += rd_QueryBvhFrustum(bvh, outObjects, maxObjects);
+		}
+		total += bn_Seconds() - start;
+	}
+
+	rd_ResetDefaultCamera();
+
+	*outFound = (double) numFound / BN_BVH_QUERIES;
+	return total / BN_BVH_QUERIES;
+}
+
+/* Draws, state changes and GL calls of the same frame drawn with rd_Draw as it goes and submitted
+ * to the render queue, as the game does with and without R. Each section holds objects of every
+ * kind the game has, with mixed materials, object types and flat shading, and the sections
+ * share out two shadow maps. */
+static int bn_BenchQueue(void)
+{
+	static const char *const modes[] = { "immediate", "queued" };
+
+	rdObject    *objects[BN_QUEUE_SECTIONS][BN_QUEUE_OBJECTS];
+	int          kinds[BN_QUEUE_SECTIONS][BN_QUEUE_OBJECTS];
+	rdCullList  *lists[BN_QUEUE_SECTIONS];
+	rdShadowMap *sms[2];
+	unsigned int seed = 7;
+	int          ok = 1;
+
+	memset(objects, 0, sizeof (objects));
+	memset(lists, 0, sizeof (lists));
+
+	rd_SetLight(0, 0.0f, 4.0f, 8.0f, 1.0f, 1.0f, 1.0f, 100.0f, 13.5f, 0.0f);
+	rd_SetLight(1, 0.0f, 4.0f, 24.0f, 1.0f, 1.0f, 1.0f, 100.0f, 13.5f, 0.0f);
+	rd_EnableLight(0);
+	rd_EnableLight(1);
+	sms[0] = rd_CreateShadowMap(0, 1024, 1024, 0.0f, 0.0f, 8.0f, 12.0f, 12.0f, 1.0f, 12.0f);
+	sms[1] = rd_CreateShadowMap(1, 2048, 1024, 0.0f, 0.0f, 24.0f, 12.0f, 12.0f, 1.0f, 12.0f);
+
+	for (int s = 0; s < BN_QUEUE_SECTIONS && ok; s++) {
+		lists[s] = rd_CreateCullList(BN_QUEUE_OBJECTS);
+		ok       = lists[s] != NULL;
+
+		for (int i = 0; i < BN_QUEUE_OBJECTS && ok; i++) {
+			const int interior = bn_Random(&seed) < 0.2f;
+			const int kind     = (int) (bn_Random(&seed) * 3.0f);
+			const int paintjob = bn_Random(&seed) < 0.25f;
+
+			rdObject *obj;
+
+			kinds[s][i] = kind;
+			obj = rd_CreateObject(sizeof (bnCubeVertices) / sizeof (bnCubeVertices[0]),
+			                      bnCubeVertices,
+			                      sizeof (bnCubeIndices) / sizeof (bnCubeIndices[0]),
+			                      bnCubeIndices, RD_INDEX_16,
+			                      interior ? RD_OBJECT_INTERIOR : RD_OBJECT_EXTERIOR,
+			                      kind == 1 ? RD_MATERIAL_BLOOM :
+			                      paintjob ? RD_MATERIAL_PAINTJOB : RD_MATERIAL_COMMON,
+			                      RD_POSITION_FLOAT);
+			objects[s][i] = obj;
+			ok            = obj != NULL;
+			if (!ok)
+				break;
+
+			rd_SetObjectMaterial(obj, (int) (bn_Random(&seed) * 8.0f));
+			rd_SetObjectFlatShaded(obj, bn_Random(&seed) < 0.5f);
+			rd_AttachShadowMap(obj, sms[s * 2 >= BN_QUEUE_SECTIONS]);
+			rd_PositionObject(obj, (bn_Random(&seed) - 0.5f) * 10.0f, bn_Random(&seed) - 0.5f,
+			                  BN_QUEUE_DEPTH * (s + 0.5f + bn_Random(&seed)));
+			rd_AddToCullList(lists[s], obj);
+		}
+	}
+
+	if (!ok || sms[0] == NULL || sms[1] == NULL) {
+		fprintf(stderr, "Error: couldn't create the scene\n");
+	} else {
+		rd_ResetDefaultCamera();
+
+		for (int queued = 0; queued < 2; queued++) {
+			rdStats stats;
+
+			for (int frame = 0; frame < BN_QUEUE_FRAMES; frame++) {
+				rd_ClearShadowMap(sms[0]);
+				rd_ClearShadowMap(sms[1]);
+				rd_Clear(RD_CLEAR_GBUFFER);
+				rd_Clear(RD_CLEAR_SHADOWS);
+				rd_Clear(RD_CLEAR_DEPTHVELOCITY);
+				rd_Clear(RD_CLEAR_BLOOM);
+
+				for (int s = 0; s < BN_QUEUE_SECTIONS; s++)
+					bn_DrawSection(lists[s], objects[s], kinds[s],
+					               sms[s * 2 >= BN_QUEUE_SECTIONS], queued);
+
+				rd_Frame();
+			}
+
+			rd_GetStats(&stats);
+			printf("%-9s: %3d draws, %3d state changes, %3d GL state calls (%d filtered)\n",
+			       modes[queued], stats.objectDraws, stats.stateChanges, stats.glCallsIssued,
+			       stats.glCallsFiltered);
+		}
+	}
+
+	for (int s = 0; s < BN_QUEUE_SECTIONS; s++) {
+		if (lists[s] != NULL)
+			rd_DestroyCullList(lists[s]);
+		for (int i = 0; i < BN_QUEUE_OBJECTS; i++) {
+			if (objects[s][i] != NULL)
+				rd_DestroyObject(objects[s][i]);
+		}
+	}
+	for (int i = 0; i < 2; i++) {
+		if (sms[i] != NULL)
+			rd_DestroyShadowMap(sms[i]);
+	}
+	rd_DisableLight(0);
+	rd_DisableLight(1);
+
+	return ok && sms[0] != NULL && sms[1] != NULL;
+}
+
+/* One section the way sr_DrawSector does it: frustum and shadow caster culling, then the
+ * occlusion test, then the passes of each kind of object. Kinds are common, bloom and the
+ * rest. */
+static void bn_DrawSection(rdCullList *list, rdObject **objects, const int *kinds,
+                           rdShadowMap *sm, int queued)
+{
+	unsigned char visible[BN_QUEUE_OBJECTS], casting[BN_QUEUE_OBJECTS];
+
+	rd_CullObjects(list, visible);
+	rd_CullShadowCasters(list, sm, casting);
+
+	if (queued) {
+		rd_SubmitOcclusionTest(list);
+
+		for (int i = 0; i < BN_QUEUE_OBJECTS; i++) {
+			unsigned int passes = 0;
+
+			if (kinds[i] != 1 && casting[i])
+				passes |= RD_PASS_SHADOWMAP;
+
+			if (visible[i]) {
+				passes |= RD_PASS_DEPTHVELOCITY;
+				if (kinds[i] == 0)
+					passes |= RD_PASS_SHADOWS;
+				else if (kinds[i] == 1)
+					passes |= RD_PASS_BLOOM;
+
+				if (kinds[i] != 1)
+					passes |= RD_PASS_GBUFFER;
+			}
+
+			if (passes != 0)
+				rd_Submit(objects[i], passes);
+		}
+
+		rd_EndOcclusionTest();
+		return;
+	}
+
+	rd_BeginOcclusionTest(list);
+
+	for (int i = 0; i < BN_QUEUE_OBJECTS; i++) {
+		if (kinds[i] != 1 && casting[i])
+			rd_Draw(RD_DRAW_SHADOWMAP, objects[i]);
+	}
+
+	for (int i = 0; i < BN_QUEUE_OBJECTS; i++) {
+		if (!visible[i])
+			continue;
+
+		rd_Draw(RD_DRAW_DEPTHVELOCITY, objects[i]);
+		if (kinds[i] == 0)
+			rd_Draw(RD_DRAW_SHADOWS, objects[i]);
+		else if (kinds[i] == 1)
+			rd_Draw(RD_DRAW_BLOOM, objects[i]);
+
+		if (kinds[i] != 1)
+			rd_Draw(RD_DRAW_GBUFFER, objects[i]);
+	}
+
+	rd_EndOcclusionTest();
+}
+
+/* The first object holds the cube's geometry and the rest are clones of it, all placed at random
+ * between min and max. Returns the first, or NULL with nothing left behind. */
+static rdObject *bn_CreateField(rdObject **outObjects, int numObjects, rdObjectType objectType,
+                                const rdVertex *min, const rdVertex *max, float scale,
+                                unsigned int *seed)
+{
+	outObjects[0] = rd_CreateObject(sizeof (bnCubeVertices) / sizeof (bnCubeVertices[0]),
+	                                bnCubeVertices,
+	                                sizeof (bnCubeIndices) / sizeof (bnCubeIndices[0]),
+	                                bnCubeIndices, RD_INDEX_16, objectType, RD_MATERIAL_COMMON,
+	                                RD_POSITION_FLOAT);
+	if (outObjects[0] == NULL)
+		return NULL;
+
+	for (int i = 0; i < numObjects; i++) {
+		float x, y, z;
+
+		if (i > 0) {
+			outObjects[i] = rd_CloneObject(outObjects[0]);
+			if (outObjects[i] == NULL) {
+				bn_DestroyField(outObjects, i);
+				return NULL;
+			}
+		}
+
+		x = min->x + bn_Random(seed) * (max->x - min->x);
+		y = min->y + bn_Random(seed) * (max->y - min->y);
+		z = min->z + bn_Random(seed) * (max->z - min->z);
+
+		rd_PositionObject(outObjects[i], x, y, z);
+		rd_ScaleObject(outObjects[i], scale);
+	}
+
+	return outObjects[0];
+}
+
+static void bn_DestroyField(rdObject **objects, int numObjects)
+{
+	/* Clones go before the object whose geometry they share */
+	for (int i = numObjects - 1; i >= 0; i--)
+		rd_DestroyObject(objects[i]);
+}
+
+/* In [0, 1), the same sequence on every platform so that runs compare */
+static float bn_Random(unsigned int *seed)
+{
+	*seed = *seed * 1664525u + 1013904223u;
+	return (*seed >> 8) / 16777216.0f;
+}
+
+static double bn_Seconds(void)
+{
+	return (double) SDL_GetPerformanceCounter() / SDL_GetPerformanceFrequency();
+}
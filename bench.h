@@ -0,0 +1,13 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * Renderer benchmarks run by p3d in place of the game, once the GL context and the renderer are
+ * up. They draw nothing to the window, so a software GL (Mesa's llvmpipe under a virtual display)
+ * is enough to run them. Returns 0 if argv asks for no benchmark, 1 if it ran one, and -1 if one
+ * failed.
+ */
+
+int bn_Main(int argc, char **argv);
+
+#endif
@@ -1,12 +1,50 @@
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <pthread.h>
 #include <SDL2/SDL.h>
 
 #include "renderer.h"
-#include "models.h"
+#include "meshpack.h"
 #include "game.h"
 
+/* Meshes within this extent (model space) quantize to half floats with at most 0.002 error */
+#define GM_HALF_POSITION_EXTENT 8.0f
+
+/* Sector floors are at 0, ceilings at 4 */
+#define GM_SECTOR_HEIGHT 4.0f
+
+#define GM_MAX_PORTAL_VERTICES 4
+/* A clipped portal leaves one plane per edge plus the far plane */
+#define GM_MAX_FRUSTUM_PLANES  16
+#define GM_MAX_CLIP_VERTICES   (GM_MAX_FRUSTUM_PLANES - 1)
+#define GM_MAX_PORTAL_DEPTH    16
+#define GM_MAX_VISIBLE_SECTORS 64
+/* Closer to a portal than this the camera looks through it unclipped */
+#define GM_PORTAL_EPSILON      0.05f
+/* Clipped portals thinner than this (at their centre) narrow the frustum by rounding noise */
+#define GM_PORTAL_SLIVER       0.01f
+
+#define GM_MAX_SECTORS       16
+#define GM_MAX_LEVEL_OBJECTS (GM_MAX_SECTORS * (2 + 8))
+/* Sector bits first, then one bit per object in cull list order */
+#define GM_PVS_ROW_BYTES     ((GM_MAX_SECTORS + GM_MAX_LEVEL_OBJECTS + 7) / 8)
+/* Eye positions per nav region side and heights per position, edges included */
+#define GM_PVS_SAMPLES       9
+#define GM_PVS_HEIGHTS       4
+#define GM_PVS_THREADS       4
+/* How far the collision code lets the camera past a nav region before it switches sectors */
+#define GM_PVS_PADDING       0.45f
+
+/* Stress scene toggled with T: a field of small teapots over the south sector's floor, to load
+ * the vertex stage and the G-buffer passes well past what the level itself does */
+#define GM_STRESS_COLUMNS 16
+#define GM_STRESS_ROWS    64
+#define GM_STRESS_OBJECTS (GM_STRESS_COLUMNS * GM_STRESS_ROWS)
+#define GM_STRESS_SPACING 0.18f
+#define GM_STRESS_SCALE   0.05f
+
 typedef enum gmObjectType {
 	GM_OBJECT_COMMON,
 	GM_OBJECT_BLOOM,
@@ -21,6 +59,34 @@ struct gmPoint
 	float z;
 };
 
+typedef struct gmVec3 gmVec3;
+struct gmVec3
+{
+	float x, y, z;
+};
+
+/* Inside if x * p.x + y * p.y + z * p.z + d >= 0 */
+typedef struct gmPlane gmPlane;
+struct gmPlane
+{
+	float x, y, z, d;
+};
+
+typedef struct gmFrustum gmFrustum;
+struct gmFrustum
+{
+	int     numPlanes;
+	gmPlane planes[GM_MAX_FRUSTUM_PLANES];
+};
+
+/* Convex opening between two linked sectors */
+typedef struct gmPortal gmPortal;
+struct gmPortal
+{
+	int    numVertices;
+	gmVec3 vertices[GM_MAX_PORTAL_VERTICES];
+};
+
 typedef struct gmNavRegion gmNavRegion;
 struct gmNavRegion
 {
@@ -44,9 +110,57 @@ struct gmSector
 	gmObject objects[8];
 	int      numObjects;
 
+	rdCullList  *cullList; /* Decoration, bulk, then the attached objects */
+	rdShadowMap *shadowMap; /* Shared by the sector's casters, if any */
+
 	gmNavRegion navRegion;
 
 	gmSector *link1, *link2;
+	gmPortal  portal1, portal2; /* Openings towards link1 and link2 */
+
+	unsigned int visibleStamp;
+
+	int index;       /* Row and bit in the PVS */
+	int firstObject; /* Bit of the first cull list entry among the PVS's objects */
+};
+
+/*
+ * Potentially visible set: per sector, the sectors and objects that can be seen from anywhere in
+ * it, in any direction. Baked once when the level is set up.
+ */
+typedef struct gmPvs gmPvs;
+struct gmPvs
+{
+	int       numSectors;
+	int       numObjects;
+	gmSector *sectors[GM_MAX_SECTORS];
+
+	unsigned char bits[GM_MAX_SECTORS][GM_PVS_ROW_BYTES];
+	int           numVisible[GM_MAX_SECTORS];
+	int           order[GM_MAX_SECTORS][GM_MAX_SECTORS]; /* Visible sectors, nearest first */
+};
+
+/* Shared by the bake threads, which take eye positions one at a time */
+typedef struct gmPvsBake gmPvsBake;
+struct gmPvsBake
+{
+	gmPvs          *pvs;
+	pthread_mutex_t lock;
+	int             nextSample;
+	int             numSamples;
+};
+
+/* State of one portal traversal */
+typedef struct gmVisibility gmVisibility;
+struct gmVisibility
+{
+	gmVec3       eye;
+	gmPlane      farPlane;
+	unsigned int stamp;
+
+	gmSector **sectors;
+	int        numSectors;
+	int        maxSectors;
 };
 
 typedef struct gmInputState gmInputState;
@@ -59,6 +173,13 @@ struct gmInputState
 	int mouseY;
 	int fullscreen;
 	int toggleFullscreen;
+	int occlusionCulling;
+	int pvs;
+	int gpuCulling;
+	int renderQueue;
+	int stateFiltering;
+	int gBufferMode; /* rdGBufferMode */
+	int stressField;
 	int quit;
 	unsigned int timeDelta;
 	unsigned int timeTotal;
@@ -88,15 +209,41 @@ static int  gm_HandleEvents(SDL_Window *window, gmInputState *state);
 static void gm_HandleSingleEvent(const SDL_Event *ev, gmInputState *state);
 static void gm_ToggleFullscreen(SDL_Window *window, int fullscreen);
 static void gm_InitInputState(gmInputState *state);
+static void gm_DrawStressField(rdCullList *list, rdObject **objects, rdShadowMap *sm,
+                               int occluders, int renderQueue);
+
+static rdObject *gm_CreateObject(const mpPack *pack, const char *name, rdObjectType objectType,
+                                 rdMaterialType materialType);
 
 static void      sr_SetupSector(gmSector *sector, gmObject *bulkObject, gmObject *decorationObject,
                            gmNavRegion navRegion);
 static void      sr_AttachObject(gmSector *sector, gmObject *obj);
-static void      sr_DrawSector(gmSector *sector);
+static gmObject *sr_GetObject(gmSector *sector, int i);
+static void      sr_DrawSector(gmSector *sector, int occlusionCulling, int gpuCulling,
+                               int renderQueue, const gmPvs *pvs, const gmSector *viewer);
 static gmSector *sr_Collision(gmSector *currSector, gmPoint *playerPosition,
                               gmPoint *previousPlayerPosition);
 static int       sr_IsInRegion(const gmNavRegion *region, const gmPoint *point, float xPad,
                                float zPad);
+static void      sr_SetupPortal(gmPortal *portal, float x1, float z1, float x2, float z2);
+static int       sr_FindVisibleSectors(gmSector *start, gmSector **outSectors, int maxSectors);
+static void      sr_VisitSector(gmVisibility *vis, gmSector *sector, const gmSector *from,
+                                const gmFrustum *frustum, int depth);
+static int       sr_ClipPortal(const gmVisibility *vis, const gmSector *sector,
+                               const gmPortal *portal, const gmFrustum *frustum, gmFrustum *out);
+static int       sr_ClipPolygon(const gmVec3 *in, int numIn, const gmPlane *plane, gmVec3 *out);
+static float     sr_PlaneDistance(const gmPlane *plane, const gmVec3 *point);
+static void      sr_BakePvs(gmPvs *pvs, gmSector **sectors, int numSectors);
+static void     *sr_BakeThread(void *arg);
+static void      sr_BakeSample(const gmPvs *pvs, int sample,
+                               unsigned char (*bits)[GM_PVS_ROW_BYTES]);
+static void      sr_BakeVisit(const gmVisibility *vis, const gmPvs *pvs, unsigned char *row,
+                              const gmSector *sector, const gmSector *from,
+                              const gmFrustum *frustum, int depth);
+static int       sr_IsBoxInFrustum(const gmFrustum *frustum, const float min[3],
+                                   const float max[3]);
+static void      sr_ReportPvs(const gmPvs *pvs, int numThreads, unsigned int milliseconds);
+static int       sr_TestBit(const unsigned char *row, int bit);
 
 void gm_Main(SDL_Window *window)
 {
@@ -134,48 +281,74 @@ void gm_Main(SDL_Window *window)
 	rdShadowMap *shadowMapMid;
 	rdShadowMap *shadowMapRoom;
 
+	rdObject   *stressField[GM_STRESS_OBJECTS];
+	rdCullList *stressList;
+
 	gameState.playerPosition.x = 0.0f;
 	gameState.playerPosition.z = 2.0f;
 
-	bulkSouth = rd_CreateObject(sizeof (modelBulkSouth) / sizeof (rdVertex), modelBulkSouth, 0,
-	                            NULL, RD_OBJECT_INTERIOR, RD_MATERIAL_PAINTJOB);
+	mpPack meshPack;
 
-	decorationSouth = rd_CreateObject(sizeof (modelDecorationSouth) / sizeof (rdVertex),
-	                                  modelDecorationSouth, 0, NULL, RD_OBJECT_EXTERIOR,
-	                                  RD_MATERIAL_COMMON);
+	unsigned int loadStart = SDL_GetTicks();
 
-	bulkMid = rd_CreateObject(sizeof (modelBulkMid) / sizeof (rdVertex), modelBulkMid, 0, NULL,
-	                          RD_OBJECT_INTERIOR, RD_MATERIAL_PAINTJOB);
+	if (!mp_Open(&meshPack, "models.p3m"))
+		return;
 
-	decorationMid = rd_CreateObject(sizeof (modelDecorationMid) / sizeof (rdVertex),
-	                                modelDecorationMid, 0, NULL, RD_OBJECT_EXTERIOR,
-	                                RD_MATERIAL_COMMON);
+	bulkSouth         = gm_CreateObject(&meshPack, "BulkSouth", RD_OBJECT_INTERIOR,
+	                                    RD_MATERIAL_PAINTJOB);
+	decorationSouth   = gm_CreateObject(&meshPack, "DecorationSouth", RD_OBJECT_EXTERIOR,
+	                                    RD_MATERIAL_COMMON);
+	bulkMid           = gm_CreateObject(&meshPack, "BulkMid", RD_OBJECT_INTERIOR,
+	                                    RD_MATERIAL_PAINTJOB);
+	decorationMid     = gm_CreateObject(&meshPack, "DecorationMid", RD_OBJECT_EXTERIOR,
+	                                    RD_MATERIAL_COMMON);
+	bulkNorth         = gm_CreateObject(&meshPack, "BulkNorth", RD_OBJECT_INTERIOR,
+	                                    RD_MATERIAL_PAINTJOB);
+	decorationNorth   = gm_CreateObject(&meshPack, "DecorationNorth", RD_OBJECT_EXTERIOR,
+	                                    RD_MATERIAL_COMMON);
+	bulkConnect       = gm_CreateObject(&meshPack, "BulkConnect", RD_OBJECT_INTERIOR,
+	                                    RD_MATERIAL_PAINTJOB);
+	decorationConnect = gm_CreateObject(&meshPack, "DecorationConnect", RD_OBJECT_EXTERIOR,
+	                                    RD_MATERIAL_COMMON);
+	bulkRoom          = gm_CreateObject(&meshPack, "BulkRoom", RD_OBJECT_INTERIOR,
+	                                    RD_MATERIAL_PAINTJOB);
+	decorationRoom    = gm_CreateObject(&meshPack, "DecorationRoom", RD_OBJECT_EXTERIOR,
+	                                    RD_MATERIAL_COMMON);
 
-	bulkNorth = rd_CreateObject(sizeof (modelBulkNorth) / sizeof (rdVertex), modelBulkNorth, 0,
-	                            NULL, RD_OBJECT_INTERIOR, RD_MATERIAL_PAINTJOB);
+	flatCylinder = gm_CreateObject(&meshPack, "FlatCylinder", RD_OBJECT_EXTERIOR,
+	                               RD_MATERIAL_BLOOM);
 
-	decorationNorth = rd_CreateObject(sizeof (modelDecorationNorth) / sizeof (rdVertex),
-		                              modelDecorationNorth, 0, NULL, RD_OBJECT_EXTERIOR,
-		                              RD_MATERIAL_COMMON);
+	sphere = gm_CreateObject(&meshPack, "Sphere", RD_OBJECT_EXTERIOR, RD_MATERIAL_COMMON);
 
-	bulkConnect = rd_CreateObject(sizeof (modelBulkConnect) / sizeof (rdVertex), modelBulkConnect,
-	                              0, NULL, RD_OBJECT_INTERIOR, RD_MATERIAL_PAINTJOB);
+	riserSouth = gm_CreateObject(&meshPack, "RiserSouth", RD_OBJECT_EXTERIOR, RD_MATERIAL_COMMON);
+	riserMid   = gm_CreateObject(&meshPack, "RiserMid", RD_OBJECT_EXTERIOR, RD_MATERIAL_COMMON);
+	riserRoom  = gm_CreateObject(&meshPack, "RiserRoom", RD_OBJECT_EXTERIOR, RD_MATERIAL_COMMON);
 
-	decorationConnect = rd_CreateObject(sizeof (modelDecorationConnect) / sizeof (rdVertex),
-	                                    modelDecorationConnect, 0, NULL, RD_OBJECT_EXTERIOR,
-	                                    RD_MATERIAL_COMMON);
+	teapot = gm_CreateObject(&meshPack, "Teapot", RD_OBJECT_EXTERIOR, RD_MATERIAL_COMMON);
+
+	/* Everything lives in GL buffers now, so the mapping can go */
+	mp_Close(&meshPack);
 
-	bulkRoom = rd_CreateObject(sizeof (modelBulkRoom) / sizeof (rdVertex), modelBulkRoom, 0, NULL,
-	                           RD_OBJECT_INTERIOR, RD_MATERIAL_PAINTJOB);
+	/* A mesh that is missing or didn't fit takes the others with it, as a missing pack does */
+	{
+		rdObject *loaded[] = { bulkSouth, decorationSouth, bulkMid, decorationMid, bulkNorth,
+		                       decorationNorth, bulkConnect, decorationConnect, bulkRoom,
+		                       decorationRoom, flatCylinder, sphere, riserSouth, riserMid,
+		                       riserRoom, teapot };
+		const int numLoaded = sizeof (loaded) / sizeof (loaded[0]);
+		int       failed    = 0;
 
-	decorationRoom = rd_CreateObject(sizeof (modelDecorationRoom) / sizeof (rdVertex),
-	                                 modelDecorationRoom, 0, NULL, RD_OBJECT_EXTERIOR,
-	                                 RD_MATERIAL_COMMON);
+		for (int i = 0; i < numLoaded; i++)
+			failed |= loaded[i] == NULL;
 
-	flatCylinder = rd_CreateObject(sizeof (modelFlatCylinderVertices) / sizeof (rdVertex),
-	                               modelFlatCylinderVertices,
-	                               sizeof (modelFlatCylinderIndices) / sizeof (rdIndex),
-	                               modelFlatCylinderIndices, RD_OBJECT_EXTERIOR, RD_MATERIAL_BLOOM);
+		if (failed) {
+			for (int i = 0; i < numLoaded; i++) {
+				if (loaded[i] != NULL)
+					rd_DestroyObject(loaded[i]);
+			}
+			return;
+		}
+	}
 
 	flatCylinder2 = rd_CloneObject(flatCylinder);
 	flatCylinder3 = rd_CloneObject(flatCylinder);
@@ -183,27 +356,28 @@ void gm_Main(SDL_Window *window)
 	flatCylinder5 = rd_CloneObject(flatCylinder);
 	flatCylinder6 = rd_CloneObject(flatCylinder);
 
-	sphere = rd_CreateObject(sizeof (modelSphereVertices) / sizeof (rdVertex),
-	                               modelSphereVertices, sizeof (modelSphereIndices) / sizeof (rdIndex),
-	                               modelSphereIndices, RD_OBJECT_EXTERIOR, RD_MATERIAL_COMMON);
-
 	sphere2 = rd_CloneObject(sphere);
 	sphere3 = rd_CloneObject(sphere);
 	sphere4 = rd_CloneObject(sphere);
 	sphere5 = rd_CloneObject(sphere);
 
-	riserSouth = rd_CreateObject(sizeof (modelRiserSouth) / sizeof (rdVertex), modelRiserSouth, 0,
-	                             NULL, RD_OBJECT_EXTERIOR, RD_MATERIAL_COMMON);
-
-	riserMid = rd_CreateObject(sizeof (modelRiserMid) / sizeof (rdVertex), modelRiserMid, 0, NULL,
-	                           RD_OBJECT_EXTERIOR, RD_MATERIAL_COMMON);
-
-	riserRoom = rd_CreateObject(sizeof (modelRiserRoom) / sizeof (rdVertex), modelRiserRoom, 0,
-	                            NULL, RD_OBJECT_EXTERIOR, RD_MATERIAL_COMMON);
+	/* Clones, so the queue draws them as instances and picks a level of detail for each */
+	stressList = rd_CreateCullList(GM_STRESS_OBJECTS);
+	for (int i = 0; i < GM_STRESS_OBJECTS; i++) {
+		const int   column = i % GM_STRESS_COLUMNS;
+		const int   row    = i / GM_STRESS_COLUMNS;
+		const float x      = (column - (GM_STRESS_COLUMNS - 1) / 2.0f) * GM_STRESS_SPACING;
+		const float z      = (row - (GM_STRESS_ROWS - 1) / 2.0f) * GM_STRESS_SPACING;
+
+		stressField[i] = rd_CloneObject(teapot);
+		rd_SetObjectMaterial(stressField[i], 10);
+		rd_ScaleObject(stressField[i], GM_STRESS_SCALE);
+		rd_OrientObject(stressField[i], 0.0f, 37.0f * i, 0.0f);
+		rd_PositionObject(stressField[i], x, 0.0f, z);
+		rd_AddToCullList(stressList, stressField[i]);
+	}
 
-	teapot = rd_CreateObject(sizeof (modelTeapotVertices) / sizeof (rdVertex), modelTeapotVertices,
-	                         sizeof (modelTeapotIndices) / sizeof (rdIndex), modelTeapotIndices,
-	                         RD_OBJECT_EXTERIOR, RD_MATERIAL_COMMON);
+	printf("Loaded meshes in %u ms\n", SDL_GetTicks() - loadStart);
 
 	rd_SetLight(0, 0.0f, 3.98f, 0.0f, 0.7f, 0.7f, 1.0f, 100.0f, 9.0f, 0.0f);
 	rd_SetLight(1, 0.0f, 2.28f, -0.25f, 0.7f, 0.7f, 1.0f, 16.0f, 7.5f, 1.0f);
@@ -288,6 +462,8 @@ void gm_Main(SDL_Window *window)
 	rd_AttachShadowMap(bulkRoom, shadowMapRoom);
 	rd_AttachShadowMap(decorationRoom, shadowMapRoom);
 	rd_AttachShadowMap(teapot, shadowMapRoom);
+	for (int i = 0; i < GM_STRESS_OBJECTS; i++)
+		rd_AttachShadowMap(stressField[i], shadowMapSouth);
 
 	gmSector    sectorSouth;
 	gmObject    sectorSouthBulkObject;
@@ -324,6 +500,7 @@ void gm_Main(SDL_Window *window)
 	southRiser.rObj = riserSouth;
 
 	sr_SetupSector(&sectorSouth, &sectorSouthBulkObject, &southDecoration, sectorSouthNavRegion);
+	sectorSouth.shadowMap = shadowMapSouth;
 	sr_AttachObject(&sectorSouth, &southSphere1);
 	sr_AttachObject(&sectorSouth, &southSphere2);
 	sr_AttachObject(&sectorSouth, &southFlatCylinder);
@@ -370,6 +547,7 @@ void gm_Main(SDL_Window *window)
 	midSphere3.rObj = sphere5;
 
 	sr_SetupSector(&sectorMid, &sectorMidBulkObject, NULL, midNavRegion);
+	sectorMid.shadowMap = shadowMapMid;
 	sr_AttachObject(&sectorMid, &midFlatCylinder);
 	sr_AttachObject(&sectorMid, &midFlatCylinder2);
 	sr_AttachObject(&sectorMid, &midRiser);
@@ -464,6 +642,7 @@ void gm_Main(SDL_Window *window)
 	roomTeapot.rObj = teapot;
 
 	sr_SetupSector(&sectorRoom, &sectorRoomBulkObject, &sectorRoomDecorationObject, roomNavRegion);
+	sectorRoom.shadowMap = shadowMapRoom;
 	sr_AttachObject(&sectorRoom, &roomFlatCylinder);
 	sr_AttachObject(&sectorRoom, &roomRiser);
 	sr_AttachObject(&sectorRoom, &roomTeapot);
@@ -478,7 +657,22 @@ void gm_Main(SDL_Window *window)
 
 	sectorRoom.link1 = &sectorConnect;
 
+	sr_SetupPortal(&sectorSouth.portal1, -2.0f, -6.0f, 2.0f, -6.0f);
+	sectorMid.portal1 = sectorSouth.portal1;
+	sr_SetupPortal(&sectorMid.portal2, 6.0f, -10.0f, 10.0f, -10.0f);
+	sectorNorth.portal1 = sectorMid.portal2;
+	sr_SetupPortal(&sectorNorth.portal2, 10.0f, -18.0f, 10.0f, -22.0f);
+	sectorConnect.portal1 = sectorNorth.portal2;
+	sr_SetupPortal(&sectorConnect.portal2, 12.0f, -18.0f, 12.0f, -22.0f);
+	sectorRoom.portal1 = sectorConnect.portal2;
+
+	gmSector *levelSectors[] = { &sectorSouth, &sectorMid, &sectorNorth, &sectorConnect,
+	                             &sectorRoom };
+	gmPvs     pvs;
+
 	gmSector *actualSector = &sectorSouth;
+	gmSector *visibleSectors[GM_MAX_VISIBLE_SECTORS];
+	int       numVisibleSectors;
 
 	rd_ResetDefaultCamera();
 	rd_OrientDefaultCamera(180.0f, 0.0f);
@@ -518,6 +712,9 @@ void gm_Main(SDL_Window *window)
 
 	rd_PositionDefaultCamera(gameState.playerPosition.x, 2.9f, gameState.playerPosition.z);
 
+	/* Nothing in the level moves, so the placement above is what the PVS holds for good */
+	sr_BakePvs(&pvs, levelSectors, sizeof (levelSectors) / sizeof (levelSectors[0]));
+
 	gm_InitInputState(&inputState);
 	gm_InitInputState(&inputStateCopy);
 
@@ -582,11 +779,32 @@ void gm_Main(SDL_Window *window)
 		rd_Clear(RD_CLEAR_DEPTHVELOCITY);
 		rd_Clear(RD_CLEAR_BLOOM);
 
-		sr_DrawSector(&sectorSouth);
-		sr_DrawSector(&sectorMid);
-		sr_DrawSector(&sectorNorth);
-		sr_DrawSector(&sectorConnect);
-		sr_DrawSector(&sectorRoom);
+		if (inputState.pvs) {
+			const int row = actualSector->index;
+
+			numVisibleSectors = pvs.numVisible[row];
+			for (int i = 0; i < numVisibleSectors; i++)
+				visibleSectors[i] = pvs.sectors[pvs.order[row][i]];
+		} else
+			numVisibleSectors = sr_FindVisibleSectors(actualSector, visibleSectors,
+			                                          GM_MAX_VISIBLE_SECTORS);
+
+		/* The sectors' walls hide what is behind them before anything is submitted. Culling on
+		 * the GPU tests against the whole previous frame instead. */
+		if (inputState.occlusionCulling && !inputState.gpuCulling) {
+			for (int i = 0; i < numVisibleSectors; i++)
+				rd_AddOccluder(visibleSectors[i]->bulkObject.rObj);
+			rd_RasterizeOccluders();
+		}
+
+		for (int i = 0; i < numVisibleSectors; i++)
+			sr_DrawSector(visibleSectors[i], inputState.occlusionCulling, inputState.gpuCulling,
+			              inputState.renderQueue, inputState.pvs ? &pvs : NULL, actualSector);
+
+		if (inputState.stressField)
+			gm_DrawStressField(stressList, stressField, shadowMapSouth,
+			                   inputState.occlusionCulling && !inputState.gpuCulling,
+			                   inputState.renderQueue);
 
  		rd_Frame();
 
@@ -616,7 +834,15 @@ void gm_Main(SDL_Window *window)
 	rd_DestroyObject(decorationConnect);
 	rd_DestroyObject(bulkRoom);
 	rd_DestroyObject(decorationRoom);
+	rd_DestroyCullList(stressList);
+	for (int i = 0; i < GM_STRESS_OBJECTS; i++)
+		rd_DestroyObject(stressField[i]);
 	rd_DestroyObject(teapot);
+	rd_DestroyCullList(sectorSouth.cullList);
+	rd_DestroyCullList(sectorMid.cullList);
+	rd_DestroyCullList(sectorNorth.cullList);
+	rd_DestroyCullList(sectorConnect.cullList);
+	rd_DestroyCullList(sectorRoom.cullList);
 	rd_DestroyShadowMap(shadowMapSouth);
 	rd_DestroyShadowMap(shadowMapMid);
 	rd_DestroyShadowMap(shadowMapRoom);
@@ -643,7 +869,32 @@ static int gm_HandleEvents(SDL_Window *window, gmInputState *state)
 	state->timeSecond += state->timeDelta;
 
 	if (state->timeSecond >= 1000) {
+		rdStats stats;
+
+		rd_GetStats(&stats);
+
 		printf("Frames per second: %u\n", state->numFrames);
+		printf("Shadow maps: %d draws, %d of %d casters culled, %.2f ms GPU\n",
+		       stats.shadowMapDraws, stats.shadowCastersCulled, stats.shadowCastersTested,
+		       stats.shadowMapMilliseconds);
+		printf("Occlusion: %d of %d sectors hidden, %d objects skipped\n",
+		       stats.occlusionCulled, stats.occlusionTests, stats.occlusionObjectsCulled);
+		printf("Occluders: %d triangles in %.2f ms, %d of %d objects hidden\n",
+		       stats.occluderTriangles, stats.occluderMilliseconds, stats.occluderObjectsCulled,
+		       stats.occluderObjectsTested);
+		printf("GPU culling: %d objects\n", stats.gpuCullObjects);
+		printf("Draws: %d objects, %d as instances, %d state changes%s\n", stats.objectDraws,
+		       stats.instancedObjects, stats.stateChanges,
+		       state->renderQueue ? "" : " (immediate)");
+		printf("GL state calls: %d issued, %d filtered%s\n", stats.glCallsIssued,
+		       stats.glCallsFiltered, state->stateFiltering ? "" : " (filtering off)");
+		printf("G-buffer: %s%s, %d vertices, %.2f ms GPU (%.1f Mvertices/s), overdraw %.2f\n",
+		       stats.gBufferSinglePass ? "single pass" : "prepass",
+		       state->gBufferMode == RD_GBUFFER_ADAPTIVE ? " (adaptive)" : "",
+		       stats.gBufferVertices, stats.gBufferMilliseconds,
+		       stats.gBufferMilliseconds > 0.0 ?
+		       stats.gBufferVertices / (stats.gBufferMilliseconds * 1000.0) : 0.0,
+		       stats.gBufferOverdraw);
 		state->numFrames = 0;
 		state->timeSecond = 0;
 	}
@@ -691,7 +942,22 @@ static void gm_HandleSingleEvent(const SDL_Event *ev, gmInputState *state)
 		else if (sc == SDL_SCANCODE_M) {
 			state->fullscreen = (state->fullscreen != 1);
 			state->toggleFullscreen = 1;
-		}
+		} else if (sc == SDL_SCANCODE_O)
+			state->occlusionCulling = (state->occlusionCulling != 1);
+		else if (sc == SDL_SCANCODE_P)
+			state->pvs = (state->pvs != 1);
+		else if (sc == SDL_SCANCODE_G)
+			state->gpuCulling = (state->gpuCulling != 1);
+		else if (sc == SDL_SCANCODE_R)
+			state->renderQueue = (state->renderQueue != 1);
+		else if (sc == SDL_SCANCODE_F) {
+			state->stateFiltering = (state->stateFiltering != 1);
+			rd_SetStateFiltering(state->stateFiltering);
+		} else if (sc == SDL_SCANCODE_B) {
+			state->gBufferMode = (state->gBufferMode + 1) % (RD_GBUFFER_ADAPTIVE + 1);
+			rd_SetGBufferMode(state->gBufferMode);
+		} else if (sc == SDL_SCANCODE_T)
+			state->stressField = (state->stressField != 1);
 
 		return;
 	}
@@ -727,6 +993,13 @@ static void gm_InitInputState(gmInputState *state)
 	state->mouseY              = 0;
 	state->fullscreen          = 0;
 	state->toggleFullscreen    = 0;
+	state->occlusionCulling    = 1;
+	state->pvs                 = 1;
+	state->gpuCulling          = 0;
+	state->renderQueue         = 1;
+	state->stateFiltering      = 1;
+	state->gBufferMode         = RD_GBUFFER_PREPASS;
+	state->stressField         = 0;
 	state->quit                = 0;
 	state->timeDelta           = 0;
 	state->timeTotal           = 0;
@@ -735,6 +1008,82 @@ static void gm_InitInputState(gmInputState *state)
 	state->timeSecond          = 0;
 }
 
+/* Drawn like a sector's common objects, without an occlusion test of its own; the occluders
+ * still hide what is behind the walls if they were rasterized this frame */
+static void gm_DrawStressField(rdCullList *list, rdObject **objects, rdShadowMap *sm,
+                               int occluders, int renderQueue)
+{
+	static unsigned char visible[GM_STRESS_OBJECTS], casting[GM_STRESS_OBJECTS];
+
+	rd_CullObjects(list, visible);
+	if (occluders)
+		rd_CullOccludedObjects(list, visible);
+	rd_CullShadowCasters(list, sm, casting);
+
+	if (renderQueue) {
+		for (int i = 0; i < GM_STRESS_OBJECTS; i++) {
+			unsigned int passes = casting[i] ? RD_PASS_SHADOWMAP : 0;
+
+			if (visible[i])
+				passes |= RD_PASS_DEPTHVELOCITY | RD_PASS_SHADOWS | RD_PASS_GBUFFER;
+
+			if (passes != 0)
+				rd_Submit(objects[i], passes);
+		}
+
+		return;
+	}
+
+	for (int i = 0; i < GM_STRESS_OBJECTS; i++) {
+		if (casting[i])
+			rd_Draw(RD_DRAW_SHADOWMAP, objects[i]);
+	}
+
+	for (int i = 0; i < GM_STRESS_OBJECTS; i++) {
+		if (!visible[i])
+			continue;
+
+		rd_Draw(RD_DRAW_DEPTHVELOCITY, objects[i]);
+		rd_Draw(RD_DRAW_SHADOWS, objects[i]);
+		rd_Draw(RD_DRAW_GBUFFER, objects[i]);
+	}
+}
+
+static rdObject *gm_CreateObject(const mpPack *pack, const char *name, rdObjectType objectType,
+                                 rdMaterialType materialType)
+{
+	const mpMeshEntry *e;
+	rdObject          *obj;
+	rdPositionFormat   positionFormat = RD_POSITION_HALF;
+
+	e = mp_Find(pack, name);
+	if (e == NULL) {
+		fprintf(stderr, "Error: mesh pack has no mesh %s\n", name);
+		return NULL;
+	}
+
+	assert(!(e->flags & MP_MESH_INTERIOR) == (objectType != RD_OBJECT_INTERIOR));
+
+	for (int i = 0; i < 3; i++) {
+		if (fabsf(e->boundsMin[i]) > GM_HALF_POSITION_EXTENT ||
+		    fabsf(e->boundsMax[i]) > GM_HALF_POSITION_EXTENT)
+			positionFormat = RD_POSITION_FLOAT;
+	}
+
+	obj = rd_CreateObjectPrecomputed(e->numVertices, mp_Vertices(pack, e), mp_Normals(pack, e),
+	                                 e->numIndices, mp_Indices(pack, e), mp_IndexFormat(e),
+	                                 objectType, materialType, positionFormat);
+	if (obj == NULL) {
+		fprintf(stderr, "Error: couldn't create object %s\n", name);
+		return NULL;
+	}
+
+	/* Welded flat meshes still want front faces culled in the shadow map */
+	rd_SetObjectFlatShaded(obj, (e->flags & MP_MESH_FLAT) != 0);
+
+	return obj;
+}
+
 static void sr_SetupSector(gmSector *sector, gmObject *bulkObject, gmObject *decorationObject,
                            gmNavRegion navRegion)
 {
@@ -748,9 +1097,25 @@ static void sr_SetupSector(gmSector *sector, gmObject *bulkObject, gmObject *dec
 
 	sector->navRegion = navRegion;
 
+	sector->shadowMap = NULL;
+
+	sector->cullList = rd_CreateCullList(2 + 8);
+	assert(sector->cullList != NULL);
+
+	if (sector->decorationObject)
+		rd_AddToCullList(sector->cullList, sector->decorationObject->rObj);
+	rd_AddToCullList(sector->cullList, sector->bulkObject.rObj);
+
 	sector->numObjects = 0;
 	sector->link1 = NULL;
 	sector->link2 = NULL;
+	sector->portal1.numVertices = 0;
+	sector->portal2.numVertices = 0;
+
+	sector->visibleStamp = 0;
+
+	sector->index       = -1;
+	sector->firstObject = 0;
 }
 
 static void sr_AttachObject(gmSector *sector, gmObject *obj)
@@ -759,41 +1124,117 @@ static void sr_AttachObject(gmSector *sector, gmObject *obj)
 
 	sector->objects[sector->numObjects] = *obj;
 	sector->numObjects++;
+
+	rd_AddToCullList(sector->cullList, obj->rObj);
 }
 
-static void sr_DrawSector(gmSector *sector)
+/* i counts from -2 for the decoration and -1 for the bulk object; NULL for a missing decoration */
+static gmObject *sr_GetObject(gmSector *sector, int i)
 {
-	for (int i = -2; i < sector->numObjects; i++) {
-		gmObject *obj;
+	if (i == -2)
+		return sector->decorationObject;
+	if (i == -1)
+		return &sector->bulkObject;
+	return &sector->objects[i];
+}
 
-		if (i == -2) {
-			obj = sector->decorationObject;
+/* With a PVS, objects that can't be seen from anywhere in viewer's sector are skipped up front.
+ * Queued, each object is submitted once for all of its passes and the renderer orders the draws;
+ * otherwise they are drawn right away, pass by pass within the sector. */
+static void sr_DrawSector(gmSector *sector, int occlusionCulling, int gpuCulling,
+                          int renderQueue, const gmPvs *pvs, const gmSector *viewer)
+{
+	/* Objects sit in the cull list in drawing order, without a gap for a missing decoration */
+	const int base = sector->decorationObject != NULL ? 2 : 1;
+
+	unsigned char visible[2 + 8], casting[2 + 8];
+
+	/* The GPU leaves out the objects it culls itself, the PVS costs nothing to apply first */
+	if (gpuCulling)
+		memset(visible, 1, sizeof (visible));
+	else
+		rd_CullObjects(sector->cullList, visible);
+	if (pvs != NULL) {
+		const unsigned char *row   = pvs->bits[viewer->index];
+		const int            first = pvs->numSectors + sector->firstObject;
+
+		for (int i = 0; i < base + sector->numObjects; i++) {
+			if (!sr_TestBit(row, first + i))
+				visible[i] = 0;
+		}
+	}
+	if (occlusionCulling && !gpuCulling)
+		rd_CullOccludedObjects(sector->cullList, visible);
+
+	if (sector->shadowMap != NULL)
+		rd_CullShadowCasters(sector->cullList, sector->shadowMap, casting);
+	else
+		memset(casting, 1, sizeof (casting));
+
+	if (gpuCulling)
+		rd_CullObjectsOnGpu(sector->cullList);
+
+	/* Against the sectors drawn before, which the portal walk and the PVS both hand out front to
+	 * back. The sector's shadow map only serves its own objects, so it is skipped along with
+	 * them. */
+	if (occlusionCulling && renderQueue)
+		rd_SubmitOcclusionTest(sector->cullList);
+	else if (occlusionCulling)
+		rd_BeginOcclusionTest(sector->cullList);
+
+	if (renderQueue) {
+		for (int i = -2; i < sector->numObjects; i++) {
+			gmObject    *obj = sr_GetObject(sector, i);
+			unsigned int passes = 0;
 
 			if (obj == NULL)
 				continue;
-		} else if (i == -1)
-			obj = &sector->bulkObject;
-		else
-			obj = &sector->objects[i];
+
+			if (obj->type != GM_OBJECT_SKIPSHADOWMAP && obj->type != GM_OBJECT_BLOOM &&
+			    casting[i + base])
+				passes |= RD_PASS_SHADOWMAP;
+
+			if (visible[i + base]) {
+				passes |= RD_PASS_DEPTHVELOCITY;
+				if (obj->type == GM_OBJECT_COMMON)
+					passes |= RD_PASS_SHADOWS;
+				else if (obj->type == GM_OBJECT_BLOOM)
+					passes |= RD_PASS_BLOOM;
+
+				if (obj->type != GM_OBJECT_BLOOM)
+					passes |= RD_PASS_GBUFFER;
+			}
+
+			if (passes != 0)
+				rd_Submit(obj->rObj, passes);
+		}
+
+		rd_EndOcclusionTest();
+		return;
+	}
+
+	for (int i = -2; i < sector->numObjects; i++) {
+		gmObject *obj = sr_GetObject(sector, i);
+
+		if (obj == NULL)
+			continue;
 
 		if (obj->type == GM_OBJECT_SKIPSHADOWMAP || obj->type == GM_OBJECT_BLOOM)
 			continue;
+		if (!casting[i + base])
+			continue;
 
 		rd_Draw(RD_DRAW_SHADOWMAP, obj->rObj);
 	}
 
 	for (int i = -2; i < sector->numObjects; i++) {
-		gmObject *obj;
+		gmObject *obj = sr_GetObject(sector, i);
 
-		if (i == -2) {
-			obj = sector->decorationObject;
+		if (obj == NULL)
+			continue;
 
-			if (obj == NULL)
-				continue;
-		} else if (i == -1)
-			obj = &sector->bulkObject;
-		else
-			obj = &sector->objects[i];
+		if (!visible[i + base])
+			continue;
 
 		rd_Draw(RD_DRAW_DEPTHVELOCITY, obj->rObj);
 		if (obj->type == GM_OBJECT_COMMON) {
@@ -807,6 +1248,8 @@ static void sr_DrawSector(gmSector *sector)
 			rd_Draw(RD_DRAW_GBUFFER, obj->rObj);
 		}
 	}
+
+	rd_EndOcclusionTest();
 }
 
 static gmSector *sr_Collision(gmSector *currSector, gmPoint *playerPosition,
@@ -860,3 +1303,505 @@ static int sr_IsInRegion(const gmNavRegion *region, const gmPoint *point, float
 		return 0;
 	return 1;
 }
+
+/* Door-sized opening standing on the floor, from (x1, z1) to (x2, z2) */
+static void sr_SetupPortal(gmPortal *portal, float x1, float z1, float x2, float z2)
+{
+	portal->numVertices = 4;
+
+	portal->vertices[0].x = x1;
+	portal->vertices[0].y = 0.0f;
+	portal->vertices[0].z = z1;
+	portal->vertices[1].x = x2;
+	portal->vertices[1].y = 0.0f;
+	portal->vertices[1].z = z2;
+	portal->vertices[2].x = x2;
+	portal->vertices[2].y = GM_SECTOR_HEIGHT;
+	portal->vertices[2].z = z2;
+	portal->vertices[3].x = x1;
+	portal->vertices[3].y = GM_SECTOR_HEIGHT;
+	portal->vertices[3].z = z1;
+}
+
+/*
+ * Collects the sectors the default camera can see from start, which is the sector it is in. Only
+ * sectors whose portals are in view are entered, each with the view frustum narrowed to the part
+ * of the portal that is visible, so the cost follows what is on screen rather than the level size.
+ */
+static int sr_FindVisibleSectors(gmSector *start, gmSector **outSectors, int maxSectors)
+{
+	static unsigned int stamp = 0;
+
+	gmVisibility vis;
+	gmFrustum    frustum;
+	float        planes[6][4];
+
+	rd_GetDefaultCameraPosition(&vis.eye.x, &vis.eye.y, &vis.eye.z);
+	rd_GetDefaultCameraFrustum(planes);
+
+	frustum.numPlanes = 6;
+	for (int i = 0; i < 6; i++) {
+		frustum.planes[i].x = planes[i][0];
+		frustum.planes[i].y = planes[i][1];
+		frustum.planes[i].z = planes[i][2];
+		frustum.planes[i].d = planes[i][3];
+	}
+
+	/* Narrowed frustums keep the far plane, the near one is replaced by the portal */
+	vis.farPlane = frustum.planes[5];
+
+	/* Zero is what sectors start with */
+	if (++stamp == 0)
+		stamp = 1;
+	vis.stamp = stamp;
+
+	vis.sectors    = outSectors;
+	vis.numSectors = 0;
+	vis.maxSectors = maxSectors;
+
+	sr_VisitSector(&vis, start, NULL, &frustum, 0);
+
+	return vis.numSectors;
+}
+
+static void sr_VisitSector(gmVisibility *vis, gmSector *sector, const gmSector *from,
+                           const gmFrustum *frustum, int depth)
+{
+	if (sector->visibleStamp != vis->stamp) {
+		sector->visibleStamp = vis->stamp;
+
+		assert(vis->numSectors < vis->maxSectors);
+		vis->sectors[vis->numSectors] = sector;
+		vis->numSectors++;
+	}
+
+	if (depth == GM_MAX_PORTAL_DEPTH)
+		return;
+
+	for (int i = 0; i < 2; i++) {
+		gmSector       *next   = i == 0 ? sector->link1 : sector->link2;
+		const gmPortal *portal = i == 0 ? &sector->portal1 : &sector->portal2;
+		gmFrustum       narrowed;
+
+		/* Looking back through the portal we came in by shows nothing new */
+		if (next == NULL || next == from)
+			continue;
+
+		if (sr_ClipPortal(vis, sector, portal, frustum, &narrowed))
+			sr_VisitSector(vis, next, sector, &narrowed, depth + 1);
+	}
+}
+
+/* Narrows frustum to what can be seen of the next sector through portal, 0 if nothing can */
+static int sr_ClipPortal(const gmVisibility *vis, const gmSector *sector,
+                         const gmPortal *portal, const gmFrustum *frustum, gmFrustum *out)
+{
+	gmVec3  polygon[2][GM_MAX_CLIP_VERTICES + 1];
+	gmVec3  edge1, edge2, center;
+	gmPlane portalPlane;
+	float   length, side;
+	int     numVertices, current = 0;
+
+	if (portal->numVertices < 3)
+		return 0;
+
+	const gmVec3 *v = portal->vertices;
+
+	edge1.x = v[1].x - v[0].x;
+	edge1.y = v[1].y - v[0].y;
+	edge1.z = v[1].z - v[0].z;
+	edge2.x = v[2].x - v[0].x;
+	edge2.y = v[2].y - v[0].y;
+	edge2.z = v[2].z - v[0].z;
+
+	portalPlane.x = edge1.y * edge2.z - edge1.z * edge2.y;
+	portalPlane.y = edge1.z * edge2.x - edge1.x * edge2.z;
+	portalPlane.z = edge1.x * edge2.y - edge1.y * edge2.x;
+	length = sqrtf(portalPlane.x * portalPlane.x + portalPlane.y * portalPlane.y +
+	               portalPlane.z * portalPlane.z);
+	portalPlane.x /= length;
+	portalPlane.y /= length;
+	portalPlane.z /= length;
+	portalPlane.d = -(portalPlane.x * v[0].x + portalPlane.y * v[0].y + portalPlane.z * v[0].z);
+
+	/* Which side of the portal the sector we look from is on */
+	center.x = 0.25f * (sector->navRegion.upperLeft.x + sector->navRegion.upperRight.x +
+	                    sector->navRegion.lowerLeft.x + sector->navRegion.lowerRight.x);
+	center.y = 0.5f * GM_SECTOR_HEIGHT;
+	center.z = 0.25f * (sector->navRegion.upperLeft.z + sector->navRegion.upperRight.z +
+	                    sector->navRegion.lowerLeft.z + sector->navRegion.lowerRight.z);
+	side = sr_PlaneDistance(&portalPlane, &center) < 0.0f ? -1.0f : 1.0f;
+
+	/*
+	 * Walking through the doorway the eye is on (or, until the collision code switches sectors,
+	 * slightly past) the portal plane, where the planes through its edges degenerate
+	 */
+	if (side * sr_PlaneDistance(&portalPlane, &vis->eye) < GM_PORTAL_EPSILON) {
+		*out = *frustum;
+		return 1;
+	}
+
+	numVertices = portal->numVertices;
+	memcpy(polygon[0], portal->vertices, numVertices * sizeof (gmVec3));
+
+	for (int i = 0; i < frustum->numPlanes; i++) {
+		numVertices = sr_ClipPolygon(polygon[current], numVertices, &frustum->planes[i],
+		                             polygon[current ^ 1]);
+		current ^= 1;
+
+		if (numVertices < 3)
+			return 0;
+
+		/* Too fine to narrow any further, keep looking through the whole frustum */
+		if (numVertices > GM_MAX_CLIP_VERTICES) {
+			*out = *frustum;
+			return 1;
+		}
+	}
+
+	const gmVec3 *p = polygon[current];
+
+	center.x = center.y = center.z = 0.0f;
+	for (int i = 0; i < numVertices; i++) {
+		center.x += p[i].x;
+		center.y += p[i].y;
+		center.z += p[i].z;
+	}
+	center.x /= numVertices;
+	center.y /= numVertices;
+	center.z /= numVertices;
+
+	/* One plane through the eye and each edge of what is left, facing the polygon */
+	out->numPlanes = 0;
+	for (int i = 0; i < numVertices; i++) {
+		const gmVec3 *a     = &p[i];
+		const gmVec3 *b     = &p[(i + 1) % numVertices];
+		gmPlane      *plane = &out->planes[out->numPlanes];
+
+		edge1.x = a->x - vis->eye.x;
+		edge1.y = a->y - vis->eye.y;
+		edge1.z = a->z - vis->eye.z;
+		edge2.x = b->x - vis->eye.x;
+		edge2.y = b->y - vis->eye.y;
+		edge2.z = b->z - vis->eye.z;
+
+		plane->x = edge1.y * edge2.z - edge1.z * edge2.y;
+		plane->y = edge1.z * edge2.x - edge1.x * edge2.z;
+		plane->z = edge1.x * edge2.y - edge1.y * edge2.x;
+		length = sqrtf(plane->x * plane->x + plane->y * plane->y + plane->z * plane->z);
+
+		/* Clipping leaves (almost) repeated vertices behind */
+		if (length < 1e-6f)
+			continue;
+
+		plane->x /= length;
+		plane->y /= length;
+		plane->z /= length;
+		plane->d = -(plane->x * vis->eye.x + plane->y * vis->eye.y + plane->z * vis->eye.z);
+
+		/* Seen almost edge on, which way the plane faces is down to rounding; keep it all */
+		side = sr_PlaneDistance(plane, &center);
+		if (fabsf(side) < GM_PORTAL_SLIVER) {
+			*out = *frustum;
+			return 1;
+		}
+
+		if (side < 0.0f) {
+			plane->x = -plane->x;
+			plane->y = -plane->y;
+			plane->z = -plane->z;
+			plane->d = -plane->d;
+		}
+
+		out->numPlanes++;
+	}
+
+	out->planes[out->numPlanes] = vis->farPlane;
+	out->numPlanes++;
+
+	return 1;
+}
+
+/* Sutherland-Hodgman against a single plane, out has room for numIn + 1 vertices */
+static int sr_ClipPolygon(const gmVec3 *in, int numIn, const gmPlane *plane, gmVec3 *out)
+{
+	int numOut = 0;
+
+	for (int i = 0; i < numIn; i++) {
+		const gmVec3 *a  = &in[i];
+		const gmVec3 *b  = &in[(i + 1) % numIn];
+		const float   da = sr_PlaneDistance(plane, a);
+		const float   db = sr_PlaneDistance(plane, b);
+
+		if (da >= 0.0f)
+			out[numOut++] = *a;
+
+		if ((da >= 0.0f) != (db >= 0.0f)) {
+			const float t = da / (da - db);
+
+			out[numOut].x = a->x + t * (b->x - a->x);
+			out[numOut].y = a->y + t * (b->y - a->y);
+			out[numOut].z = a->z + t * (b->z - a->z);
+			numOut++;
+		}
+	}
+
+	return numOut;
+}
+
+static float sr_PlaneDistance(const gmPlane *plane, const gmVec3 *point)
+{
+	return plane->x * point->x + plane->y * point->y + plane->z * point->z + plane->d;
+}
+
+/*
+ * Bakes the PVS of the level made up of sectors. Each sector is sampled on a grid of eye positions
+ * over its nav region, widened by how far the camera gets past it, at several heights between
+ * floor and ceiling. From each one the portal walk starts out looking every way at once, so what
+ * it reaches is what can be seen from there in some direction. The grid is shared among threads.
+ */
+static void sr_BakePvs(gmPvs *pvs, gmSector **sectors, int numSectors)
+{
+	gmPvsBake    bake;
+	pthread_t    threads[GM_PVS_THREADS - 1];
+	int          started[GM_PVS_THREADS - 1];
+	int          numThreads = 1;
+	unsigned int bakeStart  = SDL_GetTicks();
+
+	assert(numSectors <= GM_MAX_SECTORS);
+
+	pvs->numSectors = numSectors;
+	pvs->numObjects = 0;
+	for (int i = 0; i < numSectors; i++) {
+		pvs->sectors[i] = sectors[i];
+
+		sectors[i]->index       = i;
+		sectors[i]->firstObject = pvs->numObjects;
+
+		pvs->numObjects += (sectors[i]->decorationObject != NULL ? 2 : 1) +
+		                   sectors[i]->numObjects;
+	}
+	assert(pvs->numObjects <= GM_MAX_LEVEL_OBJECTS);
+
+	memset(pvs->bits, 0, sizeof (pvs->bits));
+
+	bake.pvs        = pvs;
+	bake.nextSample = 0;
+	bake.numSamples = numSectors * GM_PVS_SAMPLES * GM_PVS_SAMPLES * GM_PVS_HEIGHTS;
+	pthread_mutex_init(&bake.lock, NULL);
+
+	/* The calling thread works along, so failing to start the others only costs time */
+	for (int i = 0; i < GM_PVS_THREADS - 1; i++) {
+		started[i] = pthread_create(&threads[i], NULL, sr_BakeThread, &bake) == 0;
+		numThreads += started[i];
+	}
+
+	sr_BakeThread(&bake);
+
+	for (int i = 0; i < GM_PVS_THREADS - 1; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&bake.lock);
+
+	/* Breadth first over the links, so sectors are drawn nearest first */
+	for (int i = 0; i < numSectors; i++) {
+		int           queue[GM_MAX_SECTORS], head = 0, tail = 0;
+		unsigned char queued[GM_MAX_SECTORS];
+
+		memset(queued, 0, sizeof (queued));
+		queue[tail++] = i;
+		queued[i]     = 1;
+
+		pvs->numVisible[i] = 0;
+
+		while (head < tail) {
+			const gmSector *sector = pvs->sectors[queue[head++]];
+
+			if (sr_TestBit(pvs->bits[i], sector->index))
+				pvs->order[i][pvs->numVisible[i]++] = sector->index;
+
+			for (int j = 0; j < 2; j++) {
+				const gmSector *next = j == 0 ? sector->link1 : sector->link2;
+
+				if (next == NULL)
+					continue;
+
+				assert(next->index >= 0);
+
+				if (!queued[next->index]) {
+					queue[tail++]       = next->index;
+					queued[next->index] = 1;
+				}
+			}
+		}
+	}
+
+	sr_ReportPvs(pvs, numThreads, SDL_GetTicks() - bakeStart);
+}
+
+static void *sr_BakeThread(void *arg)
+{
+	gmPvsBake    *bake = arg;
+	unsigned char bits[GM_MAX_SECTORS][GM_PVS_ROW_BYTES];
+
+	memset(bits, 0, sizeof (bits));
+
+	for (;;) {
+		int sample;
+
+		pthread_mutex_lock(&bake->lock);
+		sample = bake->nextSample++;
+		pthread_mutex_unlock(&bake->lock);
+
+		if (sample >= bake->numSamples)
+			break;
+
+		sr_BakeSample(bake->pvs, sample, bits);
+	}
+
+	/* A sector sees what any of its eye positions sees */
+	pthread_mutex_lock(&bake->lock);
+	for (int i = 0; i < bake->pvs->numSectors; i++) {
+		for (int j = 0; j < GM_PVS_ROW_BYTES; j++)
+			bake->pvs->bits[i][j] |= bits[i][j];
+	}
+	pthread_mutex_unlock(&bake->lock);
+
+	return NULL;
+}
+
+static void sr_BakeSample(const gmPvs *pvs, int sample, unsigned char (*bits)[GM_PVS_ROW_BYTES])
+{
+	const int          perSector = GM_PVS_SAMPLES * GM_PVS_SAMPLES * GM_PVS_HEIGHTS;
+	const int          cell      = sample % perSector;
+	const gmSector    *sector    = pvs->sectors[sample / perSector];
+	const gmNavRegion *region    = &sector->navRegion;
+
+	const float tx = (float) (cell % GM_PVS_SAMPLES) / (GM_PVS_SAMPLES - 1);
+	const float tz = (float) (cell / GM_PVS_SAMPLES % GM_PVS_SAMPLES) / (GM_PVS_SAMPLES - 1);
+	const float ty = (float) (cell / (GM_PVS_SAMPLES * GM_PVS_SAMPLES)) / (GM_PVS_HEIGHTS - 1);
+
+	const float minX = fminf(region->upperLeft.x, region->lowerLeft.x) - GM_PVS_PADDING;
+	const float maxX = fmaxf(region->upperRight.x, region->lowerRight.x) + GM_PVS_PADDING;
+	const float minZ = fminf(region->lowerLeft.z, region->lowerRight.z) - GM_PVS_PADDING;
+	const float maxZ = fmaxf(region->upperLeft.z, region->upperRight.z) + GM_PVS_PADDING;
+	const float minY = GM_PORTAL_EPSILON;
+	const float maxY = GM_SECTOR_HEIGHT - GM_PORTAL_EPSILON;
+
+	gmVisibility vis;
+	gmFrustum    frustum;
+
+	vis.eye.x = minX + tx * (maxX - minX);
+	vis.eye.y = minY + ty * (maxY - minY);
+	vis.eye.z = minZ + tz * (maxZ - minZ);
+
+	/* Nothing is out of reach */
+	vis.farPlane.x = 0.0f;
+	vis.farPlane.y = 0.0f;
+	vis.farPlane.z = 0.0f;
+	vis.farPlane.d = 1.0f;
+
+	vis.stamp      = 0;
+	vis.sectors    = NULL;
+	vis.numSectors = 0;
+	vis.maxSectors = 0;
+
+	frustum.numPlanes = 0;
+
+	sr_BakeVisit(&vis, pvs, bits[sector->index], sector, NULL, &frustum, 0);
+}
+
+/* sr_VisitSector for the bake, which sets bits in row instead of stamping the shared sectors */
+static void sr_BakeVisit(const gmVisibility *vis, const gmPvs *pvs, unsigned char *row,
+                         const gmSector *sector, const gmSector *from, const gmFrustum *frustum,
+                         int depth)
+{
+	const gmObject *objects[2 + 8];
+	int             numObjects = 0;
+
+	row[sector->index / 8] |= 1 << (sector->index % 8);
+
+	if (sector->decorationObject != NULL)
+		objects[numObjects++] = sector->decorationObject;
+	objects[numObjects++] = &sector->bulkObject;
+	for (int i = 0; i < sector->numObjects; i++)
+		objects[numObjects++] = &sector->objects[i];
+
+	for (int i = 0; i < numObjects; i++) {
+		const int bit = pvs->numSectors + sector->firstObject + i;
+		float     min[3], max[3];
+
+		if (sr_TestBit(row, bit))
+			continue;
+
+		/* Without geometry yet there are no bounds to rule it out by */
+		if (!rd_GetObjectBounds(objects[i]->rObj, min, max) ||
+		    sr_IsBoxInFrustum(frustum, min, max))
+			row[bit / 8] |= 1 << (bit % 8);
+	}
+
+	if (depth == GM_MAX_PORTAL_DEPTH)
+		return;
+
+	for (int i = 0; i < 2; i++) {
+		const gmSector *next   = i == 0 ? sector->link1 : sector->link2;
+		const gmPortal *portal = i == 0 ? &sector->portal1 : &sector->portal2;
+		gmFrustum       narrowed;
+
+		if (next == NULL || next == from)
+			continue;
+
+		if (sr_ClipPortal(vis, sector, portal, frustum, &narrowed))
+			sr_BakeVisit(vis, pvs, row, next, sector, &narrowed, depth + 1);
+	}
+}
+
+/* Outside only if the corner furthest along some plane's normal is behind it */
+static int sr_IsBoxInFrustum(const gmFrustum *frustum, const float min[3], const float max[3])
+{
+	for (int i = 0; i < frustum->numPlanes; i++) {
+		const gmPlane *plane = &frustum->planes[i];
+		gmVec3         corner;
+
+		corner.x = plane->x >= 0.0f ? max[0] : min[0];
+		corner.y = plane->y >= 0.0f ? max[1] : min[1];
+		corner.z = plane->z >= 0.0f ? max[2] : min[2];
+
+		if (sr_PlaneDistance(plane, &corner) < 0.0f)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void sr_ReportPvs(const gmPvs *pvs, int numThreads, unsigned int milliseconds)
+{
+	const int rowBytes = (pvs->numSectors + pvs->numObjects + 7) / 8;
+	float     culled   = 0.0f;
+
+	printf("Baked PVS from %d eye positions per sector on %d threads in %u ms, %d bytes\n",
+	       GM_PVS_SAMPLES * GM_PVS_SAMPLES * GM_PVS_HEIGHTS, numThreads, milliseconds,
+	       pvs->numSectors * rowBytes);
+
+	for (int i = 0; i < pvs->numSectors; i++) {
+		int numObjects = 0;
+
+		for (int j = 0; j < pvs->numObjects; j++)
+			numObjects += sr_TestBit(pvs->bits[i], pvs->numSectors + j);
+
+		culled += 1.0f - (float) numObjects / pvs->numObjects;
+
+		printf("PVS of sector %d: %d of %d sectors, %d of %d objects, %.0f%% culled\n", i,
+		       pvs->numVisible[i], pvs->numSectors, numObjects, pvs->numObjects,
+		       100.0f - 100.0f * numObjects / pvs->numObjects);
+	}
+
+	printf("PVS culls %.0f%% of objects on average\n", 100.0f * culled / pvs->numSectors);
+}
+
+static int sr_TestBit(const unsigned char *row, int bit)
+{
+	return (row[bit / 8] >> (bit % 8)) & 1;
+}
@@ -6,6 +6,7 @@
 #include "renderer.h"
 #include "renderer_gldecl.h"
 #include "game.h"
+#include "bench.h"
 
 #define SCREEN_WIDTH 1280
 #define SCREEN_HEIGHT 960
@@ -19,6 +20,7 @@ int main(int argc, char **argv)
 	SDL_Window   *window;
 	SDL_GLContext glc;
 	rdGL          gl;
+	int           bench;
 
 	srand( (unsigned int) time(NULL));
 
@@ -58,13 +60,17 @@ int main(int argc, char **argv)
 	load_gl(&gl);
 	rd_Init(gl, SCREEN_WIDTH, SCREEN_HEIGHT);
 	rd_SetCustomAllocator(alloc_or_abort, free);
-	gm_Main(window);
+
+	/* A benchmark runs instead of the game if one is asked for */
+	bench = bn_Main(argc, argv);
+	if (bench == 0)
+		gm_Main(window);
 
 	rd_Shutdown();
 	SDL_GL_DeleteContext(glc);
 	SDL_DestroyWindow(window);
 	SDL_Quit();
-	return EXIT_SUCCESS;
+	return bench < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 static void load_gl(rdGL *gl)
@@ -81,6 +87,8 @@ static void load_gl(rdGL *gl)
 	gl->GetError                = gl_proc("glGetError");
 	gl->BindBuffer              = gl_proc("glBindBuffer");
 	gl->BufferData              = gl_proc("glBufferData");
+	gl->BufferSubData           = gl_proc("glBufferSubData");
+	gl->CopyBufferSubData       = gl_proc("glCopyBufferSubData");
 	gl->GenVertexArrays         = gl_proc("glGenVertexArrays");
 	gl->DeleteVertexArrays      = gl_proc("glDeleteVertexArrays");
 	gl->BindVertexArray         = gl_proc("glBindVertexArray");
@@ -108,7 +116,9 @@ static void load_gl(rdGL *gl)
 	gl->Uniform1fv              = gl_proc("glUniform1fv");
 	gl->Uniform2fv              = gl_proc("glUniform2fv");
 	gl->Uniform3fv              = gl_proc("glUniform3fv");
+	gl->Uniform4fv              = gl_proc("glUniform4fv");
 	gl->DrawElements            = gl_proc("glDrawElements");
+	gl->DrawElementsBaseVertex  = gl_proc("glDrawElementsBaseVertex");
 	gl->Viewport                = gl_proc("glViewport");
 	gl->CullFace                = gl_proc("glCullFace");
 	gl->GenFramebuffers         = gl_proc("glGenFramebuffers");
@@ -132,6 +142,29 @@ static void load_gl(rdGL *gl)
 	gl->BindRenderbuffer        = gl_proc("glBindRenderbuffer");
 	gl->RenderbufferStorage     = gl_proc("glRenderbufferStorage");
 	gl->FramebufferRenderbuffer = gl_proc("glFramebufferRenderbuffer");
+	gl->GenQueries              = gl_proc("glGenQueries");
+	gl->DeleteQueries           = gl_proc("glDeleteQueries");
+	gl->BeginQuery              = gl_proc("glBeginQuery");
+	gl->EndQuery                = gl_proc("glEndQuery");
+	gl->GetQueryObjectuiv       = gl_proc("glGetQueryObjectuiv");
+	gl->GetQueryObjectui64v     = gl_proc("glGetQueryObjectui64v");
+	gl->BeginConditionalRender  = gl_proc("glBeginConditionalRender");
+	gl->EndConditionalRender    = gl_proc("glEndConditionalRender");
+	gl->ColorMask               = gl_proc("glColorMask");
+	gl->VertexAttribIPointer    = gl_proc("glVertexAttribIPointer");
+	gl->BindBufferBase          = gl_proc("glBindBufferBase");
+	gl->BeginTransformFeedback  = gl_proc("glBeginTransformFeedback");
+	gl->EndTransformFeedback    = gl_proc("glEndTransformFeedback");
+	gl->DrawArraysIndirect      = gl_proc("glDrawArraysIndirect");
+	gl->DrawElementsIndirect    = gl_proc("glDrawElementsIndirect");
+	gl->VertexAttribDivisor     = gl_proc("glVertexAttribDivisor");
+	gl->DrawArraysInstanced     = gl_proc("glDrawArraysInstanced");
+	gl->GetUniformBlockIndex    = gl_proc("glGetUniformBlockIndex");
+	gl->UniformBlockBinding     = gl_proc("glUniformBlockBinding");
+	gl->TransformFeedbackVaryings
+	                            = gl_proc("glTransformFeedbackVaryings");
+	gl->DrawElementsInstancedBaseVertex
+	                            = gl_proc("glDrawElementsInstancedBaseVertex");
 }
 
 static void *gl_proc(const char *proc)
@@ -0,0 +1,710 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "renderer.h"
+#include "models.h"
+#include "meshpack.h"
+#include "meshopt.h"
+#include "objimport.h"
+
+#define MC_MAX_IMPORTS     16
+#define MC_BENCH_THREADS   8  /* Default upper thread count for --bench-obj */
+#define MC_BENCH_RUNS      3
+#define MC_BENCH_TRIANGLES 1000000 /* Default synthetic mesh size for --bench-normals */
+#define MC_BENCH_SAMPLES   256     /* Vertices the quadratic normals are timed on for large meshes */
+
+typedef struct mcSource mcSource;
+struct mcSource
+{
+	const char     *name;
+	const rdVertex *vertices;
+	int             numVertices;
+	const void     *indices;
+	int             numIndices;
+	rdObjectType    objectType;
+	rdIndexFormat   indexFormat;
+};
+
+static const mcSource sources[] = {
+	{ "BulkSouth", modelBulkSouth, sizeof (modelBulkSouth) / sizeof (rdVertex), NULL, 0,
+	  RD_OBJECT_INTERIOR, RD_INDEX_16 },
+	{ "BulkMid", modelBulkMid, sizeof (modelBulkMid) / sizeof (rdVertex), NULL, 0,
+	  RD_OBJECT_INTERIOR, RD_INDEX_16 },
+	{ "BulkNorth", modelBulkNorth, sizeof (modelBulkNorth) / sizeof (rdVertex), NULL, 0,
+	  RD_OBJECT_INTERIOR, RD_INDEX_16 },
+	{ "BulkConnect", modelBulkConnect, sizeof (modelBulkConnect) / sizeof (rdVertex), NULL, 0,
+	  RD_OBJECT_INTERIOR, RD_INDEX_16 },
+	{ "BulkRoom", modelBulkRoom, sizeof (modelBulkRoom) / sizeof (rdVertex), NULL, 0,
+	  RD_OBJECT_INTERIOR, RD_INDEX_16 },
+	{ "DecorationSouth", modelDecorationSouth, sizeof (modelDecorationSouth) / sizeof (rdVertex),
+	  NULL, 0, RD_OBJECT_EXTERIOR, RD_INDEX_16 },
+	{ "DecorationMid", modelDecorationMid, sizeof (modelDecorationMid) / sizeof (rdVertex),
+	  NULL, 0, RD_OBJECT_EXTERIOR, RD_INDEX_16 },
+	{ "DecorationNorth", modelDecorationNorth, sizeof (modelDecorationNorth) / sizeof (rdVertex),
+	  NULL, 0, RD_OBJECT_EXTERIOR, RD_INDEX_16 },
+	{ "DecorationConnect", modelDecorationConnect,
+	  sizeof (modelDecorationConnect) / sizeof (rdVertex), NULL, 0, RD_OBJECT_EXTERIOR,
+	  RD_INDEX_16 },
+	{ "DecorationRoom", modelDecorationRoom, sizeof (modelDecorationRoom) / sizeof (rdVertex),
+	  NULL, 0, RD_OBJECT_EXTERIOR, RD_INDEX_16 },
+	{ "RiserSouth", modelRiserSouth, sizeof (modelRiserSouth) / sizeof (rdVertex), NULL, 0,
+	  RD_OBJECT_EXTERIOR, RD_INDEX_16 },
+	{ "RiserMid", modelRiserMid, sizeof (modelRiserMid) / sizeof (rdVertex), NULL, 0,
+	  RD_OBJECT_EXTERIOR, RD_INDEX_16 },
+	{ "RiserRoom", modelRiserRoom, sizeof (modelRiserRoom) / sizeof (rdVertex), NULL, 0,
+	  RD_OBJECT_EXTERIOR, RD_INDEX_16 },
+	{ "FlatCylinder", modelFlatCylinderVertices,
+	  sizeof (modelFlatCylinderVertices) / sizeof (rdVertex), modelFlatCylinderIndices,
+	  sizeof (modelFlatCylinderIndices) / sizeof (rdIndex), RD_OBJECT_EXTERIOR, RD_INDEX_16 },
+	{ "Sphere", modelSphereVertices, sizeof (modelSphereVertices) / sizeof (rdVertex),
+	  modelSphereIndices, sizeof (modelSphereIndices) / sizeof (rdIndex), RD_OBJECT_EXTERIOR,
+	  RD_INDEX_16 },
+	{ "Teapot", modelTeapotVertices, sizeof (modelTeapotVertices) / sizeof (rdVertex),
+	  modelTeapotIndices, sizeof (modelTeapotIndices) / sizeof (rdIndex), RD_OBJECT_EXTERIOR,
+	  RD_INDEX_16 }
+};
+
+static uint32_t mc_Align(uint32_t offset);
+static int      mc_WritePadded(FILE *f, const void *data, size_t size);
+static int      mc_WriteIndices(FILE *f, const moMesh *mesh, int wide);
+static int      mc_CookMesh(moMesh *mesh, const mcSource *src, const rdVertex *normals,
+                            int overdraw);
+static int      mc_BenchObj(const char *path, int maxThreads);
+static int      mc_BenchPack(const char *path);
+static int      mc_BenchNormals(int numTriangles);
+static int      mc_BenchNormalsMesh(const char *name, int numVertices, const rdVertex *vertices,
+                                    int numIndices, const void *indices,
+                                    rdIndexFormat indexFormat);
+static void     mc_QuadraticNormal(rdVertex *outNormal, const rdVertex *vertex,
+                                   const rdVertex *vertices, int numIndices, const void *indices,
+                                   rdIndexFormat indexFormat);
+static rdIndex32
+                mc_Index(const void *indices, rdIndexFormat indexFormat, int i);
+static double   mc_Seconds(void);
+static size_t   mc_ResidentBytes(void);
+static uint32_t mc_Sum(const void *data, size_t size);
+
+static volatile uint32_t mcSink; /* Keeps the benchmarks' reads from being optimised away */
+
+int main(int argc, char **argv)
+{
+	const int numSources = sizeof (sources) / sizeof (sources[0]);
+
+	mpHeader    header;
+	mpMeshEntry entries[sizeof (sources) / sizeof (sources[0]) + MC_MAX_IMPORTS];
+	moMesh      meshes[sizeof (sources) / sizeof (sources[0]) + MC_MAX_IMPORTS];
+	mcSource    imports[MC_MAX_IMPORTS];
+	oiMesh      objs[MC_MAX_IMPORTS];
+	const char *objPaths[MC_MAX_IMPORTS];
+	const char *output = NULL;
+	int         numImports = 0, numMeshes, overdraw = 0;
+	uint32_t    offset;
+	FILE       *f;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--overdraw") == 0) {
+			overdraw = 1;
+		} else if (strcmp(argv[i], "--obj") == 0 && i + 2 < argc &&
+		           numImports < MC_MAX_IMPORTS) {
+			imports[numImports].name = argv[i + 1];
+			objPaths[numImports++]   = argv[i + 2];
+			i += 2;
+		} else if (strcmp(argv[i], "--bench-obj") == 0 && i + 1 < argc) {
+			int maxThreads = i + 2 < argc ? atoi(argv[i + 2]) : MC_BENCH_THREADS;
+			return mc_BenchObj(argv[i + 1], maxThreads) ? EXIT_SUCCESS : EXIT_FAILURE;
+		} else if (strcmp(argv[i], "--bench-pack") == 0 && i + 1 < argc) {
+			return mc_BenchPack(argv[i + 1]) ? EXIT_SUCCESS : EXIT_FAILURE;
+		} else if (strcmp(argv[i], "--bench-normals") == 0) {
+			int numTriangles = i + 1 < argc ? atoi(argv[i + 1]) : MC_BENCH_TRIANGLES;
+			return mc_BenchNormals(numTriangles) ? EXIT_SUCCESS : EXIT_FAILURE;
+		} else if (output == NULL && argv[i][0] != '-') {
+			output = argv[i];
+		} else {
+			output = NULL;
+			break;
+		}
+	}
+
+	if (output == NULL) {
+		fprintf(stderr, "Usage: %s [--overdraw] [--obj <name> <file.obj>]... <output.p3m>\n"
+		                "       %s --bench-obj <file.obj> [max threads]\n"
+		                "       %s --bench-pack <file.p3m>\n"
+		                "       %s --bench-normals [triangles]\n", argv[0], argv[0], argv[0],
+		        argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Imported meshes are exterior props, cooked with the file's own normals when it has them */
+	for (int i = 0; i < numImports; i++) {
+		mcSource *src = &imports[i];
+		oiMesh   *obj = &objs[i];
+
+		if (!oi_Load(obj, objPaths[i], MC_BENCH_THREADS))
+			return EXIT_FAILURE;
+
+		src->vertices    = obj->vertices;
+		src->numVertices = obj->numVertices;
+		src->indices     = obj->indices;
+		src->numIndices  = obj->numIndices;
+		src->objectType  = RD_OBJECT_EXTERIOR;
+		src->indexFormat = RD_INDEX_32;
+	}
+
+	numMeshes = numSources + numImports;
+
+	header.magic     = MP_MAGIC;
+	header.version   = MP_VERSION;
+	header.numMeshes = numMeshes;
+	header.reserved  = 0;
+
+	offset = mc_Align(sizeof (header) + numMeshes * sizeof (mpMeshEntry));
+
+	for (int i = 0; i < numMeshes; i++) {
+		const mcSource *src     = i < numSources ? &sources[i] : &imports[i - numSources];
+		const rdVertex *normals = i < numSources ? NULL : objs[i - numSources].normals;
+		mpMeshEntry    *e       = &entries[i];
+		moMesh         *mesh    = &meshes[i];
+
+		if (!mc_CookMesh(mesh, src, normals, overdraw)) {
+			fprintf(stderr, "Error: couldn't cook %s\n", src->name);
+			return EXIT_FAILURE;
+		}
+
+		if (i >= numSources)
+			oi_Free(&objs[i - numSources]);
+
+		memset(e, 0, sizeof (*e));
+		strncpy(e->name, src->name, sizeof (e->name) - 1);
+
+		e->flags = 0;
+		if (src->objectType == RD_OBJECT_INTERIOR)
+			e->flags |= MP_MESH_INTERIOR;
+		if (src->indices == NULL)
+			e->flags |= MP_MESH_FLAT;
+		if (mesh->numVertices > 65536)
+			e->flags |= MP_MESH_INDEX32;
+
+		e->numVertices = mesh->numVertices;
+		e->numIndices  = mesh->numIndices;
+
+		e->boundsMin[0] = e->boundsMax[0] = mesh->vertices[0].x;
+		e->boundsMin[1] = e->boundsMax[1] = mesh->vertices[0].y;
+		e->boundsMin[2] = e->boundsMax[2] = mesh->vertices[0].z;
+
+		for (int j = 1; j < mesh->numVertices; j++) {
+			const float v[3] = { mesh->vertices[j].x, mesh->vertices[j].y, mesh->vertices[j].z };
+
+			for (int k = 0; k < 3; k++) {
+				if (v[k] < e->boundsMin[k])
+					e->boundsMin[k] = v[k];
+				if (v[k] > e->boundsMax[k])
+					e->boundsMax[k] = v[k];
+			}
+		}
+
+		e->vertexOffset = offset;
+		offset = mc_Align(offset + mesh->numVertices * sizeof (rdVertex));
+
+		e->normalOffset = offset;
+		offset = mc_Align(offset + mesh->numVertices * sizeof (rdVertex));
+
+		e->indexOffset = offset;
+		if (e->flags & MP_MESH_INDEX32)
+			offset = mc_Align(offset + mesh->numIndices * sizeof (rdIndex32));
+		else
+			offset = mc_Align(offset + mesh->numIndices * sizeof (rdIndex));
+	}
+
+	f = fopen(output, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Error: couldn't create %s\n", output);
+		return EXIT_FAILURE;
+	}
+
+	if (fwrite(&header, sizeof (header), 1, f) != 1 ||
+	    !mc_WritePadded(f, entries, numMeshes * sizeof (mpMeshEntry)))
+		goto write_error;
+
+	for (int i = 0; i < numMeshes; i++) {
+		const moMesh *mesh = &meshes[i];
+
+		if (!mc_WritePadded(f, mesh->vertices, mesh->numVertices * sizeof (rdVertex)) ||
+		    !mc_WritePadded(f, mesh->normals, mesh->numVertices * sizeof (rdVertex)) ||
+		    !mc_WriteIndices(f, mesh, entries[i].flags & MP_MESH_INDEX32))
+			goto write_error;
+
+		mo_FreeMesh(&meshes[i]);
+	}
+
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Error: couldn't write %s\n", output);
+		return EXIT_FAILURE;
+	}
+
+	printf("Wrote %d meshes to %s (%u bytes)\n", numMeshes, output, offset);
+	return EXIT_SUCCESS;
+
+write_error:
+	fprintf(stderr, "Error: couldn't write %s\n", output);
+	fclose(f);
+	return EXIT_FAILURE;
+}
+
+static uint32_t mc_Align(uint32_t offset)
+{
+	return (offset + 15u) & ~15u;
+}
+
+static int mc_WritePadded(FILE *f, const void *data, size_t size)
+{
+	static const unsigned char zeros[16];
+	size_t                     padding = mc_Align(size) - size;
+
+	if (size > 0 && fwrite(data, size, 1, f) != 1)
+		return 0;
+	if (padding > 0 && fwrite(zeros, padding, 1, f) != 1)
+		return 0;
+	return 1;
+}
+
+/* The cooked indices are 32 bits; meshes that fit 16 are written narrowed, at half the size */
+static int mc_WriteIndices(FILE *f, const moMesh *mesh, int wide)
+{
+	rdIndex *narrow;
+	int      ok;
+
+	if (wide || mesh->numIndices == 0)
+		return mc_WritePadded(f, mesh->indices, mesh->numIndices * sizeof (rdIndex32));
+
+	narrow = malloc(mesh->numIndices * sizeof (*narrow));
+	if (narrow == NULL)
+		return 0;
+
+	for (int i = 0; i < mesh->numIndices; i++)
+		narrow[i] = (rdIndex) mesh->indices[i];
+
+	ok = mc_WritePadded(f, narrow, mesh->numIndices * sizeof (*narrow));
+	free(narrow);
+
+	return ok;
+}
+
+/* normals may come with the source (an OBJ with vn lines); otherwise they're generated */
+static int mc_CookMesh(moMesh *mesh, const mcSource *src, const rdVertex *normals, int overdraw)
+{
+	rdVertex *generated = NULL;
+	float     acmrBefore, acmrAfter;
+	int       ok;
+
+	if (normals == NULL) {
+		generated = malloc(src->numVertices * sizeof (*generated));
+		if (generated == NULL)
+			return 0;
+
+		if (!rd_GenerateNormals(generated, src->numVertices, src->vertices, src->numIndices,
+		                        src->indices, src->indexFormat, src->objectType)) {
+			free(generated);
+			return 0;
+		}
+
+		normals = generated;
+	}
+
+	ok = mo_Weld(mesh, src->numVertices, src->vertices, normals, src->numIndices, src->indices,
+	             src->indexFormat);
+	free(generated);
+
+	if (!ok)
+		return 0;
+
+	/* A triangle soup misses on every vertex */
+	if (src->indices != NULL)
+		acmrBefore = mo_ACMR(src->indices, src->indexFormat, src->numIndices, src->numVertices);
+	else
+		acmrBefore = 3.0f;
+
+	if (!mo_OptimizeVertexCache(mesh) || (overdraw && !mo_OptimizeOverdraw(mesh)) ||
+	    !mo_OptimizeVertexFetch(mesh)) {
+		mo_FreeMesh(mesh);
+		return 0;
+	}
+
+	acmrAfter = mo_ACMR(mesh->indices, RD_INDEX_32, mesh->numIndices, mesh->numVertices);
+
+	printf("%-18s %6d -> %6d vertices %6d indices  ACMR %.3f -> %.3f\n", src->name,
+	       src->numVertices, mesh->numVertices, mesh->numIndices, acmrBefore, acmrAfter);
+
+	return 1;
+}
+
+static int mc_BenchObj(const char *path, int maxThreads)
+{
+	double baseline = 0.0;
+	FILE  *f;
+	long   size;
+
+	f = fopen(path, "rb");
+	if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) <= 0) {
+		fprintf(stderr, "Error: couldn't read %s\n", path);
+		if (f != NULL)
+			fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	if (maxThreads < 1)
+		maxThreads = 1;
+
+	/* Powers of two up to maxThreads, then maxThreads itself */
+	for (int threads = 1; threads <= maxThreads;
+	     threads = threads * 2 > maxThreads && threads < maxThreads ? maxThreads : threads * 2) {
+		double best = 0.0;
+		oiMesh mesh;
+
+		for (int run = 0; run < MC_BENCH_RUNS; run++) {
+			double start = mc_Seconds(), elapsed;
+
+			if (!oi_Load(&mesh, path, threads))
+				return 0;
+
+			elapsed = mc_Seconds() - start;
+			if (run == 0 || elapsed < best)
+				best = elapsed;
+
+			if (run == MC_BENCH_RUNS - 1 && threads == 1)
+				printf("%s: %ld bytes, %d vertices, %d indices%s\n", path, size,
+				       mesh.numVertices, mesh.numIndices, mesh.normals ? "" : ", no normals");
+			oi_Free(&mesh);
+		}
+
+		if (threads == 1)
+			baseline = best;
+
+		printf("%2d threads: %8.1f ms %8.1f MB/s  x%.2f\n", threads, best * 1000.0,
+		       size / best / (1024.0 * 1024.0), baseline / best);
+	}
+
+	return 1;
+}
+
+/* Startup with the arrays compiled in, which generated normals for every mesh, against mapping
+ * the pack and reading each array once, as the upload does. There is no GL here, so the upload
+ * itself is left out of both. The pack goes first, while the arrays aren't resident yet, and
+ * resident sizes come from a run whose code was already paged in. */
+static int mc_BenchPack(const char *path)
+{
+	const int numSources = sizeof (sources) / sizeof (sources[0]);
+
+	double   packBest = 0.0, arraysBest = 0.0;
+	size_t   packMapped = 0, packClosed = 0, arraysLoading = 0, arraysAfter = 0;
+	size_t   packBytes = 0, arrayBytes = 0;
+	uint32_t sum = 0;
+
+	static const rdVertex warmVertices[3] = { { 0.0f, 0.0f, 0.0f }, { 1.0f, 0.0f, 0.0f },
+	                                          { 0.0f, 1.0f, 0.0f } };
+	static const rdIndex  warmIndices[3]  = { 0, 1, 2 };
+	rdVertex              warmNormals[3];
+
+	for (int run = 0; run < MC_BENCH_RUNS; run++) {
+		const size_t base  = mc_ResidentBytes();
+		const double start = mc_Seconds();
+		double       elapsed;
+		mpPack       pack;
+
+		if (!mp_Open(&pack, path))
+			return 0;
+
+		for (uint32_t i = 0; i < pack.header->numMeshes; i++) {
+			const mpMeshEntry *e         = &pack.entries[i];
+			const size_t       indexSize = mp_IndexFormat(e) == RD_INDEX_32 ? sizeof (rdIndex32)
+			                                                                : sizeof (rdIndex);
+
+			sum += mc_Sum(mp_Vertices(&pack, e), e->numVertices * sizeof (rdVertex));
+			sum += mc_Sum(mp_Normals(&pack, e), e->numVertices * sizeof (rdVertex));
+			sum += mc_Sum(mp_Indices(&pack, e), e->numIndices * indexSize);
+		}
+
+		if (run == 1)
+			packMapped = mc_ResidentBytes() - base;
+		packBytes = pack.size;
+		mp_Close(&pack);
+
+		elapsed = mc_Seconds() - start;
+		if (run == 0 || elapsed < packBest)
+			packBest = elapsed;
+		if (run == 1)
+			packClosed = mc_ResidentBytes() - base;
+	}
+
+	if (!rd_GenerateNormals(warmNormals, 3, warmVertices, 3, warmIndices, RD_INDEX_16,
+	                        RD_OBJECT_EXTERIOR))
+		return 0;
+
+	for (int run = 0; run < MC_BENCH_RUNS; run++) {
+		const size_t base  = mc_ResidentBytes();
+		const double start = mc_Seconds();
+		double       elapsed;
+		size_t       peak = 0;
+
+		for (int i = 0; i < numSources; i++) {
+			const mcSource *src = &sources[i];
+			rdVertex       *normals;
+			size_t          resident;
+
+			normals = malloc(src->numVertices * sizeof (*normals));
+			if (normals == NULL ||
+			    !rd_GenerateNormals(normals, src->numVertices, src->vertices, src->numIndices,
+			                        src->indices, src->indexFormat, src->objectType)) {
+				free(normals);
+				return 0;
+			}
+
+			sum += mc_Sum(src->vertices, src->numVertices * sizeof (rdVertex));
+			sum += mc_Sum(normals, src->numVertices * sizeof (rdVertex));
+			sum += mc_Sum(src->indices, src->numIndices * sizeof (rdIndex));
+
+			resident = mc_ResidentBytes() - base;
+			if (resident > peak)
+				peak = resident;
+			free(normals);
+
+			if (run == 0)
+				arrayBytes += src->numVertices * sizeof (rdVertex) +
+				              src->numIndices * sizeof (rdIndex);
+		}
+
+		elapsed = mc_Seconds() - start;
+		if (run == 0 || elapsed < arraysBest)
+			arraysBest = elapsed;
+		if (run == 0) {
+			arraysLoading = peak;
+			arraysAfter   = mc_ResidentBytes() - base;
+		}
+	}
+
+	mcSink = sum;
+
+	printf("compiled-in arrays: %zu bytes, %s: %zu bytes\n", arrayBytes, path, packBytes);
+	printf("compiled-in: %8.3f ms, %6zu KB resident while loading, %6zu KB for good\n",
+	       arraysBest * 1000.0, arraysLoading / 1024, arraysAfter / 1024);
+	printf("pack:        %8.3f ms, %6zu KB resident while mapped,  %6zu KB once closed\n",
+	       packBest * 1000.0, packMapped / 1024, packClosed / 1024);
+
+	return 1;
+}
+
+/* The linear normal generator against the quadratic one it replaced, which tested every vertex
+ * against every triangle, on the teapot, the sphere and a wavy grid of about numTriangles */
+static int mc_BenchNormals(int numTriangles)
+{
+	const int side = (int) sqrt(numTriangles / 2.0) + 1;
+
+	rdVertex  *vertices;
+	rdIndex32 *indices;
+	int        numIndices = 0, ok;
+
+	for (int i = 0; i < (int) (sizeof (sources) / sizeof (sources[0])); i++) {
+		const mcSource *src = &sources[i];
+
+		if (strcmp(src->name, "Teapot") != 0 && strcmp(src->name, "Sphere") != 0)
+			continue;
+
+		if (!mc_BenchNormalsMesh(src->name, src->numVertices, src->vertices, src->numIndices,
+		                         src->indices, src->indexFormat))
+			return 0;
+	}
+
+	if (side < 2)
+		return 1;
+
+	vertices = malloc((size_t) side * side * sizeof (*vertices));
+	indices  = malloc((size_t) (side - 1) * (side - 1) * 6 * sizeof (*indices));
+
+	if (vertices == NULL || indices == NULL) {
+		free(vertices);
+		free(indices);
+		return 0;
+	}
+
+	for (int z = 0; z < side; z++) {
+		for (int x = 0; x < side; x++) {
+			rdVertex *v = &vertices[z * side + x];
+
+			v->x = x * 0.01f;
+			v->y = sinf(x * 0.05f) * cosf(z * 0.07f);
+			v->z = z * 0.01f;
+		}
+	}
+
+	for (int z = 0; z < side - 1; z++) {
+		for (int x = 0; x < side - 1; x++) {
+			const rdIndex32 a = z * side + x;
+
+			indices[numIndices++] = a;
+			indices[numIndices++] = a + side;
+			indices[numIndices++] = a + 1;
+			indices[numIndices++] = a + 1;
+			indices[numIndices++] = a + side;
+			indices[numIndices++] = a + side + 1;
+		}
+	}
+
+	ok = mc_BenchNormalsMesh("Grid", side * side, vertices, numIndices, indices, RD_INDEX_32);
+
+	free(vertices);
+	free(indices);
+
+	return ok;
+}
+
+/* Meshes too large to finish quadratically get it timed on MC_BENCH_SAMPLES evenly spread
+ * vertices and scaled up; the difference is only over the vertices it was computed for */
+static int mc_BenchNormalsMesh(const char *name, int numVertices, const rdVertex *vertices,
+                               int numIndices, const void *indices, rdIndexFormat indexFormat)
+{
+	const int numSamples = numVertices > 16 * MC_BENCH_SAMPLES ? MC_BENCH_SAMPLES : numVertices;
+
+	rdVertex *normals;
+	double    linear = 0.0, quadratic, start;
+	float     maxDiff = 0.0f;
+
+	normals = malloc(numVertices * sizeof (*normals));
+	if (normals == NULL)
+		return 0;
+
+	for (int run = 0; run < MC_BENCH_RUNS; run++) {
+		double elapsed;
+
+		start = mc_Seconds();
+		if (!rd_GenerateNormals(normals, numVertices, vertices, numIndices, indices, indexFormat,
+		                        RD_OBJECT_EXTERIOR)) {
+			free(normals);
+			return 0;
+		}
+		elapsed = mc_Seconds() - start;
+
+		if (run == 0 || elapsed < linear)
+			linear = elapsed;
+	}
+
+	start = mc_Seconds();
+
+	for (int i = 0; i < numSamples; i++) {
+		const int v = (int) ((long long) i * numVertices / numSamples);
+		rdVertex  reference;
+
+		mc_QuadraticNormal(&reference, &vertices[v], vertices, numIndices, indices, indexFormat);
+
+		maxDiff = fmaxf(maxDiff, fabsf(reference.x - normals[v].x));
+		maxDiff = fmaxf(maxDiff, fabsf(reference.y - normals[v].y));
+		maxDiff = fmaxf(maxDiff, fabsf(reference.z - normals[v].z));
+	}
+
+	quadratic = (mc_Seconds() - start) * numVertices / numSamples;
+
+	printf("%-8s %8d vertices %8d triangles  quadratic %10.1f ms%s  linear %8.2f ms  x%-8.0f"
+	       "max diff %g\n", name, numVertices, numIndices / 3, quadratic * 1000.0,
+	       numSamples < numVertices ? " (est.)" : "       ", linear * 1000.0, quadratic / linear,
+	       maxDiff);
+
+	free(normals);
+	return 1;
+}
+
+/* What normal generation did before welding: the normals of every triangle touching the
+ * vertex's position, summed and normalised */
+static void mc_QuadraticNormal(rdVertex *outNormal, const rdVertex *vertex,
+                               const rdVertex *vertices, int numIndices, const void *indices,
+                               rdIndexFormat indexFormat)
+{
+	float length;
+
+	outNormal->x = outNormal->y = outNormal->z = 0.0f;
+
+	for (int i = 0; i < numIndices; i += 3) {
+		const rdVertex *v1 = &vertices[mc_Index(indices, indexFormat, i + 0)];
+		const rdVertex *v2 = &vertices[mc_Index(indices, indexFormat, i + 1)];
+		const rdVertex *v3 = &vertices[mc_Index(indices, indexFormat, i + 2)];
+		float           e1[3], e2[3], n[3];
+
+		if ((v1->x != vertex->x || v1->y != vertex->y || v1->z != vertex->z) &&
+		    (v2->x != vertex->x || v2->y != vertex->y || v2->z != vertex->z) &&
+		    (v3->x != vertex->x || v3->y != vertex->y || v3->z != vertex->z))
+			continue;
+
+		e1[0] = v2->x - v1->x; e1[1] = v2->y - v1->y; e1[2] = v2->z - v1->z;
+		e2[0] = v3->x - v1->x; e2[1] = v3->y - v1->y; e2[2] = v3->z - v1->z;
+
+		n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+		n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+		n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+
+		length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		if (length > 0.0f) {
+			outNormal->x += n[0] / length;
+			outNormal->y += n[1] / length;
+			outNormal->z += n[2] / length;
+		}
+	}
+
+	length = sqrtf(outNormal->x * outNormal->x + outNormal->y * outNormal->y +
+	               outNormal->z * outNormal->z);
+	if (length > 0.0f) {
+		outNormal->x /= length;
+		outNormal->y /= length;
+		outNormal->z /= length;
+	}
+}
+
+static rdIndex32 mc_Index(const void *indices, rdIndexFormat indexFormat, int i)
+{
+	if (indexFormat == RD_INDEX_32)
+		return ((const rdIndex32 *) indices)[i];
+	else
+		return ((const rdIndex *) indices)[i];
+}
+
+static double mc_Seconds(void)
+{
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Linux only; 0 where /proc isn't there */
+static size_t mc_ResidentBytes(void)
+{
+	unsigned long size, resident = 0;
+	FILE         *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+
+	return resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+static uint32_t mc_Sum(const void *data, size_t size)
+{
+	const unsigned char *bytes = data;
+	uint32_t             sum   = 0;
+
+	for (size_t i = 0; i < size; i += sizeof (uint32_t)) {
+		uint32_t word = 0;
+
+		memcpy(&word, bytes + i, size - i < sizeof (word) ? size - i : sizeof (word));
+		sum += word;
+	}
+
+	return sum;
+}
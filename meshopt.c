@@ -0,0 +1,502 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "meshopt.h"
+
+/* Forsyth's linear-speed vertex cache optimisation, with the constants from his write-up */
+#define MO_CACHE_SIZE        32
+#define MO_CACHE_DECAY_POWER 1.5f
+#define MO_LAST_TRI_SCORE    0.75f
+#define MO_VALENCE_SCALE     2.0f
+#define MO_VALENCE_POWER     0.5f
+
+typedef struct moCluster moCluster;
+struct moCluster
+{
+	int   first;
+	int   count;
+	float sortKey;
+};
+
+static unsigned int mo_HashFloat(unsigned int hash, float f);
+static unsigned int mo_HashVertex(const rdVertex *v, const rdVertex *n);
+static int          mo_VertexEqual(const rdVertex *v1, const rdVertex *n1, const rdVertex *v2,
+                                   const rdVertex *n2);
+static float        mo_VertexScore(int cachePosition, int remainingTriangles);
+static int          mo_CompareClusters(const void *a, const void *b);
+static rdIndex32    mo_Index(const void *indices, rdIndexFormat indexFormat, int i);
+
+int mo_Weld(moMesh *out, int numVertices, const rdVertex *vertices, const rdVertex *normals,
+            int numIndices, const void *indices, rdIndexFormat indexFormat)
+{
+	int  tableSize = 1;
+	int *table;
+	int *remap;
+
+	if (indices == NULL)
+		numIndices = numVertices;
+
+	while (tableSize < 2 * numVertices)
+		tableSize *= 2;
+
+	out->numVertices = 0;
+	out->vertices    = malloc(numVertices * sizeof (rdVertex));
+	out->normals     = malloc(numVertices * sizeof (rdVertex));
+	out->numIndices  = numIndices;
+	out->indices     = malloc(numIndices * sizeof (rdIndex32));
+
+	table = malloc(tableSize * sizeof (*table));
+	remap = malloc(numVertices * sizeof (*remap));
+
+	if (out->vertices == NULL || out->normals == NULL || out->indices == NULL || table == NULL ||
+	    remap == NULL)
+		goto error;
+
+	for (int i = 0; i < tableSize; i++)
+		table[i] = -1;
+
+	for (int i = 0; i < numVertices; i++) {
+		unsigned int h = mo_HashVertex(&vertices[i], &normals[i]) & (tableSize - 1);
+
+		while (table[h] != -1 && !mo_VertexEqual(&out->vertices[table[h]], &out->normals[table[h]],
+		                                         &vertices[i], &normals[i]))
+			h = (h + 1) & (tableSize - 1);
+
+		if (table[h] == -1) {
+			table[h] = out->numVertices;
+			out->vertices[out->numVertices] = vertices[i];
+			out->normals[out->numVertices]  = normals[i];
+			out->numVertices++;
+		}
+
+		remap[i] = table[h];
+	}
+
+	for (int i = 0; i < numIndices; i++)
+		out->indices[i] = remap[indices ? mo_Index(indices, indexFormat, i) : (rdIndex32) i];
+
+	free(table);
+	free(remap);
+	return 1;
+
+error:
+	free(table);
+	free(remap);
+	mo_FreeMesh(out);
+	return 0;
+}
+
+void mo_FreeMesh(moMesh *mesh)
+{
+	free(mesh->vertices);
+	free(mesh->normals);
+	free(mesh->indices);
+
+	mesh->numVertices = 0;
+	mesh->vertices    = NULL;
+	mesh->normals     = NULL;
+	mesh->numIndices  = 0;
+	mesh->indices     = NULL;
+}
+
+int mo_OptimizeVertexCache(moMesh *mesh)
+{
+	const int numTriangles = mesh->numIndices / 3;
+	const int numVertices  = mesh->numVertices;
+
+	int           *remaining, *adjOffset, *adjacency, *cachePosition;
+	float         *vertexScore, *triangleScore;
+	unsigned char *emitted;
+	rdIndex32     *out;
+
+	int cache[MO_CACHE_SIZE + 3];
+	int cacheCount = 0;
+	int best, cursor = 0;
+	int ok = 0;
+
+	remaining     = calloc(numVertices, sizeof (*remaining));
+	adjOffset     = calloc(numVertices + 1, sizeof (*adjOffset));
+	adjacency     = malloc(numTriangles * 3 * sizeof (*adjacency));
+	cachePosition = calloc(numVertices, sizeof (*cachePosition));
+	vertexScore   = malloc(numVertices * sizeof (*vertexScore));
+	triangleScore = malloc(numTriangles * sizeof (*triangleScore));
+	emitted       = calloc(numTriangles, sizeof (*emitted));
+	out           = malloc(numTriangles * 3 * sizeof (*out));
+
+	if (remaining == NULL || adjOffset == NULL || adjacency == NULL || cachePosition == NULL ||
+	    vertexScore == NULL || triangleScore == NULL || emitted == NULL || out == NULL)
+		goto done;
+
+	/* Triangle lists per vertex; cachePosition doubles as the fill cursor */
+	for (int i = 0; i < numTriangles * 3; i++)
+		remaining[mesh->indices[i]]++;
+
+	for (int v = 0; v < numVertices; v++)
+		adjOffset[v + 1] = adjOffset[v] + remaining[v];
+
+	for (int i = 0; i < numTriangles * 3; i++) {
+		int v = mesh->indices[i];
+		adjacency[adjOffset[v] + cachePosition[v]++] = i / 3;
+	}
+
+	for (int v = 0; v < numVertices; v++) {
+		cachePosition[v] = -1;
+		vertexScore[v]   = mo_VertexScore(-1, remaining[v]);
+	}
+
+	best = -1;
+	for (int t = 0; t < numTriangles; t++) {
+		const rdIndex32 *tri = &mesh->indices[t * 3];
+
+		triangleScore[t] = vertexScore[tri[0]] + vertexScore[tri[1]] + vertexScore[tri[2]];
+		if (best < 0 || triangleScore[t] > triangleScore[best])
+			best = t;
+	}
+
+	for (int n = 0; n < numTriangles; n++) {
+		int   newCache[MO_CACHE_SIZE + 3];
+		int   newCount = 0;
+		float bestScore;
+
+		/* Nothing in the cache has triangles left, start over at the next unused one */
+		if (best < 0) {
+			while (emitted[cursor])
+				cursor++;
+			best = cursor;
+		}
+
+		emitted[best] = 1;
+
+		for (int k = 0; k < 3; k++) {
+			int  v    = mesh->indices[best * 3 + k];
+			int *list = &adjacency[adjOffset[v]];
+
+			out[n * 3 + k] = v;
+
+			for (int i = 0; i < remaining[v]; i++) {
+				if (list[i] == best) {
+					list[i] = list[remaining[v] - 1];
+					remaining[v]--;
+					break;
+				}
+			}
+
+			for (int i = 0; i < newCount; i++) {
+				if (newCache[i] == v) {
+					v = -1;
+					break;
+				}
+			}
+
+			if (v >= 0)
+				newCache[newCount++] = v;
+		}
+
+		for (int i = 0, triCount = newCount; i < cacheCount; i++) {
+			int j = 0;
+
+			while (j < triCount && newCache[j] != cache[i])
+				j++;
+
+			if (j == triCount)
+				newCache[newCount++] = cache[i];
+		}
+
+		/* Entries past MO_CACHE_SIZE were just evicted, rescore them too */
+		for (int i = 0; i < newCount; i++) {
+			int v = newCache[i];
+
+			cachePosition[v] = i < MO_CACHE_SIZE ? i : -1;
+			vertexScore[v]   = mo_VertexScore(cachePosition[v], remaining[v]);
+		}
+
+		best      = -1;
+		bestScore = -1.0f;
+
+		for (int i = 0; i < newCount; i++) {
+			int v = newCache[i];
+
+			for (int j = 0; j < remaining[v]; j++) {
+				int              t   = adjacency[adjOffset[v] + j];
+				const rdIndex32 *tri = &mesh->indices[t * 3];
+
+				triangleScore[t] = vertexScore[tri[0]] + vertexScore[tri[1]] +
+				                   vertexScore[tri[2]];
+				if (triangleScore[t] > bestScore) {
+					best      = t;
+					bestScore = triangleScore[t];
+				}
+			}
+		}
+
+		cacheCount = newCount < MO_CACHE_SIZE ? newCount : MO_CACHE_SIZE;
+		memcpy(cache, newCache, cacheCount * sizeof (*cache));
+	}
+
+	memcpy(mesh->indices, out, numTriangles * 3 * sizeof (*out));
+	ok = 1;
+
+done:
+	free(remaining);
+	free(adjOffset);
+	free(adjacency);
+	free(cachePosition);
+	free(vertexScore);
+	free(triangleScore);
+	free(emitted);
+	free(out);
+	return ok;
+}
+
+/*
+ * Splits the cache-optimised order into clusters at points where the FIFO cache goes cold anyway
+ * (all three vertices miss), then draws outward-facing clusters first (Sander et al., "Fast
+ * Triangle Reordering for Vertex Locality and Reduced Overdraw").
+ */
+int mo_OptimizeOverdraw(moMesh *mesh)
+{
+	const int numTriangles = mesh->numIndices / 3;
+
+	moCluster *clusters;
+	int       *stamp;
+	rdIndex32 *out;
+	int        numClusters = 0;
+	int        time = 0;
+	rdVertex   center = { 0.0f, 0.0f, 0.0f };
+
+	clusters = malloc(numTriangles * sizeof (*clusters));
+	stamp    = malloc(mesh->numVertices * sizeof (*stamp));
+	out      = malloc(mesh->numIndices * sizeof (*out));
+
+	if (clusters == NULL || stamp == NULL || out == NULL) {
+		free(clusters);
+		free(stamp);
+		free(out);
+		return 0;
+	}
+
+	for (int v = 0; v < mesh->numVertices; v++) {
+		stamp[v] = -MO_FIFO_SIZE - 1;
+
+		center.x += mesh->vertices[v].x / mesh->numVertices;
+		center.y += mesh->vertices[v].y / mesh->numVertices;
+		center.z += mesh->vertices[v].z / mesh->numVertices;
+	}
+
+	for (int t = 0; t < numTriangles; t++) {
+		int misses = 0;
+
+		for (int k = 0; k < 3; k++) {
+			int v = mesh->indices[t * 3 + k];
+
+			if (time - stamp[v] > MO_FIFO_SIZE) {
+				stamp[v] = time++;
+				misses++;
+			}
+		}
+
+		if (t == 0 || misses == 3) {
+			clusters[numClusters].first = t;
+			clusters[numClusters].count = 0;
+			numClusters++;
+		}
+
+		clusters[numClusters - 1].count++;
+	}
+
+	for (int c = 0; c < numClusters; c++) {
+		moCluster *cl       = &clusters[c];
+		rdVertex   normal   = { 0.0f, 0.0f, 0.0f };
+		rdVertex   centroid = { 0.0f, 0.0f, 0.0f };
+		float      area     = 0.0f;
+		float      length;
+
+		for (int t = cl->first; t < cl->first + cl->count; t++) {
+			const rdVertex *v0 = &mesh->vertices[mesh->indices[t * 3 + 0]];
+			const rdVertex *v1 = &mesh->vertices[mesh->indices[t * 3 + 1]];
+			const rdVertex *v2 = &mesh->vertices[mesh->indices[t * 3 + 2]];
+
+			rdVertex e1 = { v1->x - v0->x, v1->y - v0->y, v1->z - v0->z };
+			rdVertex e2 = { v2->x - v0->x, v2->y - v0->y, v2->z - v0->z };
+			rdVertex n  = { e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z,
+			                e1.x * e2.y - e1.y * e2.x };
+			float    w  = sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+
+			normal.x += n.x;
+			normal.y += n.y;
+			normal.z += n.z;
+
+			centroid.x += (v0->x + v1->x + v2->x) * w;
+			centroid.y += (v0->y + v1->y + v2->y) * w;
+			centroid.z += (v0->z + v1->z + v2->z) * w;
+			area += w;
+		}
+
+		length = sqrtf(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+
+		if (area > 0.0f && length > 0.0f) {
+			centroid.x = centroid.x / (area * 3.0f) - center.x;
+			centroid.y = centroid.y / (area * 3.0f) - center.y;
+			centroid.z = centroid.z / (area * 3.0f) - center.z;
+
+			cl->sortKey = (centroid.x * normal.x + centroid.y * normal.y +
+			               centroid.z * normal.z) / length;
+		} else {
+			cl->sortKey = 0.0f;
+		}
+	}
+
+	qsort(clusters, numClusters, sizeof (*clusters), mo_CompareClusters);
+
+	for (int c = 0, n = 0; c < numClusters; c++) {
+		memcpy(&out[n], &mesh->indices[clusters[c].first * 3],
+		       clusters[c].count * 3 * sizeof (*out));
+		n += clusters[c].count * 3;
+	}
+
+	memcpy(mesh->indices, out, numTriangles * 3 * sizeof (*out));
+
+	free(clusters);
+	free(stamp);
+	free(out);
+	return 1;
+}
+
+int mo_OptimizeVertexFetch(moMesh *mesh)
+{
+	int      *remap;
+	rdVertex *vertices, *normals;
+	int       numVertices = 0;
+
+	remap    = malloc(mesh->numVertices * sizeof (*remap));
+	vertices = malloc(mesh->numVertices * sizeof (*vertices));
+	normals  = malloc(mesh->numVertices * sizeof (*normals));
+
+	if (remap == NULL || vertices == NULL || normals == NULL) {
+		free(remap);
+		free(vertices);
+		free(normals);
+		return 0;
+	}
+
+	for (int v = 0; v < mesh->numVertices; v++)
+		remap[v] = -1;
+
+	for (int i = 0; i < mesh->numIndices; i++) {
+		int v = mesh->indices[i];
+
+		if (remap[v] < 0) {
+			remap[v] = numVertices;
+			vertices[numVertices] = mesh->vertices[v];
+			normals[numVertices]  = mesh->normals[v];
+			numVertices++;
+		}
+
+		mesh->indices[i] = remap[v];
+	}
+
+	free(remap);
+	free(mesh->vertices);
+	free(mesh->normals);
+
+	mesh->numVertices = numVertices;
+	mesh->vertices    = vertices;
+	mesh->normals     = normals;
+	return 1;
+}
+
+float mo_ACMR(const void *indices, rdIndexFormat indexFormat, int numIndices, int numVertices)
+{
+	int *stamp;
+	int  time = 0;
+
+	if (numIndices < 3)
+		return 0.0f;
+
+	stamp = malloc(numVertices * sizeof (*stamp));
+	if (stamp == NULL)
+		return 0.0f;
+
+	for (int v = 0; v < numVertices; v++)
+		stamp[v] = -MO_FIFO_SIZE - 1;
+
+	for (int i = 0; i < numIndices; i++) {
+		const rdIndex32 v = mo_Index(indices, indexFormat, i);
+
+		if (time - stamp[v] > MO_FIFO_SIZE)
+			stamp[v] = time++;
+	}
+
+	free(stamp);
+	return (float) time / (numIndices / 3);
+}
+
+static unsigned int mo_HashFloat(unsigned int hash, float f)
+{
+	unsigned int bits;
+
+	if (f == 0.0f)
+		f = 0.0f;
+
+	memcpy(&bits, &f, sizeof (bits));
+	return (hash ^ bits) * 16777619u;
+}
+
+static unsigned int mo_HashVertex(const rdVertex *v, const rdVertex *n)
+{
+	unsigned int hash = 2166136261u;
+
+	hash = mo_HashFloat(hash, v->x);
+	hash = mo_HashFloat(hash, v->y);
+	hash = mo_HashFloat(hash, v->z);
+	hash = mo_HashFloat(hash, n->x);
+	hash = mo_HashFloat(hash, n->y);
+	hash = mo_HashFloat(hash, n->z);
+
+	return hash ^ (hash >> 15);
+}
+
+static int mo_VertexEqual(const rdVertex *v1, const rdVertex *n1, const rdVertex *v2,
+                          const rdVertex *n2)
+{
+	return v1->x == v2->x && v1->y == v2->y && v1->z == v2->z &&
+	       n1->x == n2->x && n1->y == n2->y && n1->z == n2->z;
+}
+
+static float mo_VertexScore(int cachePosition, int remainingTriangles)
+{
+	float score = 0.0f;
+
+	if (remainingTriangles == 0)
+		return -1.0f;
+
+	if (cachePosition >= 0) {
+		if (cachePosition < 3) {
+			score = MO_LAST_TRI_SCORE;
+		} else {
+			const float scaler = 1.0f / (MO_CACHE_SIZE - 3);
+			score = powf(1.0f - (cachePosition - 3) * scaler, MO_CACHE_DECAY_POWER);
+		}
+	}
+
+	return score + MO_VALENCE_SCALE * powf(remainingTriangles, -MO_VALENCE_POWER);
+}
+
+static int mo_CompareClusters(const void *a, const void *b)
+{
+	const moCluster *c1 = a;
+	const moCluster *c2 = b;
+
+	if (c1->sortKey != c2->sortKey)
+		return c1->sortKey > c2->sortKey ? -1 : 1;
+	return c1->first - c2->first;
+}
+
+static rdIndex32 mo_Index(const void *indices, rdIndexFormat indexFormat, int i)
+{
+	if (indexFormat == RD_INDEX_32)
+		return ((const rdIndex32 *) indices)[i];
+	else
+		return ((const rdIndex *) indices)[i];
+}
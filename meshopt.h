@@ -0,0 +1,33 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include "renderer.h"
+
+/*
+ * Offline mesh cooking used by p3d_meshconv. Flat-shaded triangle soups are welded into indexed
+ * meshes (vertices sharing both position and normal are merged, so hard edges stay split), then
+ * triangles are reordered for the post-transform vertex cache and vertices for fetch locality.
+ */
+
+#define MO_FIFO_SIZE 16 /* Cache size used to report ACMR */
+
+typedef struct moMesh moMesh;
+struct moMesh
+{
+	int       numVertices;
+	rdVertex *vertices;
+	rdVertex *normals;
+
+	int        numIndices;
+	rdIndex32 *indices; /* The pack narrows them to rdIndex when it can */
+};
+
+int   mo_Weld(moMesh *out, int numVertices, const rdVertex *vertices, const rdVertex *normals,
+              int numIndices, const void *indices, rdIndexFormat indexFormat);
+void  mo_FreeMesh(moMesh *mesh);
+int   mo_OptimizeVertexCache(moMesh *mesh);
+int   mo_OptimizeOverdraw(moMesh *mesh);
+int   mo_OptimizeVertexFetch(moMesh *mesh);
+float mo_ACMR(const void *indices, rdIndexFormat indexFormat, int numIndices, int numVertices);
+
+#endif
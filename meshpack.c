@@ -0,0 +1,133 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "meshpack.h"
+
+static int mp_CheckRange(const mpPack *pack, uint32_t offset, size_t length);
+
+int mp_Open(mpPack *pack, const char *path)
+{
+	struct stat st;
+	void       *base;
+	int         fd;
+
+	pack->base    = NULL;
+	pack->size    = 0;
+	pack->header  = NULL;
+	pack->entries = NULL;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error: couldn't open mesh pack %s\n", path);
+		return 0;
+	}
+
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof (mpHeader)) {
+		fprintf(stderr, "Error: mesh pack %s is truncated\n", path);
+		close(fd);
+		return 0;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Error: couldn't map mesh pack %s\n", path);
+		return 0;
+	}
+
+	pack->base   = base;
+	pack->size   = st.st_size;
+	pack->header = base;
+
+	if (pack->header->magic != MP_MAGIC || pack->header->version != MP_VERSION) {
+		fprintf(stderr, "Error: %s is not a version %u mesh pack\n", path, MP_VERSION);
+		mp_Close(pack);
+		return 0;
+	}
+
+	if (!mp_CheckRange(pack, sizeof (mpHeader),
+	                   (size_t) pack->header->numMeshes * sizeof (mpMeshEntry))) {
+		fprintf(stderr, "Error: mesh pack %s is truncated\n", path);
+		mp_Close(pack);
+		return 0;
+	}
+
+	pack->entries = (const mpMeshEntry *) (pack->base + sizeof (mpHeader));
+
+	for (uint32_t i = 0; i < pack->header->numMeshes; i++) {
+		const mpMeshEntry *e = &pack->entries[i];
+		size_t             vertexBytes = (size_t) e->numVertices * sizeof (rdVertex);
+		size_t             indexBytes  = (size_t) e->numIndices *
+		                                 (e->flags & MP_MESH_INDEX32 ? sizeof (rdIndex32)
+		                                                             : sizeof (rdIndex));
+
+		if (!mp_CheckRange(pack, e->vertexOffset, vertexBytes) ||
+		    !mp_CheckRange(pack, e->normalOffset, vertexBytes) ||
+		    !mp_CheckRange(pack, e->indexOffset, indexBytes) ||
+		    memchr(e->name, '\0', sizeof (e->name)) == NULL) {
+			fprintf(stderr, "Error: mesh pack %s has a corrupt entry %u\n", path, i);
+			mp_Close(pack);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+void mp_Close(mpPack *pack)
+{
+	if (pack->base != NULL)
+		munmap((void *) pack->base, pack->size);
+
+	pack->base    = NULL;
+	pack->size    = 0;
+	pack->header  = NULL;
+	pack->entries = NULL;
+}
+
+const mpMeshEntry *mp_Find(const mpPack *pack, const char *name)
+{
+	for (uint32_t i = 0; i < pack->header->numMeshes; i++) {
+		if (strcmp(pack->entries[i].name, name) == 0)
+			return &pack->entries[i];
+	}
+	return NULL;
+}
+
+const rdVertex *mp_Vertices(const mpPack *pack, const mpMeshEntry *entry)
+{
+	return (const rdVertex *) (pack->base + entry->vertexOffset);
+}
+
+const rdVertex *mp_Normals(const mpPack *pack, const mpMeshEntry *entry)
+{
+	return (const rdVertex *) (pack->base + entry->normalOffset);
+}
+
+const void *mp_Indices(const mpPack *pack, const mpMeshEntry *entry)
+{
+	if (entry->numIndices == 0)
+		return NULL;
+	return pack->base + entry->indexOffset;
+}
+
+rdIndexFormat mp_IndexFormat(const mpMeshEntry *entry)
+{
+	return entry->flags & MP_MESH_INDEX32 ? RD_INDEX_32 : RD_INDEX_16;
+}
+
+static int mp_CheckRange(const mpPack *pack, uint32_t offset, size_t length)
+{
+	if (offset % 16 != 0)
+		return 0;
+	if (offset > pack->size || length > pack->size - offset)
+		return 0;
+	return 1;
+}
@@ -0,0 +1,71 @@
+#ifndef MESHPACK_H
+#define MESHPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "renderer.h"
+
+/*
+ * Binary mesh container. The whole file is mapped read-only and the vertex, normal and index
+ * arrays are handed to rd_CreateObjectPrecomputed in place, so all fields are stored in native
+ * byte order and every array starts on a 16-byte boundary.
+ *
+ *   mpHeader
+ *   mpMeshEntry[numMeshes]
+ *   per mesh: rdVertex vertices[numVertices], rdVertex normals[numVertices],
+ *             rdIndex or rdIndex32 indices[numIndices], see MP_MESH_INDEX32
+ */
+
+#define MP_MAGIC   0x4d443350u /* "P3DM" */
+#define MP_VERSION 4u
+
+#define MP_MESH_INTERIOR 0x1u /* Normals were inverted for RD_OBJECT_INTERIOR */
+#define MP_MESH_FLAT     0x2u /* Welded from a flat-shaded triangle soup */
+#define MP_MESH_INDEX32  0x4u /* More than 65536 vertices, so the indices are rdIndex32 */
+
+typedef struct mpHeader mpHeader;
+struct mpHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t numMeshes;
+	uint32_t reserved;
+};
+
+typedef struct mpMeshEntry mpMeshEntry;
+struct mpMeshEntry
+{
+	char     name[32];
+	uint32_t flags;
+	uint32_t numVertices;
+	uint32_t numIndices;
+	uint32_t reserved;
+
+	float boundsMin[3];
+	float boundsMax[3];
+
+	uint32_t vertexOffset;
+	uint32_t normalOffset;
+	uint32_t indexOffset;
+	uint32_t reserved2;
+};
+
+typedef struct mpPack mpPack;
+struct mpPack
+{
+	const unsigned char *base;
+	size_t               size;
+
+	const mpHeader    *header;
+	const mpMeshEntry *entries;
+};
+
+int                mp_Open(mpPack *pack, const char *path);
+void               mp_Close(mpPack *pack);
+const mpMeshEntry *mp_Find(const mpPack *pack, const char *name);
+const rdVertex    *mp_Vertices(const mpPack *pack, const mpMeshEntry *entry);
+const rdVertex    *mp_Normals(const mpPack *pack, const mpMeshEntry *entry);
+const void        *mp_Indices(const mpPack *pack, const mpMeshEntry *entry);
+rdIndexFormat      mp_IndexFormat(const mpMeshEntry *entry);
+
+#endif
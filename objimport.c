@@ -0,0 +1,668 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "objimport.h"
+
+#define OI_MAX_THREADS 64
+#define OI_PARTITIONS  64 /* Fixed, so the vertex order doesn't depend on the thread count */
+
+typedef struct oiLoader oiLoader;
+
+typedef struct oiChunk oiChunk;
+struct oiChunk
+{
+	oiLoader *loader;
+	int       index;
+
+	const char *begin, *end;
+
+	size_t numPositions, numNormals, numCorners;
+	size_t positionBase, normalBase, cornerBase;
+
+	int error;
+	int missingNormal;
+
+	size_t partitionOffsets[OI_PARTITIONS];
+};
+
+struct oiLoader
+{
+	int     numThreads;
+	oiChunk chunks[OI_MAX_THREADS];
+
+	size_t     numPositions, numNormals, numCorners;
+	rdVertex  *positions;
+	rdVertex  *normals;
+	rdIndex32 *cornerPositions;
+	int       *cornerNormals;
+
+	/* Corners grouped by partition, and for every deduplicated vertex the corner that
+	 * introduced it */
+	int    *order;
+	int    *firstCorner;
+	size_t  partitionStart[OI_PARTITIONS + 1];
+	size_t  partitionVertices[OI_PARTITIONS];
+	size_t  vertexBase[OI_PARTITIONS];
+
+	oiMesh *out;
+};
+
+static void        oi_Parallel(oiLoader *ld, void *(*job)(void *));
+static void       *oi_CountChunk(void *arg);
+static void       *oi_ParseChunk(void *arg);
+static void       *oi_PartitionChunk(void *arg);
+static void       *oi_ScatterChunk(void *arg);
+static void       *oi_DedupPartitions(void *arg);
+static void       *oi_EmitPartitions(void *arg);
+static const char *oi_Keyword(const char *p, const char *eol, const char *keyword);
+static const char *oi_SkipSpace(const char *p, const char *eol);
+static const char *oi_ParseFloat(const char *p, const char *eol, float *out);
+static const char *oi_ParseInt(const char *p, const char *eol, long *out);
+static int         oi_ParseCorner(oiChunk *c, const char **p, const char *eol, size_t numPositions,
+                                  size_t numNormals, rdIndex32 *outPosition, int *outNormal);
+static unsigned int
+                   oi_Hash(unsigned int position, int normal);
+
+int oi_Load(oiMesh *out, const char *path, int numThreads)
+{
+	oiLoader   *ld;
+	struct stat st;
+	const char *base;
+	size_t      size;
+	int         fd, ok = 0;
+
+	out->numVertices = 0;
+	out->vertices    = NULL;
+	out->normals     = NULL;
+	out->numIndices  = 0;
+	out->indices     = NULL;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error: couldn't open %s\n", path);
+		return 0;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		fprintf(stderr, "Error: %s is empty\n", path);
+		close(fd);
+		return 0;
+	}
+
+	size = st.st_size;
+	base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Error: couldn't map %s\n", path);
+		return 0;
+	}
+
+	ld = calloc(1, sizeof (*ld));
+	if (ld == NULL)
+		goto done;
+
+	if (numThreads < 1)
+		numThreads = 1;
+	if (numThreads > OI_MAX_THREADS)
+		numThreads = OI_MAX_THREADS;
+
+	ld->numThreads = numThreads;
+	ld->out        = out;
+
+	/* Chunks end just past a newline, so no line is split between two threads */
+	for (int t = 0; t < numThreads; t++) {
+		oiChunk    *c = &ld->chunks[t];
+		const char *end;
+
+		c->loader = ld;
+		c->index  = t;
+		c->begin  = t == 0 ? base : ld->chunks[t - 1].end;
+
+		end = t == numThreads - 1 ? base + size : base + size / numThreads * (t + 1);
+		if (end < c->begin)
+			end = c->begin;
+
+		while (end < base + size && end > c->begin && end[-1] != '\n')
+			end++;
+		c->end = end;
+	}
+
+	oi_Parallel(ld, oi_CountChunk);
+
+	for (int t = 0; t < numThreads; t++) {
+		oiChunk *c = &ld->chunks[t];
+
+		c->positionBase = ld->numPositions;
+		c->normalBase   = ld->numNormals;
+		c->cornerBase   = ld->numCorners;
+
+		ld->numPositions += c->numPositions;
+		ld->numNormals   += c->numNormals;
+		ld->numCorners   += c->numCorners;
+	}
+
+	if (ld->numCorners == 0) {
+		fprintf(stderr, "Error: %s has no faces\n", path);
+		goto done;
+	}
+	if (ld->numPositions > INT_MAX || ld->numCorners > INT_MAX) {
+		fprintf(stderr, "Error: %s is too large\n", path);
+		goto done;
+	}
+
+	ld->positions       = malloc(ld->numPositions * sizeof (rdVertex));
+	ld->normals         = malloc((ld->numNormals ? ld->numNormals : 1) * sizeof (rdVertex));
+	ld->cornerPositions = malloc(ld->numCorners * sizeof (rdIndex32));
+	ld->cornerNormals   = malloc(ld->numCorners * sizeof (int));
+
+	if (ld->positions == NULL || ld->normals == NULL || ld->cornerPositions == NULL ||
+	    ld->cornerNormals == NULL) {
+		fprintf(stderr, "Error: out of memory loading %s\n", path);
+		goto done;
+	}
+
+	oi_Parallel(ld, oi_ParseChunk);
+
+	for (int t = 0; t < numThreads; t++) {
+		if (ld->chunks[t].error) {
+			fprintf(stderr, "Error: %s has a malformed line or an index out of range\n", path);
+			goto done;
+		}
+	}
+
+	out->numIndices = ld->numCorners;
+
+	/* Without a normal on every corner there is nothing to deduplicate against, and the caller
+	 * generates normals anyway */
+	for (int t = 0; t < numThreads; t++) {
+		if (ld->chunks[t].missingNormal || ld->numNormals == 0) {
+			out->numVertices = ld->numPositions;
+			out->vertices    = ld->positions;
+			out->indices     = ld->cornerPositions;
+
+			ld->positions       = NULL;
+			ld->cornerPositions = NULL;
+			ok = 1;
+			goto done;
+		}
+	}
+
+	ld->order       = malloc(ld->numCorners * sizeof (int));
+	ld->firstCorner = malloc(ld->numCorners * sizeof (int));
+	out->indices    = malloc(ld->numCorners * sizeof (rdIndex32));
+
+	if (ld->order == NULL || ld->firstCorner == NULL || out->indices == NULL) {
+		fprintf(stderr, "Error: out of memory loading %s\n", path);
+		goto done;
+	}
+
+	oi_Parallel(ld, oi_PartitionChunk);
+
+	/* Partition p holds chunk 0's corners first, then chunk 1's, and so on */
+	for (int p = 0; p < OI_PARTITIONS; p++) {
+		size_t offset = ld->partitionStart[p];
+
+		for (int t = 0; t < numThreads; t++) {
+			size_t count = ld->chunks[t].partitionOffsets[p];
+
+			ld->chunks[t].partitionOffsets[p] = offset;
+			offset += count;
+		}
+
+		ld->partitionStart[p + 1] = offset;
+	}
+
+	oi_Parallel(ld, oi_ScatterChunk);
+	oi_Parallel(ld, oi_DedupPartitions);
+
+	for (int t = 0; t < numThreads; t++) {
+		if (ld->chunks[t].error) {
+			fprintf(stderr, "Error: out of memory loading %s\n", path);
+			goto done;
+		}
+	}
+
+	for (int p = 0; p < OI_PARTITIONS; p++) {
+		ld->vertexBase[p] = out->numVertices;
+		out->numVertices += ld->partitionVertices[p];
+	}
+
+	out->vertices = malloc(out->numVertices * sizeof (rdVertex));
+	out->normals  = malloc(out->numVertices * sizeof (rdVertex));
+
+	if (out->vertices == NULL || out->normals == NULL) {
+		fprintf(stderr, "Error: out of memory loading %s\n", path);
+		goto done;
+	}
+
+	oi_Parallel(ld, oi_EmitPartitions);
+	ok = 1;
+
+done:
+	if (ld != NULL) {
+		free(ld->positions);
+		free(ld->normals);
+		free(ld->cornerPositions);
+		free(ld->cornerNormals);
+		free(ld->order);
+		free(ld->firstCorner);
+		free(ld);
+	}
+
+	munmap((void *) base, size);
+
+	if (!ok)
+		oi_Free(out);
+	return ok;
+}
+
+void oi_Free(oiMesh *mesh)
+{
+	free(mesh->vertices);
+	free(mesh->normals);
+	free(mesh->indices);
+
+	mesh->numVertices = 0;
+	mesh->vertices    = NULL;
+	mesh->normals     = NULL;
+	mesh->numIndices  = 0;
+	mesh->indices     = NULL;
+}
+
+static void oi_Parallel(oiLoader *ld, void *(*job)(void *))
+{
+	pthread_t threads[OI_MAX_THREADS];
+	int       started[OI_MAX_THREADS];
+
+	for (int t = 1; t < ld->numThreads; t++)
+		started[t] = pthread_create(&threads[t], NULL, job, &ld->chunks[t]) == 0;
+
+	job(&ld->chunks[0]);
+
+	/* A thread that couldn't be started has its share done here instead */
+	for (int t = 1; t < ld->numThreads; t++) {
+		if (started[t])
+			pthread_join(threads[t], NULL);
+		else
+			job(&ld->chunks[t]);
+	}
+}
+
+static void *oi_CountChunk(void *arg)
+{
+	oiChunk    *c = arg;
+	const char *p = c->begin;
+
+	while (p < c->end) {
+		const char *eol = memchr(p, '\n', c->end - p);
+		const char *q;
+
+		if (eol == NULL)
+			eol = c->end;
+
+		if (oi_Keyword(p, eol, "v") != NULL) {
+			c->numPositions++;
+		} else if (oi_Keyword(p, eol, "vn") != NULL) {
+			c->numNormals++;
+		} else if ((q = oi_Keyword(p, eol, "f")) != NULL) {
+			size_t numTokens = 0;
+
+			for (q = oi_SkipSpace(q, eol); q < eol && *q != '#'; q = oi_SkipSpace(q, eol)) {
+				while (q < eol && *q != ' ' && *q != '\t' && *q != '\r')
+					q++;
+				numTokens++;
+			}
+
+			if (numTokens >= 3)
+				c->numCorners += (numTokens - 2) * 3;
+		}
+
+		p = eol + 1;
+	}
+
+	return NULL;
+}
+
+static void *oi_ParseChunk(void *arg)
+{
+	oiChunk  *c  = arg;
+	oiLoader *ld = c->loader;
+
+	const char *p = c->begin;
+	size_t      numPositions = 0, numNormals = 0, numCorners = 0;
+
+	while (p < c->end) {
+		const char *eol = memchr(p, '\n', c->end - p);
+		const char *q;
+
+		if (eol == NULL)
+			eol = c->end;
+
+		if ((q = oi_Keyword(p, eol, "v")) != NULL) {
+			rdVertex *v = &ld->positions[c->positionBase + numPositions++];
+
+			if ((q = oi_ParseFloat(q, eol, &v->x)) == NULL ||
+			    (q = oi_ParseFloat(q, eol, &v->y)) == NULL ||
+			    (q = oi_ParseFloat(q, eol, &v->z)) == NULL)
+				goto error;
+		} else if ((q = oi_Keyword(p, eol, "vn")) != NULL) {
+			rdVertex *n = &ld->normals[c->normalBase + numNormals++];
+
+			if ((q = oi_ParseFloat(q, eol, &n->x)) == NULL ||
+			    (q = oi_ParseFloat(q, eol, &n->y)) == NULL ||
+			    (q = oi_ParseFloat(q, eol, &n->z)) == NULL)
+				goto error;
+		} else if ((q = oi_Keyword(p, eol, "f")) != NULL) {
+			rdIndex32 firstPosition = 0, prevPosition = 0, position;
+			int     firstNormal = 0, prevNormal = 0, normal;
+			int     numTokens = 0;
+
+			for (q = oi_SkipSpace(q, eol); q < eol && *q != '#'; q = oi_SkipSpace(q, eol)) {
+				if (!oi_ParseCorner(c, &q, eol, numPositions, numNormals, &position, &normal))
+					goto error;
+
+				if (numTokens == 0) {
+					firstPosition = position;
+					firstNormal   = normal;
+				} else if (numTokens >= 2) {
+					size_t corner = c->cornerBase + numCorners;
+
+					/* Counting and parsing must agree, or we'd write past the chunk */
+					if (numCorners + 3 > c->numCorners)
+						goto error;
+
+					ld->cornerPositions[corner + 0] = firstPosition;
+					ld->cornerPositions[corner + 1] = prevPosition;
+					ld->cornerPositions[corner + 2] = position;
+					ld->cornerNormals[corner + 0]   = firstNormal;
+					ld->cornerNormals[corner + 1]   = prevNormal;
+					ld->cornerNormals[corner + 2]   = normal;
+					numCorners += 3;
+
+					if (firstNormal < 0 || prevNormal < 0 || normal < 0)
+						c->missingNormal = 1;
+				}
+
+				prevPosition = position;
+				prevNormal   = normal;
+				numTokens++;
+			}
+		}
+
+		p = eol + 1;
+	}
+
+	return NULL;
+
+error:
+	c->error = 1;
+	return NULL;
+}
+
+static void *oi_PartitionChunk(void *arg)
+{
+	oiChunk  *c  = arg;
+	oiLoader *ld = c->loader;
+
+	for (size_t i = c->cornerBase; i < c->cornerBase + c->numCorners; i++) {
+		unsigned int h = oi_Hash(ld->cornerPositions[i], ld->cornerNormals[i]);
+		c->partitionOffsets[h % OI_PARTITIONS]++;
+	}
+
+	return NULL;
+}
+
+static void *oi_ScatterChunk(void *arg)
+{
+	oiChunk  *c  = arg;
+	oiLoader *ld = c->loader;
+
+	for (size_t i = c->cornerBase; i < c->cornerBase + c->numCorners; i++) {
+		unsigned int h = oi_Hash(ld->cornerPositions[i], ld->cornerNormals[i]);
+		ld->order[c->partitionOffsets[h % OI_PARTITIONS]++] = i;
+	}
+
+	return NULL;
+}
+
+static void *oi_DedupPartitions(void *arg)
+{
+	oiChunk  *c  = arg;
+	oiLoader *ld = c->loader;
+
+	for (int p = c->index; p < OI_PARTITIONS; p += ld->numThreads) {
+		const size_t start = ld->partitionStart[p];
+		const size_t count = ld->partitionStart[p + 1] - start;
+
+		size_t tableSize = 1;
+		int   *table;
+		int    numVertices = 0;
+
+		while (tableSize < count * 2)
+			tableSize *= 2;
+
+		table = malloc(tableSize * sizeof (*table));
+		if (table == NULL) {
+			c->error = 1;
+			return NULL;
+		}
+
+		for (size_t i = 0; i < tableSize; i++)
+			table[i] = -1;
+
+		for (size_t i = start; i < start + count; i++) {
+			const int     corner   = ld->order[i];
+			const rdIndex32 position = ld->cornerPositions[corner];
+			const int     normal   = ld->cornerNormals[corner];
+
+			size_t h = (oi_Hash(position, normal) / OI_PARTITIONS) & (tableSize - 1);
+
+			while (table[h] != -1) {
+				const int first = ld->firstCorner[start + table[h]];
+
+				if (ld->cornerPositions[first] == position && ld->cornerNormals[first] == normal)
+					break;
+				h = (h + 1) & (tableSize - 1);
+			}
+
+			if (table[h] == -1) {
+				table[h] = numVertices;
+				ld->firstCorner[start + numVertices] = corner;
+				numVertices++;
+			}
+
+			ld->out->indices[corner] = table[h];
+		}
+
+		ld->partitionVertices[p] = numVertices;
+		free(table);
+	}
+
+	return NULL;
+}
+
+static void *oi_EmitPartitions(void *arg)
+{
+	oiChunk  *c   = arg;
+	oiLoader *ld  = c->loader;
+	oiMesh   *out = ld->out;
+
+	for (int p = c->index; p < OI_PARTITIONS; p += ld->numThreads) {
+		const size_t start = ld->partitionStart[p];
+		const size_t end   = ld->partitionStart[p + 1];
+		const size_t base  = ld->vertexBase[p];
+
+		for (size_t v = 0; v < ld->partitionVertices[p]; v++) {
+			const int corner = ld->firstCorner[start + v];
+
+			out->vertices[base + v] = ld->positions[ld->cornerPositions[corner]];
+			out->normals[base + v]  = ld->normals[ld->cornerNormals[corner]];
+		}
+
+		for (size_t i = start; i < end; i++)
+			out->indices[ld->order[i]] += base;
+	}
+
+	return NULL;
+}
+
+static const char *oi_Keyword(const char *p, const char *eol, const char *keyword)
+{
+	p = oi_SkipSpace(p, eol);
+
+	while (*keyword != '\0') {
+		if (p == eol || *p != *keyword)
+			return NULL;
+		p++;
+		keyword++;
+	}
+
+	if (p == eol || (*p != ' ' && *p != '\t'))
+		return NULL;
+	return p;
+}
+
+static const char *oi_SkipSpace(const char *p, const char *eol)
+{
+	while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+	return p;
+}
+
+static const char *oi_ParseFloat(const char *p, const char *eol, float *out)
+{
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+		1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	double value = 0.0;
+	int    negative = 0, digits = 0, exponent = 0;
+
+	p = oi_SkipSpace(p, eol);
+
+	if (p < eol && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+
+	/* Exact up to 15 significant digits, which covers anything an exporter writes */
+	for (; p < eol && *p >= '0' && *p <= '9'; p++, digits++)
+		value = value * 10.0 + (*p - '0');
+
+	if (p < eol && *p == '.') {
+		for (p++; p < eol && *p >= '0' && *p <= '9'; p++, digits++, exponent--)
+			value = value * 10.0 + (*p - '0');
+	}
+
+	if (digits == 0)
+		return NULL;
+
+	if (p < eol && (*p == 'e' || *p == 'E')) {
+		long e;
+
+		p = oi_ParseInt(p + 1, eol, &e);
+		if (p == NULL)
+			return NULL;
+		exponent += e;
+	}
+
+	if (exponent < 0 && -exponent <= 22)
+		value /= powers[-exponent];
+	else if (exponent > 0 && exponent <= 22)
+		value *= powers[exponent];
+	else if (exponent != 0)
+		value *= pow(10.0, exponent);
+
+	*out = (float) (negative ? -value : value);
+	return p;
+}
+
+static const char *oi_ParseInt(const char *p, const char *eol, long *out)
+{
+	long value = 0;
+	int  negative = 0;
+
+	if (p < eol && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+
+	if (p == eol || *p < '0' || *p > '9')
+		return NULL;
+
+	for (; p < eol && *p >= '0' && *p <= '9'; p++) {
+		if (value > INT_MAX / 10)
+			return NULL;
+		value = value * 10 + (*p - '0');
+	}
+
+	*out = negative ? -value : value;
+	return p;
+}
+
+/* Reads one "p", "p/t", "p//n" or "p/t/n" token; relative (negative) indices count back from
+ * the elements this chunk has parsed so far */
+static int oi_ParseCorner(oiChunk *c, const char **p, const char *eol, size_t numPositions,
+                          size_t numNormals, rdIndex32 *outPosition, int *outNormal)
+{
+	const oiLoader *ld = c->loader;
+
+	const char *q = *p;
+	long        index, position;
+
+	if ((q = oi_ParseInt(q, eol, &index)) == NULL || index == 0)
+		return 0;
+
+	position = index > 0 ? index - 1 : (long) (c->positionBase + numPositions) + index;
+	if (position < 0 || (size_t) position >= ld->numPositions)
+		return 0;
+
+	*outPosition = position;
+	*outNormal   = -1;
+
+	if (q < eol && *q == '/') {
+		q++;
+
+		if (q < eol && *q != '/') {
+			if ((q = oi_ParseInt(q, eol, &index)) == NULL)
+				return 0;
+		}
+
+		if (q < eol && *q == '/') {
+			long normal;
+
+			if ((q = oi_ParseInt(q + 1, eol, &index)) == NULL || index == 0)
+				return 0;
+
+			normal = index > 0 ? index - 1 : (long) (c->normalBase + numNormals) + index;
+			if (normal < 0 || (size_t) normal >= ld->numNormals)
+				return 0;
+
+			*outNormal = normal;
+		}
+	}
+
+	if (q < eol && *q != ' ' && *q != '\t' && *q != '\r')
+		return 0;
+
+	*p = q;
+	return 1;
+}
+
+static unsigned int oi_Hash(unsigned int position, int normal)
+{
+	unsigned int h = position * 0x9e3779b1u + (unsigned int) normal * 0x85ebca77u;
+
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return h;
+}
@@ -0,0 +1,27 @@
+#ifndef OBJIMPORT_H
+#define OBJIMPORT_H
+
+#include "renderer.h"
+
+/*
+ * Wavefront OBJ importer. The file is mapped, split into line-aligned chunks and parsed on a pool
+ * of threads; position/normal pairs are deduplicated so the result can go straight into
+ * rd_CreateObject (or rd_CreateObjectPrecomputed when the file has normals). Texture coordinates,
+ * groups and materials are ignored, polygons are triangulated as fans.
+ */
+
+typedef struct oiMesh oiMesh;
+struct oiMesh
+{
+	int       numVertices;
+	rdVertex *vertices;
+	rdVertex *normals; /* NULL unless every face corner referenced a normal */
+
+	int        numIndices;
+	rdIndex32 *indices; /* RD_INDEX_32, scans easily exceed 65536 vertices */
+};
+
+int  oi_Load(oiMesh *out, const char *path, int numThreads);
+void oi_Free(oiMesh *mesh);
+
+#endif
@@ -1,7 +1,21 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* RD_NO_SIMD forces the scalar paths, to compare them against the vector ones */
+#if defined(__AVX__) && !defined(RD_NO_SIMD)
+#include <immintrin.h>
+#elif defined(__SSE__) && !defined(RD_NO_SIMD)
+#include <xmmintrin.h>
+#endif
 
 #include "renderer.h"
 #include "shaders.h"
@@ -21,6 +35,177 @@ struct rdMem
 	rdFree  *free;
 };
 
+typedef struct rdScratchBlock rdScratchBlock;
+struct rdScratchBlock
+{
+	rdScratchBlock *next;
+	size_t          capacity;
+	size_t          used;
+};
+
+typedef struct rdScratch rdScratch;
+struct rdScratch
+{
+	rdScratchBlock *head;
+
+	size_t used;
+	size_t highWater;
+};
+
+#define RD_GEOMETRY_PAGE_SIZE (4 * 1024 * 1024)
+
+#define RD_DEFAULT_UPLOAD_BUDGET (1024 * 1024) /* Bytes of async mesh data uploaded per frame */
+
+#define RD_MAX_LODS        4
+#define RD_LOD_MIN_INDICES 384   /* Smaller meshes aren't worth simplifying */
+#define RD_LOD_PIXEL_ERROR 1.0f  /* Largest on-screen deviation a LOD may introduce */
+#define RD_LOD_SHADOW_BIAS 1     /* Shadow maps are drawn this many levels coarser */
+
+/* Objects tested per step by rd_CullObjects, pixels per step when rasterizing occluders */
+#if defined(__AVX__) && !defined(RD_NO_SIMD)
+#define RD_CULL_WIDTH 8
+#elif defined(__SSE__) && !defined(RD_NO_SIMD)
+#define RD_CULL_WIDTH 4
+#else
+#define RD_CULL_WIDTH 1
+#endif
+
+#define RD_CULL_EMPTY_EXTENT -1.0e30f /* Fails every plane, for objects without geometry yet */
+#define RD_CULL_MAX_PLANES   24       /* A light frustum plus a camera frustum stretched to a light */
+
+#define RD_SHADOW_RESOLVE_MAPS 8 /* Shadow maps the resolve pass samples, as sized in its shader */
+
+#define RD_TIMER_FRAMES 3   /* Frames before a timer query is read, so reading it doesn't stall */
+#define RD_TIMER_RUNS   128 /* Runs of consecutive shadow map or G-buffer draws timed per frame */
+
+/* A single pass is taken once the overdraw drops below LOW, and left once it rises above HIGH */
+#define RD_GBUFFER_OVERDRAW_LOW  1.5f
+#define RD_GBUFFER_OVERDRAW_HIGH 2.0f
+#define RD_GBUFFER_PROBE_FRAMES  60 /* Single pass frames between prepass frames that measure */
+
+#define RD_OCCLUSION_FRAMES 2  /* Results are read for stats one frame after they were drawn */
+#define RD_OCCLUSION_TESTS  64 /* Per frame, later tests are skipped */
+
+/* Widths of the fields of a render queue sort key, from the top; the prepass and shadow maps move
+ * depth up to right after the shadow map. The pass also decides the program. Shadow maps and
+ * vertex arrays are numbered per frame; past the last number they share it, which only costs
+ * state changes. */
+#define RD_QUEUE_PASS_BITS      3
+#define RD_QUEUE_TEST_BITS      7  /* 0 for none, so RD_OCCLUSION_TESTS has to stay below 128 */
+#define RD_QUEUE_SHADOWMAP_BITS 6
+#define RD_QUEUE_ARRAY_BITS     8
+#define RD_QUEUE_RASTER_BITS    2
+#define RD_QUEUE_MATERIAL_BITS  7
+#define RD_QUEUE_DEPTH_BITS     24 /* Positive float bits lose the low 8 and still sort by value */
+
+#define RD_INSTANCE_BUFFER_SIZE (64 * 1024) /* Bytes the instance buffer starts out with */
+
+/* Binding points of the uniform blocks the lighting, SSR and composite programs share */
+#define RD_BLOCK_FRAME     0
+#define RD_BLOCK_LIGHTS    1
+#define RD_BLOCK_MATERIALS 2
+#define RD_BLOCKS          3
+
+/* What the GL state wrappers keep track of. Calls beyond these limits go through unfiltered. */
+#define RD_GL_PROGRAMS      32
+#define RD_GL_UNIFORMS      64 /* Locations per program */
+#define RD_GL_TEXTURE_UNITS 16
+#define RD_GL_CAPS          4  /* Depth test, culling, blending and rasterizer discard */
+
+/* Software depth buffer interior objects are rasterized into as occluders. The width has to be a
+ * multiple of RD_CULL_WIDTH, bands and the height multiples of the tile size. */
+#define RD_OCCLUDER_WIDTH   512
+#define RD_OCCLUDER_HEIGHT  256
+#define RD_OCCLUDER_TILE    8  /* Tiles keep the farthest depth they hold, so most tests stop there */
+#define RD_OCCLUDER_BAND    16 /* Rows a worker takes at a time */
+#define RD_OCCLUDER_THREADS 3  /* Workers besides the render thread */
+
+#define RD_BVH_LEAF_SIZE     4    /* Objects per leaf at most */
+#define RD_BVH_BINS          16   /* Split candidates per axis when building */
+#define RD_BVH_MAX_DEPTH     32   /* Deeper nodes are split in half by count, keeping stacks small */
+#define RD_BVH_STACK         64
+#define RD_BVH_REBUILD_COST  1.5f /* Rebuilt once refits grew the summed node area this much */
+#define RD_BVH_REFIT_ALL     16   /* Refit the whole tree if more than 1 in this many objects moved */
+
+/* Words of the per-node refit marks, two nodes per object at most, and of the marks over them */
+#define RD_BVH_REFIT_WORDS(capacity) ((2 * (capacity) + 31) / 32)
+#define RD_BVH_REFIT_TOP(capacity)   ((RD_BVH_REFIT_WORDS(capacity) + 31) / 32)
+
+typedef struct rdRange rdRange;
+struct rdRange
+{
+	size_t offset;
+	size_t size;
+};
+
+typedef struct rdFreeList rdFreeList;
+struct rdFreeList
+{
+	rdRange *ranges; /* Sorted by offset, never adjacent */
+	int      numRanges;
+	int      maxRanges;
+};
+
+typedef struct rdGeometry         rdGeometry;
+typedef struct rdGeometryPage     rdGeometryPage;
+typedef struct rdOccluderMesh     rdOccluderMesh;
+typedef struct rdOccluderTriangle rdOccluderTriangle;
+
+/* One level of detail, stored after the others in its geometry's index range. All levels share
+ * the full mesh's vertices. */
+typedef struct rdLod rdLod;
+struct rdLod
+{
+	int   firstIndex;
+	int   numIndices;
+	float error; /* Object space distance to the full mesh */
+};
+
+/* One VBO/IBO pair with its VAO, shared by every object of the same vertex format */
+struct rdGeometryPage
+{
+	rdGeometryPage *next;
+
+	rdPositionFormat positionFormat;
+	GLsizei          vertexSize;
+
+	GLuint vertexBuffer;
+	GLuint indexBuffer;
+	GLuint vertexArray;
+
+	size_t     vertexCapacity;
+	size_t     indexCapacity;
+	rdFreeList vertexFree;
+	rdFreeList indexFree;
+
+	rdGeometry *geometries;
+	int         numGeometries;
+};
+
+/* A mesh's range within a page, shared by an object and its clones */
+struct rdGeometry
+{
+	rdGeometryPage *page;
+	rdGeometry     *prev, *next;
+	int             refCount;
+
+	size_t vertexOffset, vertexBytes;
+	size_t indexOffset, indexBytes;
+
+	GLint  baseVertex;
+	GLenum indexType;
+
+	int   numLods;
+	rdLod lods[RD_MAX_LODS];
+
+	rdOccluderMesh *occluder; /* Interior meshes only */
+
+	/* Queue item each pass batches the clones sharing the geometry under, while batchGeneration
+	 * is the queue's */
+	int          batchItems[RD_DRAW_BLOOM + 1];
+	unsigned int batchGeneration;
+};
+
 typedef struct rdVec2 rdVec2;
 struct rdVec2
 {
@@ -39,6 +224,113 @@ struct rdVec4
 	float x, y, z, w;
 };
 
+/* Object-space copy of an interior mesh, for the software rasterizer */
+struct rdOccluderMesh
+{
+	int        numVertices;
+	int        numIndices;
+	rdVec3    *vertices;
+	rdIndex32 *indices; /* Widened, made up for meshes that had none */
+};
+
+/* Set up once, then walked by every band it overlaps */
+struct rdOccluderTriangle
+{
+	int   firstX, lastX; /* Pixels whose centers the bounding box covers, firstX aligned down */
+	int   firstY, lastY;
+	float a[3], b[3], c[3]; /* Edge functions, not negative inside */
+	float z, dzdx, dzdy;    /* Depth plane, z at the origin */
+};
+
+/* Interleaved object vertex, normal packed as GL_INT_2_10_10_10_REV */
+typedef struct rdPackedVertex rdPackedVertex;
+struct rdPackedVertex
+{
+	float  x, y, z;
+	GLuint normal;
+};
+
+typedef struct rdPackedVertexHalf rdPackedVertexHalf;
+struct rdPackedVertexHalf
+{
+	unsigned short x, y, z, w;
+	GLuint         normal;
+};
+
+/* Symmetric 4x4 error quadric, upper triangle, with planes weighted by triangle area */
+typedef struct rdQuadric rdQuadric;
+struct rdQuadric
+{
+	double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+	double area;
+};
+
+typedef struct rdCollapse rdCollapse;
+struct rdCollapse
+{
+	float cost;
+	int   from, to;
+};
+
+typedef struct rdEdge rdEdge;
+struct rdEdge
+{
+	int a, b; /* Position IDs, a == -1 for an empty slot */
+	int count;
+};
+
+/* Working state of the LOD generator, all of it in scratch memory */
+typedef struct rdSimplifier rdSimplifier;
+struct rdSimplifier
+{
+	int             numVertices;
+	const rdVertex *vertices;
+	const int      *positionIDs;
+
+	rdIndex32 *indices; /* Shrinks as edges collapse */
+	int        numIndices;
+
+	unsigned char *locked;  /* Seam, border and non-manifold vertices never move */
+	unsigned char *touched; /* Already part of a collapse this pass */
+	rdQuadric     *quadrics;
+
+	int        *adjacencyStart; /* Triangles around each vertex */
+	int        *adjacency;
+	rdCollapse *collapses;
+	int        *order; /* Collapses, roughly cheapest first */
+
+	double maxError; /* Squared */
+};
+
+/* Everything about an object that can be worked out without GL */
+typedef struct rdMeshData rdMeshData;
+struct rdMeshData
+{
+	rdPositionFormat positionFormat;
+
+	const void *vertexData;
+	size_t      vertexBytes;
+	const void *indexData;    /* The caller's, untouched */
+	const void *lodIndexData; /* Coarser levels, uploaded right after it in the same format */
+	size_t      indexBytes;   /* Both together */
+	size_t      lodIndexBytes;
+	GLenum      indexType;
+
+	int   numLods;
+	rdLod lods[RD_MAX_LODS];
+
+	rdVec3 boundsCenter;
+	rdVec3 boundsExtent;
+	float  boundsRadius;
+
+	/* The caller's arrays, copied once the object is finished; interior meshes only */
+	int             numOccluderVertices;
+	const rdVertex *occluderVertices;
+	int             numOccluderIndices;
+	const void     *occluderIndices;
+	rdIndexFormat   occluderIndexFormat;
+};
+
 typedef struct rdMat3 rdMat3;
 struct rdMat3
 {
@@ -80,14 +372,53 @@ struct rdMaterial
 	float reflectance;
 };
 
+/* std140 copies of the uniform blocks in shaders.h. Every member is a vec4 or a row-major mat4,
+ * so the C arrays have the 16 byte stride std140 gives them. */
+typedef struct rdFrameBlock rdFrameBlock;
+struct rdFrameBlock
+{
+	rdMat4  mProjection;
+	rdMat4  mInvProjection;
+	GLfloat viewspaceUp[4];
+};
+
+typedef struct rdLightBlock rdLightBlock;
+struct rdLightBlock
+{
+	GLfloat positions[64][4]; /* View space, enabled lights first */
+	GLfloat colors[64][4];
+	GLfloat properties[64][4]; /* Intensity, cutoff radius, upward */
+	GLint   numLights;
+	GLint   pad[3];
+};
+
+typedef struct rdMaterialBlock rdMaterialBlock;
+struct rdMaterialBlock
+{
+	GLfloat colors[64][4];
+	GLfloat properties[64][4]; /* Metalness, roughness, ambient, reflectance */
+};
+
+/* The buffers behind the blocks. They are only uploaded again after a change marked them dirty;
+ * the frame and light blocks are in view space, so moving the camera does too. */
+typedef struct rdUniformBlocks rdUniformBlocks;
+struct rdUniformBlocks
+{
+	GLuint       buffers[RD_BLOCKS];
+	unsigned int dirty; /* Bits by binding point */
+
+	unsigned int cameraVersion; /* Of the camera the view space blocks were built for */
+};
+
 typedef struct rdCamera rdCamera;
 struct rdCamera
 {
 	float x, y, z;
 	float yaw, pitch;
 
-	rdMat4 mView;
-	int    update;
+	rdMat4       mView;
+	int          update;
+	unsigned int version; /* Advanced whenever mView or the projection changes */
 };
 
 typedef struct rdShader rdShader;
@@ -100,6 +431,16 @@ struct rdShader
 	GLint uniforms[16];
 };
 
+/* Unit cube, scaled and moved over the bounds an occlusion test draws */
+typedef struct rdBox rdBox;
+struct rdBox
+{
+	GLuint vertexBuffer;
+	GLuint indexBuffer;
+
+	GLuint vertexArray;
+};
+
 typedef struct rdQuad rdQuad;
 struct rdQuad
 {
@@ -118,6 +459,20 @@ struct rdDepthVelocityBuffer
 	GLuint velocityTexture;
 };
 
+/* Farthest prepass depth over ever coarser blocks of pixels, level 0 at half the screen size and
+ * the last at 1x1. Built at the end of a frame for rd_CullObjectsOnGpu to test against during
+ * the next. */
+typedef struct rdHiZBuffer rdHiZBuffer;
+struct rdHiZBuffer
+{
+	int    numLevels;
+	int    valid;           /* Holds the prepass of the frame before */
+	rdMat4 mViewProjection; /* The prepass was drawn with */
+
+	GLuint framebuf;
+	GLuint depthTexture;
+};
+
 typedef struct rdColorBuffer rdColorBuffer;
 struct rdColorBuffer
 {
@@ -131,6 +486,7 @@ typedef struct rdGBuffer rdGBuffer;
 struct rdGBuffer
 {
 	GLuint framebuf;
+	GLuint framebufSinglePass; /* Velocity as well, for the single pass */
 	GLuint materialIDTexture;
 	GLuint normalTexture;
 };
@@ -155,6 +511,17 @@ struct rdShadowsBuffer
 	GLuint shadowsTexture;
 };
 
+/* Shadow maps the resolve pass samples this frame, each with the box around the objects that
+ * receive its shadows */
+typedef struct rdShadowReceivers rdShadowReceivers;
+struct rdShadowReceivers
+{
+	const rdShadowMap *maps[RD_SHADOW_RESOLVE_MAPS];
+	rdVec3             min[RD_SHADOW_RESOLVE_MAPS];
+	rdVec3             max[RD_SHADOW_RESOLVE_MAPS];
+	int                numMaps;
+};
+
 typedef struct rdBloomBuffer rdBloomBuffer;
 struct rdBloomBuffer
 {
@@ -186,6 +553,8 @@ struct rdSSAOBuffer
 	GLuint occlusionBlurTexture;
 };
 
+typedef struct rdJob rdJob;
+
 struct rdObject
 {
 	rdObject *parent;
@@ -206,23 +575,400 @@ struct rdObject
 	int    update;
 
 	int    isIndexed;
+	int    isFlatShaded;
 
-	GLuint vertexBuffer;
-	GLuint normalBuffer;
-	GLuint indexBuffer;
-	GLuint vertexArray;
+	rdGeometry    *geometry;
+	rdObjectStatus status;
+	rdJob         *job; /* Until resident or failed */
+
+	/* Object space; the box and the sphere share the center */
+	rdVec3 boundsCenter;
+	rdVec3 boundsExtent;
+	float  boundsRadius;
+
+	/* Kept up to date by every transform change */
+	rdVec3 worldCenter;
+	rdVec3 worldExtent;
+	float  worldRadius;
+
+	rdCullList *cullList;
+	int         cullIndex;
+
+	rdBvh *bvh;
+	int    bvhIndex;
 
 	rdMat4 mMVP;
 	rdMat4 *mPrevMVP, _mPrevMVP;
+	unsigned int velocityFrame; /* mPrevMVP is only valid if drawn the frame before */
 
-	rdVec3 lastCameraPosition;
-	float  lastCameraYaw, lastCameraPitch;
+	/* Derived from mModel and the camera by tr_UpdateObject, only again after either changes */
+	rdMat4       mModelView;
+	rdMat3       mNormal;
+	rdMat4       mModelLightspace;  /* Only with a shadow map */
+	unsigned int cameraVersion;     /* Of the camera mMVP was built for, 0 for none */
+	unsigned int viewspaceVersion;  /* Same for mModelView and mNormal, which only the passes
+	                                 * that write the G-buffer need */
 
 	int jitterIndex;
 
 	rdShadowMap *sm;
 };
 
+/* Binary tree over world-space boxes. Nodes are built depth first with both children next to
+ * each other, so a child always comes after its parent. Moved objects are only marked; the tree
+ * is refit, or rebuilt, by the next query. */
+typedef struct rdBvhNode rdBvhNode;
+struct rdBvhNode
+{
+	rdVec3 min;
+	int    first; /* Leaves: first object, inner nodes: left child, right is next */
+	rdVec3 max;
+	int    count; /* Objects in a leaf, 0 for inner nodes */
+};
+
+struct rdBvh
+{
+	/* Per object, indexed by bvhIndex. Building sorts them by leaf, so that refits and queries
+	 * read them in order. */
+	int        numObjects;
+	int        capacity;
+	rdObject **objects;
+	rdVec3    *boxMin; /* Empty boxes have min above max */
+	rdVec3    *boxMax;
+	int       *leafOf;
+
+	rdBvhNode *nodes;
+	int       *parents;
+	int        numNodes;
+
+	unsigned char *moved; /* Per object, set while in the dirty list */
+	unsigned int  *refit; /* Per node, a bit set while its box has to be fit again */
+	unsigned int  *refitWords; /* Per word of those, a bit set while it has any set */
+	int           *dirty;
+	int            numDirty;
+
+	int   rebuild;   /* Objects came or went since the last build */
+	float cost;      /* Summed node area */
+	float builtCost;
+};
+
+typedef enum rdBvhShape
+{
+	RD_BVH_FRUSTUM,
+	RD_BVH_BOX,
+	RD_BVH_SPHERE
+} rdBvhShape;
+
+/* Queries in internal coordinates */
+typedef struct rdBvhQuery rdBvhQuery;
+struct rdBvhQuery
+{
+	rdBvhShape shape;
+	rdVec4     planes[6];
+	rdVec3     min, max; /* The sphere's center is in min */
+	float      radius;
+};
+
+/* The layout glDrawElementsIndirect reads. glDrawArraysIndirect reads the first four fields as
+ * count, instance count, first vertex and a reserved zero. */
+typedef struct rdDrawCommand rdDrawCommand;
+struct rdDrawCommand
+{
+	GLuint count;
+	GLuint instanceCount;
+	GLuint first;
+	GLint  baseVertex;
+	GLuint reserved;
+};
+
+/* An object as the cull shader sees it. Levels are resolved to ranges of the page's buffers, so
+ * moving geometry around invalidates the records. */
+typedef struct rdGpuCullRecord rdGpuCullRecord;
+struct rdGpuCullRecord
+{
+	GLfloat center[4];  /* World space, radius in w */
+	GLfloat extent[4];  /* World space, scale in w */
+	GLfloat lodErrors[RD_MAX_LODS];
+	GLuint  lodCounts[RD_MAX_LODS];
+	GLuint  lodFirsts[RD_MAX_LODS]; /* First index, or first vertex if not indexed */
+	GLint   numLods;                /* 0 while there is nothing to draw */
+	GLint   baseVertex;
+};
+
+/* World-space boxes of the objects in a cull list, one array per component so the frustum test
+ * covers RD_CULL_WIDTH objects per step. The arrays are padded to a multiple of that. */
+struct rdCullList
+{
+	int        numObjects;
+	int        capacity;
+	rdObject **objects;
+
+	float *centerX, *centerY, *centerZ;
+	float *extentX, *extentY, *extentZ;
+
+	/* Set up by the first rd_CullObjectsOnGpu. Records in [dirtyFirst, dirtyEnd) changed since
+	 * they were uploaded. */
+	rdGpuCullRecord *records;
+	GLuint           recordBuffer;
+	GLuint           commandBuffer; /* An rdDrawCommand per object */
+	GLuint           vertexArray;
+	int              dirtyFirst, dirtyEnd;
+	unsigned int     geometryMoves; /* local.geometryMoves as of the last upload */
+	unsigned int     gpuCullFrame;  /* One past the frame the commands were written for */
+	int              gpuCullObjects;
+};
+
+/* An object being created asynchronously. The loader thread prepares it, then the render thread
+ * uploads it a slice per frame. */
+struct rdJob
+{
+	rdJob    *next;
+	rdObject *obj; /* NULL once the object was destroyed */
+
+	int              numVertices;
+	const rdVertex  *vertices;
+	const rdVertex  *normals;
+	int              numIndices;
+	const void      *indices;
+	rdIndexFormat    indexFormat;
+	rdObjectType     objectType;
+	rdPositionFormat positionFormat;
+
+	rdScratch  scratch;
+	rdMeshData mesh;
+	int        prepared; /* 0 if preparing ran out of memory */
+
+	rdGeometry *geometry;
+	size_t      uploadedBytes;
+};
+
+typedef struct rdAsync rdAsync;
+struct rdAsync
+{
+	pthread_t       thread;
+	int             threadStarted;
+	int             quit;
+	pthread_mutex_t lock;
+	pthread_cond_t  wake; /* A job was queued, or quit was set */
+	pthread_cond_t  done; /* The loader thread finished a job */
+
+	/* Guarded by lock */
+	rdJob *queued, *queuedTail;
+	rdJob *current;
+	rdJob *prepared, *preparedTail;
+
+	/* Render thread only */
+	rdJob *uploading, *uploadingTail;
+	size_t uploadBudget;
+};
+
+/* Occluders queued for the frame, and the depth buffer they were rasterized into. Workers take
+ * bands of rows off nextBand until none are left. */
+typedef struct rdOccluders rdOccluders;
+struct rdOccluders
+{
+	rdObject **queued;
+	int        numQueued;
+	int        queueCapacity;
+
+	rdOccluderTriangle *triangles;
+	int                 numTriangles;
+	int                 triangleCapacity;
+
+	float *depth;   /* Normalized device depth, 1 where nothing was drawn */
+	float *tileMax; /* Farthest depth in each tile */
+	rdMat4 mViewProjection;
+	int    valid;   /* Rasterized this frame */
+
+	pthread_t       threads[RD_OCCLUDER_THREADS];
+	int             numThreads;
+	int             quit;
+	pthread_mutex_t lock;
+	pthread_cond_t  wake; /* A new generation of bands is up, or quit was set */
+	pthread_cond_t  done; /* pending dropped to 0 */
+	unsigned int    generation;
+	int             pending; /* Workers still on the current generation */
+	int             nextBand;
+};
+
+/* GL state as the object draws left it. Framebuffer and program are unknown, as no
+ * pass uses them; a NULL viewport is the screen's. */
+typedef struct rdDrawState rdDrawState;
+struct rdDrawState
+{
+	GLuint framebuf;
+	GLuint program;
+	int    depthEqual; /* GL_EQUAL without depth writes, instead of GL_LESS with them */
+	int    cullEnabled;
+	GLenum cullMode;
+
+	const rdShadowMap *viewport;
+};
+
+typedef struct rdQueueItem rdQueueItem;
+struct rdQueueItem
+{
+	uint64_t   key;
+	int        order; /* Of submission, so equal keys keep it */
+	int        batch; /* Order of the first item of its clone batch, its own if it has none */
+	rdDrawType draw;
+	rdObject  *obj;   /* NULL once destroyed */
+};
+
+/* The box is drawn right before the first object under the test, when the depth in front of
+ * that object is complete */
+typedef struct rdQueueTest rdQueueTest;
+struct rdQueueTest
+{
+	rdVec3 center;
+	rdVec3 extent;
+	int    numObjects;
+	int    issued;
+	GLuint query; /* 0 if the box was skipped, when the queries ran out */
+};
+
+/* Draws submitted for the frame, executed by rd_Frame in the order of their keys */
+typedef struct rdQueue rdQueue;
+struct rdQueue
+{
+	rdQueueItem *items;
+	int          numItems;
+	int          capacity;
+
+	rdQueueTest tests[RD_OCCLUSION_TESTS];
+	int         numTests;
+	int         testing; /* Test number submitted objects go under, 0 for none */
+
+	const rdShadowMap *shadowMaps[1 << RD_QUEUE_SHADOWMAP_BITS];
+	int                numShadowMaps;
+	GLuint             vertexArrays[1 << RD_QUEUE_ARRAY_BITS];
+	int                numVertexArrays;
+
+	unsigned int generation; /* Advanced every time the queue is emptied */
+};
+
+/* Attributes of an instance in a clone batch, matrices column by column the way GL reads them.
+ * The second matrix is the previous MVP for the prepass and the model-view matrix for the
+ * G-buffer; the normal matrix and material only go to the passes that write the G-buffer. */
+typedef struct rdInstance rdInstance;
+struct rdInstance
+{
+	GLfloat mMVP[16];
+	GLfloat mOther[16];
+	GLfloat mNormal[9];
+	GLint   materialID;
+};
+
+/* The buffer every geometry page's vertex array reads instances from, refilled for each
+ * instanced draw, and the batch being put together */
+typedef struct rdInstances rdInstances;
+struct rdInstances
+{
+	GLuint buffer;
+	size_t bufferSize;
+
+	rdObject     **objects;
+	unsigned char *lods;
+	rdInstance    *data;
+	rdInstance    *packed; /* The instances at one level, as uploaded */
+	int            capacity;
+};
+
+/* What an object is drawn with in a pass, worked out before its draw */
+typedef struct rdDrawSetup rdDrawSetup;
+struct rdDrawSetup
+{
+	int indirect;
+	int lod;
+	int singlePass;
+
+	const rdMat4 *mPrevMVP;
+};
+
+typedef enum rdGLUniformKind
+{
+	RD_GL_UNIFORM_UNKNOWN,
+	RD_GL_UNIFORM_1I,
+	RD_GL_UNIFORM_1F,
+	RD_GL_UNIFORM_2F,
+	RD_GL_UNIFORM_3F,
+	RD_GL_UNIFORM_4F,
+	RD_GL_UNIFORM_MATRIX3,
+	RD_GL_UNIFORM_MATRIX3_TRANSPOSED,
+	RD_GL_UNIFORM_MATRIX4,
+	RD_GL_UNIFORM_MATRIX4_TRANSPOSED
+} rdGLUniformKind;
+
+typedef struct rdGLUniform rdGLUniform;
+struct rdGLUniform
+{
+	int     kind;      /* rdGLUniformKind */
+	GLfloat value[16]; /* Bytes of the last upload */
+};
+
+typedef struct rdGLProgram rdGLProgram;
+struct rdGLProgram
+{
+	GLuint      program; /* 0 for a free cache */
+	rdGLUniform uniforms[RD_GL_UNIFORMS];
+};
+
+/* The driver's state as the gs_ wrappers last set it. A value is only used while it is known. */
+typedef struct rdGLState rdGLState;
+struct rdGLState
+{
+	int filtering; /* Otherwise every call goes through, but is still tracked */
+
+	GLuint       framebuf;
+	int          framebufKnown;
+	GLuint       program;
+	int          programKnown;
+	rdGLProgram *programCache; /* NULL if the program has none */
+	GLuint       vertexArray;
+	int          vertexArrayKnown;
+	GLenum       activeTexture;
+	int          activeTextureKnown;
+	GLuint       textures[RD_GL_TEXTURE_UNITS]; /* GL_TEXTURE_2D bindings */
+	int          texturesKnown[RD_GL_TEXTURE_UNITS];
+
+	int       caps[RD_GL_CAPS];
+	int       capsKnown[RD_GL_CAPS];
+	GLenum    depthFunc;
+	int       depthFuncKnown;
+	GLboolean depthMask;
+	int       depthMaskKnown;
+	GLenum    cullFace;
+	int       cullFaceKnown;
+	GLint     viewport[4];
+	int       viewportKnown;
+	GLboolean colorMask[4];
+	int       colorMaskKnown;
+
+	rdGLProgram programs[RD_GL_PROGRAMS];
+	int         numPrograms;
+};
+
+typedef enum rdTimerRun
+{
+	RD_TIMER_NONE,
+	RD_TIMER_SHADOWMAP,
+	RD_TIMER_DEPTH,  /* Depth written, by the prepass or the single G-buffer pass */
+	RD_TIMER_GBUFFER /* After a prepass */
+} rdTimerRun;
+
+/* Queries of a frame, read when they are about to be reused */
+typedef struct rdTimerFrame rdTimerFrame;
+struct rdTimerFrame
+{
+	GLuint timeQueries[RD_TIMER_RUNS];
+	GLuint sampleQueries[RD_TIMER_RUNS]; /* Only taken by the G-buffer runs */
+	int    runs[RD_TIMER_RUNS];          /* rdTimerRun */
+	int    numRuns;
+	int    singlePass;
+	int    partial; /* Runs went untimed, or rd_Draw drew camera passes out of order, so the
+	                 * samples don't give the overdraw */
+};
+
 typedef struct rdLocal rdLocal;
 struct rdLocal
 {
@@ -230,15 +976,57 @@ struct rdLocal
 
 	int screenWidth, screenHeight;
 
-	rdLight    lights[64];
-	rdMaterial materials[64];
+	rdScratch scratch;
+
+	unsigned int frameIndex;
+
+	rdGLState glState;
+
+	rdStats      stats;      /* Last complete frame */
+	rdStats      frameStats; /* Being gathered */
+	rdTimerFrame timerFrames[RD_TIMER_FRAMES];
+	rdTimerRun   timerRunning;
+
+	rdGBufferMode gBufferMode;
+	int           singlePass;         /* How this frame draws the G-buffer */
+	int           adaptiveSinglePass; /* What the adaptive mode settled on, between probes */
+	int           singlePassFrames;
+	float         gBufferOverdraw;
+	GLuint64      visibleSamples;     /* Drawn by the last measured G-buffer pass */
+
+	GLuint occlusionQueries[RD_OCCLUSION_FRAMES][RD_OCCLUSION_TESTS];
+	int    occlusionObjects[RD_OCCLUSION_FRAMES][RD_OCCLUSION_TESTS];
+	int    numOcclusionTests[RD_OCCLUSION_FRAMES];
+	int    occlusionTesting;
+	rdBox  occlusionBox;
+
+	rdQueue     queue;
+	rdInstances instances;
+
+	rdGeometryPage *geometryPages;
+	GLuint          boundVertexArray;
+	unsigned int    geometryMoves; /* Times geometry changed place within its page */
+
+	rdAsync async;
+
+	rdOccluders occluders;
+
+	rdLight         lights[64];
+	rdMaterial      materials[64];
+	rdUniformBlocks uniformBlocks;
 
 	rdShader depthOnlyShader;
 	rdShader depthVelocityShader;
 	rdShader geometryShader;
+	rdShader geometryVelocityShader;
+	rdShader depthOnlyInstancedShader;
+	rdShader depthVelocityInstancedShader;
+	rdShader geometryInstancedShader;
+	rdShader geometryVelocityInstancedShader;
+	rdShader bloomInstancedShader;
 	rdShader lightingShader;
 	rdShader ssaoShader;
-	rdShader shadowShader;
+	rdShader shadowResolveShader;
 	rdShader bloomShader;
 	rdShader ssrShader;
 	rdShader compositeShader;
@@ -250,8 +1038,11 @@ struct rdLocal
 	rdShader debugDualChannelShader;
 	rdShader debugTripleChannelShader;
 	rdShader debugNormalsShader;
+	rdShader hiZShader;
+	rdShader cullShader;
 
 	rdDepthVelocityBuffer depthVelocityBuffer;
+	rdHiZBuffer           hiZBuffer;
 	rdGBuffer             gBuffer;
 
 	rdColorBuffer colorBuffer;
@@ -260,8 +1051,9 @@ struct rdLocal
 	rdColorBuffer reflectionsBuffer;
 
 	rdSSAOBuffer    ssaoBuffer;
-	rdShadowsBuffer shadowsBuffer;
-	rdBloomBuffer   bloomBuffer;
+	rdShadowsBuffer   shadowsBuffer;
+	rdShadowReceivers shadowReceivers;
+	rdBloomBuffer     bloomBuffer;
 
 	rdQuad screenQuad;
 
@@ -270,20 +1062,30 @@ struct rdLocal
 	rdMat4 mProjection;
 	rdMat4 mProjectionJitter;
 	rdMat4 mInvProjection;
+
+	int    jitterIndex;
+	rdVec2 currJitter;
+	rdVec2 prevJitter;
 };
 
 static void cm_ResetCamera(rdCamera *cam);
 static void cm_SyncViewMatrix(rdCamera *cam);
-static int  cm_CheckCameraAttributes(const rdCamera *cam, const rdVec3 *pos, float yaw,
-                                     float pitch);
+static void cm_AdvanceJitter(void);
 
 static void fb_SetupQuad(rdQuad *quad);
 static void fb_DestroyQuad(rdQuad *quad);
+static void fb_SetupBox(rdBox *box);
+static void fb_DestroyBox(rdBox *box);
 
 static void fb_SetupDepthVelocityBuffer(rdDepthVelocityBuffer *depthVelocityBuffer, int screenWidth,
                                         int screenHeight);
 static void fb_DestroyDepthVelocityBuffer(rdDepthVelocityBuffer *depthVelocityBuffer);
 
+static void fb_SetupHiZBuffer(rdHiZBuffer *hiZBuffer, int screenWidth, int screenHeight);
+static void fb_DestroyHiZBuffer(rdHiZBuffer *hiZBuffer);
+static void fb_BuildHiZBuffer(rdHiZBuffer *hiZBuffer,
+                              const rdDepthVelocityBuffer *depthVelocityBuffer);
+
 static void fb_SetupGBuffer(rdGBuffer *gBuffer, const rdDepthVelocityBuffer *depthVelocityBuffer,
                             int screenWidth, int screenHeight);
 static void fb_DestroyGBuffer(rdGBuffer *gBuffer);
@@ -291,8 +1093,7 @@ static void fb_DestroyGBuffer(rdGBuffer *gBuffer);
 static void fb_SetupColorBuffer(rdColorBuffer *colorBuffer, int width, int height);
 static void fb_DestroyColorBuffer(rdColorBuffer *colorBuffer);
 
-static void fb_SetupShadowsBuffer(rdShadowsBuffer *shadowsBuffer,
-                                  const rdDepthVelocityBuffer *depthVelocityBuffer, int screenWidth,
+static void fb_SetupShadowsBuffer(rdShadowsBuffer *shadowsBuffer, int screenWidth,
                                   int screenHeight);
 static void fb_DestroyShadowsBuffer(rdShadowsBuffer *shadowsBuffer);
 
@@ -304,19 +1105,83 @@ static void fb_DestroyBloomBuffer(rdBloomBuffer *bloomBuffer);
 static void fb_SetupAmbientOcclusionBuffer(rdSSAOBuffer *ssaoBuffer, int width, int height);
 static void fb_DestroyAmbientOcclusionBuffer(rdSSAOBuffer *ssaoBuffer);
 
-static void sh_SetupShader(rdShader *shader, const char *sourceVertex, const char *sourceFragment);
-static void sh_DestroyShader(rdShader *shader);
-static void sh_SetupUniform(rdShader *shader, int index, const char *name);
-
-static void me_GenerateNormalsIndexed(rdVec3 *outNormals, int numVertices, const rdVertex *vertices,
-                                      int numIndices, const rdIndex *indices);
+static void *ar_Alloc(rdScratch *ar, size_t size);
+static void  ar_Reset(rdScratch *ar);
+static void  ar_Destroy(rdScratch *ar);
+
+static rdGeometry     *gh_Alloc(rdPositionFormat positionFormat, size_t vertexBytes,
+                                size_t indexBytes);
+static void            gh_Free(rdGeometry *geo);
+static rdGeometryPage *gh_CreatePage(rdPositionFormat positionFormat, size_t vertexCapacity,
+                                     size_t indexCapacity);
+static void            gh_DestroyPage(rdGeometryPage *page);
+static void            gh_Defragment(rdGeometryPage *page);
+static void            gh_MoveRange(GLuint buffer, size_t from, size_t to, size_t size);
+static int             gh_AllocRange(rdFreeList *list, size_t size, size_t *outOffset);
+static int             gh_FreeRange(rdFreeList *list, size_t offset, size_t size);
+static size_t          gh_HoleBytes(const rdFreeList *list, size_t capacity);
+static int             gh_CompareVertexOffset(const void *a, const void *b);
+static int             gh_CompareIndexOffset(const void *a, const void *b);
+static void            gh_BindVertexArray(GLuint vertexArray);
+
+static void   sh_SetupShader(rdShader *shader, const char *sourceVertex,
+                             const char *sourceFragment);
+static void   sh_SetupFeedbackShader(rdShader *shader, const char *sourceVertex, int numVaryings,
+                                     const char **varyings);
+static GLuint sh_CompileStage(GLenum type, const char *source);
+static void   sh_LinkProgram(GLuint program);
+static void   sh_DestroyShader(rdShader *shader);
+static void   sh_SetupUniform(rdShader *shader, int index, const char *name);
+static void   sh_SetupBlock(rdShader *shader, const char *name, GLuint binding);
+
+static rdObject *
+            me_CreateObject(int numVertices, const rdVertex *vertices, const rdVertex *normals,
+                            int numIndices, const void *indices, rdIndexFormat indexFormat,
+                            rdObjectType objectType, rdMaterialType materialType,
+                            rdPositionFormat positionFormat);
+static void me_InitObject(rdObject *obj, int numVertices, int numIndices, int isIndexed,
+                          rdObjectType objectType, rdMaterialType materialType);
+static int  me_PrepareMesh(rdScratch *ar, rdMeshData *out, int numVertices,
+                           const rdVertex *vertices, const rdVertex *normals, int numIndices,
+                           const void *indices, rdIndexFormat indexFormat,
+                           rdObjectType objectType, rdPositionFormat positionFormat);
+static rdGeometry *
+            me_AllocGeometry(const rdMeshData *mesh);
+static void me_UploadMesh(const rdGeometry *geo, const rdMeshData *mesh, size_t offset,
+                          size_t size);
+static void me_FinishObject(rdObject *obj, rdGeometry *geo, const rdMeshData *mesh);
+static void me_UpdateTransform(rdObject *obj);
+static int  me_GenerateNormals(rdScratch *ar, rdVec3 *outNormals, int numVertices,
+                               const rdVertex *vertices, int numIndices, const void *indices,
+                               rdIndexFormat indexFormat, rdObjectType objectType);
+static int  me_GenerateNormalsIndexed(rdScratch *ar, rdVec3 *outNormals, int numVertices,
+                                      const rdVertex *vertices, int numIndices,
+                                      const void *indices, rdIndexFormat indexFormat);
+static int  me_WeldPositions(rdScratch *ar, int *outPositionIDs, int numVertices,
+                             const rdVertex *vertices);
+static unsigned int
+            me_HashPosition(const rdVec3 *vec);
 static void me_GenerateNormalsNonIndexed(rdVec3 *outNormals, int numVertices,
                                          const rdVertex *vertices);
 static void me_InvertNormals(rdVec3 *normals, int numNormals);
+static rdIndex32
+            me_Index(const void *indices, rdIndexFormat indexFormat, int i);
+
+static int    lo_BuildChain(rdScratch *ar, rdLod *outLods, void **outIndices, int numVertices,
+                            const rdVertex *vertices, int numIndices, const void *indices,
+                            rdIndexFormat indexFormat);
+static int    lo_CollapsePass(rdSimplifier *s, int targetIndices);
+static int    lo_SelectLod(const rdObject *obj, int bias);
+static int    lo_FindLockedVertices(rdScratch *ar, rdSimplifier *s);
+static rdEdge *
+              lo_EdgeSlot(rdEdge *table, unsigned int mask, int a, int b);
+static void   lo_AddPlane(rdQuadric *q, const rdVec3 *normal, float d, float area);
+static void   lo_AddQuadric(rdQuadric *q, const rdQuadric *other);
+static double lo_Evaluate(const rdQuadric *q, const rdVertex *v);
+static void   lo_SortCollapses(int *outOrder, const rdCollapse *collapses, int numCollapses);
 
 static rdTriangle tr_FromVertices(const rdVec3 *v1, const rdVec3 *v2, const rdVec3 *v3);
 static rdVec3     tr_Normal(const rdTriangle *tri);
-static int        tr_IsAdjacent(const rdTriangle *tri, const rdVec3 *vec);
 
 static void   mx_Identity(rdMat4 *mat);
 static void   mx_Zero(rdMat4 *mat);
@@ -328,6 +1193,7 @@ static void   mx_LookAt(rdMat4 *mat, const rdVec3 *position, const rdVec3 *targe
 static void   mx_Frustum(rdMat4 *p, double left, double right, double bottom, double top,
                          double zNear, double zFar);
 static void   mx_InvertFrustum(rdMat4 *p);
+static void   mx_InvertRigid(rdMat4 *out, const rdMat4 *in);
 #if 0
 static void   mx_Ortho(rdMat4 *o, double left, double right, double bottom, double top, double near,
                        double far);
@@ -347,6 +1213,8 @@ static void   vc_Zero(rdVec3 *vec);
 static rdVec3 vc_Add(const rdVec3 *a, const rdVec3 *b);
 static rdVec3 vc_Sub(const rdVec3 *a, const rdVec3 *b);
 static rdVec3 vc_Multiply(const rdVec3 *a, const rdVec3 *b);
+static rdVec3 vc_Min(const rdVec3 *a, const rdVec3 *b);
+static rdVec3 vc_Max(const rdVec3 *a, const rdVec3 *b);
 static rdVec3 vc_MultiScalar(const rdVec3 *vec, float scalar);
 #if 0
 static rdVec3 vc_DivideScalar(const rdVec3 *vec, float scalar);
@@ -357,15 +1225,180 @@ static float  vc_Dot(const rdVec3 *a, const rdVec3 *b);
 static void   vc_Normalize(rdVec3 *vec);
 static void   vc_Invert(rdVec3 *vec);
 
+static void   cu_FrustumPlanes(rdVec4 *outPlanes, const rdMat4 *mViewProjection);
+static void   cu_CameraPlanes(rdVec4 *outPlanes);
+static int    cu_ShadowCasterPlanes(rdVec4 *outPlanes, const rdShadowMap *sm);
+static rdVec3 cu_IntersectPlanes(const rdVec4 *a, const rdVec4 *b, const rdVec4 *c);
+static int    cu_TestBoxes(const rdCullList *list, const rdVec4 *planes, int numPlanes,
+                           unsigned char *outVisible);
+static void   cu_StoreBounds(rdCullList *list, int index, const rdObject *obj);
+static int    cu_ListBounds(const rdCullList *list, rdVec3 *outCenter, rdVec3 *outExtent);
+static void   cu_MarkDirty(rdCullList *list, int first, int end);
+static int    cu_SetupGpuList(rdCullList *list);
+static void   cu_FillRecord(rdGpuCullRecord *record, const rdObject *obj);
+static int    cu_OcclusionBox(const rdCullList *list, rdVec3 *outCenter, rdVec3 *outExtent);
+static GLuint cu_DrawOcclusionBox(const rdVec3 *center, const rdVec3 *extent, int numObjects);
+
+static rdOccluderMesh *
+            oc_CreateMesh(int numVertices, const rdVertex *vertices, int numIndices,
+                          const void *indices, rdIndexFormat indexFormat);
+static int  oc_Start(rdOccluders *oc);
+static void oc_Stop(rdOccluders *oc);
+static void oc_AddTriangles(rdOccluders *oc, const rdObject *obj);
+static void oc_PushTriangle(rdOccluders *oc, const rdVec3 *a, const rdVec3 *b, const rdVec3 *c);
+static void *
+            oc_WorkerThread(void *arg);
+static void oc_RasterizeBands(rdOccluders *oc);
+static void oc_RasterizeBand(rdOccluders *oc, int band);
+static int  oc_IsOccluded(const rdOccluders *oc, const rdVec3 *center, const rdVec3 *extent);
+
+static int       bv_Reserve(rdBvh *bvh, int capacity);
+static void      bv_StoreBounds(rdBvh *bvh, int index, const rdObject *obj);
+static void      bv_Update(rdBvh *bvh);
+static void      bv_Build(rdBvh *bvh);
+static int       bv_SplitNode(rdBvh *bvh, int node, int depth);
+static void      bv_Refit(rdBvh *bvh);
+static void      bv_Mark(rdBvh *bvh, int node);
+static int       bv_HighestBit(unsigned int bits);
+static int       bv_FitNode(rdBvh *bvh, int node);
+static float     bv_Area(const rdVec3 *min, const rdVec3 *max);
+static int       bv_Query(rdBvh *bvh, const rdBvhQuery *q, rdObject **outObjects, int maxObjects);
+static int       bv_Test(const rdBvhQuery *q, const rdVec3 *min, const rdVec3 *max);
+static rdObject *bv_Raycast(rdBvh *bvh, const rdVec3 *origin, const rdVec3 *dir,
+                            float maxDistance, float *outDistance);
+static int       bv_RayBox(const rdVec3 *origin, const rdVec3 *invDir, const rdVec3 *min,
+                           const rdVec3 *max, float maxDistance, float *outDistance);
+
+static int      qu_Push(rdDrawType draw, rdObject *obj);
+static uint64_t qu_Key(rdDrawType draw, const rdObject *obj);
+static uint32_t qu_Depth(rdDrawType draw, const rdObject *obj);
+static int      qu_ShadowMapNumber(const rdShadowMap *sm);
+static int      qu_VertexArrayNumber(GLuint vertexArray);
+static void     qu_Batch(rdQueueItem *item);
+static int      qu_CanBatch(const rdQueueItem *first, const rdQueueItem *item);
+static int      qu_KeyTest(uint64_t key);
+static int      qu_CompareItems(const void *a, const void *b);
+static void     qu_Execute(void);
+static void     qu_Clear(void);
+static void     qu_DrawObject(rdDrawType draw, rdObject *obj, rdDrawState *state);
+static void     qu_DrawInstances(const rdQueueItem *items, int numItems, rdDrawState *state);
+static int      qu_SetupObject(rdDrawType draw, rdObject *obj, rdDrawSetup *setup);
+static void     qu_SetPassState(rdDrawType draw, const rdObject *obj, int singlePass,
+                                int instanced, rdDrawState *state);
+static void     qu_FinishObject(rdDrawType draw, rdObject *obj, int lod);
+static void     qu_StoreInstance(rdDrawType draw, const rdObject *obj, const rdDrawSetup *setup,
+                                 rdInstance *instance);
+static int      qu_ReserveInstances(rdInstances *in, int capacity);
+static void     qu_UploadInstances(rdInstances *in, int numInstances);
+static void     qu_SetupInstances(rdInstances *in);
+static void     qu_DestroyInstances(rdInstances *in);
+static void     qu_ForgetState(rdDrawState *state);
+static void     qu_ResetState(rdDrawState *state);
+static void     qu_SetDepthEqual(rdDrawState *state, int depthEqual);
+static void     qu_SetCulling(rdDrawState *state, int cullEnabled, GLenum cullMode);
+
+static void         gs_Install(rdGL *table);
+static void         gs_Forget(void);
+static int          gs_Count(int changes);
+static int          gs_CapIndex(GLenum cap);
+static rdGLProgram *gs_FindProgram(GLuint program);
+static int          gs_UniformChanges(GLint location, GLsizei count, int kind, const void *value,
+                                      size_t size);
+static void APIENTRY
+                    gs_Enable(GLenum cap);
+static void APIENTRY
+                    gs_Disable(GLenum cap);
+static void APIENTRY
+                    gs_DepthFunc(GLenum func);
+static void APIENTRY
+                    gs_DepthMask(GLboolean flag);
+static void APIENTRY
+                    gs_CullFace(GLenum mode);
+static void APIENTRY
+                    gs_Viewport(GLint x, GLint y, GLsizei width, GLsizei height);
+static void APIENTRY
+                    gs_ColorMask(GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha);
+static void APIENTRY
+                    gs_BindFramebuffer(GLenum target, GLuint framebuf);
+static void APIENTRY
+                    gs_BindVertexArray(GLuint vertexArray);
+static void APIENTRY
+                    gs_ActiveTexture(GLenum texture);
+static void APIENTRY
+                    gs_BindTexture(GLenum target, GLuint texture);
+static void APIENTRY
+                    gs_UseProgram(GLuint program);
+static void APIENTRY
+                    gs_LinkProgram(GLuint program);
+static void APIENTRY
+                    gs_DeleteProgram(GLuint program);
+static void APIENTRY
+                    gs_DeleteFramebuffers(GLsizei n, GLuint *framebufs);
+static void APIENTRY
+                    gs_DeleteVertexArrays(GLsizei n, GLuint *vertexArrays);
+static void APIENTRY
+                    gs_DeleteTextures(GLsizei n, const GLuint *textures);
+static void APIENTRY
+                    gs_Uniform1i(GLint location, GLint v0);
+static void APIENTRY
+                    gs_Uniform1f(GLint location, GLfloat v0);
+static void APIENTRY
+                    gs_Uniform1fv(GLint location, GLsizei count, const GLfloat *value);
+static void APIENTRY
+                    gs_Uniform2fv(GLint location, GLsizei count, const GLfloat *value);
+static void APIENTRY
+                    gs_Uniform3fv(GLint location, GLsizei count, const GLfloat *value);
+static void APIENTRY
+                    gs_Uniform4fv(GLint location, GLsizei count, const GLfloat *value);
+static void APIENTRY
+                    gs_UniformMatrix3fv(GLint location, GLsizei count, GLboolean transpose,
+                                        const GLfloat *value);
+static void APIENTRY
+                    gs_UniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose,
+                                        const GLfloat *value);
+
+static void st_StartTimer(rdTimerRun run);
+static void st_StopTimer(void);
+static void st_EndFrame(void);
+static int  st_ChooseSinglePass(void);
+
+static void sd_AddReceiver(const rdObject *obj);
+
+static void tr_UpdateObject(rdObject *obj, int viewspace);
+static void tr_UpdateQueued(const rdQueue *q);
+static int  tr_WritesGBuffer(rdDrawType draw, const rdObject *obj);
+
+static void ub_Setup(rdUniformBlocks *ub);
+static void ub_Destroy(rdUniformBlocks *ub);
+static void ub_Update(rdUniformBlocks *ub);
+static void ub_Upload(GLuint buffer, GLsizeiptr size, const void *data);
+
 static float ma_ToRadians(float degrees);
 static float ma_WrapAngle(float angle);
 static float ma_Clamp(float val, float min, float max);
 static float ma_Random(float min, float max);
 static float ma_Lerp(float a, float b, float f);
-static float ma_Halton(unsigned int i, unsigned int base);
+static rdObject *
+            as_QueueObject(int numVertices, const rdVertex *vertices, const rdVertex *normals,
+                           int numIndices, const void *indices, rdIndexFormat indexFormat,
+                           rdObjectType objectType, rdMaterialType materialType,
+                           rdPositionFormat positionFormat);
+static void *
+            as_LoaderThread(void *arg);
+static void as_DrainUploads(void);
+static void as_CancelJob(rdJob *job);
+static void as_Append(rdJob **head, rdJob **tail, rdJob *job);
+static void as_FreeJob(rdJob *job);
 
-static rdMem   mem;
-static rdGL    gl;
+static float ma_Halton(unsigned int i, unsigned int base);
+static unsigned short
+             ma_FloatToHalf(float f);
+static GLuint
+             ma_PackNormal(const rdVec3 *normal);
+
+static rdMem   mem = { malloc, free };
+static rdGL    gl;       /* Filtered by the gs_ wrappers */
+static rdGL    glDriver; /* What the renderer was given */
 static rdLocal local;
 
 void rd_Init(rdGL gl_init, int width, int height)
@@ -373,10 +1406,15 @@ void rd_Init(rdGL gl_init, int width, int height)
 	mem.alloc = malloc;
 	mem.free  = free;
 
-	gl = gl_init;
+	glDriver = gl_init;
+	gl       = gl_init;
+	gs_Install(&gl);
+	local.glState.filtering = 1;
+	gs_Forget();
 
 	assert(sizeof(float) == sizeof(GLfloat));
 	assert(sizeof(unsigned short) == sizeof(GLushort));
+	assert(sizeof(rdIndex32) == sizeof(GLuint));
 
 	printf("Initializing renderer...\n");
 	printf("OpenGL version: %s\n", gl.GetString(GL_VERSION));
@@ -394,6 +1432,60 @@ void rd_Init(rdGL gl_init, int width, int height)
 	local.screenWidth  = 2;
 	local.screenHeight = 2;
 
+	local.scratch.head      = NULL;
+	local.scratch.used      = 0;
+	local.scratch.highWater = 0;
+
+	local.frameIndex = 0;
+
+	memset(&local.stats, 0, sizeof (local.stats));
+	memset(&local.frameStats, 0, sizeof (local.frameStats));
+	memset(local.timerFrames, 0, sizeof (local.timerFrames));
+	local.timerRunning = RD_TIMER_NONE;
+
+	local.gBufferMode        = RD_GBUFFER_PREPASS;
+	local.singlePass         = 0;
+	local.adaptiveSinglePass = 0;
+	local.singlePassFrames   = 0;
+	local.gBufferOverdraw    = 0.0f;
+	local.visibleSamples     = 0;
+
+	memset(local.numOcclusionTests, 0, sizeof (local.numOcclusionTests));
+	local.occlusionTesting = 0;
+
+	local.queue.items      = NULL;
+	local.queue.numItems   = 0;
+	local.queue.capacity   = 0;
+	local.queue.generation = 0;
+	qu_Clear();
+
+	/* Geometry pages point their vertex arrays at the instance buffer */
+	qu_SetupInstances(&local.instances);
+
+	local.jitterIndex = 8;
+	local.currJitter  = vc_Vec2(0.0f, 0.0f);
+	local.prevJitter  = vc_Vec2(0.0f, 0.0f);
+
+	pthread_mutex_init(&local.async.lock, NULL);
+	pthread_cond_init(&local.async.wake, NULL);
+	pthread_cond_init(&local.async.done, NULL);
+	local.async.threadStarted = 0;
+	local.async.quit          = 0;
+	local.async.queued        = local.async.queuedTail    = NULL;
+	local.async.current       = NULL;
+	local.async.prepared      = local.async.preparedTail  = NULL;
+	local.async.uploading     = local.async.uploadingTail = NULL;
+	local.async.uploadBudget  = RD_DEFAULT_UPLOAD_BUDGET;
+
+	local.geometryPages    = NULL;
+	local.boundVertexArray = 0;
+	local.geometryMoves    = 0;
+
+	memset(&local.occluders, 0, sizeof (local.occluders));
+	pthread_mutex_init(&local.occluders.lock, NULL);
+	pthread_cond_init(&local.occluders.wake, NULL);
+	pthread_cond_init(&local.occluders.done, NULL);
+
 	cm_ResetCamera(&local.defaultCamera);
 	mx_Identity(&local.mProjection);
 
@@ -429,6 +1521,8 @@ void rd_Init(rdGL gl_init, int width, int height)
 		m->reflectance = 0.00f;
 	}
 
+	ub_Setup(&local.uniformBlocks);
+
 	sh_SetupShader(&local.depthOnlyShader, shaderSourceDepthOnlyVertex,
 	               shaderSourceDepthOnlyFragment);
 	sh_SetupUniform(&local.depthOnlyShader, 0, "mMVP");
@@ -447,6 +1541,35 @@ void rd_Init(rdGL gl_init, int width, int height)
 	sh_SetupUniform(&local.geometryShader, 3, "paintjob");
 	sh_SetupUniform(&local.geometryShader, 4, "materialID");
 
+	sh_SetupShader(&local.geometryVelocityShader, shaderSourceGeometryVelocityVertex,
+	               shaderSourceGeometryVelocityFragment);
+	sh_SetupUniform(&local.geometryVelocityShader, 0, "mMVP");
+	sh_SetupUniform(&local.geometryVelocityShader, 1, "mPrevMVP");
+	sh_SetupUniform(&local.geometryVelocityShader, 2, "currJitter");
+	sh_SetupUniform(&local.geometryVelocityShader, 3, "prevJitter");
+	sh_SetupUniform(&local.geometryVelocityShader, 4, "mNormal");
+	sh_SetupUniform(&local.geometryVelocityShader, 5, "paintjob");
+	sh_SetupUniform(&local.geometryVelocityShader, 6, "materialID");
+
+	sh_SetupShader(&local.depthOnlyInstancedShader, shaderSourceDepthOnlyInstancedVertex,
+	               shaderSourceDepthOnlyFragment);
+
+	sh_SetupShader(&local.depthVelocityInstancedShader, shaderSourceDepthVelocityInstancedVertex,
+	               shaderSourceDepthVelocityFragment);
+	sh_SetupUniform(&local.depthVelocityInstancedShader, 0, "currJitter");
+	sh_SetupUniform(&local.depthVelocityInstancedShader, 1, "prevJitter");
+
+	sh_SetupShader(&local.geometryInstancedShader, shaderSourceGeometryInstancedVertex,
+	               shaderSourceGeometryFragment);
+	sh_SetupUniform(&local.geometryInstancedShader, 0, "paintjob");
+
+	sh_SetupShader(&local.geometryVelocityInstancedShader,
+	               shaderSourceGeometryVelocityInstancedVertex,
+	               shaderSourceGeometryVelocityFragment);
+	sh_SetupUniform(&local.geometryVelocityInstancedShader, 0, "currJitter");
+	sh_SetupUniform(&local.geometryVelocityInstancedShader, 1, "prevJitter");
+	sh_SetupUniform(&local.geometryVelocityInstancedShader, 2, "paintjob");
+
 	sh_SetupShader(&local.lightingShader, shaderSourceLightingVertex, shaderSourceLightingFragment);
 	sh_SetupUniform(&local.lightingShader, 0, "depthTexture");
 	sh_SetupUniform(&local.lightingShader, 1, "materialIDTexture");
@@ -455,14 +1578,9 @@ void rd_Init(rdGL gl_init, int width, int height)
 	sh_SetupUniform(&local.lightingShader, 4, "shadowsTexture");
 	sh_SetupUniform(&local.lightingShader, 5, "bloomRawTexture");
 	sh_SetupUniform(&local.lightingShader, 6, "bloomBlurredTexture");
-	sh_SetupUniform(&local.lightingShader, 7, "mInvProjection");
-	sh_SetupUniform(&local.lightingShader, 8, "viewspaceUp");
-	sh_SetupUniform(&local.lightingShader, 9, "materialColors");
-	sh_SetupUniform(&local.lightingShader, 10, "materialProperties");
-	sh_SetupUniform(&local.lightingShader, 11, "numLights");
-	sh_SetupUniform(&local.lightingShader, 12, "lightPositions");
-	sh_SetupUniform(&local.lightingShader, 13, "lightColors");
-	sh_SetupUniform(&local.lightingShader, 14, "lightProperties");
+	sh_SetupBlock(&local.lightingShader, "FrameBlock", RD_BLOCK_FRAME);
+	sh_SetupBlock(&local.lightingShader, "LightBlock", RD_BLOCK_LIGHTS);
+	sh_SetupBlock(&local.lightingShader, "MaterialBlock", RD_BLOCK_MATERIALS);
 
 	sh_SetupShader(&local.ssaoShader, shaderSourceSSAOVertex, shaderSourceSSAOFragment);
 	sh_SetupUniform(&local.ssaoShader, 0, "depthTexture");
@@ -473,32 +1591,47 @@ void rd_Init(rdGL gl_init, int width, int height)
 	sh_SetupUniform(&local.ssaoShader, 5, "samples");
 	sh_SetupUniform(&local.ssaoShader, 6, "resolution");
 
-	sh_SetupShader(&local.shadowShader, shaderSourceShadowVertex, shaderSourceShadowFragment);
-	sh_SetupUniform(&local.shadowShader, 0, "mMVP");
-	sh_SetupUniform(&local.shadowShader, 1, "mNormal");
-	sh_SetupUniform(&local.shadowShader, 2, "mModelView");
-	sh_SetupUniform(&local.shadowShader, 3, "mModelLightspace");
-	sh_SetupUniform(&local.shadowShader, 4, "shadowMapTexture");
-	sh_SetupUniform(&local.shadowShader, 5, "actualLightPosition");
+	sh_SetupShader(&local.shadowResolveShader, shaderSourceShadowResolveVertex,
+	               shaderSourceShadowResolveFragment);
+	sh_SetupUniform(&local.shadowResolveShader, 0, "depthTexture");
+	sh_SetupUniform(&local.shadowResolveShader, 1, "normalTexture");
+	sh_SetupUniform(&local.shadowResolveShader, 2, "mInvProjection");
+	sh_SetupUniform(&local.shadowResolveShader, 3, "mInvView");
+	sh_SetupUniform(&local.shadowResolveShader, 4, "numShadowMaps");
+	sh_SetupUniform(&local.shadowResolveShader, 5, "mLightspace");
+	sh_SetupUniform(&local.shadowResolveShader, 6, "lightPositions");
+	sh_SetupUniform(&local.shadowResolveShader, 7, "receiverMin");
+	sh_SetupUniform(&local.shadowResolveShader, 8, "receiverMax");
+
+	/* The shadow maps are on the units after the depth and normal textures, for good */
+	gl.UseProgram(local.shadowResolveShader.shaderProgram);
+	for (int i = 0; i < RD_SHADOW_RESOLVE_MAPS; i++) {
+		char name[32];
+
+		snprintf(name, sizeof name, "shadowMapTextures[%d]", i);
+		gl.Uniform1i(gl.GetUniformLocation(local.shadowResolveShader.shaderProgram, name), 2 + i);
+	}
 
 	sh_SetupShader(&local.bloomShader, shaderSourceBloomVertex, shaderSourceBloomFragment);
 	sh_SetupUniform(&local.bloomShader, 0, "mMVP");
 
+	sh_SetupShader(&local.bloomInstancedShader, shaderSourceDepthOnlyInstancedVertex,
+	               shaderSourceBloomFragment);
+
 	sh_SetupShader(&local.ssrShader, shaderSourceSSRVertex, shaderSourceSSRFragment);
-	sh_SetupUniform(&local.ssrShader, 0, "mProjection");
-	sh_SetupUniform(&local.ssrShader, 1, "mInvProjection");
-	sh_SetupUniform(&local.ssrShader, 2, "depthTexture");
-	sh_SetupUniform(&local.ssrShader, 3, "materialIDTexture");
-	sh_SetupUniform(&local.ssrShader, 4, "normalTexture");
-	sh_SetupUniform(&local.ssrShader, 5, "colorTexture");
-	sh_SetupUniform(&local.ssrShader, 6, "reflectanceProperties");
+	sh_SetupUniform(&local.ssrShader, 0, "depthTexture");
+	sh_SetupUniform(&local.ssrShader, 1, "materialIDTexture");
+	sh_SetupUniform(&local.ssrShader, 2, "normalTexture");
+	sh_SetupUniform(&local.ssrShader, 3, "colorTexture");
+	sh_SetupBlock(&local.ssrShader, "FrameBlock", RD_BLOCK_FRAME);
+	sh_SetupBlock(&local.ssrShader, "MaterialBlock", RD_BLOCK_MATERIALS);
 
 	sh_SetupShader(&local.compositeShader, shaderSourceCompositeVertex,
 	               shaderSourceCompositeFragment);
 	sh_SetupUniform(&local.compositeShader, 0, "colorTexture");
 	sh_SetupUniform(&local.compositeShader, 1, "reflectionsTexture");
 	sh_SetupUniform(&local.compositeShader, 2, "materialIDTexture");
-	sh_SetupUniform(&local.compositeShader, 3, "reflectanceProperties");
+	sh_SetupBlock(&local.compositeShader, "MaterialBlock", RD_BLOCK_MATERIALS);
 
 	sh_SetupShader(&local.tAAResolveMotionBlurShader, shaderSourceTAAResolveMotionBlurVertex,
 	               shaderSourceTAAResolveMotionBlurFragment);
@@ -541,7 +1674,25 @@ void rd_Init(rdGL gl_init, int width, int height)
 	sh_SetupShader(&local.debugNormalsShader, shaderSourceDebugNormalsVertex,
 	               shaderSourceDebugNormalsFragment);
 
+	sh_SetupShader(&local.hiZShader, shaderSourceHiZVertex, shaderSourceHiZFragment);
+	sh_SetupUniform(&local.hiZShader, 0, "inputTexture");
+
+	{
+		const char *varyings[] = { "command", "reserved" };
+
+		sh_SetupFeedbackShader(&local.cullShader, shaderSourceCullVertex, 2, varyings);
+		sh_SetupUniform(&local.cullShader, 0, "planes");
+		sh_SetupUniform(&local.cullShader, 1, "viewDepthRow");
+		sh_SetupUniform(&local.cullShader, 2, "pixelScale");
+		sh_SetupUniform(&local.cullShader, 3, "maxPixelError");
+		sh_SetupUniform(&local.cullShader, 4, "mPrevViewProjection");
+		sh_SetupUniform(&local.cullShader, 5, "hiZTexture");
+		sh_SetupUniform(&local.cullShader, 6, "hiZLevels");
+		sh_SetupUniform(&local.cullShader, 7, "screenSize");
+	}
+
 	fb_SetupDepthVelocityBuffer(&local.depthVelocityBuffer, 128, 128);
+	fb_SetupHiZBuffer(&local.hiZBuffer, 128, 128);
 	fb_SetupGBuffer(&local.gBuffer, &local.depthVelocityBuffer, 128, 128);
 
 	fb_SetupColorBuffer(&local.colorBuffer, 128, 128);
@@ -550,10 +1701,17 @@ void rd_Init(rdGL gl_init, int width, int height)
 	fb_SetupColorBuffer(&local.reflectionsBuffer, 128, 128);
 
 	fb_SetupAmbientOcclusionBuffer(&local.ssaoBuffer, 128, 128);
-	fb_SetupShadowsBuffer(&local.shadowsBuffer, &local.depthVelocityBuffer, 128, 128);
+	fb_SetupShadowsBuffer(&local.shadowsBuffer, 128, 128);
 	fb_SetupBloomBuffer(&local.bloomBuffer, &local.depthVelocityBuffer, 128, 128, 128, 128);
 
 	fb_SetupQuad(&local.screenQuad);
+	fb_SetupBox(&local.occlusionBox);
+
+	for (int i = 0; i < RD_TIMER_FRAMES; i++) {
+		gl.GenQueries(RD_TIMER_RUNS, local.timerFrames[i].timeQueries);
+		gl.GenQueries(RD_TIMER_RUNS, local.timerFrames[i].sampleQueries);
+	}
+	gl.GenQueries(RD_OCCLUSION_FRAMES * RD_OCCLUSION_TESTS, &local.occlusionQueries[0][0]);
 
 	gl.BindFramebuffer(GL_FRAMEBUFFER, 0);
 	rd_Viewport(width, height);
@@ -561,16 +1719,76 @@ void rd_Init(rdGL gl_init, int width, int height)
 
 void rd_Shutdown(void)
 {
+	rdGeometryPage *page;
+	int             numPages = 0;
+	size_t          geometryBytes = 0;
+
+	for (page = local.geometryPages; page != NULL; page = page->next) {
+		numPages++;
+		geometryBytes += page->vertexCapacity + page->indexCapacity;
+	}
+
 	printf("Shutting down renderer...\n");
+	printf("Mesh scratch memory high-water mark: %lu bytes\n",
+	       (unsigned long) local.scratch.highWater);
+	printf("Geometry heap: %d pages, %lu bytes\n", numPages, (unsigned long) geometryBytes);
+
+	/* Jobs still around belong to objects that were never destroyed; their geometry goes
+	 * with the pages below */
+	if (local.async.threadStarted) {
+		rdJob *lists[3];
+
+		pthread_mutex_lock(&local.async.lock);
+		local.async.quit = 1;
+		pthread_cond_signal(&local.async.wake);
+		pthread_mutex_unlock(&local.async.lock);
+
+		pthread_join(local.async.thread, NULL);
+		local.async.threadStarted = 0;
+
+		lists[0] = local.async.queued;
+		lists[1] = local.async.prepared;
+		lists[2] = local.async.uploading;
+
+		for (int i = 0; i < 3; i++) {
+			while (lists[i] != NULL) {
+				rdJob *next = lists[i]->next;
+
+				if (lists[i]->obj != NULL)
+					lists[i]->obj->job = NULL;
+				as_FreeJob(lists[i]);
+				lists[i] = next;
+			}
+		}
+
+		local.async.queued    = local.async.queuedTail    = NULL;
+		local.async.prepared  = local.async.preparedTail  = NULL;
+		local.async.uploading = local.async.uploadingTail = NULL;
+	}
+
+	pthread_cond_destroy(&local.async.done);
+	pthread_cond_destroy(&local.async.wake);
+	pthread_mutex_destroy(&local.async.lock);
+
+	oc_Stop(&local.occluders);
+	pthread_cond_destroy(&local.occluders.done);
+	pthread_cond_destroy(&local.occluders.wake);
+	pthread_mutex_destroy(&local.occluders.lock);
 
 	sh_DestroyShader(&local.depthOnlyShader);
 	sh_DestroyShader(&local.depthVelocityShader);
 	sh_DestroyShader(&local.geometryShader);
+	sh_DestroyShader(&local.geometryVelocityShader);
+	sh_DestroyShader(&local.depthOnlyInstancedShader);
+	sh_DestroyShader(&local.depthVelocityInstancedShader);
+	sh_DestroyShader(&local.geometryInstancedShader);
+	sh_DestroyShader(&local.geometryVelocityInstancedShader);
+	sh_DestroyShader(&local.bloomInstancedShader);
 	sh_DestroyShader(&local.lightingShader);
 	sh_DestroyShader(&local.ssaoShader);
 	sh_DestroyShader(&local.blurSingleChannelShader);
 	sh_DestroyShader(&local.gaussianBlurSingleChannelShader);
-	sh_DestroyShader(&local.shadowShader);
+	sh_DestroyShader(&local.shadowResolveShader);
 	sh_DestroyShader(&local.bloomShader);
 	sh_DestroyShader(&local.ssrShader);
 	sh_DestroyShader(&local.compositeShader);
@@ -580,8 +1798,11 @@ void rd_Shutdown(void)
 	sh_DestroyShader(&local.debugDualChannelShader);
 	sh_DestroyShader(&local.debugTripleChannelShader);
 	sh_DestroyShader(&local.debugNormalsShader);
+	sh_DestroyShader(&local.hiZShader);
+	sh_DestroyShader(&local.cullShader);
 
 	fb_DestroyDepthVelocityBuffer(&local.depthVelocityBuffer);
+	fb_DestroyHiZBuffer(&local.hiZBuffer);
 	fb_DestroyGBuffer(&local.gBuffer);
 	fb_DestroyColorBuffer(&local.colorBuffer);
 	fb_DestroyColorBuffer(&local.frontBuffer);
@@ -593,16 +1814,69 @@ void rd_Shutdown(void)
 	fb_DestroyBloomBuffer(&local.bloomBuffer);
 
 	fb_DestroyQuad(&local.screenQuad);
+	fb_DestroyBox(&local.occlusionBox);
+
+	st_StopTimer();
+	for (int i = 0; i < RD_TIMER_FRAMES; i++) {
+		gl.DeleteQueries(RD_TIMER_RUNS, local.timerFrames[i].timeQueries);
+		gl.DeleteQueries(RD_TIMER_RUNS, local.timerFrames[i].sampleQueries);
+	}
+	rd_EndOcclusionTest();
+	gl.DeleteQueries(RD_OCCLUSION_FRAMES * RD_OCCLUSION_TESTS, &local.occlusionQueries[0][0]);
+
+	/* Whatever was submitted after the last frame is dropped */
+	if (local.queue.items != NULL)
+		mem.free(local.queue.items);
+
+	while (local.geometryPages != NULL)
+		gh_DestroyPage(local.geometryPages);
+	qu_DestroyInstances(&local.instances);
+	ub_Destroy(&local.uniformBlocks);
+
+	ar_Destroy(&local.scratch);
 }
 
 void rd_SetCustomAllocator(rdAlloc *alloc, rdFree *free)
 {
 	assert(alloc != NULL && free != NULL);
 
+	/* Scratch blocks must be returned to the allocator that handed them out. The loader thread
+	 * allocates too, so the allocator has to be thread-safe once async creation is used. */
+	ar_Destroy(&local.scratch);
+	assert(local.geometryPages == NULL);
+	assert(local.async.queued == NULL && local.async.current == NULL);
+
 	mem.alloc = alloc;
 	mem.free  = free;
 }
 
+size_t rd_GetScratchHighWater(void)
+{
+	return local.scratch.highWater;
+}
+
+void rd_GetStats(rdStats *outStats)
+{
+	*outStats = local.stats;
+}
+
+void rd_SetUploadBudget(size_t bytesPerFrame)
+{
+	assert(bytesPerFrame > 0);
+
+	local.async.uploadBudget = bytesPerFrame;
+}
+
+void rd_SetStateFiltering(int enabled)
+{
+	local.glState.filtering = enabled;
+}
+
+void rd_SetGBufferMode(rdGBufferMode mode)
+{
+	local.gBufferMode = mode;
+}
+
 void rd_Viewport(int width, int height)
 {
 	double aspect, fov;
@@ -627,11 +1901,19 @@ void rd_Viewport(int width, int height)
 	local.mInvProjection = local.mProjection;
 	mx_InvertFrustum(&local.mInvProjection);
 
+	local.uniformBlocks.dirty |= 1u << RD_BLOCK_FRAME;
+
 	local.mProjectionJitter = local.mProjection;
 
+	/* The cached MVPs were built with the old projection */
+	local.defaultCamera.version++;
+
 	fb_DestroyDepthVelocityBuffer(&local.depthVelocityBuffer);
 	fb_SetupDepthVelocityBuffer(&local.depthVelocityBuffer, width, height);
 
+	fb_DestroyHiZBuffer(&local.hiZBuffer);
+	fb_SetupHiZBuffer(&local.hiZBuffer, width, height);
+
 	fb_DestroyGBuffer(&local.gBuffer);
 	fb_SetupGBuffer(&local.gBuffer, &local.depthVelocityBuffer, width, height);
 
@@ -651,7 +1933,7 @@ void rd_Viewport(int width, int height)
 	fb_SetupAmbientOcclusionBuffer(&local.ssaoBuffer, width / 2, height / 2);
 
 	fb_DestroyShadowsBuffer(&local.shadowsBuffer);
-	fb_SetupShadowsBuffer(&local.shadowsBuffer, &local.depthVelocityBuffer, width, height);
+	fb_SetupShadowsBuffer(&local.shadowsBuffer, width, height);
 
 	fb_DestroyBloomBuffer(&local.bloomBuffer);
 	fb_SetupBloomBuffer(&local.bloomBuffer, &local.depthVelocityBuffer, width, height,
@@ -696,19 +1978,7 @@ void rd_ClearShadowMap(const rdShadowMap *sw)
 
 void rd_Draw(rdDrawType draw, rdObject *obj)
 {
-	static int jitterIndex = 8;
-
-	static rdVec2 currJitter = { 0.0f, 0.0f };
-	static rdVec2 prevJitter = { 0.0f, 0.0f };
-
-	int calcMVP = 0;
-
-	rdMat4 mMVPCopy;
-	rdMat4 mModelLightspace;
-	GLuint framebuf;
-
-	rdMat4 mModelView;
-	rdMat3 mNormal;
+	rdDrawState state;
 
 	if (obj == NULL) {
 		GLuint texture;
@@ -729,7 +1999,7 @@ void rd_Draw(rdDrawType draw, rdObject *obj)
 		gl.Disable(GL_DEPTH_TEST);
 
 		gl.BindFramebuffer(GL_FRAMEBUFFER, 0);
-		gl.BindVertexArray(local.screenQuad.vertexArray);
+		gh_BindVertexArray(local.screenQuad.vertexArray);
 
 		gl.ActiveTexture(GL_TEXTURE0);
 		gl.BindTexture(GL_TEXTURE_2D, texture);
@@ -764,7 +2034,7 @@ void rd_Draw(rdDrawType draw, rdObject *obj)
 		gl.Disable(GL_DEPTH_TEST);
 
 		gl.BindFramebuffer(GL_FRAMEBUFFER, 0);
-		gl.BindVertexArray(local.screenQuad.vertexArray);
+		gh_BindVertexArray(local.screenQuad.vertexArray);
 
 		gl.ActiveTexture(GL_TEXTURE0);
 		gl.BindTexture(GL_TEXTURE_2D, texture);
@@ -780,206 +2050,44 @@ void rd_Draw(rdDrawType draw, rdObject *obj)
 		return;
 	}
 
-	if (draw == RD_DRAW_SHADOWMAP || draw == RD_DRAW_SHADOWS)
-		assert(obj->sm != NULL);
-
-	mMVPCopy = obj->mMVP;
+	if (obj->status != RD_OBJECT_RESIDENT)
+		return;
 
-	if (obj->mPrevMVP == NULL) {
-		calcMVP = 1;
+	/* Shadows are resolved for the whole screen by rd_Frame */
+	if (draw == RD_DRAW_SHADOWS) {
+		sd_AddReceiver(obj);
+		return;
 	}
 
-	if (obj->update == 1) {
-		mx_Identity(&obj->mModel);
-		mx_Rotate(&obj->mModel, ma_ToRadians(obj->rotX), ma_ToRadians(obj->rotY),
-		                        ma_ToRadians(obj->rotZ));
-		mx_Scale(&obj->mModel, obj->scale, obj->scale, obj->scale);
-		mx_Translate(&obj->mModel, obj->posX, obj->posY, -obj->posZ);
+	/* Interleaved with the other passes and unsorted, the samples tell nothing of the overdraw */
+	if (draw == RD_DRAW_DEPTHVELOCITY || draw == RD_DRAW_GBUFFER)
+		local.timerFrames[local.frameIndex % RD_TIMER_FRAMES].partial = 1;
 
-		obj->update = 0;
-		calcMVP = 1;
-	}
-
-	if (local.defaultCamera.update) {
-		cm_SyncViewMatrix(&local.defaultCamera);
-		local.defaultCamera.update = 0;
-		calcMVP = 1;
-	}
-	
-	if (!cm_CheckCameraAttributes(&local.defaultCamera, &obj->lastCameraPosition,
-	                             obj->lastCameraYaw, obj->lastCameraPitch))
-		calcMVP = 1;
-
-	if (draw == RD_DRAW_GBUFFER || draw == RD_DRAW_SHADOWS) {
-		rdMat3 mInvModelView3;
-
-		mx_MultiAB(&mModelView, &local.defaultCamera.mView, &obj->mModel);
-		mInvModelView3 = mx_Mat3From4(&mModelView);
-		mx_Invert3(&mInvModelView3);
-		mNormal = mInvModelView3;
-		mx_Transpose3(&mNormal);
-	}
-
-	if (local.renderState == RD_RENDERSTATE_FRESH) {
-		float haltonX = 2.0f * ma_Halton(jitterIndex + 1, 2) - 1.0f;
-		float haltonY = 2.0f * ma_Halton(jitterIndex + 1, 3) - 1.0f;
-
-		float jitterX = (haltonX / local.screenWidth);
-		float jitterY = (haltonY / local.screenHeight);
-
-		local.mProjectionJitter = local.mProjection;
-
-		local.mProjectionJitter.m[0][2] += jitterX;
-		local.mProjectionJitter.m[1][2] += jitterY;
-
-		prevJitter = currJitter;
-		currJitter.x = jitterX;
-		currJitter.y = jitterY;
-
-		jitterIndex++;
-		jitterIndex = jitterIndex % 8;
-	}
-
-	if (obj->jitterIndex != jitterIndex)
-		calcMVP = 1;
-
-	if (draw == RD_DRAW_SHADOWMAP || draw == RD_DRAW_SHADOWS)
-		mx_MultiAB(&mModelLightspace, &obj->sm->mLightspace, &obj->mModel);
-
-	if (calcMVP) {
-		mx_MultiABC(&obj->mMVP, &local.mProjectionJitter, &local.defaultCamera.mView, &obj->mModel);
-		obj->jitterIndex = jitterIndex;
-	}
+	/* Nothing is known about the state, and it is left the way the frame expects it */
+	qu_ForgetState(&state);
+	qu_DrawObject(draw, obj, &state);
+	qu_ResetState(&state);
+}
 
-	switch (draw) {
-	case RD_DRAW_DEPTHVELOCITY:
-		framebuf = local.depthVelocityBuffer.framebuf;
-		break;
-	case RD_DRAW_SHADOWMAP:
-		framebuf = obj->sm->framebuf;
-		if (!obj->isIndexed)
-			gl.CullFace(GL_FRONT);
-		break;
-	case RD_DRAW_GBUFFER:
-		framebuf = local.gBuffer.framebuf;
-		gl.DepthFunc(GL_EQUAL);
-		gl.DepthMask(GL_FALSE);
-		break;
-	case RD_DRAW_SHADOWS:
-		framebuf = local.shadowsBuffer.framebuf;
-		gl.DepthFunc(GL_EQUAL);
-		gl.DepthMask(GL_FALSE);
-		break;
-	case RD_DRAW_BLOOM:
-		framebuf = local.bloomBuffer.framebufRaw;
-		gl.DepthFunc(GL_EQUAL);
-		gl.DepthMask(GL_FALSE);
-		break;
-	default:
+void rd_Submit(rdObject *obj, unsigned int passes)
+{
+	if (obj->status != RD_OBJECT_RESIDENT)
 		return;
-	}
-
-	gl.BindFramebuffer(GL_FRAMEBUFFER, framebuf);
 
-	if (draw == RD_DRAW_SHADOWMAP)
-		gl.Viewport(0, 0, obj->sm->pixWidth, obj->sm->pixHeight);
+	for (int draw = RD_DRAW_DEPTHVELOCITY; draw <= RD_DRAW_BLOOM; draw++) {
+		if (!(passes & 1u << draw))
+			continue;
 
-	switch (draw) {
-	case RD_DRAW_DEPTHVELOCITY:
-		gl.UseProgram(local.depthVelocityShader.shaderProgram);
-		gl.UniformMatrix4fv(local.depthVelocityShader.uniforms[0], 1, GL_TRUE, &obj->mMVP.m[0][0]);
-		if (obj->mPrevMVP) {
-			gl.UniformMatrix4fv(local.depthVelocityShader.uniforms[1], 1, GL_TRUE,
-			                    &obj->mPrevMVP->m[0][0]);
-		} else {
-			gl.UniformMatrix4fv(local.depthVelocityShader.uniforms[1], 1, GL_TRUE,
-			                    &obj->mMVP.m[0][0]);
+		if (draw == RD_DRAW_SHADOWS) {
+			sd_AddReceiver(obj);
+			continue;
 		}
-		gl.Uniform2fv(local.depthVelocityShader.uniforms[2], 1, &currJitter.x);
-		gl.Uniform2fv(local.depthVelocityShader.uniforms[3], 1, &prevJitter.x);
-		break;
-	case RD_DRAW_SHADOWMAP:
-		gl.UseProgram(local.depthOnlyShader.shaderProgram);
-		gl.UniformMatrix4fv(local.depthOnlyShader.uniforms[0], 1, GL_TRUE,
-		                    &mModelLightspace.m[0][0]);
-		break;
-	case RD_DRAW_GBUFFER:
-		gl.UseProgram(local.geometryShader.shaderProgram);
-		gl.UniformMatrix4fv(local.geometryShader.uniforms[0], 1, GL_TRUE, &mModelView.m[0][0]);
-		gl.UniformMatrix4fv(local.geometryShader.uniforms[1], 1, GL_TRUE, &obj->mMVP.m[0][0]);
-		gl.UniformMatrix3fv(local.geometryShader.uniforms[2], 1, GL_TRUE, &mNormal.m[0][0]);
-		gl.Uniform1i(local.geometryShader.uniforms[3], obj->materialType == RD_MATERIAL_PAINTJOB);
-		gl.Uniform1i(local.geometryShader.uniforms[4], obj->materialID);
-		break;
-	case RD_DRAW_SHADOWS:
-	{
-		rdVec4 tmp, lightPosViewspace;
-
-		tmp.x = local.lights[obj->sm->originLightIndex].x;
-		tmp.y = local.lights[obj->sm->originLightIndex].y;
-		tmp.z = local.lights[obj->sm->originLightIndex].z;
-		tmp.w = 1.0f;
-
-		lightPosViewspace = mx_MultiVector4(&local.defaultCamera.mView, &tmp);
-
-		gl.ActiveTexture(GL_TEXTURE0);
-		gl.BindTexture(GL_TEXTURE_2D, obj->sm->depthTexture);
-
-		gl.UseProgram(local.shadowShader.shaderProgram);
-		gl.UniformMatrix4fv(local.shadowShader.uniforms[0], 1, GL_TRUE, &obj->mMVP.m[0][0]);
-		gl.UniformMatrix3fv(local.shadowShader.uniforms[1], 1, GL_TRUE, &mNormal.m[0][0]);
-		gl.UniformMatrix4fv(local.shadowShader.uniforms[2], 1, GL_TRUE, &mModelView.m[0][0]);
-		gl.UniformMatrix4fv(local.shadowShader.uniforms[3], 1, GL_TRUE, &mModelLightspace.m[0][0]);
-		gl.Uniform1i(local.shadowShader.uniforms[4], 0);
-		gl.Uniform3fv(local.shadowShader.uniforms[5], 1, &lightPosViewspace.x);
-		break;
-	}
-	case RD_DRAW_BLOOM:
-		gl.UseProgram(local.bloomShader.shaderProgram);
-		gl.UniformMatrix4fv(local.bloomShader.uniforms[0], 1, GL_TRUE, &obj->mMVP.m[0][0]);
-		break;
-	default:
-		return;
-	}
-
-	gl.BindVertexArray(obj->vertexArray);
-
-	if (obj->objectType == RD_OBJECT_INTERIOR)
-		gl.Disable(GL_CULL_FACE);
-
-	if (obj->isIndexed) {
-		gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj->indexBuffer);
-		gl.DrawElements(GL_TRIANGLES, obj->numIndices, GL_UNSIGNED_SHORT, NULL);
-	} else {
-		gl.DrawArrays(GL_TRIANGLES, 0, obj->numVertices);
-	}
-	
-	if (obj->objectType == RD_OBJECT_INTERIOR)
-		gl.Enable(GL_CULL_FACE);
-
-	if (draw == RD_DRAW_GBUFFER || draw == RD_DRAW_SHADOWS || draw == RD_DRAW_BLOOM) {
-		gl.DepthFunc(GL_LESS);
-		gl.DepthMask(GL_TRUE);
-	}
-	else if (draw == RD_DRAW_SHADOWMAP)
-		gl.CullFace(GL_BACK);
 
-	if (draw == RD_DRAW_SHADOWMAP)
-		gl.Viewport(0, 0, local.screenWidth, local.screenHeight);
-
-	if (draw == RD_DRAW_DEPTHVELOCITY) {
-		obj->_mPrevMVP = mMVPCopy;
-		obj->mPrevMVP = &obj->_mPrevMVP;
+		/* Out of memory the draw goes out now; with the depth tests the passes after the
+		 * prepass use, later draws in front of it still cover it */
+		if (!qu_Push(draw, obj))
+			rd_Draw(draw, obj);
 	}
-
-	obj->lastCameraPosition.x = local.defaultCamera.x;
-	obj->lastCameraPosition.y = local.defaultCamera.y;
-	obj->lastCameraPosition.z = local.defaultCamera.z;
-
-	obj->lastCameraYaw   = local.defaultCamera.yaw;
-	obj->lastCameraPitch = local.defaultCamera.pitch;
-
-	local.renderState = RD_RENDERSTATE_PARTIAL;
 }
 
 void rd_Frame(void)
@@ -989,18 +2097,6 @@ void rd_Frame(void)
 	{
 		rdVec2 aoResolution;
 
-		int numLights;
-
-		rdVec3 lightPositions[64];
-		rdVec3 lightColors[64];
-		rdVec3 lightProperties[64];
-		rdVec3 materialColors[64];
-		rdVec3 materialProperties[64];
-
-		rdVec3 viewspaceUp;
-
-		float reflectanceProperties[64];
-
 		float  randomInput;
 		rdVec3 lensFlareLightPos;
 		int    lensFlareEnabled;
@@ -1012,98 +2108,106 @@ void rd_Frame(void)
 
 	static int frontOrBackBuffer = 0;
 
-	/* Set stage variables */
-
-	stage.aoResolution = vc_Vec2(local.ssaoBuffer.width, local.ssaoBuffer.height);
+	st_StopTimer();
+	rd_EndOcclusionTest();
 
-	stage.numLights = 0;
+	/* What was submitted is drawn before anything reads the buffers */
+	qu_Execute();
 
-	for (int i = 0; i < 64; i++) {
-		stage.lightPositions[i]  = vc_Vec3(0.0f, 0.0f, 0.0f);
-		stage.lightColors[i]     = vc_Vec3(0.0f, 0.0f, 0.0f);
-		stage.lightProperties[i] = vc_Vec3(0.0f, 0.0f, 0.0f);
-	}
+	/* The camera may move before the next rasterization */
+	local.occluders.valid = 0;
 
-	for (int i = 0; i < 64; i++) {
-		rdLight *l;
+	/* Lights, materials and the projection are uploaded again only if they changed */
+	ub_Update(&local.uniformBlocks);
 
-		l = &local.lights[i];
+	/* Set stage variables */
 
-		if (l->enabled) {
-			int n = stage.numLights;
+	stage.aoResolution = vc_Vec2(local.ssaoBuffer.width, local.ssaoBuffer.height);
 
-			rdVec4 tmp, tmp2;
+	stage.resolution.x = local.screenWidth;
+	stage.resolution.y = local.screenHeight;
 
-			tmp = vc_Vec4(l->x, l->y, l->z, 1.0f);
-			tmp2 = mx_MultiVector4(&local.defaultCamera.mView, &tmp);
+	stage.randomInput       = ma_Random(0.0f, 100.0f);
+	stage.lensFlareEnabled  = 0;
+	stage.lensFlareLightPos = vc_Vec3(0.0f, 0.0f, 0.0f);
 
-			stage.lightPositions[n].x = tmp2.x;
-			stage.lightPositions[n].y = tmp2.y;
-			stage.lightPositions[n].z = tmp2.z;
 
-			stage.lightColors[n].x = l->red;
-			stage.lightColors[n].y = l->green;
-			stage.lightColors[n].z = l->blue;
+	/* Begin assembling final frame */
 
-			stage.lightProperties[n].x = l->intensity;
-			stage.lightProperties[n].y = l->cutoffRadius;
-			stage.lightProperties[n].z = l->upward;
+	gl.Disable(GL_DEPTH_TEST);
 
-			stage.numLights++;
-		}
-	}
+	/* The prepass is complete, so it can cull the next frame's objects. A pyramid skipped for a
+	 * frame would be stale by then. */
+	if (local.frameStats.gpuCullObjects > 0)
+		fb_BuildHiZBuffer(&local.hiZBuffer, &local.depthVelocityBuffer);
+	else
+		local.hiZBuffer.valid = 0;
 
-	for (int i = 0; i < 64; i++) {
-		rdMaterial *m;
-		rdVec3 *c, *p;
+	/* Shadow resolve pass */
 
-		m = &local.materials[i];
-		c = &stage.materialColors[i];
-		p = &stage.materialProperties[i];
+	{
+		const rdShadowReceivers *r = &local.shadowReceivers;
 
-		c->x = m->red;
-		c->y = m->green;
-		c->z = m->blue;
+		rdMat4 mInvView;
+		rdMat4 mLightspace[RD_SHADOW_RESOLVE_MAPS];
+		rdVec3 lightPositions[RD_SHADOW_RESOLVE_MAPS];
 
-		p->x = m->metalness;
-		p->y = m->roughness;
-		p->z = m->ambient;
-	}
+		/* ub_Update synced the camera */
+		mx_InvertRigid(&mInvView, &local.defaultCamera.mView);
 
-	{
-		rdMat3 mNormal;
+		for (int i = 0; i < r->numMaps; i++) {
+			const rdLight *l = &local.lights[r->maps[i]->originLightIndex];
 
-		rdVec3 up = vc_Vec3(0.0, 1.0f, 0.0f);
+			rdVec4 tmp, lightPosViewspace;
 
-		mNormal = mx_Mat3From4(&local.defaultCamera.mView);
-		mx_Invert3(&mNormal);
-		mx_Transpose3(&mNormal);
+			tmp               = vc_Vec4(l->x, l->y, l->z, 1.0f);
+			lightPosViewspace = mx_MultiVector4(&local.defaultCamera.mView, &tmp);
 
-		stage.viewspaceUp = mx_MultiVector3(&mNormal, &up);
-	}
+			mLightspace[i]    = r->maps[i]->mLightspace;
+			lightPositions[i] = vc_Vec3(lightPosViewspace.x, lightPosViewspace.y,
+			                            lightPosViewspace.z);
 
-	for (int i = 0; i < 64; i++) {
-		stage.reflectanceProperties[i] = local.materials[i].reflectance;
-	}
+			gl.ActiveTexture(GL_TEXTURE2 + i);
+			gl.BindTexture(GL_TEXTURE_2D, r->maps[i]->depthTexture);
+		}
 
-	stage.resolution.x = local.screenWidth;
-	stage.resolution.y = local.screenHeight;
+		gl.Viewport(0, 0, local.screenWidth, local.screenHeight);
 
-	stage.randomInput       = ma_Random(0.0f, 100.0f);
-	stage.lensFlareEnabled  = 0;
-	stage.lensFlareLightPos = vc_Vec3(0.0f, 0.0f, 0.0f);
+		gl.BindFramebuffer(GL_FRAMEBUFFER, local.shadowsBuffer.framebuf);
+		gh_BindVertexArray(local.screenQuad.vertexArray);
+
+		gl.UseProgram(local.shadowResolveShader.shaderProgram);
+		gl.Uniform1i(local.shadowResolveShader.uniforms[0], 0);
+		gl.Uniform1i(local.shadowResolveShader.uniforms[1], 1);
+		gl.UniformMatrix4fv(local.shadowResolveShader.uniforms[2], 1, GL_TRUE,
+		                    &local.mInvProjection.m[0][0]);
+		gl.UniformMatrix4fv(local.shadowResolveShader.uniforms[3], 1, GL_TRUE, &mInvView.m[0][0]);
+		gl.Uniform1i(local.shadowResolveShader.uniforms[4], r->numMaps);
+		if (r->numMaps > 0) {
+			gl.UniformMatrix4fv(local.shadowResolveShader.uniforms[5], r->numMaps, GL_TRUE,
+			                    &mLightspace[0].m[0][0]);
+			gl.Uniform3fv(local.shadowResolveShader.uniforms[6], r->numMaps, &lightPositions[0].x);
+			gl.Uniform3fv(local.shadowResolveShader.uniforms[7], r->numMaps, &r->min[0].x);
+			gl.Uniform3fv(local.shadowResolveShader.uniforms[8], r->numMaps, &r->max[0].x);
+		}
 
+		gl.ActiveTexture(GL_TEXTURE0);
+		gl.BindTexture(GL_TEXTURE_2D, local.depthVelocityBuffer.depthTexture);
+		gl.ActiveTexture(GL_TEXTURE1);
+		gl.BindTexture(GL_TEXTURE_2D, local.gBuffer.normalTexture);
 
-	/* Begin assembling final frame */
+		gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, local.screenQuad.indexBuffer);
+		gl.DrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, NULL);
 
-	gl.Disable(GL_DEPTH_TEST);
+		local.shadowReceivers.numMaps = 0;
+	}
 
 	/* SSAO pass */
 
 	gl.Viewport(0, 0, local.ssaoBuffer.width, local.ssaoBuffer.height);
 
 	gl.BindFramebuffer(GL_FRAMEBUFFER, local.ssaoBuffer.framebufRaw);
-	gl.BindVertexArray(local.screenQuad.vertexArray);
+	gh_BindVertexArray(local.screenQuad.vertexArray);
 
 	gl.UseProgram(local.ssaoShader.shaderProgram);
 	gl.Uniform1i(local.ssaoShader.uniforms[0], 3);
@@ -1127,7 +2231,7 @@ void rd_Frame(void)
 	/* SSAO blur */
 
 	gl.BindFramebuffer(GL_FRAMEBUFFER, local.ssaoBuffer.framebufBlur);
-	gl.BindVertexArray(local.screenQuad.vertexArray);
+	gh_BindVertexArray(local.screenQuad.vertexArray);
 
 	gl.UseProgram(local.blurSingleChannelShader.shaderProgram);
 	gl.Uniform1i(local.blurSingleChannelShader.uniforms[0], 0);
@@ -1145,7 +2249,7 @@ void rd_Frame(void)
 	gl.Viewport(0, 0, local.bloomBuffer.blurWidth, local.bloomBuffer.blurHeight);
 
 	gl.BindFramebuffer(GL_FRAMEBUFFER, local.bloomBuffer.framebufBlur1);
-	gl.BindVertexArray(local.screenQuad.vertexArray);
+	gh_BindVertexArray(local.screenQuad.vertexArray);
 
 	gl.UseProgram(local.gaussianBlurSingleChannelShader.shaderProgram);
 	gl.Uniform1i(local.gaussianBlurSingleChannelShader.uniforms[0], 0);
@@ -1158,7 +2262,7 @@ void rd_Frame(void)
 	gl.DrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, NULL);
 
 	gl.BindFramebuffer(GL_FRAMEBUFFER, local.bloomBuffer.framebufBlur2);
-	gl.BindVertexArray(local.screenQuad.vertexArray);
+	gh_BindVertexArray(local.screenQuad.vertexArray);
 
 	gl.UseProgram(local.gaussianBlurSingleChannelShader.shaderProgram);
 	gl.Uniform1i(local.gaussianBlurSingleChannelShader.uniforms[0], 0);
@@ -1171,7 +2275,7 @@ void rd_Frame(void)
 	gl.DrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, NULL);
 
 	gl.BindFramebuffer(GL_FRAMEBUFFER, local.bloomBuffer.framebufBlur1);
-	gl.BindVertexArray(local.screenQuad.vertexArray);
+	gh_BindVertexArray(local.screenQuad.vertexArray);
 
 	gl.UseProgram(local.gaussianBlurSingleChannelShader.shaderProgram);
 	gl.Uniform1i(local.gaussianBlurSingleChannelShader.uniforms[0], 0);
@@ -1188,7 +2292,7 @@ void rd_Frame(void)
 	/* Lighting */
 
 	gl.BindFramebuffer(GL_FRAMEBUFFER, local.colorBuffer.framebuf);
-	gl.BindVertexArray(local.screenQuad.vertexArray);
+	gh_BindVertexArray(local.screenQuad.vertexArray);
 
 	gl.UseProgram(local.lightingShader.shaderProgram);
 	gl.Uniform1i(local.lightingShader.uniforms[0], 5);
@@ -1198,16 +2302,6 @@ void rd_Frame(void)
 	gl.Uniform1i(local.lightingShader.uniforms[4], 4);
 	gl.Uniform1i(local.lightingShader.uniforms[5], 6);
 	gl.Uniform1i(local.lightingShader.uniforms[6], 7);
-	gl.UniformMatrix4fv(local.lightingShader.uniforms[7], 1, GL_TRUE,
-	                    &local.mInvProjection.m[0][0]);
-	gl.Uniform3fv(local.lightingShader.uniforms[8], 1, &stage.viewspaceUp.x);
-	gl.Uniform3fv(local.lightingShader.uniforms[9], 64, &stage.materialColors[0].x);
-	gl.Uniform3fv(local.lightingShader.uniforms[10], 64, &stage.materialProperties[0].x);
-
-	gl.Uniform1i(local.lightingShader.uniforms[11], stage.numLights);
-	gl.Uniform3fv(local.lightingShader.uniforms[12], 64, &stage.lightPositions[0].x);
-	gl.Uniform3fv(local.lightingShader.uniforms[13], 64, &stage.lightColors[0].x);
-	gl.Uniform3fv(local.lightingShader.uniforms[14], 64, &stage.lightProperties[0].x);
 
 	gl.ActiveTexture(GL_TEXTURE0);
 	gl.BindTexture(GL_TEXTURE_2D, local.gBuffer.materialIDTexture);
@@ -1232,16 +2326,13 @@ void rd_Frame(void)
 	gl.Viewport(0, 0, local.reflectionsBuffer.pixWidth, local.reflectionsBuffer.pixHeight);
 
 	gl.BindFramebuffer(GL_FRAMEBUFFER, local.reflectionsBuffer.framebuf);
-	gl.BindVertexArray(local.screenQuad.vertexArray);
+	gh_BindVertexArray(local.screenQuad.vertexArray);
 
 	gl.UseProgram(local.ssrShader.shaderProgram);
-	gl.UniformMatrix4fv(local.ssrShader.uniforms[0], 1, GL_TRUE, &local.mProjection.m[0][0]);
-	gl.UniformMatrix4fv(local.ssrShader.uniforms[1], 1, GL_TRUE, &local.mInvProjection.m[0][0]);
-	gl.Uniform1i(local.ssrShader.uniforms[2], 0);
-	gl.Uniform1i(local.ssrShader.uniforms[4], 1);
-	gl.Uniform1i(local.ssrShader.uniforms[5], 2);
-	gl.Uniform1i(local.ssrShader.uniforms[3], 3);
-	gl.Uniform1fv(local.ssrShader.uniforms[6], 64, &stage.reflectanceProperties[0]);
+	gl.Uniform1i(local.ssrShader.uniforms[0], 0);
+	gl.Uniform1i(local.ssrShader.uniforms[2], 1);
+	gl.Uniform1i(local.ssrShader.uniforms[3], 2);
+	gl.Uniform1i(local.ssrShader.uniforms[1], 3);
 
 	gl.ActiveTexture(GL_TEXTURE0);
 	gl.BindTexture(GL_TEXTURE_2D, local.depthVelocityBuffer.depthTexture);
@@ -1264,13 +2355,12 @@ void rd_Frame(void)
 	else
 		gl.BindFramebuffer(GL_FRAMEBUFFER, local.backBuffer.framebuf);
 
-	gl.BindVertexArray(local.screenQuad.vertexArray);
+	gh_BindVertexArray(local.screenQuad.vertexArray);
 
 	gl.UseProgram(local.compositeShader.shaderProgram);
 	gl.Uniform1i(local.compositeShader.uniforms[0], 0);
 	gl.Uniform1i(local.compositeShader.uniforms[1], 1);
 	gl.Uniform1i(local.compositeShader.uniforms[2], 2);
-	gl.Uniform1fv(local.compositeShader.uniforms[3], 64, &stage.reflectanceProperties[0]);
 	gl.ActiveTexture(GL_TEXTURE0);
 	gl.BindTexture(GL_TEXTURE_2D, local.colorBuffer.colorTexture);
 	gl.ActiveTexture(GL_TEXTURE1);
@@ -1284,7 +2374,7 @@ void rd_Frame(void)
 	/* TAA resolve + motion blur */
 
 	gl.BindFramebuffer(GL_FRAMEBUFFER, local.colorBuffer.framebuf);
-	gl.BindVertexArray(local.screenQuad.vertexArray);
+	gh_BindVertexArray(local.screenQuad.vertexArray);
 
 	gl.UseProgram(local.tAAResolveMotionBlurShader.shaderProgram);
 	gl.Uniform1i(local.tAAResolveMotionBlurShader.uniforms[0], 0);
@@ -1312,7 +2402,7 @@ void rd_Frame(void)
 	gl.DrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, NULL);
 
 	gl.BindFramebuffer(GL_FRAMEBUFFER, 0);
-	gl.BindVertexArray(local.screenQuad.vertexArray);
+	gh_BindVertexArray(local.screenQuad.vertexArray);
 
 	gl.UseProgram(local.postProcessShader.shaderProgram);
 	gl.Uniform1i(local.postProcessShader.uniforms[0], 0);
@@ -1331,6 +2421,11 @@ void rd_Frame(void)
 
 	local.renderState = RD_RENDERSTATE_FRESH;
 	frontOrBackBuffer = frontOrBackBuffer == 1;
+	local.frameIndex++;
+
+	st_EndFrame();
+
+	as_DrainUploads();
 }
 
 void rd_SetLight(int index, float x, float y, float z, float red, float green, float blue,
@@ -1353,6 +2448,8 @@ void rd_SetLight(int index, float x, float y, float z, float red, float green, f
 	l->intensity    = ma_Clamp(intensity, 0.01f, 1000.0f);
 	l->cutoffRadius = ma_Clamp(cutoffRadius, 0.01f, 1000.0f);
 	l->upward       = ma_Clamp(upward, 0.0f, 1.0f);
+
+	local.uniformBlocks.dirty |= 1u << RD_BLOCK_LIGHTS;
 }
 
 void rd_EnableLight(int index)
@@ -1360,6 +2457,7 @@ void rd_EnableLight(int index)
 	assert(index <= 64);
 
 	local.lights[index].enabled = 1;
+	local.uniformBlocks.dirty |= 1u << RD_BLOCK_LIGHTS;
 }
 
 void rd_DisableLight(int index)
@@ -1367,6 +2465,7 @@ void rd_DisableLight(int index)
 	assert(index <= 64);
 
 	local.lights[index].enabled = 0;
+	local.uniformBlocks.dirty |= 1u << RD_BLOCK_LIGHTS;
 }
 
 void rd_SetMaterial(int index, float red, float green, float blue, float metalness, float roughness,
@@ -1385,6 +2484,8 @@ void rd_SetMaterial(int index, float red, float green, float blue, float metalne
 
 	m->ambient     = ma_Clamp(ambient, 0.0f, 1.0f);
 	m->reflectance = ma_Clamp(reflectance, 0.0f, 1.0f);
+
+	local.uniformBlocks.dirty |= 1u << RD_BLOCK_MATERIALS;
 }
 
 rdShadowMap *rd_CreateShadowMap(int originLightIndex, int pixWidth, int pixHeight, float targetX,
@@ -1464,114 +2565,130 @@ void rd_AttachShadowMap(rdObject *obj, rdShadowMap *sm)
 
 	obj->sm = sm;
 	sm->numObjectsAttached++;
+
+	/* For mModelLightspace */
+	obj->update = 1;
 }
 
 rdObject *rd_CreateObject(int numVertices, const rdVertex *vertices, int numIndices,
-	                      const rdIndex *indices, rdObjectType objectType,
-	                      rdMaterialType materialType)
+                          const void *indices, rdIndexFormat indexFormat, rdObjectType objectType,
+                          rdMaterialType materialType, rdPositionFormat positionFormat)
 {
-	rdVec3    normals[numVertices];
 	rdObject *obj;
 
-	obj = mem.alloc(sizeof (*obj));
-	if (obj == NULL)
-		return NULL;
-
-	obj->parent    = NULL;
-	obj->numClones = 0;
-
-	obj->objectType   = objectType;
-	obj->materialType = materialType;
-	obj->materialID   = 0;
+	obj = me_CreateObject(numVertices, vertices, NULL, numIndices, indices, indexFormat,
+	                      objectType, materialType, positionFormat);
 
-	obj->numVertices = numVertices;
-	obj->numIndices  = numIndices;
+	ar_Reset(&local.scratch);
 
-	obj->posX  = obj->posY = obj->posZ = 0.0f;
-	obj->scale = 1.0f;
-	obj->rotX  = obj->rotY = obj->rotZ = 0.0f;
+	return obj;
+}
 
-	mx_Identity(&obj->mModel);
-	obj->update = 0;
-	if (indices)
-		obj->isIndexed = 1;
-	else
-		obj->isIndexed = 0;
+rdObject *rd_CreateObjectPrecomputed(int numVertices, const rdVertex *vertices,
+                                     const rdVertex *normals, int numIndices, const void *indices,
+                                     rdIndexFormat indexFormat, rdObjectType objectType,
+                                     rdMaterialType materialType, rdPositionFormat positionFormat)
+{
+	rdObject *obj;
 
-	obj->vertexBuffer = 0;
-	obj->normalBuffer = 0;
-	obj->indexBuffer  = 0;
-	obj->vertexArray  = 0;
+	obj = me_CreateObject(numVertices, vertices, normals, numIndices, indices, indexFormat,
+	                      objectType, materialType, positionFormat);
 
-	mx_Identity(&obj->mMVP);
+	ar_Reset(&local.scratch);
 
-	obj->mPrevMVP = NULL;
-	mx_Identity(&obj->_mPrevMVP);
+	return obj;
+}
 
-	if (indices)
-		me_GenerateNormalsIndexed(normals, numVertices, vertices, numIndices, indices);
-	else
-		me_GenerateNormalsNonIndexed(normals, numVertices, vertices);
+rdObject *rd_CreateObjectAsync(int numVertices, const rdVertex *vertices, int numIndices,
+                               const void *indices, rdIndexFormat indexFormat,
+                               rdObjectType objectType, rdMaterialType materialType,
+                               rdPositionFormat positionFormat)
+{
+	return as_QueueObject(numVertices, vertices, NULL, numIndices, indices, indexFormat,
+	                      objectType, materialType, positionFormat);
+}
 
-	if (objectType == RD_OBJECT_INTERIOR)
-		me_InvertNormals(normals, numVertices);
+rdObject *rd_CreateObjectPrecomputedAsync(int numVertices, const rdVertex *vertices,
+                                          const rdVertex *normals, int numIndices,
+                                          const void *indices, rdIndexFormat indexFormat,
+                                          rdObjectType objectType, rdMaterialType materialType,
+                                          rdPositionFormat positionFormat)
+{
+	return as_QueueObject(numVertices, vertices, normals, numIndices, indices, indexFormat,
+	                      objectType, materialType, positionFormat);
+}
 
-	gl.GenBuffers(1, &obj->vertexBuffer);
-	gl.BindBuffer(GL_ARRAY_BUFFER, obj->vertexBuffer);
-	gl.BufferData(GL_ARRAY_BUFFER, numVertices * 3 * sizeof (float), vertices, GL_STATIC_DRAW);
+rdObjectStatus rd_GetObjectStatus(const rdObject *obj)
+{
+	return obj->status;
+}
 
-	gl.GenBuffers(1, &obj->normalBuffer);
-	gl.BindBuffer(GL_ARRAY_BUFFER, obj->normalBuffer);
-	gl.BufferData(GL_ARRAY_BUFFER, numVertices * 3 * sizeof (float), normals, GL_STATIC_DRAW);
+int rd_GetObjectBounds(const rdObject *obj, float outMin[3], float outMax[3])
+{
+	const rdVec3 *c = &obj->worldCenter, *e = &obj->worldExtent;
 
-	if (indices != NULL) {
-		gl.GenBuffers(1, &obj->indexBuffer);
-		gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj->indexBuffer);
-		gl.BufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices * sizeof (unsigned short), indices,
-		              GL_STATIC_DRAW);
-	}
+	if (e->x < 0.0f)
+		return 0;
 
-	gl.GenVertexArrays(1, &obj->vertexArray);
-	gl.BindVertexArray(obj->vertexArray);
-	gl.BindBuffer(GL_ARRAY_BUFFER, obj->vertexBuffer);
-	gl.VertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-	gl.BindBuffer(GL_ARRAY_BUFFER, obj->normalBuffer);
-	gl.VertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-	gl.EnableVertexAttribArray(0);
-	gl.EnableVertexAttribArray(1);
+	outMin[0] = c->x - e->x;
+	outMin[1] = c->y - e->y;
+	outMin[2] = -(c->z + e->z);
+	outMax[0] = c->x + e->x;
+	outMax[1] = c->y + e->y;
+	outMax[2] = -(c->z - e->z);
 
-	obj->lastCameraPosition = vc_Vec3(0.0f, 0.0f, 0.0f);
-	obj->lastCameraYaw = 0.0f;
-	obj->lastCameraPitch = 0.0f;
+	return 1;
+}
 
-	obj->jitterIndex = -1;
+int rd_GenerateNormals(rdVertex *outNormals, int numVertices, const rdVertex *vertices,
+                       int numIndices, const void *indices, rdIndexFormat indexFormat,
+                       rdObjectType objectType)
+{
+	int ok;
 
-	obj->sm = NULL;
+	ok = me_GenerateNormals(&local.scratch, (rdVec3 *) outNormals, numVertices, vertices,
+	                        numIndices, indices, indexFormat, objectType);
+	ar_Reset(&local.scratch);
 
-	return obj;
+	return ok;
 }
 
 void rd_DestroyObject(rdObject *obj)
 {
 	assert(obj->numClones == 0);
 
-	gl.DeleteVertexArrays(1, &obj->vertexArray);
-	gl.DeleteBuffers(1, &obj->vertexBuffer);
-	gl.DeleteBuffers(1, &obj->normalBuffer);
+	if (obj->job != NULL)
+		as_CancelJob(obj->job);
+
+	if (obj->cullList != NULL)
+		rd_RemoveFromCullList(obj);
+	if (obj->bvh != NULL)
+		rd_RemoveFromBvh(obj);
 
-	if (obj->isIndexed)
-		gl.DeleteBuffers(1, &obj->indexBuffer);
+	if (obj->geometry != NULL && --obj->geometry->refCount == 0)
+		gh_Free(obj->geometry);
 
 	if (obj->sm)
 		obj->sm->numObjectsAttached--;
 
+	for (int i = 0; i < local.queue.numItems; i++) {
+		if (local.queue.items[i].obj == obj)
+			local.queue.items[i].obj = NULL;
+	}
+
 	mem.free(obj);
+
+	/* Defragmentation sorts in scratch memory */
+	ar_Reset(&local.scratch);
 }
 
 rdObject *rd_CloneObject(rdObject *original)
 {
 	rdObject *obj;
 
+	/* Clones share the original's geometry, so there has to be some */
+	assert(original->status == RD_OBJECT_RESIDENT);
+
 	obj = mem.alloc(sizeof (*obj));
 	if (obj == NULL)
 		return NULL;
@@ -1599,21 +2716,40 @@ rdObject *rd_CloneObject(rdObject *original)
 	obj->mModel = original->mModel;
 	obj->update = original->update;
 
-	obj->isIndexed = original->isIndexed;
+	obj->isIndexed    = original->isIndexed;
+	obj->isFlatShaded = original->isFlatShaded;
+
+	obj->geometry = original->geometry;
+	obj->geometry->refCount++;
+
+	obj->status = RD_OBJECT_RESIDENT;
+	obj->job    = NULL;
 
-	obj->vertexBuffer = original->vertexBuffer;
-	obj->normalBuffer = original->normalBuffer;
-	obj->indexBuffer  = original->indexBuffer;
-	obj->vertexArray  = original->vertexArray;
+	obj->boundsCenter = original->boundsCenter;
+	obj->boundsExtent = original->boundsExtent;
+	obj->boundsRadius = original->boundsRadius;
+
+	obj->worldCenter = original->worldCenter;
+	obj->worldExtent = original->worldExtent;
+	obj->worldRadius = original->worldRadius;
+
+	obj->cullList  = NULL;
+	obj->cullIndex = -1;
+
+	obj->bvh      = NULL;
+	obj->bvhIndex = -1;
 
 	obj->mMVP      = original->mMVP;
 	obj->_mPrevMVP = original->_mPrevMVP;
 
 	obj->mPrevMVP = &obj->_mPrevMVP;
+	obj->velocityFrame = original->velocityFrame;
 
-	obj->lastCameraPosition = original->lastCameraPosition;
-	obj->lastCameraYaw = original->lastCameraYaw;
-	obj->lastCameraPitch = original->lastCameraPitch;
+	obj->mModelView       = original->mModelView;
+	obj->mNormal          = original->mNormal;
+	obj->mModelLightspace = original->mModelLightspace;
+	obj->cameraVersion    = original->cameraVersion;
+	obj->viewspaceVersion = original->viewspaceVersion;
 
 	obj->jitterIndex = original->jitterIndex;
 
@@ -1630,6 +2766,11 @@ void rd_SetObjectMaterial(rdObject *obj, int materialID)
 	obj->materialID = materialID;
 }
 
+void rd_SetObjectFlatShaded(rdObject *obj, int flatShaded)
+{
+	obj->isFlatShaded = flatShaded;
+}
+
 void rd_ResetObject(rdObject *obj)
 {
 	obj->update = 1;
@@ -1637,6 +2778,8 @@ void rd_ResetObject(rdObject *obj)
 	obj->posX  = obj->posY = obj->posZ = 0.0f;
 	obj->scale = 1.0f;
 	obj->rotX  = obj->rotY = obj->rotZ = 0.0f;
+
+	me_UpdateTransform(obj);
 }
 
 void rd_PositionObject(rdObject *obj, float x, float y, float z)
@@ -1646,6 +2789,8 @@ void rd_PositionObject(rdObject *obj, float x, float y, float z)
 	obj->posX = x;
 	obj->posY = y;
 	obj->posZ = z;
+
+	me_UpdateTransform(obj);
 }
 
 void rd_MoveObject(rdObject *obj, float x, float y, float z)
@@ -1655,6 +2800,8 @@ void rd_MoveObject(rdObject *obj, float x, float y, float z)
 	obj->posX += x;
 	obj->posY += y;
 	obj->posZ += z;
+
+	me_UpdateTransform(obj);
 }
 
 void rd_ScaleObject(rdObject *obj, float scale)
@@ -1662,6 +2809,8 @@ void rd_ScaleObject(rdObject *obj, float scale)
 	obj->update = 1;
 
 	obj->scale = scale;
+
+	me_UpdateTransform(obj);
 }
 
 void rd_OrientObject(rdObject *obj, float x, float y, float z)
@@ -1671,6 +2820,8 @@ void rd_OrientObject(rdObject *obj, float x, float y, float z)
 	obj->rotX = ma_WrapAngle(x);
 	obj->rotY = ma_WrapAngle(y);
 	obj->rotZ = ma_WrapAngle(z);
+
+	me_UpdateTransform(obj);
 }
 
 void rd_RotateObject(rdObject *obj, float x, float y, float z)
@@ -1680,64 +2831,551 @@ void rd_RotateObject(rdObject *obj, float x, float y, float z)
 	obj->rotX = ma_WrapAngle(obj->rotX + x);
 	obj->rotY = ma_WrapAngle(obj->rotY + y);
 	obj->rotZ = ma_WrapAngle(obj->rotZ + z);
+
+	me_UpdateTransform(obj);
 }
 
-void rd_ResetDefaultCamera(void)
+rdCullList *rd_CreateCullList(int capacity)
 {
-	local.defaultCamera.update = 1;
+	rdCullList *list;
+	int         padded;
+	float      *arrays;
 
-	local.defaultCamera.x = local.defaultCamera.y = local.defaultCamera.z = 0.0f;
-	local.defaultCamera.yaw   = 0.0f;
-	local.defaultCamera.pitch = 0.0f;
+	assert(capacity > 0);
+
+	padded = (capacity + RD_CULL_WIDTH - 1) / RD_CULL_WIDTH * RD_CULL_WIDTH;
+
+	list = mem.alloc(sizeof (*list) + capacity * sizeof (rdObject *) +
+	                 6 * padded * sizeof (float));
+	if (list == NULL)
+		return NULL;
+
+	list->numObjects = 0;
+	list->capacity   = capacity;
+	list->objects    = (rdObject **) (list + 1);
+
+	/* The padding is tested along with the last step, so it has to hold numbers */
+	arrays = (float *) (list->objects + capacity);
+	memset(arrays, 0, 6 * padded * sizeof (float));
+
+	list->centerX = arrays;
+	list->centerY = arrays + padded;
+	list->centerZ = arrays + padded * 2;
+	list->extentX = arrays + padded * 3;
+	list->extentY = arrays + padded * 4;
+	list->extentZ = arrays + padded * 5;
+
+	list->records        = NULL;
+	list->dirtyFirst     = 0;
+	list->dirtyEnd       = 0;
+	list->geometryMoves  = 0;
+	list->gpuCullFrame   = 0;
+	list->gpuCullObjects = 0;
+
+	return list;
 }
 
-void rd_PositionDefaultCamera(float x, float y, float z)
+void rd_DestroyCullList(rdCullList *list)
 {
-	local.defaultCamera.update = 1;
+	for (int i = 0; i < list->numObjects; i++) {
+		list->objects[i]->cullList  = NULL;
+		list->objects[i]->cullIndex = -1;
+	}
 
-	local.defaultCamera.x = x;
-	local.defaultCamera.y = y;
-	local.defaultCamera.z = z;
+	if (list->records != NULL) {
+		if (local.boundVertexArray == list->vertexArray)
+			local.boundVertexArray = 0;
+
+		gl.DeleteVertexArrays(1, &list->vertexArray);
+		gl.DeleteBuffers(1, &list->recordBuffer);
+		gl.DeleteBuffers(1, &list->commandBuffer);
+		mem.free(list->records);
+	}
+
+	mem.free(list);
 }
 
-void rd_MoveDefaultCamera(float x, float y, float z)
+void rd_AddToCullList(rdCullList *list, rdObject *obj)
 {
-	local.defaultCamera.update = 1;
+	assert(list->numObjects < list->capacity);
+	assert(obj->cullList == NULL);
 
-	local.defaultCamera.x += x;
-	local.defaultCamera.y += y;
-	local.defaultCamera.z += z;
+	obj->cullList  = list;
+	obj->cullIndex = list->numObjects;
+
+	list->objects[list->numObjects] = obj;
+	cu_StoreBounds(list, list->numObjects, obj);
+	list->numObjects++;
 }
 
-void rd_MoveDefaultCameraFacingDirection(float right, float forward)
+void rd_RemoveFromCullList(rdObject *obj)
 {
-	float turnX, turnZ;
-	float yaw = local.defaultCamera.yaw - 90.0f;
+	rdCullList *list = obj->cullList;
+	float      *arrays[6];
+	int         index, tail;
 
-	local.defaultCamera.update = 1;
+	assert(list != NULL);
 
-	turnX = cosf(ma_ToRadians(yaw));
-	turnZ = sinf(ma_ToRadians(yaw));
+	arrays[0] = list->centerX;
+	arrays[1] = list->centerY;
+	arrays[2] = list->centerZ;
+	arrays[3] = list->extentX;
+	arrays[4] = list->extentY;
+	arrays[5] = list->extentZ;
 
-	local.defaultCamera.x +=  forward * turnX - right * turnZ;
-	local.defaultCamera.z += -forward * turnZ - right * turnX;
+	/* Shifting rather than swapping in the last object keeps the order rd_CullObjects reports in */
+	index = obj->cullIndex;
+	tail  = list->numObjects - index - 1;
+
+	memmove(&list->objects[index], &list->objects[index + 1], tail * sizeof (rdObject *));
+	for (int i = 0; i < 6; i++)
+		memmove(&arrays[i][index], &arrays[i][index + 1], tail * sizeof (float));
+
+	list->numObjects--;
+
+	for (int i = index; i < list->numObjects; i++)
+		list->objects[i]->cullIndex = i;
+	cu_MarkDirty(list, index, list->numObjects);
+
+	obj->cullList  = NULL;
+	obj->cullIndex = -1;
 }
 
-void rd_OrientDefaultCamera(float yaw, float pitch)
+int rd_CullObjects(const rdCullList *list, unsigned char *outVisible)
 {
-	local.defaultCamera.update = 1;
+	rdVec4 planes[6];
 
-	local.defaultCamera.yaw   = ma_WrapAngle(yaw);
-	local.defaultCamera.pitch = ma_WrapAngle(pitch);
+	cu_CameraPlanes(planes);
+
+	return cu_TestBoxes(list, planes, 6, outVisible);
 }
 
-void rd_RotateDefaultCamera(float yaw, float pitch)
+int rd_CullShadowCasters(const rdCullList *list, const rdShadowMap *sm, unsigned char *outVisible)
 {
-	local.defaultCamera.update = 1;
+	rdVec4 planes[RD_CULL_MAX_PLANES];
+	int    numVisible;
 
-	local.defaultCamera.yaw   = ma_WrapAngle(local.defaultCamera.yaw + yaw);
-	local.defaultCamera.pitch = ma_WrapAngle(local.defaultCamera.pitch + pitch);
-	local.defaultCamera.pitch = ma_Clamp(local.defaultCamera.pitch, -89.9999f, 89.9999f);
+	numVisible = cu_TestBoxes(list, planes, cu_ShadowCasterPlanes(planes, sm), outVisible);
+
+	local.frameStats.shadowCastersTested += list->numObjects;
+	local.frameStats.shadowCastersCulled += list->numObjects - numVisible;
+
+	return numVisible;
+}
+
+int rd_BeginOcclusionTest(const rdCullList *list)
+{
+	rdVec3 center, extent;
+	GLuint query;
+
+	assert(!local.occlusionTesting);
+
+	if (!cu_OcclusionBox(list, &center, &extent))
+		return 0;
+
+	query = cu_DrawOcclusionBox(&center, &extent, list->numObjects);
+	if (query == 0)
+		return 0;
+
+	/* The GPU waits for the result, the CPU carries on */
+	gl.BeginConditionalRender(query, GL_QUERY_WAIT);
+	local.occlusionTesting = 1;
+
+	return 1;
+}
+
+int rd_SubmitOcclusionTest(const rdCullList *list)
+{
+	rdQueue     *q = &local.queue;
+	rdQueueTest *test;
+
+	assert(!local.occlusionTesting && q->testing == 0);
+
+	if (q->numTests == RD_OCCLUSION_TESTS)
+		return 0;
+
+	test = &q->tests[q->numTests];
+	if (!cu_OcclusionBox(list, &test->center, &test->extent))
+		return 0;
+
+	test->numObjects = list->numObjects;
+	test->issued     = 0;
+	test->query      = 0;
+
+	q->numTests++;
+	q->testing = q->numTests;
+
+	return 1;
+}
+
+void rd_EndOcclusionTest(void)
+{
+	local.queue.testing = 0;
+
+	if (!local.occlusionTesting)
+		return;
+
+	gl.EndConditionalRender();
+	local.occlusionTesting = 0;
+}
+
+void rd_AddOccluder(rdObject *obj)
+{
+	rdOccluders *oc = &local.occluders;
+
+	assert(obj->objectType == RD_OBJECT_INTERIOR);
+
+	if (obj->status != RD_OBJECT_RESIDENT || obj->geometry->occluder == NULL)
+		return;
+
+	if (oc->numQueued == oc->queueCapacity) {
+		const int  capacity = oc->queueCapacity > 0 ? 2 * oc->queueCapacity : 64;
+		rdObject **queued;
+
+		/* Dropping the occluder only makes culling less effective */
+		queued = mem.alloc(capacity * sizeof (*queued));
+		if (queued == NULL)
+			return;
+
+		if (oc->numQueued > 0)
+			memcpy(queued, oc->queued, oc->numQueued * sizeof (*queued));
+		mem.free(oc->queued);
+
+		oc->queued        = queued;
+		oc->queueCapacity = capacity;
+	}
+
+	oc->queued[oc->numQueued++] = obj;
+}
+
+void rd_RasterizeOccluders(void)
+{
+	rdOccluders    *oc = &local.occluders;
+	struct timespec start, end;
+
+	timespec_get(&start, TIME_UTC);
+
+	oc->valid = 0;
+
+	if (!oc_Start(oc)) {
+		oc->numQueued = 0;
+		return;
+	}
+
+	if (local.defaultCamera.update)
+		cm_SyncViewMatrix(&local.defaultCamera);
+
+	/* Unjittered, the buffer is too coarse for the jitter to matter */
+	mx_MultiAB(&oc->mViewProjection, &local.mProjection, &local.defaultCamera.mView);
+
+	oc->numTriangles = 0;
+	for (int i = 0; i < oc->numQueued; i++)
+		oc_AddTriangles(oc, oc->queued[i]);
+	oc->numQueued = 0;
+
+	ar_Reset(&local.scratch);
+
+	pthread_mutex_lock(&oc->lock);
+	oc->nextBand = 0;
+	oc->pending  = oc->numThreads;
+	oc->generation++;
+	pthread_cond_broadcast(&oc->wake);
+	pthread_mutex_unlock(&oc->lock);
+
+	oc_RasterizeBands(oc);
+
+	pthread_mutex_lock(&oc->lock);
+	while (oc->pending > 0)
+		pthread_cond_wait(&oc->done, &oc->lock);
+	pthread_mutex_unlock(&oc->lock);
+
+	oc->valid = 1;
+
+	timespec_get(&end, TIME_UTC);
+
+	local.frameStats.occluderTriangles    += oc->numTriangles;
+	local.frameStats.occluderMilliseconds += (end.tv_sec - start.tv_sec) * 1.0e3 +
+	                                         (end.tv_nsec - start.tv_nsec) / 1.0e6;
+}
+
+int rd_CullOccludedObjects(const rdCullList *list, unsigned char *inOutVisible)
+{
+	const rdOccluders *oc = &local.occluders;
+
+	int numVisible = 0;
+
+	for (int i = 0; i < list->numObjects; i++) {
+		rdVec3 center, extent;
+
+		if (!inOutVisible[i])
+			continue;
+
+		center = vc_Vec3(list->centerX[i], list->centerY[i], list->centerZ[i]);
+		extent = vc_Vec3(list->extentX[i], list->extentY[i], list->extentZ[i]);
+
+		/* Occluders would be tested against themselves */
+		if (oc->valid && extent.x >= 0.0f &&
+		    list->objects[i]->objectType != RD_OBJECT_INTERIOR) {
+			local.frameStats.occluderObjectsTested++;
+
+			if (oc_IsOccluded(oc, &center, &extent)) {
+				local.frameStats.occluderObjectsCulled++;
+				inOutVisible[i] = 0;
+				continue;
+			}
+		}
+
+		numVisible++;
+	}
+
+	return numVisible;
+}
+
+void rd_CullObjectsOnGpu(rdCullList *list)
+{
+	const rdShader *shader = &local.cullShader;
+	const rdMat4   *mView  = &local.defaultCamera.mView;
+
+	rdVec4 planes[6], viewDepthRow;
+	rdVec2 screenSize;
+	float  pixelScale;
+
+	if (list->numObjects == 0)
+		return;
+
+	/* Without the buffers, rd_Draw keeps drawing the list's objects directly */
+	if (list->records == NULL && !cu_SetupGpuList(list))
+		return;
+
+	if (list->geometryMoves != local.geometryMoves) {
+		cu_MarkDirty(list, 0, list->numObjects);
+		list->geometryMoves = local.geometryMoves;
+	}
+
+	/* Removing objects can leave the range past the end */
+	if (list->dirtyEnd > list->numObjects)
+		list->dirtyEnd = list->numObjects;
+
+	if (list->dirtyFirst < list->dirtyEnd) {
+		for (int i = list->dirtyFirst; i < list->dirtyEnd; i++)
+			cu_FillRecord(&list->records[i], list->objects[i]);
+
+		gl.BindBuffer(GL_ARRAY_BUFFER, list->recordBuffer);
+		gl.BufferSubData(GL_ARRAY_BUFFER, list->dirtyFirst * sizeof (rdGpuCullRecord),
+		                 (list->dirtyEnd - list->dirtyFirst) * sizeof (rdGpuCullRecord),
+		                 &list->records[list->dirtyFirst]);
+	}
+	list->dirtyFirst = list->dirtyEnd = 0;
+
+	/* cu_CameraPlanes syncs the view matrix, the level is picked from it as in lo_SelectLod */
+	cu_CameraPlanes(planes);
+
+	viewDepthRow = vc_Vec4(mView->m[2][0], mView->m[2][1], mView->m[2][2], mView->m[2][3]);
+	pixelScale   = local.mProjection.m[1][1] * local.screenHeight * 0.5f;
+	screenSize   = vc_Vec2(local.screenWidth, local.screenHeight);
+
+	st_StopTimer();
+
+	gl.UseProgram(shader->shaderProgram);
+	gl.Uniform4fv(shader->uniforms[0], 6, &planes[0].x);
+	gl.Uniform4fv(shader->uniforms[1], 1, &viewDepthRow.x);
+	gl.Uniform1f(shader->uniforms[2], pixelScale);
+	gl.Uniform1f(shader->uniforms[3], RD_LOD_PIXEL_ERROR);
+	gl.UniformMatrix4fv(shader->uniforms[4], 1, GL_TRUE, &local.hiZBuffer.mViewProjection.m[0][0]);
+	gl.Uniform1i(shader->uniforms[5], 0);
+	gl.Uniform1i(shader->uniforms[6], local.hiZBuffer.valid ? local.hiZBuffer.numLevels : 0);
+	gl.Uniform2fv(shader->uniforms[7], 1, &screenSize.x);
+
+	gl.ActiveTexture(GL_TEXTURE0);
+	gl.BindTexture(GL_TEXTURE_2D, local.hiZBuffer.depthTexture);
+
+	gh_BindVertexArray(list->vertexArray);
+	gl.BindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, list->commandBuffer);
+
+	gl.Enable(GL_RASTERIZER_DISCARD);
+	gl.BeginTransformFeedback(GL_POINTS);
+	gl.DrawArrays(GL_POINTS, 0, list->numObjects);
+	gl.EndTransformFeedback();
+	gl.Disable(GL_RASTERIZER_DISCARD);
+
+	gl.BindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+
+	list->gpuCullFrame   = local.frameIndex + 1;
+	list->gpuCullObjects = list->numObjects;
+
+	local.frameStats.gpuCullObjects += list->numObjects;
+}
+
+rdBvh *rd_CreateBvh(void)
+{
+	rdBvh *bvh;
+
+	bvh = mem.alloc(sizeof (*bvh));
+	if (bvh == NULL)
+		return NULL;
+
+	memset(bvh, 0, sizeof (*bvh));
+
+	return bvh;
+}
+
+void rd_DestroyBvh(rdBvh *bvh)
+{
+	for (int i = 0; i < bvh->numObjects; i++) {
+		bvh->objects[i]->bvh      = NULL;
+		bvh->objects[i]->bvhIndex = -1;
+	}
+
+	mem.free(bvh->nodes);
+	mem.free(bvh);
+}
+
+void rd_AddToBvh(rdBvh *bvh, rdObject *obj)
+{
+	assert(obj->bvh == NULL);
+
+	/* Without the room the object is left out, and found by no query */
+	if (bvh->numObjects == bvh->capacity &&
+	    !bv_Reserve(bvh, bvh->capacity > 0 ? 2 * bvh->capacity : 64))
+		return;
+
+	bvh->rebuild = 1;
+
+	obj->bvh      = bvh;
+	obj->bvhIndex = bvh->numObjects;
+
+	bvh->objects[bvh->numObjects] = obj;
+	bvh->moved[bvh->numObjects]   = 0;
+	bv_StoreBounds(bvh, bvh->numObjects, obj);
+	bvh->numObjects++;
+}
+
+void rd_RemoveFromBvh(rdObject *obj)
+{
+	rdBvh *bvh = obj->bvh;
+	int    index, last;
+
+	assert(bvh != NULL);
+
+	/* The tree is rebuilt anyway, so the last object can take the slot */
+	index = obj->bvhIndex;
+	last  = --bvh->numObjects;
+
+	bvh->objects[index] = bvh->objects[last];
+	bvh->boxMin[index]  = bvh->boxMin[last];
+	bvh->boxMax[index]  = bvh->boxMax[last];
+	bvh->objects[index]->bvhIndex = index;
+
+	bvh->rebuild = 1;
+
+	obj->bvh      = NULL;
+	obj->bvhIndex = -1;
+}
+
+void rd_UpdateBvh(rdBvh *bvh)
+{
+	bv_Update(bvh);
+}
+
+int rd_QueryBvhFrustum(rdBvh *bvh, rdObject **outObjects, int maxObjects)
+{
+	rdBvhQuery q;
+
+	q.shape = RD_BVH_FRUSTUM;
+	cu_CameraPlanes(q.planes);
+
+	return bv_Query(bvh, &q, outObjects, maxObjects);
+}
+
+int rd_QueryBvhBox(rdBvh *bvh, float minX, float minY, float minZ, float maxX, float maxY,
+                   float maxZ, rdObject **outObjects, int maxObjects)
+{
+	rdBvhQuery q;
+
+	q.shape = RD_BVH_BOX;
+	q.min   = vc_Vec3(minX, minY, -maxZ);
+	q.max   = vc_Vec3(maxX, maxY, -minZ);
+
+	return bv_Query(bvh, &q, outObjects, maxObjects);
+}
+
+int rd_QueryBvhSphere(rdBvh *bvh, float x, float y, float z, float radius,
+                      rdObject **outObjects, int maxObjects)
+{
+	rdBvhQuery q;
+
+	q.shape  = RD_BVH_SPHERE;
+	q.min    = vc_Vec3(x, y, -z);
+	q.radius = radius;
+
+	return bv_Query(bvh, &q, outObjects, maxObjects);
+}
+
+rdObject *rd_RaycastBvh(rdBvh *bvh, float x, float y, float z, float dirX, float dirY, float dirZ,
+                        float maxDistance, float *outDistance)
+{
+	const rdVec3 origin = vc_Vec3(x, y, -z);
+	const rdVec3 dir    = vc_Vec3(dirX, dirY, -dirZ);
+
+	return bv_Raycast(bvh, &origin, &dir, maxDistance, outDistance);
+}
+
+void rd_ResetDefaultCamera(void)
+{
+	local.defaultCamera.update = 1;
+
+	local.defaultCamera.x = local.defaultCamera.y = local.defaultCamera.z = 0.0f;
+	local.defaultCamera.yaw   = 0.0f;
+	local.defaultCamera.pitch = 0.0f;
+}
+
+void rd_PositionDefaultCamera(float x, float y, float z)
+{
+	local.defaultCamera.update = 1;
+
+	local.defaultCamera.x = x;
+	local.defaultCamera.y = y;
+	local.defaultCamera.z = z;
+}
+
+void rd_MoveDefaultCamera(float x, float y, float z)
+{
+	local.defaultCamera.update = 1;
+
+	local.defaultCamera.x += x;
+	local.defaultCamera.y += y;
+	local.defaultCamera.z += z;
+}
+
+void rd_MoveDefaultCameraFacingDirection(float right, float forward)
+{
+	float turnX, turnZ;
+	float yaw = local.defaultCamera.yaw - 90.0f;
+
+	local.defaultCamera.update = 1;
+
+	turnX = cosf(ma_ToRadians(yaw));
+	turnZ = sinf(ma_ToRadians(yaw));
+
+	local.defaultCamera.x +=  forward * turnX - right * turnZ;
+	local.defaultCamera.z += -forward * turnZ - right * turnX;
+}
+
+void rd_OrientDefaultCamera(float yaw, float pitch)
+{
+	local.defaultCamera.update = 1;
+
+	local.defaultCamera.yaw   = ma_WrapAngle(yaw);
+	local.defaultCamera.pitch = ma_WrapAngle(pitch);
+}
+
+void rd_RotateDefaultCamera(float yaw, float pitch)
+{
+	local.defaultCamera.update = 1;
+
+	local.defaultCamera.yaw   = ma_WrapAngle(local.defaultCamera.yaw + yaw);
+	local.defaultCamera.pitch = ma_WrapAngle(local.defaultCamera.pitch + pitch);
+	local.defaultCamera.pitch = ma_Clamp(local.defaultCamera.pitch, -89.9999f, 89.9999f);
 }
 
 void rd_GetDefaultCameraPosition(float *x, float *y, float *z)
@@ -1758,6 +3396,21 @@ void rd_GetDefaultCameraOrientation(float *yaw, float *pitch)
 		*pitch = local.defaultCamera.pitch;
 }
 
+void rd_GetDefaultCameraFrustum(float outPlanes[6][4])
+{
+	rdVec4 planes[6];
+
+	cu_CameraPlanes(planes);
+
+	/* Positions come in with z flipped */
+	for (int i = 0; i < 6; i++) {
+		outPlanes[i][0] =  planes[i].x;
+		outPlanes[i][1] =  planes[i].y;
+		outPlanes[i][2] = -planes[i].z;
+		outPlanes[i][3] =  planes[i].w;
+	}
+}
+
 static void cm_ResetCamera(rdCamera *cam)
 {
 	cam->update = 1;
@@ -1771,6 +3424,7 @@ static void cm_SyncViewMatrix(rdCamera *cam)
 {
 	float       yawRadians, pitchRadians;
 	rdVec3      up, position, center, turn;
+	rdMat4      mView;
 
 	yawRadians   = ma_ToRadians(cam->yaw - 90.0f);
 	pitchRadians = ma_ToRadians(cam->pitch);
@@ -1784,16 +3438,36 @@ static void cm_SyncViewMatrix(rdCamera *cam)
 
 	center = vc_Add(&position, &turn);
 
-	mx_LookAt(&cam->mView, &position, &center, &up);
+	mx_LookAt(&mView, &position, &center, &up);
+
+	if (memcmp(&mView, &cam->mView, sizeof (mView)) != 0) {
+		cam->mView = mView;
+		cam->version++;
+	}
 }
 
-static int cm_CheckCameraAttributes(const rdCamera *cam, const rdVec3 *pos, float yaw, float pitch)
+/* Moves the projection on to the next subpixel offset, once at the start of a frame */
+static void cm_AdvanceJitter(void)
 {
-	if (cam->yaw != yaw || cam->pitch != pitch)
-		return 0;
-	if (cam->x != pos->x || cam->y != pos->y || cam->z != pos->z)
-		return 0;
-	return 1;
+	float haltonX = 2.0f * ma_Halton(local.jitterIndex + 1, 2) - 1.0f;
+	float haltonY = 2.0f * ma_Halton(local.jitterIndex + 1, 3) - 1.0f;
+
+	float jitterX = (haltonX / local.screenWidth);
+	float jitterY = (haltonY / local.screenHeight);
+
+	local.mProjectionJitter = local.mProjection;
+
+	local.mProjectionJitter.m[0][2] += jitterX;
+	local.mProjectionJitter.m[1][2] += jitterY;
+
+	local.prevJitter = local.currJitter;
+	local.currJitter.x = jitterX;
+	local.currJitter.y = jitterY;
+
+	local.jitterIndex++;
+	local.jitterIndex = local.jitterIndex % 8;
+
+	local.renderState = RD_RENDERSTATE_PARTIAL;
 }
 
 static void fb_SetupQuad(rdQuad *quad)
@@ -1819,7 +3493,7 @@ static void fb_SetupQuad(rdQuad *quad)
 	gl.BufferData(GL_ELEMENT_ARRAY_BUFFER, 6 * sizeof (unsigned short), indices, GL_STATIC_DRAW);
 
 	gl.GenVertexArrays(1, &quad->vertexArray);
-	gl.BindVertexArray(quad->vertexArray);
+	gh_BindVertexArray(quad->vertexArray);
 	gl.BindBuffer(GL_ARRAY_BUFFER, quad->vertexBuffer);
 	gl.VertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
 	gl.BindBuffer(GL_ARRAY_BUFFER, quad->uvBuffer);
@@ -1836,6 +3510,39 @@ static void fb_DestroyQuad(rdQuad *quad)
 	gl.DeleteBuffers(1, &quad->indexBuffer);
 }
 
+static void fb_SetupBox(rdBox *box)
+{
+	const float vertices[] = { -1.0f, -1.0f, -1.0f,  1.0f, -1.0f, -1.0f,
+	                           -1.0f,  1.0f, -1.0f,  1.0f,  1.0f, -1.0f,
+	                           -1.0f, -1.0f,  1.0f,  1.0f, -1.0f,  1.0f,
+	                           -1.0f,  1.0f,  1.0f,  1.0f,  1.0f,  1.0f };
+
+	/* Winding doesn't matter, faces aren't culled */
+	const unsigned short indices[] = { 0, 1, 3, 3, 2, 0,  4, 6, 7, 7, 5, 4,
+	                                   0, 2, 6, 6, 4, 0,  1, 5, 7, 7, 3, 1,
+	                                   0, 4, 5, 5, 1, 0,  2, 3, 7, 7, 6, 2 };
+
+	gl.GenBuffers(1, &box->vertexBuffer);
+	gl.BindBuffer(GL_ARRAY_BUFFER, box->vertexBuffer);
+	gl.BufferData(GL_ARRAY_BUFFER, sizeof (vertices), vertices, GL_STATIC_DRAW);
+
+	gl.GenVertexArrays(1, &box->vertexArray);
+	gh_BindVertexArray(box->vertexArray);
+	gl.VertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+	gl.EnableVertexAttribArray(0);
+
+	gl.GenBuffers(1, &box->indexBuffer);
+	gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, box->indexBuffer);
+	gl.BufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof (indices), indices, GL_STATIC_DRAW);
+}
+
+static void fb_DestroyBox(rdBox *box)
+{
+	gl.DeleteVertexArrays(1, &box->vertexArray);
+	gl.DeleteBuffers(1, &box->vertexBuffer);
+	gl.DeleteBuffers(1, &box->indexBuffer);
+}
+
 static void fb_SetupDepthVelocityBuffer(rdDepthVelocityBuffer *depthVelocityBuffer, int screenWidth,
                                         int screenHeight)
 {
@@ -1876,34 +3583,146 @@ static void fb_DestroyDepthVelocityBuffer(rdDepthVelocityBuffer *depthVelocityBu
 	gl.DeleteFramebuffers(1, &depthVelocityBuffer->framebuf);
 }
 
-static void fb_SetupGBuffer(rdGBuffer *gBuffer, const rdDepthVelocityBuffer *depthVelocityBuffer,
-                            int screenWidth, int screenHeight)
+/* Level sizes are halved and rounded down, as mipmaps are, so a level's texel x covers texels
+ * 2x and 2x + 1 of the level before, and pixel x lands in texel x >> (level + 1) until that
+ * passes the last one */
+static void fb_SetupHiZBuffer(rdHiZBuffer *hiZBuffer, int screenWidth, int screenHeight)
 {
-	const GLenum bufferAttachments[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	int width  = screenWidth / 2 > 1 ? screenWidth / 2 : 1;
+	int height = screenHeight / 2 > 1 ? screenHeight / 2 : 1;
 
-	gl.GenFramebuffers(1, &gBuffer->framebuf);
-	gl.BindFramebuffer(GL_FRAMEBUFFER, gBuffer->framebuf);
+	gl.GenTextures(1, &hiZBuffer->depthTexture);
+	gl.BindTexture(GL_TEXTURE_2D, hiZBuffer->depthTexture);
 
-	gl.GenTextures(1, &gBuffer->materialIDTexture);
-	gl.BindTexture(GL_TEXTURE_2D, gBuffer->materialIDTexture);
-	gl.TexImage2D(GL_TEXTURE_2D, 0, GL_RED, screenWidth, screenHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gBuffer->materialIDTexture, 0);
+	hiZBuffer->numLevels = 0;
 
-	gl.GenTextures(1, &gBuffer->normalTexture);
-	gl.BindTexture(GL_TEXTURE_2D, gBuffer->normalTexture);
-	gl.TexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, screenWidth, screenHeight, 0, GL_RGB, GL_FLOAT, NULL);
-	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gBuffer->normalTexture, 0);
+	for (;;) {
+		gl.TexImage2D(GL_TEXTURE_2D, hiZBuffer->numLevels, GL_R32F, width, height, 0, GL_RED,
+		              GL_FLOAT, NULL);
+		hiZBuffer->numLevels++;
 
-	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthVelocityBuffer->depthTexture, 0);
+		if (width == 1 && height == 1)
+			break;
 
-	gl.DrawBuffers(2, bufferAttachments);
+		width  = width / 2 > 1 ? width / 2 : 1;
+		height = height / 2 > 1 ? height / 2 : 1;
+	}
 
+	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, hiZBuffer->numLevels - 1);
 
-	assert(gl.CheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+	gl.GenFramebuffers(1, &hiZBuffer->framebuf);
+	gl.BindFramebuffer(GL_FRAMEBUFFER, hiZBuffer->framebuf);
+	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+	                        hiZBuffer->depthTexture, 0);
+
+	assert(gl.CheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+	gl.BindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	hiZBuffer->valid = 0;
+	mx_Identity(&hiZBuffer->mViewProjection);
+}
+
+static void fb_DestroyHiZBuffer(rdHiZBuffer *hiZBuffer)
+{
+	gl.DeleteTextures(1, &hiZBuffer->depthTexture);
+	gl.DeleteFramebuffers(1, &hiZBuffer->framebuf);
+}
+
+/* Each level is drawn from the one before. Limiting the texture to that level while drawing
+ * keeps the level being written out of what can be read. */
+static void fb_BuildHiZBuffer(rdHiZBuffer *hiZBuffer,
+                              const rdDepthVelocityBuffer *depthVelocityBuffer)
+{
+	int width  = local.screenWidth;
+	int height = local.screenHeight;
+
+	gl.BindFramebuffer(GL_FRAMEBUFFER, hiZBuffer->framebuf);
+	gh_BindVertexArray(local.screenQuad.vertexArray);
+	gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, local.screenQuad.indexBuffer);
+
+	gl.UseProgram(local.hiZShader.shaderProgram);
+	gl.Uniform1i(local.hiZShader.uniforms[0], 0);
+	gl.ActiveTexture(GL_TEXTURE0);
+
+	for (int level = 0; level < hiZBuffer->numLevels; level++) {
+		width  = width / 2 > 1 ? width / 2 : 1;
+		height = height / 2 > 1 ? height / 2 : 1;
+
+		if (level == 0) {
+			gl.BindTexture(GL_TEXTURE_2D, depthVelocityBuffer->depthTexture);
+		} else {
+			gl.BindTexture(GL_TEXTURE_2D, hiZBuffer->depthTexture);
+			gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1);
+			gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+		}
+
+		gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+		                        hiZBuffer->depthTexture, level);
+		gl.Viewport(0, 0, width, height);
+		gl.DrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, NULL);
+	}
+
+	gl.BindTexture(GL_TEXTURE_2D, hiZBuffer->depthTexture);
+	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, hiZBuffer->numLevels - 1);
+
+	gl.Viewport(0, 0, local.screenWidth, local.screenHeight);
+
+	/* The prepass was drawn jittered */
+	mx_MultiAB(&hiZBuffer->mViewProjection, &local.mProjectionJitter,
+	           &local.defaultCamera.mView);
+	hiZBuffer->valid = 1;
+}
+
+static void fb_SetupGBuffer(rdGBuffer *gBuffer, const rdDepthVelocityBuffer *depthVelocityBuffer,
+                            int screenWidth, int screenHeight)
+{
+	const GLenum bufferAttachments[]     = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	const GLenum singlePassAttachments[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1,
+	                                         GL_COLOR_ATTACHMENT2 };
+
+	gl.GenFramebuffers(1, &gBuffer->framebuf);
+	gl.BindFramebuffer(GL_FRAMEBUFFER, gBuffer->framebuf);
+
+	gl.GenTextures(1, &gBuffer->materialIDTexture);
+	gl.BindTexture(GL_TEXTURE_2D, gBuffer->materialIDTexture);
+	gl.TexImage2D(GL_TEXTURE_2D, 0, GL_RED, screenWidth, screenHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gBuffer->materialIDTexture, 0);
+
+	gl.GenTextures(1, &gBuffer->normalTexture);
+	gl.BindTexture(GL_TEXTURE_2D, gBuffer->normalTexture);
+	gl.TexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, screenWidth, screenHeight, 0, GL_RGB, GL_FLOAT, NULL);
+	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gBuffer->normalTexture, 0);
+
+	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthVelocityBuffer->depthTexture, 0);
+
+	gl.DrawBuffers(2, bufferAttachments);
+
+
+	assert(gl.CheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+	/* The same targets with velocity added, at the location the geometry-velocity shader writes
+	 * it */
+	gl.GenFramebuffers(1, &gBuffer->framebufSinglePass);
+	gl.BindFramebuffer(GL_FRAMEBUFFER, gBuffer->framebufSinglePass);
+
+	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gBuffer->materialIDTexture, 0);
+	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gBuffer->normalTexture, 0);
+	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, depthVelocityBuffer->velocityTexture, 0);
+	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthVelocityBuffer->depthTexture, 0);
+
+	gl.DrawBuffers(3, singlePassAttachments);
+
+	assert(gl.CheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
 	gl.BindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
@@ -1911,6 +3730,7 @@ static void fb_DestroyGBuffer(rdGBuffer *gBuffer)
 {
 	gl.DeleteTextures(1, &gBuffer->normalTexture);
 	gl.DeleteTextures(1, &gBuffer->materialIDTexture);
+	gl.DeleteFramebuffers(1, &gBuffer->framebufSinglePass);
 	gl.DeleteFramebuffers(1, &gBuffer->framebuf);
 }
 
@@ -1941,8 +3761,7 @@ static void fb_DestroyColorBuffer(rdColorBuffer *colorBuffer)
 	gl.DeleteFramebuffers(1, &colorBuffer->framebuf);
 }
 
-static void fb_SetupShadowsBuffer(rdShadowsBuffer *shadowsBuffer,
-                                  const rdDepthVelocityBuffer *depthVelocityBuffer, int screenWidth,
+static void fb_SetupShadowsBuffer(rdShadowsBuffer *shadowsBuffer, int screenWidth,
                                   int screenHeight)
 {
 	gl.GenFramebuffers(1, &shadowsBuffer->framebuf);
@@ -1956,8 +3775,6 @@ static void fb_SetupShadowsBuffer(rdShadowsBuffer *shadowsBuffer,
 
 	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
 	                        shadowsBuffer->shadowsTexture, 0);
-	gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
-	                        depthVelocityBuffer->depthTexture, 0);
 
 	assert(gl.CheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
 }
@@ -2112,564 +3929,5307 @@ static void fb_DestroyAmbientOcclusionBuffer(rdSSAOBuffer *ssaoBuffer)
 	gl.DeleteTextures(1, &ssaoBuffer->noiseTexture);
 }
 
-static void sh_SetupShader(rdShader *shader, const char *sourceVertex,
-                           const char *sourceFragment)
+static void *ar_Alloc(rdScratch *ar, size_t size)
 {
-	GLchar debugBuf[2048];
-	GLint  status;
+	const size_t headerSize = (sizeof (rdScratchBlock) + 15) & ~(size_t) 15;
 
-	shader->vertexShader = gl.CreateShader(GL_VERTEX_SHADER);
-	gl.ShaderSource(shader->vertexShader, 1, &sourceVertex, NULL);
-	gl.CompileShader(shader->vertexShader);
-	gl.GetShaderiv(shader->vertexShader, GL_COMPILE_STATUS, &status);
-	if (status == GL_FALSE) {
-		gl.GetShaderInfoLog(shader->vertexShader, sizeof (debugBuf) - 1, NULL, debugBuf);
-		printf("Error compiling vertex shader: %s", debugBuf);
-		assert(status == GL_TRUE);
-	}
+	rdScratchBlock *block = ar->head;
+	void           *ptr;
 
-	shader->fragmentShader = gl.CreateShader(GL_FRAGMENT_SHADER);
-	gl.ShaderSource(shader->fragmentShader, 1, &sourceFragment, NULL);
-	gl.CompileShader(shader->fragmentShader);
-	gl.GetShaderiv(shader->fragmentShader, GL_COMPILE_STATUS, &status);
-	if (status == GL_FALSE) {
-		gl.GetShaderInfoLog(shader->fragmentShader, sizeof (debugBuf) - 1, NULL, debugBuf);
-		printf("Error compiling fragment shader: %s", debugBuf);
-		assert(status == GL_TRUE);
-	}
+	size = (size + 15) & ~(size_t) 15;
 
-	shader->shaderProgram = gl.CreateProgram();
-	gl.AttachShader(shader->shaderProgram, shader->vertexShader);
-	gl.AttachShader(shader->shaderProgram, shader->fragmentShader);
-	gl.LinkProgram(shader->shaderProgram);
-	gl.GetProgramiv(shader->shaderProgram, GL_LINK_STATUS, &status);
-	if (status == GL_FALSE) {
-		gl.GetProgramInfoLog(shader->shaderProgram, sizeof (debugBuf) - 1, NULL, debugBuf);
-		printf("Error linking shader program: %s", debugBuf);
-		assert(status == GL_TRUE);
+	if (block == NULL || block->used + size > block->capacity) {
+		size_t capacity = 64 * 1024;
+
+		if (block != NULL && capacity < block->capacity * 2)
+			capacity = block->capacity * 2;
+		if (capacity < size)
+			capacity = size;
+
+		block = mem.alloc(headerSize + capacity);
+		if (block == NULL)
+			return NULL;
+
+		block->next     = ar->head;
+		block->capacity = capacity;
+		block->used     = 0;
+
+		ar->head = block;
 	}
+
+	ptr = (char *) block + headerSize + block->used;
+	block->used += size;
+
+	ar->used += size;
+	if (ar->used > ar->highWater)
+		ar->highWater = ar->used;
+
+	return ptr;
 }
 
-static void sh_DestroyShader(rdShader *shader)
+static void ar_Reset(rdScratch *ar)
 {
-	gl.DeleteShader(shader->vertexShader);
-	gl.DeleteShader(shader->fragmentShader);
-	gl.DeleteProgram(shader->shaderProgram);
+	const size_t headerSize = (sizeof (rdScratchBlock) + 15) & ~(size_t) 15;
+
+	/* If the last upload spilled into several blocks, fold them into one block big enough for
+	 * the high-water mark, so that the next upload of the same size costs no allocation. */
+
+	if (ar->head != NULL && ar->head->next != NULL) {
+		rdScratchBlock *block;
+
+		ar_Destroy(ar);
+
+		block = mem.alloc(headerSize + ar->highWater);
+		if (block != NULL) {
+			block->next     = NULL;
+			block->capacity = ar->highWater;
+			block->used     = 0;
+
+			ar->head = block;
+		}
+	} else if (ar->head != NULL)
+		ar->head->used = 0;
+
+	ar->used = 0;
 }
 
-static void sh_SetupUniform(rdShader *shader, int index, const char *name)
+static void ar_Destroy(rdScratch *ar)
 {
-	assert(index >= 0 && index < 16);
+	while (ar->head != NULL) {
+		rdScratchBlock *next = ar->head->next;
 
-	shader->uniforms[index] = gl.GetUniformLocation(shader->shaderProgram, name);
+		mem.free(ar->head);
+		ar->head = next;
+	}
+
+	ar->used = 0;
 }
 
-static void me_GenerateNormalsIndexed(rdVec3 *outNormals, int numVertices, const rdVertex *vertices,
-                                      int numIndices, const rdIndex *indices)
+static rdGeometry *gh_Alloc(rdPositionFormat positionFormat, size_t vertexBytes,
+                            size_t indexBytes)
 {
-	const int  numTriangles = numIndices / 3;
+	rdGeometryPage *page;
+	rdGeometry     *geo;
+	size_t          vertexOffset = 0, indexOffset = 0;
 
-	rdTriangle triangles[numTriangles];
-	rdVec3     triNormals[numTriangles];
+	indexBytes = (indexBytes + 3) & ~(size_t) 3;
 
-	for (int i = 0; i < numVertices; i++)
-		vc_Zero(&outNormals[i]);
-
-	for (int i = 0; i < numTriangles; i++) {
-		const rdVec3 *v1, *v2, *v3;
+	geo = mem.alloc(sizeof (*geo));
+	if (geo == NULL)
+		return NULL;
 
-		v1 = (const rdVec3 *) &vertices[indices[i * 3 + 0]];
-		v2 = (const rdVec3 *) &vertices[indices[i * 3 + 1]];
-		v3 = (const rdVec3 *) &vertices[indices[i * 3 + 2]];
+	for (page = local.geometryPages; page != NULL; page = page->next) {
+		if (page->positionFormat != positionFormat)
+			continue;
 
-		triangles[i]  = tr_FromVertices(v1, v2, v3);
-		triNormals[i] = tr_Normal(&triangles[i]);
+		if (gh_AllocRange(&page->vertexFree, vertexBytes, &vertexOffset)) {
+			if (gh_AllocRange(&page->indexFree, indexBytes, &indexOffset))
+				break;
+			gh_FreeRange(&page->vertexFree, vertexOffset, vertexBytes);
+		}
 	}
 
-	for (int i = 0; i < numVertices; i++) {
-		for (int j = 0; j < numTriangles; j++) {
-			const rdVec3 *vec;
-			
-			vec = (const rdVec3 *) &vertices[i];
-			if (tr_IsAdjacent(&triangles[j], vec))
-				outNormals[i] = vc_Add(&outNormals[i], &triNormals[j]);
+	/* Meshes larger than a page get a page of their own */
+	if (page == NULL) {
+		page = gh_CreatePage(positionFormat,
+		                     vertexBytes > RD_GEOMETRY_PAGE_SIZE ? vertexBytes
+		                                                         : RD_GEOMETRY_PAGE_SIZE,
+		                     indexBytes > RD_GEOMETRY_PAGE_SIZE ? indexBytes
+		                                                        : RD_GEOMETRY_PAGE_SIZE);
+		if (page == NULL) {
+			mem.free(geo);
+			return NULL;
 		}
-		vc_Normalize(&outNormals[i]);
+
+		gh_AllocRange(&page->vertexFree, vertexBytes, &vertexOffset);
+		gh_AllocRange(&page->indexFree, indexBytes, &indexOffset);
 	}
+
+	geo->page     = page;
+	geo->refCount = 1;
+
+	geo->vertexOffset = vertexOffset;
+	geo->vertexBytes  = vertexBytes;
+	geo->indexOffset  = indexOffset;
+	geo->indexBytes   = indexBytes;
+
+	geo->baseVertex = vertexOffset / page->vertexSize;
+	geo->indexType  = GL_UNSIGNED_SHORT;
+	geo->occluder   = NULL;
+
+	geo->batchGeneration = 0;
+
+	geo->prev = NULL;
+	geo->next = page->geometries;
+	if (geo->next != NULL)
+		geo->next->prev = geo;
+	page->geometries = geo;
+	page->numGeometries++;
+
+	return geo;
 }
 
-static void me_GenerateNormalsNonIndexed(rdVec3 *outNormals, int numVertices,
-                                         const rdVertex *vertices)
+static void gh_Free(rdGeometry *geo)
 {
-	const int numTriangles = numVertices / 3;
+	rdGeometryPage *page = geo->page;
+	int             lost = 0;
 
-	for (int i = 0; i < numTriangles; i++) {
-		const rdVec3 *v1, *v2, *v3;
-		rdTriangle    tri;
-		rdVec3        normal;
+	if (!gh_FreeRange(&page->vertexFree, geo->vertexOffset, geo->vertexBytes))
+		lost = 1;
+	if (!gh_FreeRange(&page->indexFree, geo->indexOffset, geo->indexBytes))
+		lost = 1;
 
-		v1 = (const rdVec3 *) &vertices[i * 3 + 0];
-		v2 = (const rdVec3 *) &vertices[i * 3 + 1];
-		v3 = (const rdVec3 *) &vertices[i * 3 + 2];
+	if (geo->prev != NULL)
+		geo->prev->next = geo->next;
+	else
+		page->geometries = geo->next;
+	if (geo->next != NULL)
+		geo->next->prev = geo->prev;
+	page->numGeometries--;
 
-		tri = tr_FromVertices(v1, v2, v3);
-		normal = tr_Normal(&tri);
-		outNormals[i * 3 + 0] = normal;
-		outNormals[i * 3 + 1] = normal;
-		outNormals[i * 3 + 2] = normal;
+	mem.free(geo->occluder);
+	mem.free(geo);
+
+	if (page->numGeometries == 0) {
+		gh_DestroyPage(page);
+		return;
 	}
-}
 
-static void me_InvertNormals(rdVec3 *normals, int numNormals)
-{
-	for (int i = 0; i < numNormals; i++)
-		vc_Invert(&normals[i]);
+	/* Compact once the holes add up to a quarter of the page; this also recovers ranges the
+	 * free list had no room to take back */
+	if (lost || gh_HoleBytes(&page->vertexFree, page->vertexCapacity) > page->vertexCapacity / 4 ||
+	    gh_HoleBytes(&page->indexFree, page->indexCapacity) > page->indexCapacity / 4)
+		gh_Defragment(page);
 }
 
-static rdTriangle tr_FromVertices(const rdVec3 *v1, const rdVec3 *v2, const rdVec3 *v3)
+static rdGeometryPage *gh_CreatePage(rdPositionFormat positionFormat, size_t vertexCapacity,
+                                     size_t indexCapacity)
 {
-	rdTriangle tri;
+	const int maxRanges = 16;
 
-	tri.v1 = *v1;
-	tri.v2 = *v2;
-	tri.v3 = *v3;
+	rdGeometryPage *page;
 
-	return tri;
-}
+	page = mem.alloc(sizeof (*page));
+	if (page == NULL)
+		return NULL;
 
-static rdVec3 tr_Normal(const rdTriangle *tri)
-{
-	rdVec3 normal;
-	rdVec3 edge1, edge2;
+	page->vertexFree.ranges = mem.alloc(maxRanges * sizeof (rdRange));
+	page->indexFree.ranges  = mem.alloc(maxRanges * sizeof (rdRange));
 
-	edge1 = vc_Sub(&tri->v2, &tri->v1);
-	edge2 = vc_Sub(&tri->v3, &tri->v1);
+	if (page->vertexFree.ranges == NULL || page->indexFree.ranges == NULL) {
+		if (page->vertexFree.ranges != NULL)
+			mem.free(page->vertexFree.ranges);
+		if (page->indexFree.ranges != NULL)
+			mem.free(page->indexFree.ranges);
+		mem.free(page);
+		return NULL;
+	}
 
-	normal = vc_Cross(&edge1, &edge2);
-	vc_Normalize(&normal);
+	page->positionFormat = positionFormat;
+	if (positionFormat == RD_POSITION_HALF)
+		page->vertexSize = sizeof (rdPackedVertexHalf);
+	else
+		page->vertexSize = sizeof (rdPackedVertex);
 
-	return normal;
-}
+	/* Every vertex range is a whole number of vertices, which keeps base vertices exact */
+	page->vertexCapacity = vertexCapacity - vertexCapacity % page->vertexSize;
+	page->indexCapacity  = indexCapacity;
 
-static int tr_IsAdjacent(const rdTriangle *tri, const rdVec3 *vec)
-{
-	if (vc_Equal(&tri->v1, vec))
-		return 1;
-	if (vc_Equal(&tri->v2, vec))
-		return 1;
-	if (vc_Equal(&tri->v3, vec))
-		return 1;
-	return 0;
-}
+	page->vertexFree.ranges[0].offset = 0;
+	page->vertexFree.ranges[0].size   = page->vertexCapacity;
+	page->vertexFree.numRanges        = 1;
+	page->vertexFree.maxRanges        = maxRanges;
 
-static void mx_Identity(rdMat4 *mat)
-{
-	mat->m[0][0] = 1.0f; mat->m[0][1] = 0.0f; mat->m[0][2] = 0.0f; mat->m[0][3] = 0.0f;
-	mat->m[1][0] = 0.0f; mat->m[1][1] = 1.0f; mat->m[1][2] = 0.0f; mat->m[1][3] = 0.0f;
-	mat->m[2][0] = 0.0f; mat->m[2][1] = 0.0f; mat->m[2][2] = 1.0f; mat->m[2][3] = 0.0f;
-	mat->m[3][0] = 0.0f; mat->m[3][1] = 0.0f; mat->m[3][2] = 0.0f; mat->m[3][3] = 1.0f;
-}
+	page->indexFree.ranges[0].offset = 0;
+	page->indexFree.ranges[0].size   = page->indexCapacity;
+	page->indexFree.numRanges        = 1;
+	page->indexFree.maxRanges        = maxRanges;
 
-static void mx_Zero(rdMat4 *mat)
-{
-	mat->m[0][0] = 0.0f; mat->m[0][1] = 0.0f; mat->m[0][2] = 0.0f; mat->m[0][3] = 0.0f;
-	mat->m[1][0] = 0.0f; mat->m[1][1] = 0.0f; mat->m[1][2] = 0.0f; mat->m[1][3] = 0.0f;
-	mat->m[2][0] = 0.0f; mat->m[2][1] = 0.0f; mat->m[2][2] = 0.0f; mat->m[2][3] = 0.0f;
-	mat->m[3][0] = 0.0f; mat->m[3][1] = 0.0f; mat->m[3][2] = 0.0f; mat->m[3][3] = 0.0f;
-}
+	page->geometries    = NULL;
+	page->numGeometries = 0;
 
-static void mx_Translate(rdMat4 *mat, float x, float y, float z)
-{
-	rdMat4 translate;
+	gl.GenBuffers(1, &page->vertexBuffer);
+	gl.GenBuffers(1, &page->indexBuffer);
+	gl.GenVertexArrays(1, &page->vertexArray);
 
-	mx_Identity(&translate);
-	translate.m[0][3] = x;
-	translate.m[1][3] = y;
-	translate.m[2][3] = z;
-	mx_MultiAB(mat, &translate, mat);
-}
+	gh_BindVertexArray(page->vertexArray);
 
-static void mx_Scale(rdMat4 *mat, float x, float y, float z)
-{
-	rdMat4 scale;
+	gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, page->indexBuffer);
+	gl.BufferData(GL_ELEMENT_ARRAY_BUFFER, page->indexCapacity, NULL, GL_STATIC_DRAW);
 
-	mx_Identity(&scale);
-	scale.m[0][0] = x;
-	scale.m[1][1] = y;
-	scale.m[2][2] = z;
+	gl.BindBuffer(GL_ARRAY_BUFFER, page->vertexBuffer);
+	gl.BufferData(GL_ARRAY_BUFFER, page->vertexCapacity, NULL, GL_STATIC_DRAW);
 
-	mx_MultiAB(mat, &scale, mat);
+	if (positionFormat == RD_POSITION_HALF) {
+		gl.VertexAttribPointer(0, 3, GL_HALF_FLOAT, GL_FALSE, page->vertexSize,
+		                       (GLvoid *) offsetof(rdPackedVertexHalf, x));
+		gl.VertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, page->vertexSize,
+		                       (GLvoid *) offsetof(rdPackedVertexHalf, normal));
+	} else {
+		gl.VertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, page->vertexSize,
+		                       (GLvoid *) offsetof(rdPackedVertex, x));
+		gl.VertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, page->vertexSize,
+		                       (GLvoid *) offsetof(rdPackedVertex, normal));
+	}
+	gl.EnableVertexAttribArray(0);
+	gl.EnableVertexAttribArray(1);
+
+	/* Attributes 2 to 13, one rdInstance per instance */
+	gl.BindBuffer(GL_ARRAY_BUFFER, local.instances.buffer);
+	for (int i = 0; i < 4; i++) {
+		gl.VertexAttribPointer(2 + i, 4, GL_FLOAT, GL_FALSE, sizeof (rdInstance),
+		                       (GLvoid *) (offsetof(rdInstance, mMVP) + 4 * i * sizeof (GLfloat)));
+		gl.VertexAttribPointer(6 + i, 4, GL_FLOAT, GL_FALSE, sizeof (rdInstance),
+		                       (GLvoid *) (offsetof(rdInstance, mOther) + 4 * i * sizeof (GLfloat)));
+	}
+	for (int i = 0; i < 3; i++) {
+		gl.VertexAttribPointer(10 + i, 3, GL_FLOAT, GL_FALSE, sizeof (rdInstance),
+		                       (GLvoid *) (offsetof(rdInstance, mNormal) + 3 * i * sizeof (GLfloat)));
+	}
+	gl.VertexAttribIPointer(13, 1, GL_INT, sizeof (rdInstance),
+	                        (GLvoid *) offsetof(rdInstance, materialID));
+
+	for (int i = 2; i <= 13; i++) {
+		gl.VertexAttribDivisor(i, 1);
+		gl.EnableVertexAttribArray(i);
+	}
+
+	page->next          = local.geometryPages;
+	local.geometryPages = page;
+
+	return page;
 }
 
-static void mx_Rotate(rdMat4 *mat, float x, float y, float z)
+static void gh_DestroyPage(rdGeometryPage *page)
 {
-	rdMat4 rotX, rotY, rotZ;
-	rdMat4 original, yToX, xToZ;
+	rdGeometryPage **link = &local.geometryPages;
 
-	mx_Identity(&rotX);
-	mx_Identity(&rotY);
-	mx_Identity(&rotZ);
+	while (*link != page)
+		link = &(*link)->next;
+	*link = page->next;
 
-	original = *mat;
+	/* Only at shutdown can objects still be holding on to the page */
+	while (page->geometries != NULL) {
+		rdGeometry *next = page->geometries->next;
 
-	rotX.m[1][1] =  cosf(x);
-	rotX.m[1][2] = -sinf(x);
-	rotX.m[2][1] =  sinf(x);
-	rotX.m[2][2] =  cosf(x);
+		mem.free(page->geometries->occluder);
+		mem.free(page->geometries);
+		page->geometries = next;
+	}
 
-	rotY.m[0][0] =  cosf(y);
-	rotY.m[0][2] =  sinf(y);
-	rotY.m[2][0] = -sinf(y);
-	rotY.m[2][2] =  cosf(y);
+	if (local.boundVertexArray == page->vertexArray)
+		local.boundVertexArray = 0;
 
-	rotZ.m[0][0] =  cosf(z);
-	rotZ.m[0][1] = -sinf(z);
-	rotZ.m[1][0] =  sinf(z);
-	rotZ.m[1][1] =  cosf(z);
+	gl.DeleteVertexArrays(1, &page->vertexArray);
+	gl.DeleteBuffers(1, &page->vertexBuffer);
+	gl.DeleteBuffers(1, &page->indexBuffer);
 
-	mx_MultiAB(&yToX, &rotY, &rotX);
-	mx_MultiAB(&xToZ, &yToX, &rotZ);
-	mx_MultiAB(mat, &original, &xToZ);
+	mem.free(page->vertexFree.ranges);
+	mem.free(page->indexFree.ranges);
+	mem.free(page);
 }
 
-static void mx_LookAt(rdMat4 *mat, const rdVec3 *position, const rdVec3 *target, const rdVec3 *up)
+static void gh_Defragment(rdGeometryPage *page)
 {
-	rdVec3 f, s, u;
+	rdGeometry **sorted;
+	rdGeometry  *geo;
+	size_t       offset;
+	int          i = 0;
 
-	mx_Identity(mat);
+	sorted = ar_Alloc(&local.scratch, page->numGeometries * sizeof (*sorted));
+	if (sorted == NULL)
+		return;
 
-	f = vc_Sub(target, position);
-	vc_Normalize(&f);
-	s = vc_Cross(&f, up);
-	vc_Normalize(&s);
-	u = vc_Cross(&s, &f);
+	for (geo = page->geometries; geo != NULL; geo = geo->next)
+		sorted[i++] = geo;
 
-	mat->m[0][0] =  s.x;
-	mat->m[0][1] =  s.y;
-	mat->m[0][2] =  s.z;
-	mat->m[1][0] =  u.x;
-	mat->m[1][1] =  u.y;
-	mat->m[1][2] =  u.z;
-	mat->m[2][0] = -f.x;
-	mat->m[2][1] = -f.y;
-	mat->m[2][2] = -f.z;
-	mat->m[0][3] = -vc_Dot(&s, position);
-	mat->m[1][3] = -vc_Dot(&u, position);
-	mat->m[2][3] =  vc_Dot(&f, position);
-}
+	/* Vertex and index ranges are allocated independently, so each is packed in its own order.
+	 * Indices are relative to the base vertex and survive the move unchanged. */
+
+	qsort(sorted, page->numGeometries, sizeof (*sorted), gh_CompareVertexOffset);
+	offset = 0;
+
+	for (i = 0; i < page->numGeometries; i++) {
+		geo = sorted[i];
+
+		if (geo->vertexOffset != offset) {
+			gh_MoveRange(page->vertexBuffer, geo->vertexOffset, offset, geo->vertexBytes);
+			geo->vertexOffset = offset;
+			geo->baseVertex   = offset / page->vertexSize;
+		}
+		offset += geo->vertexBytes;
+	}
+
+	page->vertexFree.ranges[0].offset = offset;
+	page->vertexFree.ranges[0].size   = page->vertexCapacity - offset;
+	page->vertexFree.numRanges        = offset < page->vertexCapacity ? 1 : 0;
+
+	qsort(sorted, page->numGeometries, sizeof (*sorted), gh_CompareIndexOffset);
+	offset = 0;
+
+	for (i = 0; i < page->numGeometries; i++) {
+		geo = sorted[i];
+
+		if (geo->indexOffset != offset) {
+			gh_MoveRange(page->indexBuffer, geo->indexOffset, offset, geo->indexBytes);
+			geo->indexOffset = offset;
+		}
+		offset += geo->indexBytes;
+	}
+
+	page->indexFree.ranges[0].offset = offset;
+	page->indexFree.ranges[0].size   = page->indexCapacity - offset;
+	page->indexFree.numRanges        = offset < page->indexCapacity ? 1 : 0;
+
+	local.geometryMoves++;
+}
+
+static void gh_MoveRange(GLuint buffer, size_t from, size_t to, size_t size)
+{
+	/* Copies within one buffer must not overlap, so step by at most the distance moved */
+	const size_t step = from - to;
+
+	gl.BindBuffer(GL_COPY_READ_BUFFER, buffer);
+	gl.BindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+
+	for (size_t done = 0; done < size; done += step) {
+		size_t chunk = size - done < step ? size - done : step;
+
+		gl.CopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, from + done, to + done,
+		                     chunk);
+	}
+}
+
+static int gh_AllocRange(rdFreeList *list, size_t size, size_t *outOffset)
+{
+	if (size == 0) {
+		*outOffset = 0;
+		return 1;
+	}
+
+	for (int i = 0; i < list->numRanges; i++) {
+		rdRange *range = &list->ranges[i];
+
+		if (range->size < size)
+			continue;
+
+		*outOffset = range->offset;
+		range->offset += size;
+		range->size   -= size;
+
+		if (range->size == 0) {
+			memmove(range, range + 1, (list->numRanges - i - 1) * sizeof (*range));
+			list->numRanges--;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+static int gh_FreeRange(rdFreeList *list, size_t offset, size_t size)
+{
+	rdRange *ranges = list->ranges;
+	int      i = 0;
+	int      joinPrev, joinNext;
+
+	if (size == 0)
+		return 1;
+
+	while (i < list->numRanges && ranges[i].offset < offset)
+		i++;
+
+	joinPrev = i > 0 && ranges[i - 1].offset + ranges[i - 1].size == offset;
+	joinNext = i < list->numRanges && offset + size == ranges[i].offset;
+
+	if (joinPrev && joinNext) {
+		ranges[i - 1].size += size + ranges[i].size;
+		memmove(&ranges[i], &ranges[i + 1], (list->numRanges - i - 1) * sizeof (*ranges));
+		list->numRanges--;
+	} else if (joinPrev) {
+		ranges[i - 1].size += size;
+	} else if (joinNext) {
+		ranges[i].offset  = offset;
+		ranges[i].size   += size;
+	} else {
+		if (list->numRanges == list->maxRanges) {
+			ranges = mem.alloc(list->maxRanges * 2 * sizeof (*ranges));
+			if (ranges == NULL)
+				return 0;
+
+			memcpy(ranges, list->ranges, list->numRanges * sizeof (*ranges));
+			mem.free(list->ranges);
+
+			list->ranges     = ranges;
+			list->maxRanges *= 2;
+		}
+
+		memmove(&ranges[i + 1], &ranges[i], (list->numRanges - i) * sizeof (*ranges));
+		ranges[i].offset = offset;
+		ranges[i].size   = size;
+		list->numRanges++;
+	}
+
+	return 1;
+}
+
+static size_t gh_HoleBytes(const rdFreeList *list, size_t capacity)
+{
+	size_t bytes = 0;
+
+	for (int i = 0; i < list->numRanges; i++) {
+		if (list->ranges[i].offset + list->ranges[i].size != capacity)
+			bytes += list->ranges[i].size;
+	}
+
+	return bytes;
+}
+
+static int gh_CompareVertexOffset(const void *a, const void *b)
+{
+	const rdGeometry *g1 = *(rdGeometry * const *) a;
+	const rdGeometry *g2 = *(rdGeometry * const *) b;
+
+	return (g1->vertexOffset > g2->vertexOffset) - (g1->vertexOffset < g2->vertexOffset);
+}
+
+static int gh_CompareIndexOffset(const void *a, const void *b)
+{
+	const rdGeometry *g1 = *(rdGeometry * const *) a;
+	const rdGeometry *g2 = *(rdGeometry * const *) b;
+
+	return (g1->indexOffset > g2->indexOffset) - (g1->indexOffset < g2->indexOffset);
+}
+
+static void gh_BindVertexArray(GLuint vertexArray)
+{
+	if (local.boundVertexArray != vertexArray) {
+		gl.BindVertexArray(vertexArray);
+		local.boundVertexArray = vertexArray;
+	}
+}
+
+static void sh_SetupShader(rdShader *shader, const char *sourceVertex,
+                           const char *sourceFragment)
+{
+	shader->vertexShader   = sh_CompileStage(GL_VERTEX_SHADER, sourceVertex);
+	shader->fragmentShader = sh_CompileStage(GL_FRAGMENT_SHADER, sourceFragment);
+
+	shader->shaderProgram = gl.CreateProgram();
+	gl.AttachShader(shader->shaderProgram, shader->vertexShader);
+	gl.AttachShader(shader->shaderProgram, shader->fragmentShader);
+	sh_LinkProgram(shader->shaderProgram);
+}
+
+/* A vertex stage alone, for drawing with the rasterizer off. Its outputs are written interleaved,
+ * in the order given, to the buffer bound for transform feedback. */
+static void sh_SetupFeedbackShader(rdShader *shader, const char *sourceVertex, int numVaryings,
+                                   const char **varyings)
+{
+	shader->vertexShader   = sh_CompileStage(GL_VERTEX_SHADER, sourceVertex);
+	shader->fragmentShader = 0;
+
+	shader->shaderProgram = gl.CreateProgram();
+	gl.AttachShader(shader->shaderProgram, shader->vertexShader);
+	gl.TransformFeedbackVaryings(shader->shaderProgram, numVaryings, varyings,
+	                             GL_INTERLEAVED_ATTRIBS);
+	sh_LinkProgram(shader->shaderProgram);
+}
+
+static GLuint sh_CompileStage(GLenum type, const char *source)
+{
+	GLchar debugBuf[2048];
+	GLint  status;
+	GLuint stage;
+
+	stage = gl.CreateShader(type);
+	gl.ShaderSource(stage, 1, &source, NULL);
+	gl.CompileShader(stage);
+	gl.GetShaderiv(stage, GL_COMPILE_STATUS, &status);
+	if (status == GL_FALSE) {
+		gl.GetShaderInfoLog(stage, sizeof (debugBuf) - 1, NULL, debugBuf);
+		printf("Error compiling %s shader: %s", type == GL_VERTEX_SHADER ? "vertex" : "fragment",
+		       debugBuf);
+		assert(status == GL_TRUE);
+	}
+
+	return stage;
+}
+
+static void sh_LinkProgram(GLuint program)
+{
+	GLchar debugBuf[2048];
+	GLint  status;
+
+	gl.LinkProgram(program);
+	gl.GetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status == GL_FALSE) {
+		gl.GetProgramInfoLog(program, sizeof (debugBuf) - 1, NULL, debugBuf);
+		printf("Error linking shader program: %s", debugBuf);
+		assert(status == GL_TRUE);
+	}
+}
+
+/* Deleting shader 0 is ignored, so feedback shaders go the same way */
+static void sh_DestroyShader(rdShader *shader)
+{
+	gl.DeleteShader(shader->vertexShader);
+	gl.DeleteShader(shader->fragmentShader);
+	gl.DeleteProgram(shader->shaderProgram);
+}
+
+static rdObject *as_QueueObject(int numVertices, const rdVertex *vertices,
+                                const rdVertex *normals, int numIndices, const void *indices,
+                                rdIndexFormat indexFormat, rdObjectType objectType,
+                                rdMaterialType materialType, rdPositionFormat positionFormat)
+{
+	rdAsync  *as = &local.async;
+	rdObject *obj;
+	rdJob    *job;
+
+	obj = mem.alloc(sizeof (*obj));
+	job = mem.alloc(sizeof (*job));
+
+	if (obj == NULL || job == NULL) {
+		mem.free(obj);
+		mem.free(job);
+		return NULL;
+	}
+
+	me_InitObject(obj, numVertices, numIndices, indices != NULL, objectType, materialType);
+	obj->job = job;
+
+	job->next           = NULL;
+	job->obj            = obj;
+	job->numVertices    = numVertices;
+	job->vertices       = vertices;
+	job->normals        = normals;
+	job->numIndices     = numIndices;
+	job->indices        = indices;
+	job->indexFormat    = indexFormat;
+	job->objectType     = objectType;
+	job->positionFormat = positionFormat;
+
+	job->scratch.head      = NULL;
+	job->scratch.used      = 0;
+	job->scratch.highWater = 0;
+
+	job->prepared      = 0;
+	job->geometry      = NULL;
+	job->uploadedBytes = 0;
+
+	pthread_mutex_lock(&as->lock);
+
+	/* The loader thread only exists once something was created asynchronously */
+	if (!as->threadStarted) {
+		as->threadStarted = pthread_create(&as->thread, NULL, as_LoaderThread, as) == 0;
+
+		if (!as->threadStarted) {
+			pthread_mutex_unlock(&as->lock);
+			fprintf(stderr, "Error: couldn't start the mesh loader thread\n");
+			mem.free(job);
+			mem.free(obj);
+			return NULL;
+		}
+	}
+
+	as_Append(&as->queued, &as->queuedTail, job);
+	pthread_cond_signal(&as->wake);
+
+	pthread_mutex_unlock(&as->lock);
+
+	return obj;
+}
+
+static void *as_LoaderThread(void *arg)
+{
+	rdAsync *as = arg;
+
+	pthread_mutex_lock(&as->lock);
+
+	for (;;) {
+		rdJob *job;
+
+		while (!as->quit && as->queued == NULL)
+			pthread_cond_wait(&as->wake, &as->lock);
+
+		if (as->quit)
+			break;
+
+		job = as->queued;
+		as->queued = job->next;
+		if (as->queued == NULL)
+			as->queuedTail = NULL;
+
+		as->current = job;
+		pthread_mutex_unlock(&as->lock);
+
+		job->prepared = me_PrepareMesh(&job->scratch, &job->mesh, job->numVertices,
+		                               job->vertices, job->normals, job->numIndices,
+		                               job->indices, job->indexFormat, job->objectType,
+		                               job->positionFormat);
+
+		pthread_mutex_lock(&as->lock);
+		as->current = NULL;
+
+		as_Append(&as->prepared, &as->preparedTail, job);
+		pthread_cond_broadcast(&as->done);
+	}
+
+	pthread_mutex_unlock(&as->lock);
+
+	return NULL;
+}
+
+/* Called once per frame on the render thread. Prepared jobs are uploaded in order until the
+ * budget is spent; a job that doesn't fit continues where it left off next frame. */
+static void as_DrainUploads(void)
+{
+	rdAsync *as = &local.async;
+	size_t   budget = as->uploadBudget;
+
+	if (!as->threadStarted)
+		return;
+
+	pthread_mutex_lock(&as->lock);
+
+	if (as->prepared != NULL) {
+		if (as->uploading == NULL)
+			as->uploading = as->prepared;
+		else
+			as->uploadingTail->next = as->prepared;
+
+		as->uploadingTail = as->preparedTail;
+		as->prepared      = NULL;
+		as->preparedTail  = NULL;
+	}
+
+	pthread_mutex_unlock(&as->lock);
+
+	while (as->uploading != NULL && budget > 0) {
+		rdJob  *job = as->uploading;
+		size_t  total, size;
+
+		if (job->obj != NULL && job->prepared && job->geometry == NULL)
+			job->geometry = me_AllocGeometry(&job->mesh);
+
+		if (job->obj != NULL && job->geometry != NULL) {
+			total = job->mesh.vertexBytes + job->mesh.indexBytes;
+			size  = total - job->uploadedBytes < budget ? total - job->uploadedBytes : budget;
+
+			me_UploadMesh(job->geometry, &job->mesh, job->uploadedBytes, size);
+
+			job->uploadedBytes += size;
+			budget             -= size;
+
+			if (job->uploadedBytes < total)
+				break;
+
+			me_FinishObject(job->obj, job->geometry, &job->mesh);
+			job->obj->job = NULL;
+		} else if (job->obj != NULL) {
+			job->obj->status = RD_OBJECT_FAILED;
+			job->obj->job    = NULL;
+		} else if (job->geometry != NULL) {
+			gh_Free(job->geometry);
+		}
+
+		as->uploading = job->next;
+		if (as->uploading == NULL)
+			as->uploadingTail = NULL;
+
+		as_FreeJob(job);
+	}
+}
+
+/* Detaches a destroyed object from its job. A job nobody has started on is dropped right away,
+ * otherwise the caller's arrays may still be in use until the loader thread is done with it. */
+static void as_CancelJob(rdJob *job)
+{
+	rdAsync *as   = &local.async;
+	rdJob   *prev = NULL;
+
+	pthread_mutex_lock(&as->lock);
+
+	for (rdJob *it = as->queued; it != NULL; prev = it, it = it->next) {
+		if (it != job)
+			continue;
+
+		if (prev == NULL)
+			as->queued = job->next;
+		else
+			prev->next = job->next;
+
+		if (as->queuedTail == job)
+			as->queuedTail = prev;
+
+		pthread_mutex_unlock(&as->lock);
+		as_FreeJob(job);
+		return;
+	}
+
+	while (as->current == job)
+		pthread_cond_wait(&as->done, &as->lock);
+
+	job->obj = NULL;
+
+	pthread_mutex_unlock(&as->lock);
+}
+
+static void as_Append(rdJob **head, rdJob **tail, rdJob *job)
+{
+	job->next = NULL;
+
+	if (*head == NULL)
+		*head = job;
+	else
+		(*tail)->next = job;
+
+	*tail = job;
+}
+
+static void as_FreeJob(rdJob *job)
+{
+	ar_Destroy(&job->scratch);
+	mem.free(job);
+}
+
+static void sh_SetupUniform(rdShader *shader, int index, const char *name)
+{
+	assert(index >= 0 && index < 16);
+
+	shader->uniforms[index] = gl.GetUniformLocation(shader->shaderProgram, name);
+}
+
+/* Points the program's block at a binding point, if the program uses it */
+static void sh_SetupBlock(rdShader *shader, const char *name, GLuint binding)
+{
+	GLuint index = gl.GetUniformBlockIndex(shader->shaderProgram, name);
+
+	if (index != GL_INVALID_INDEX)
+		gl.UniformBlockBinding(shader->shaderProgram, index, binding);
+}
+
+static rdObject *me_CreateObject(int numVertices, const rdVertex *vertices,
+                                 const rdVertex *normals, int numIndices, const void *indices,
+                                 rdIndexFormat indexFormat, rdObjectType objectType,
+                                 rdMaterialType materialType, rdPositionFormat positionFormat)
+{
+	rdObject   *obj;
+	rdGeometry *geo;
+	rdMeshData  mesh;
+
+	obj = mem.alloc(sizeof (*obj));
+	if (obj == NULL)
+		return NULL;
+
+	me_InitObject(obj, numVertices, numIndices, indices != NULL, objectType, materialType);
+
+	/* Stage everything first, so running out of memory leaves no GL objects behind */
+	if (!me_PrepareMesh(&local.scratch, &mesh, numVertices, vertices, normals, numIndices,
+	                    indices, indexFormat, objectType, positionFormat)) {
+		mem.free(obj);
+		return NULL;
+	}
+
+	geo = me_AllocGeometry(&mesh);
+	if (geo == NULL) {
+		mem.free(obj);
+		return NULL;
+	}
+
+	me_UploadMesh(geo, &mesh, 0, mesh.vertexBytes + mesh.indexBytes);
+	me_FinishObject(obj, geo, &mesh);
+
+	return obj;
+}
+
+static void me_InitObject(rdObject *obj, int numVertices, int numIndices, int isIndexed,
+                          rdObjectType objectType, rdMaterialType materialType)
+{
+	obj->parent    = NULL;
+	obj->numClones = 0;
+
+	obj->objectType   = objectType;
+	obj->materialType = materialType;
+	obj->materialID   = 0;
+
+	obj->numVertices = numVertices;
+	obj->numIndices  = numIndices;
+
+	obj->posX  = obj->posY = obj->posZ = 0.0f;
+	obj->scale = 1.0f;
+	obj->rotX  = obj->rotY = obj->rotZ = 0.0f;
+
+	mx_Identity(&obj->mModel);
+	obj->update = 0;
+	obj->isIndexed    = isIndexed;
+	obj->isFlatShaded = !obj->isIndexed;
+
+	obj->geometry = NULL;
+	obj->status   = RD_OBJECT_PENDING;
+	obj->job      = NULL;
+
+	obj->boundsCenter = vc_Vec3(0.0f, 0.0f, 0.0f);
+	obj->boundsExtent = vc_Vec3(0.0f, 0.0f, 0.0f);
+	obj->boundsRadius = 0.0f;
+
+	obj->cullList  = NULL;
+	obj->cullIndex = -1;
+
+	obj->bvh      = NULL;
+	obj->bvhIndex = -1;
+
+	me_UpdateTransform(obj);
+
+	mx_Identity(&obj->mMVP);
+
+	obj->mPrevMVP = NULL;
+	mx_Identity(&obj->_mPrevMVP);
+	obj->velocityFrame = 0;
+
+	mx_Identity(&obj->mModelView);
+	mx_Identity(&obj->mModelLightspace);
+	obj->mNormal          = mx_Mat3From4(&obj->mModelView);
+	obj->cameraVersion    = 0;
+	obj->viewspaceVersion = 0;
+
+	obj->jitterIndex = -1;
+
+	obj->sm = NULL;
+}
+
+/* Everything that doesn't need GL: normals when none are given, bounds, the LOD chain and the
+ * interleaved vertices, all in the given scratch arena. The caller's indices are uploaded as they
+ * are. Only touches its arguments, so it also runs on the loader thread. */
+static int me_PrepareMesh(rdScratch *ar, rdMeshData *out, int numVertices,
+                          const rdVertex *vertices, const rdVertex *normals, int numIndices,
+                          const void *indices, rdIndexFormat indexFormat,
+                          rdObjectType objectType, rdPositionFormat positionFormat)
+{
+	const size_t indexSize = indexFormat == RD_INDEX_32 ? sizeof (rdIndex32) : sizeof (rdIndex);
+
+	rdVec3 boundsMin, boundsMax;
+	size_t vertexSize;
+
+	if (normals == NULL) {
+		rdVertex *generated;
+
+		generated = ar_Alloc(ar, numVertices * sizeof (*generated));
+		if (generated == NULL)
+			return 0;
+
+		if (!me_GenerateNormals(ar, (rdVec3 *) generated, numVertices, vertices, numIndices,
+		                        indices, indexFormat, objectType))
+			return 0;
+
+		normals = generated;
+	}
+
+	out->positionFormat = positionFormat;
+
+	boundsMin = boundsMax = *(const rdVec3 *) &vertices[0];
+
+	for (int i = 1; i < numVertices; i++) {
+		boundsMin.x = fminf(boundsMin.x, vertices[i].x);
+		boundsMin.y = fminf(boundsMin.y, vertices[i].y);
+		boundsMin.z = fminf(boundsMin.z, vertices[i].z);
+		boundsMax.x = fmaxf(boundsMax.x, vertices[i].x);
+		boundsMax.y = fmaxf(boundsMax.y, vertices[i].y);
+		boundsMax.z = fmaxf(boundsMax.z, vertices[i].z);
+	}
+
+	out->boundsCenter = vc_Add(&boundsMin, &boundsMax);
+	out->boundsCenter = vc_MultiScalar(&out->boundsCenter, 0.5f);
+	out->boundsExtent = vc_Sub(&boundsMax, &out->boundsCenter);
+	out->boundsRadius = 0.0f;
+
+	for (int i = 0; i < numVertices; i++) {
+		rdVec3 d = vc_Sub((const rdVec3 *) &vertices[i], &out->boundsCenter);
+		out->boundsRadius = fmaxf(out->boundsRadius, vc_Dot(&d, &d));
+	}
+
+	out->boundsRadius = sqrtf(out->boundsRadius);
+
+	/* Walls and floors are what hides things, at full detail so they hide no more than drawn */
+	if (objectType == RD_OBJECT_INTERIOR) {
+		out->numOccluderVertices = numVertices;
+		out->occluderVertices    = vertices;
+		out->numOccluderIndices  = numIndices;
+		out->occluderIndices     = indices;
+		out->occluderIndexFormat = indexFormat;
+	} else {
+		out->numOccluderVertices = 0;
+		out->occluderVertices    = NULL;
+		out->numOccluderIndices  = 0;
+		out->occluderIndices     = NULL;
+		out->occluderIndexFormat = indexFormat;
+	}
+
+	out->numLods = 1;
+	out->lods[0].firstIndex = 0;
+	out->lods[0].numIndices = numIndices;
+	out->lods[0].error      = 0.0f;
+
+	out->indexData     = indices;
+	out->lodIndexData  = NULL;
+	out->indexBytes    = indices != NULL ? numIndices * indexSize : 0;
+	out->lodIndexBytes = 0;
+	out->indexType     = indexFormat == RD_INDEX_32 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+
+	/* The coarser levels go right after the full index list and are uploaded with it */
+	if (indices != NULL && numIndices >= RD_LOD_MIN_INDICES) {
+		void *chain;
+
+		out->numLods = lo_BuildChain(ar, out->lods, &chain, numVertices, vertices, numIndices,
+		                             indices, indexFormat);
+		if (out->numLods == 0)
+			return 0;
+
+		out->lodIndexData  = chain;
+		out->lodIndexBytes = (out->lods[out->numLods - 1].firstIndex +
+		                      out->lods[out->numLods - 1].numIndices - numIndices) * indexSize;
+		out->indexBytes   += out->lodIndexBytes;
+	}
+
+	if (positionFormat == RD_POSITION_HALF) {
+		rdPackedVertexHalf *packed;
+
+		packed = ar_Alloc(ar, numVertices * sizeof (*packed));
+		if (packed == NULL)
+			return 0;
+
+		for (int i = 0; i < numVertices; i++) {
+			packed[i].x      = ma_FloatToHalf(vertices[i].x);
+			packed[i].y      = ma_FloatToHalf(vertices[i].y);
+			packed[i].z      = ma_FloatToHalf(vertices[i].z);
+			packed[i].w      = 0;
+			packed[i].normal = ma_PackNormal((const rdVec3 *) &normals[i]);
+		}
+
+		out->vertexData = packed;
+		vertexSize      = sizeof (*packed);
+	} else {
+		rdPackedVertex *packed;
+
+		packed = ar_Alloc(ar, numVertices * sizeof (*packed));
+		if (packed == NULL)
+			return 0;
+
+		for (int i = 0; i < numVertices; i++) {
+			packed[i].x      = vertices[i].x;
+			packed[i].y      = vertices[i].y;
+			packed[i].z      = vertices[i].z;
+			packed[i].normal = ma_PackNormal((const rdVec3 *) &normals[i]);
+		}
+
+		out->vertexData = packed;
+		vertexSize      = sizeof (*packed);
+	}
+
+	out->vertexBytes = numVertices * vertexSize;
+
+	return 1;
+}
+
+static rdGeometry *me_AllocGeometry(const rdMeshData *mesh)
+{
+	rdGeometry *geo;
+
+	geo = gh_Alloc(mesh->positionFormat, mesh->vertexBytes, mesh->indexBytes);
+	if (geo == NULL)
+		return NULL;
+
+	geo->indexType = mesh->indexType;
+	geo->numLods   = mesh->numLods;
+	memcpy(geo->lods, mesh->lods, mesh->numLods * sizeof (*mesh->lods));
+
+	return geo;
+}
+
+/* Uploads size bytes of the mesh starting at offset, counting the vertex data first, then the
+ * full index list and the coarser levels, so a large mesh can be spread over several calls */
+static void me_UploadMesh(const rdGeometry *geo, const rdMeshData *mesh, size_t offset,
+                          size_t size)
+{
+	/* The copy target leaves the element binding of whatever VAO is bound alone */
+	if (offset < mesh->vertexBytes) {
+		size_t n = mesh->vertexBytes - offset < size ? mesh->vertexBytes - offset : size;
+
+		gl.BindBuffer(GL_COPY_WRITE_BUFFER, geo->page->vertexBuffer);
+		gl.BufferSubData(GL_COPY_WRITE_BUFFER, geo->vertexOffset + offset, n,
+		                 (const char *) mesh->vertexData + offset);
+
+		offset += n;
+		size   -= n;
+	}
+
+	if (size > 0) {
+		const size_t baseBytes = mesh->indexBytes - mesh->lodIndexBytes;
+
+		offset -= mesh->vertexBytes;
+
+		gl.BindBuffer(GL_COPY_WRITE_BUFFER, geo->page->indexBuffer);
+
+		if (offset < baseBytes) {
+			size_t n = baseBytes - offset < size ? baseBytes - offset : size;
+
+			gl.BufferSubData(GL_COPY_WRITE_BUFFER, geo->indexOffset + offset, n,
+			                 (const char *) mesh->indexData + offset);
+
+			offset += n;
+			size   -= n;
+		}
+
+		if (size > 0)
+			gl.BufferSubData(GL_COPY_WRITE_BUFFER, geo->indexOffset + offset, size,
+			                 (const char *) mesh->lodIndexData + (offset - baseBytes));
+	}
+}
+
+static void me_FinishObject(rdObject *obj, rdGeometry *geo, const rdMeshData *mesh)
+{
+	obj->geometry     = geo;
+	obj->boundsCenter = mesh->boundsCenter;
+	obj->boundsExtent = mesh->boundsExtent;
+	obj->boundsRadius = mesh->boundsRadius;
+	obj->status       = RD_OBJECT_RESIDENT;
+
+	/* Without the copy the object is still drawn, it just hides nothing */
+	if (mesh->occluderVertices != NULL)
+		geo->occluder = oc_CreateMesh(mesh->numOccluderVertices, mesh->occluderVertices,
+		                              mesh->numOccluderIndices, mesh->occluderIndices,
+		                              mesh->occluderIndexFormat);
+
+	me_UpdateTransform(obj);
+}
+
+/* Rebuilds the model matrix and the world-space bounds, and the object's slots in its cull list
+ * and its BVH. The box is the object-space box transformed and boxed again, so it stays
+ * conservative under rotation. */
+static void me_UpdateTransform(rdObject *obj)
+{
+	rdVec4 center;
+
+	mx_Identity(&obj->mModel);
+	mx_Rotate(&obj->mModel, ma_ToRadians(obj->rotX), ma_ToRadians(obj->rotY),
+	                        ma_ToRadians(obj->rotZ));
+	mx_Scale(&obj->mModel, obj->scale, obj->scale, obj->scale);
+	mx_Translate(&obj->mModel, obj->posX, obj->posY, -obj->posZ);
+
+	center = vc_Vec4(obj->boundsCenter.x, obj->boundsCenter.y, obj->boundsCenter.z, 1.0f);
+	center = mx_MultiVector4(&obj->mModel, &center);
+
+	obj->worldCenter = vc_Vec3(center.x, center.y, center.z);
+	obj->worldRadius = obj->boundsRadius * obj->scale;
+
+	if (obj->status == RD_OBJECT_RESIDENT) {
+		const rdMat4 *m = &obj->mModel;
+		const rdVec3 *e = &obj->boundsExtent;
+
+		obj->worldExtent.x = fabsf(m->m[0][0]) * e->x + fabsf(m->m[0][1]) * e->y +
+		                     fabsf(m->m[0][2]) * e->z;
+		obj->worldExtent.y = fabsf(m->m[1][0]) * e->x + fabsf(m->m[1][1]) * e->y +
+		                     fabsf(m->m[1][2]) * e->z;
+		obj->worldExtent.z = fabsf(m->m[2][0]) * e->x + fabsf(m->m[2][1]) * e->y +
+		                     fabsf(m->m[2][2]) * e->z;
+	} else
+		obj->worldExtent = vc_Vec3(RD_CULL_EMPTY_EXTENT, RD_CULL_EMPTY_EXTENT,
+		                           RD_CULL_EMPTY_EXTENT);
+
+	if (obj->cullList != NULL)
+		cu_StoreBounds(obj->cullList, obj->cullIndex, obj);
+	if (obj->bvh != NULL)
+		bv_StoreBounds(obj->bvh, obj->bvhIndex, obj);
+}
+
+
+static int me_GenerateNormals(rdScratch *ar, rdVec3 *outNormals, int numVertices,
+                              const rdVertex *vertices, int numIndices, const void *indices,
+                              rdIndexFormat indexFormat, rdObjectType objectType)
+{
+	if (indices) {
+		if (!me_GenerateNormalsIndexed(ar, outNormals, numVertices, vertices, numIndices,
+		                               indices, indexFormat))
+			return 0;
+	} else
+		me_GenerateNormalsNonIndexed(outNormals, numVertices, vertices);
+
+	if (objectType == RD_OBJECT_INTERIOR)
+		me_InvertNormals(outNormals, numVertices);
+
+	return 1;
+}
+
+static int me_GenerateNormalsIndexed(rdScratch *ar, rdVec3 *outNormals, int numVertices,
+                                     const rdVertex *vertices, int numIndices,
+                                     const void *indices, rdIndexFormat indexFormat)
+{
+	const int numTriangles = numIndices / 3;
+
+	int    *positionIDs;
+	rdVec3 *sums;
+
+	positionIDs = ar_Alloc(ar, numVertices * sizeof (*positionIDs));
+	sums        = ar_Alloc(ar, numVertices * sizeof (*sums));
+
+	if (positionIDs == NULL || sums == NULL)
+		return 0;
+
+	if (!me_WeldPositions(ar, positionIDs, numVertices, vertices))
+		return 0;
+
+	for (int i = 0; i < numVertices; i++)
+		vc_Zero(&sums[i]);
+
+	/* Every triangle contributes its face normal once to each distinct position it touches */
+
+	for (int i = 0; i < numTriangles; i++) {
+		const rdIndex32 i1 = me_Index(indices, indexFormat, i * 3 + 0);
+		const rdIndex32 i2 = me_Index(indices, indexFormat, i * 3 + 1);
+		const rdIndex32 i3 = me_Index(indices, indexFormat, i * 3 + 2);
+		const rdVec3   *v1, *v2, *v3;
+		rdTriangle      tri;
+		rdVec3          normal;
+		int             p1, p2, p3;
+
+		v1 = (const rdVec3 *) &vertices[i1];
+		v2 = (const rdVec3 *) &vertices[i2];
+		v3 = (const rdVec3 *) &vertices[i3];
+
+		tri    = tr_FromVertices(v1, v2, v3);
+		normal = tr_Normal(&tri);
+
+		p1 = positionIDs[i1];
+		p2 = positionIDs[i2];
+		p3 = positionIDs[i3];
+
+		if (p1 >= 0)
+			sums[p1] = vc_Add(&sums[p1], &normal);
+		if (p2 >= 0 && p2 != p1)
+			sums[p2] = vc_Add(&sums[p2], &normal);
+		if (p3 >= 0 && p3 != p1 && p3 != p2)
+			sums[p3] = vc_Add(&sums[p3], &normal);
+	}
+
+	for (int i = 0; i < numVertices; i++) {
+		if (positionIDs[i] >= 0)
+			outNormals[i] = sums[positionIDs[i]];
+		else
+			vc_Zero(&outNormals[i]);
+		vc_Normalize(&outNormals[i]);
+	}
+
+	return 1;
+}
+
+static int me_WeldPositions(rdScratch *ar, int *outPositionIDs, int numVertices,
+                            const rdVertex *vertices)
+{
+	int *table;
+	int  tableSize = 16;
+
+	while (tableSize < numVertices * 2)
+		tableSize *= 2;
+
+	table = ar_Alloc(ar, tableSize * sizeof (*table));
+	if (table == NULL)
+		return 0;
+
+	for (int i = 0; i < tableSize; i++)
+		table[i] = -1;
+
+	/* Open addressing keyed on the exact position, so welding matches vc_Equal. Positions
+	 * containing NaN never compare equal to anything and are left unwelded. */
+
+	for (int i = 0; i < numVertices; i++) {
+		const rdVec3 *vec = (const rdVec3 *) &vertices[i];
+		unsigned int  slot;
+
+		if (vec->x != vec->x || vec->y != vec->y || vec->z != vec->z) {
+			outPositionIDs[i] = -1;
+			continue;
+		}
+
+		slot = me_HashPosition(vec) & (tableSize - 1);
+
+		while (table[slot] != -1) {
+			if (vc_Equal((const rdVec3 *) &vertices[table[slot]], vec))
+				break;
+			slot = (slot + 1) & (tableSize - 1);
+		}
+
+		if (table[slot] == -1)
+			table[slot] = i;
+		outPositionIDs[i] = table[slot];
+	}
+
+	return 1;
+}
+
+static unsigned int me_HashPosition(const rdVec3 *vec)
+{
+	const float  components[3] = { vec->x, vec->y, vec->z };
+	unsigned int hash = 2166136261u;
+
+	for (int i = 0; i < 3; i++) {
+		unsigned int bits;
+		float        f = components[i];
+
+		/* -0.0f and 0.0f compare equal, so they have to hash equally too */
+		if (f == 0.0f)
+			f = 0.0f;
+
+		memcpy(&bits, &f, sizeof (bits));
+		hash = (hash ^ bits) * 16777619u;
+		hash ^= hash >> 15;
+	}
+
+	return hash;
+}
+
+static void me_GenerateNormalsNonIndexed(rdVec3 *outNormals, int numVertices,
+                                         const rdVertex *vertices)
+{
+	const int numTriangles = numVertices / 3;
+
+	for (int i = 0; i < numTriangles; i++) {
+		const rdVec3 *v1, *v2, *v3;
+		rdTriangle    tri;
+		rdVec3        normal;
+
+		v1 = (const rdVec3 *) &vertices[i * 3 + 0];
+		v2 = (const rdVec3 *) &vertices[i * 3 + 1];
+		v3 = (const rdVec3 *) &vertices[i * 3 + 2];
+
+		tri = tr_FromVertices(v1, v2, v3);
+		normal = tr_Normal(&tri);
+		outNormals[i * 3 + 0] = normal;
+		outNormals[i * 3 + 1] = normal;
+		outNormals[i * 3 + 2] = normal;
+	}
+}
+
+static void me_InvertNormals(rdVec3 *normals, int numNormals)
+{
+	for (int i = 0; i < numNormals; i++)
+		vc_Invert(&normals[i]);
+}
+
+static rdIndex32 me_Index(const void *indices, rdIndexFormat indexFormat, int i)
+{
+	if (indexFormat == RD_INDEX_32)
+		return ((const rdIndex32 *) indices)[i];
+	else
+		return ((const rdIndex *) indices)[i];
+}
+
+/* Builds progressively coarser index lists over the same vertices by collapsing edges in quadric
+ * error order. Only vertices whose position is unique, and which aren't on a border, may move,
+ * so seams and outlines stay where they are; a flat-shaded mesh therefore gets no LODs at all.
+ * The full list stays the caller's; outIndices gets the coarser ones, in the same format. */
+static int lo_BuildChain(rdScratch *ar, rdLod *outLods, void **outIndices, int numVertices,
+                         const rdVertex *vertices, int numIndices, const void *indices,
+                         rdIndexFormat indexFormat)
+{
+	rdSimplifier s;
+	void        *chain;
+	int         *positionIDs;
+	int          numLods = 1;
+
+	chain            = ar_Alloc(ar, (size_t) numIndices * (RD_MAX_LODS - 1) *
+	                                (indexFormat == RD_INDEX_32 ? sizeof (rdIndex32)
+	                                                            : sizeof (rdIndex)));
+	positionIDs      = ar_Alloc(ar, numVertices * sizeof (*positionIDs));
+	s.indices        = ar_Alloc(ar, numIndices * sizeof (*s.indices));
+	s.locked         = ar_Alloc(ar, numVertices);
+	s.touched        = ar_Alloc(ar, numVertices);
+	s.quadrics       = ar_Alloc(ar, numVertices * sizeof (*s.quadrics));
+	s.adjacency      = ar_Alloc(ar, numIndices * sizeof (*s.adjacency));
+	s.collapses      = ar_Alloc(ar, numIndices * sizeof (*s.collapses));
+	s.order          = ar_Alloc(ar, numIndices * sizeof (*s.order));
+	s.adjacencyStart = ar_Alloc(ar, (numVertices + 1) * sizeof (*s.adjacencyStart));
+
+	if (chain == NULL || positionIDs == NULL || s.indices == NULL || s.locked == NULL ||
+	    s.touched == NULL || s.quadrics == NULL || s.adjacency == NULL || s.collapses == NULL ||
+	    s.order == NULL || s.adjacencyStart == NULL)
+		return 0;
+
+	if (!me_WeldPositions(ar, positionIDs, numVertices, vertices))
+		return 0;
+
+	s.numVertices = numVertices;
+	s.vertices    = vertices;
+	s.positionIDs = positionIDs;
+	s.numIndices  = numIndices;
+	s.maxError    = 0.0;
+
+	for (int i = 0; i < numIndices; i++)
+		s.indices[i] = me_Index(indices, indexFormat, i);
+
+	outLods[0].firstIndex = 0;
+	outLods[0].numIndices = numIndices;
+	outLods[0].error      = 0.0f;
+
+	if (!lo_FindLockedVertices(ar, &s))
+		return 0;
+
+	memset(s.quadrics, 0, numVertices * sizeof (*s.quadrics));
+
+	for (int i = 0; i < numIndices; i += 3) {
+		const rdVec3 *v1 = (const rdVec3 *) &vertices[s.indices[i + 0]];
+		const rdVec3 *v2 = (const rdVec3 *) &vertices[s.indices[i + 1]];
+		const rdVec3 *v3 = (const rdVec3 *) &vertices[s.indices[i + 2]];
+		rdVec3        e1, e2, normal;
+		float         length;
+
+		e1     = vc_Sub(v2, v1);
+		e2     = vc_Sub(v3, v1);
+		normal = vc_Cross(&e1, &e2);
+		length = sqrtf(vc_Dot(&normal, &normal));
+
+		if (length == 0.0f)
+			continue;
+
+		normal = vc_MultiScalar(&normal, 1.0f / length);
+
+		for (int j = 0; j < 3; j++)
+			lo_AddPlane(&s.quadrics[s.indices[i + j]], &normal, -vc_Dot(&normal, v1), length * 0.5f);
+	}
+
+	/* Each level aims for half the triangles of the one before; one that can't get at least a
+	 * quarter below its predecessor ends the chain */
+
+	while (numLods < RD_MAX_LODS) {
+		const rdLod *prev   = &outLods[numLods - 1];
+		const int    target = prev->numIndices / 6 * 3;
+		rdLod       *lod    = &outLods[numLods];
+
+		while (s.numIndices > target && lo_CollapsePass(&s, target) > 0)
+			;
+
+		if (s.numIndices > prev->numIndices / 12 * 9)
+			break;
+
+		lod->firstIndex = prev->firstIndex + prev->numIndices;
+		lod->numIndices = s.numIndices;
+		lod->error      = sqrt(s.maxError);
+
+		if (indexFormat == RD_INDEX_32)
+			memcpy((rdIndex32 *) chain + lod->firstIndex - numIndices, s.indices,
+			       s.numIndices * sizeof (*s.indices));
+		else {
+			rdIndex *out = (rdIndex *) chain + lod->firstIndex - numIndices;
+
+			for (int i = 0; i < s.numIndices; i++)
+				out[i] = s.indices[i];
+		}
+		numLods++;
+	}
+
+	*outIndices = chain;
+	return numLods;
+}
+
+/* Collapses a batch of edges that don't share any triangles, cheapest first, then drops the
+ * triangles that became degenerate. Returns the number of collapses. */
+static int lo_CollapsePass(rdSimplifier *s, int targetIndices)
+{
+	const int numTriangles = s->numIndices / 3;
+
+	int numCollapses = 0, numCandidates = 0, numRemoved = 0, numKept = 0;
+
+	/* Triangles around each vertex */
+
+	memset(s->adjacencyStart, 0, (s->numVertices + 1) * sizeof (*s->adjacencyStart));
+
+	for (int i = 0; i < s->numIndices; i++)
+		s->adjacencyStart[s->indices[i] + 1]++;
+	for (int i = 0; i < s->numVertices; i++)
+		s->adjacencyStart[i + 1] += s->adjacencyStart[i];
+
+	for (int i = 0; i < s->numIndices; i++)
+		s->adjacency[s->adjacencyStart[s->indices[i]]++] = i / 3;
+	for (int i = s->numVertices; i > 0; i--)
+		s->adjacencyStart[i] = s->adjacencyStart[i - 1];
+	s->adjacencyStart[0] = 0;
+
+	/* Every interior edge is seen once in each direction, one triangle per direction. The cost
+	 * is the mean squared distance over the area the moving vertex stands for. */
+
+	for (int i = 0; i < s->numIndices; i++) {
+		const int from = s->indices[i];
+		const int to   = s->indices[i % 3 == 2 ? i - 2 : i + 1];
+
+		if (s->locked[from] || s->positionIDs[from] == s->positionIDs[to])
+			continue;
+
+		/* A vertex of nothing but degenerate triangles is free to move, and 0/0 would be a NaN
+		 * that lo_SortCollapses can't bucket */
+		if (s->quadrics[from].area > 0.0)
+			s->collapses[numCandidates].cost = lo_Evaluate(&s->quadrics[from],
+			                                               &s->vertices[to]) /
+			                                   s->quadrics[from].area;
+		else
+			s->collapses[numCandidates].cost = 0.0f;
+		s->collapses[numCandidates].from = from;
+		s->collapses[numCandidates].to   = to;
+		numCandidates++;
+	}
+
+	lo_SortCollapses(s->order, s->collapses, numCandidates);
+
+	memset(s->touched, 0, s->numVertices);
+
+	for (int i = 0; i < numCandidates; i++) {
+		const rdCollapse *c     = &s->collapses[s->order[i]];
+		const int         first = s->adjacencyStart[c->from];
+		const int         last  = s->adjacencyStart[c->from + 1];
+		const rdVec3     *to    = (const rdVec3 *) &s->vertices[c->to];
+
+		int collapsedTriangles = 0, flips = 0;
+
+		if (s->numIndices - numRemoved * 3 <= targetIndices)
+			break;
+		if (s->touched[c->from] || s->touched[c->to])
+			continue;
+
+		/* Moving the vertex must not turn any of the surviving triangles around */
+
+		for (int j = first; j < last && !flips; j++) {
+			const rdIndex32 *tri = &s->indices[s->adjacency[j] * 3];
+			rdVec3           before[3], after[3], e1, e2, n1, n2;
+
+			if (s->positionIDs[tri[0]] == s->positionIDs[c->to] ||
+			    s->positionIDs[tri[1]] == s->positionIDs[c->to] ||
+			    s->positionIDs[tri[2]] == s->positionIDs[c->to]) {
+				collapsedTriangles++;
+				continue;
+			}
+
+			for (int k = 0; k < 3; k++) {
+				before[k] = *(const rdVec3 *) &s->vertices[tri[k]];
+				after[k]  = (int) tri[k] == c->from ? *to : before[k];
+			}
+
+			e1 = vc_Sub(&before[1], &before[0]);
+			e2 = vc_Sub(&before[2], &before[0]);
+			n1 = vc_Cross(&e1, &e2);
+
+			e1 = vc_Sub(&after[1], &after[0]);
+			e2 = vc_Sub(&after[2], &after[0]);
+			n2 = vc_Cross(&e1, &e2);
+
+			if (vc_Dot(&n1, &n2) <= 0.0f)
+				flips = 1;
+		}
+
+		if (flips)
+			continue;
+
+		for (int j = first; j < last; j++) {
+			rdIndex32 *tri = &s->indices[s->adjacency[j] * 3];
+
+			for (int k = 0; k < 3; k++) {
+				s->touched[tri[k]] = 1;
+				if ((int) tri[k] == c->from)
+					tri[k] = c->to;
+			}
+		}
+
+		if (c->cost > s->maxError)
+			s->maxError = c->cost;
+
+		lo_AddQuadric(&s->quadrics[c->to], &s->quadrics[c->from]);
+		s->touched[c->to] = 1;
+
+		numRemoved += collapsedTriangles;
+		numCollapses++;
+	}
+
+	for (int i = 0; i < numTriangles; i++) {
+		const rdIndex32 *tri = &s->indices[i * 3];
+		const int        p1  = s->positionIDs[tri[0]];
+		const int        p2  = s->positionIDs[tri[1]];
+		const int        p3  = s->positionIDs[tri[2]];
+
+		if ((p1 >= 0 && (p1 == p2 || p1 == p3)) || (p2 >= 0 && p2 == p3))
+			continue;
+
+		memmove(&s->indices[numKept * 3], tri, 3 * sizeof (*tri));
+		numKept++;
+	}
+
+	s->numIndices = numKept * 3;
+
+	return numCollapses;
+}
+
+/* Picks the coarsest level whose error stays under RD_LOD_PIXEL_ERROR at the object's nearest
+ * point, then goes bias levels coarser */
+static int lo_SelectLod(const rdObject *obj, int bias)
+{
+	const rdGeometry *geo = obj->geometry;
+
+	rdVec4 center, view;
+	float  depth, pixelsPerUnit;
+	int    lod;
+
+	if (geo->numLods == 1)
+		return 0;
+
+	center = vc_Vec4(obj->worldCenter.x, obj->worldCenter.y, obj->worldCenter.z, 1.0f);
+	view   = mx_MultiVector4(&local.defaultCamera.mView, &center);
+	depth  = -view.z - obj->worldRadius;
+
+	lod = 0;
+
+	if (depth > 0.0f) {
+		pixelsPerUnit = local.mProjection.m[1][1] * local.screenHeight * 0.5f * obj->scale / depth;
+
+		for (lod = geo->numLods - 1; lod > 0; lod--) {
+			if (geo->lods[lod].error * pixelsPerUnit <= RD_LOD_PIXEL_ERROR)
+				break;
+		}
+	}
+
+	lod += bias;
+	if (lod > geo->numLods - 1)
+		lod = geo->numLods - 1;
+
+	return lod;
+}
+
+/* A position is locked if several vertices share it (a normal seam), or if one of its edges
+ * isn't shared by exactly two oppositely wound triangles (a border or non-manifold edge) */
+static int lo_FindLockedVertices(rdScratch *ar, rdSimplifier *s)
+{
+	unsigned char *lockedPositions;
+	int           *positionCounts;
+	rdEdge        *table;
+	unsigned int   tableSize = 16;
+
+	while (tableSize < (unsigned int) s->numIndices * 2)
+		tableSize *= 2;
+
+	lockedPositions = ar_Alloc(ar, s->numVertices);
+	positionCounts  = ar_Alloc(ar, s->numVertices * sizeof (*positionCounts));
+	table           = ar_Alloc(ar, tableSize * sizeof (*table));
+
+	if (lockedPositions == NULL || positionCounts == NULL || table == NULL)
+		return 0;
+
+	memset(lockedPositions, 0, s->numVertices);
+	memset(positionCounts, 0, s->numVertices * sizeof (*positionCounts));
+
+	for (unsigned int i = 0; i < tableSize; i++)
+		table[i].a = -1;
+
+	for (int i = 0; i < s->numVertices; i++) {
+		if (s->positionIDs[i] >= 0)
+			positionCounts[s->positionIDs[i]]++;
+	}
+
+	for (int i = 0; i < s->numIndices; i++) {
+		const int a = s->positionIDs[s->indices[i]];
+		const int b = s->positionIDs[s->indices[i % 3 == 2 ? i - 2 : i + 1]];
+		rdEdge   *edge;
+
+		if (a < 0 || b < 0 || a == b)
+			continue;
+
+		edge = lo_EdgeSlot(table, tableSize - 1, a, b);
+		edge->a = a;
+		edge->b = b;
+		edge->count++;
+	}
+
+	for (int i = 0; i < s->numIndices; i++) {
+		const int a = s->positionIDs[s->indices[i]];
+		const int b = s->positionIDs[s->indices[i % 3 == 2 ? i - 2 : i + 1]];
+
+		if (a < 0 || b < 0 || a == b)
+			continue;
+
+		if (lo_EdgeSlot(table, tableSize - 1, a, b)->count != 1 ||
+		    lo_EdgeSlot(table, tableSize - 1, b, a)->count != 1) {
+			lockedPositions[a] = 1;
+			lockedPositions[b] = 1;
+		}
+	}
+
+	for (int i = 0; i < s->numVertices; i++) {
+		const int p = s->positionIDs[i];
+
+		s->locked[i] = p < 0 || positionCounts[p] > 1 || lockedPositions[p];
+	}
+
+	return 1;
+}
+
+static rdEdge *lo_EdgeSlot(rdEdge *table, unsigned int mask, int a, int b)
+{
+	unsigned int slot;
+
+	slot = ((unsigned int) a * 73856093u) ^ ((unsigned int) b * 19349663u);
+	slot ^= slot >> 16;
+
+	for (slot &= mask; table[slot].a != -1; slot = (slot + 1) & mask) {
+		if (table[slot].a == a && table[slot].b == b)
+			break;
+	}
+
+	if (table[slot].a == -1)
+		table[slot].count = 0;
+
+	return &table[slot];
+}
+
+static void lo_AddPlane(rdQuadric *q, const rdVec3 *normal, float d, float area)
+{
+	q->a2 += area * normal->x * normal->x;
+	q->ab += area * normal->x * normal->y;
+	q->ac += area * normal->x * normal->z;
+	q->ad += area * normal->x * d;
+	q->b2 += area * normal->y * normal->y;
+	q->bc += area * normal->y * normal->z;
+	q->bd += area * normal->y * d;
+	q->c2 += area * normal->z * normal->z;
+	q->cd += area * normal->z * d;
+	q->d2 += area * d * d;
+
+	q->area += area;
+}
+
+static void lo_AddQuadric(rdQuadric *q, const rdQuadric *other)
+{
+	q->a2 += other->a2;
+	q->ab += other->ab;
+	q->ac += other->ac;
+	q->ad += other->ad;
+	q->b2 += other->b2;
+	q->bc += other->bc;
+	q->bd += other->bd;
+	q->c2 += other->c2;
+	q->cd += other->cd;
+	q->d2 += other->d2;
+
+	q->area += other->area;
+}
+
+/* Area weighted sum of squared distances from v to the quadric's planes */
+static double lo_Evaluate(const rdQuadric *q, const rdVertex *v)
+{
+	const double x = v->x, y = v->y, z = v->z;
+	double       error;
+
+	error = q->a2 * x * x + 2.0 * q->ab * x * y + 2.0 * q->ac * x * z + 2.0 * q->ad * x +
+	        q->b2 * y * y + 2.0 * q->bc * y * z + 2.0 * q->bd * y +
+	        q->c2 * z * z + 2.0 * q->cd * z +
+	        q->d2;
+
+	return error > 0.0 ? error : 0.0;
+}
+
+/* A full sort costs more than the rest of a pass on big meshes. Bucketing on the exponent and
+ * the top mantissa bits of the (non-negative) cost is close enough and keeps equal costs in
+ * mesh order. */
+static void lo_SortCollapses(int *outOrder, const rdCollapse *collapses, int numCollapses)
+{
+	int counts[1 << 11] = { 0 };
+	int offset = 0;
+
+	for (int i = 0; i < numCollapses; i++) {
+		unsigned int bits;
+
+		memcpy(&bits, &collapses[i].cost, sizeof (bits));
+		counts[bits >> 20]++;
+	}
+
+	for (int i = 0; i < 1 << 11; i++) {
+		int count = counts[i];
+
+		counts[i] = offset;
+		offset += count;
+	}
+
+	for (int i = 0; i < numCollapses; i++) {
+		unsigned int bits;
+
+		memcpy(&bits, &collapses[i].cost, sizeof (bits));
+		outOrder[counts[bits >> 20]++] = i;
+	}
+}
+
+static rdTriangle tr_FromVertices(const rdVec3 *v1, const rdVec3 *v2, const rdVec3 *v3)
+{
+	rdTriangle tri;
+
+	tri.v1 = *v1;
+	tri.v2 = *v2;
+	tri.v3 = *v3;
+
+	return tri;
+}
+
+static rdVec3 tr_Normal(const rdTriangle *tri)
+{
+	rdVec3 normal;
+	rdVec3 edge1, edge2;
+
+	edge1 = vc_Sub(&tri->v2, &tri->v1);
+	edge2 = vc_Sub(&tri->v3, &tri->v1);
+
+	normal = vc_Cross(&edge1, &edge2);
+	vc_Normalize(&normal);
+
+	return normal;
+}
+
+static void mx_Identity(rdMat4 *mat)
+{
+	mat->m[0][0] = 1.0f; mat->m[0][1] = 0.0f; mat->m[0][2] = 0.0f; mat->m[0][3] = 0.0f;
+	mat->m[1][0] = 0.0f; mat->m[1][1] = 1.0f; mat->m[1][2] = 0.0f; mat->m[1][3] = 0.0f;
+	mat->m[2][0] = 0.0f; mat->m[2][1] = 0.0f; mat->m[2][2] = 1.0f; mat->m[2][3] = 0.0f;
+	mat->m[3][0] = 0.0f; mat->m[3][1] = 0.0f; mat->m[3][2] = 0.0f; mat->m[3][3] = 1.0f;
+}
+
+static void mx_Zero(rdMat4 *mat)
+{
+	mat->m[0][0] = 0.0f; mat->m[0][1] = 0.0f; mat->m[0][2] = 0.0f; mat->m[0][3] = 0.0f;
+	mat->m[1][0] = 0.0f; mat->m[1][1] = 0.0f; mat->m[1][2] = 0.0f; mat->m[1][3] = 0.0f;
+	mat->m[2][0] = 0.0f; mat->m[2][1] = 0.0f; mat->m[2][2] = 0.0f; mat->m[2][3] = 0.0f;
+	mat->m[3][0] = 0.0f; mat->m[3][1] = 0.0f; mat->m[3][2] = 0.0f; mat->m[3][3] = 0.0f;
+}
+
+static void mx_Translate(rdMat4 *mat, float x, float y, float z)
+{
+	rdMat4 translate;
+
+	mx_Identity(&translate);
+	translate.m[0][3] = x;
+	translate.m[1][3] = y;
+	translate.m[2][3] = z;
+	mx_MultiAB(mat, &translate, mat);
+}
+
+static void mx_Scale(rdMat4 *mat, float x, float y, float z)
+{
+	rdMat4 scale;
+
+	mx_Identity(&scale);
+	scale.m[0][0] = x;
+	scale.m[1][1] = y;
+	scale.m[2][2] = z;
+
+	mx_MultiAB(mat, &scale, mat);
+}
+
+static void mx_Rotate(rdMat4 *mat, float x, float y, float z)
+{
+	rdMat4 rotX, rotY, rotZ;
+	rdMat4 original, yToX, xToZ;
+
+	mx_Identity(&rotX);
+	mx_Identity(&rotY);
+	mx_Identity(&rotZ);
+
+	original = *mat;
+
+	rotX.m[1][1] =  cosf(x);
+	rotX.m[1][2] = -sinf(x);
+	rotX.m[2][1] =  sinf(x);
+	rotX.m[2][2] =  cosf(x);
+
+	rotY.m[0][0] =  cosf(y);
+	rotY.m[0][2] =  sinf(y);
+	rotY.m[2][0] = -sinf(y);
+	rotY.m[2][2] =  cosf(y);
+
+	rotZ.m[0][0] =  cosf(z);
+	rotZ.m[0][1] = -sinf(z);
+	rotZ.m[1][0] =  sinf(z);
+	rotZ.m[1][1] =  cosf(z);
+
+	mx_MultiAB(&yToX, &rotY, &rotX);
+	mx_MultiAB(&xToZ, &yToX, &rotZ);
+	mx_MultiAB(mat, &original, &xToZ);
+}
+
+static void mx_LookAt(rdMat4 *mat, const rdVec3 *position, const rdVec3 *target, const rdVec3 *up)
+{
+	rdVec3 f, s, u;
+
+	mx_Identity(mat);
+
+	f = vc_Sub(target, position);
+	vc_Normalize(&f);
+	s = vc_Cross(&f, up);
+	vc_Normalize(&s);
+	u = vc_Cross(&s, &f);
+
+	mat->m[0][0] =  s.x;
+	mat->m[0][1] =  s.y;
+	mat->m[0][2] =  s.z;
+	mat->m[1][0] =  u.x;
+	mat->m[1][1] =  u.y;
+	mat->m[1][2] =  u.z;
+	mat->m[2][0] = -f.x;
+	mat->m[2][1] = -f.y;
+	mat->m[2][2] = -f.z;
+	mat->m[0][3] = -vc_Dot(&s, position);
+	mat->m[1][3] = -vc_Dot(&u, position);
+	mat->m[2][3] =  vc_Dot(&f, position);
+}
 
 static void mx_Frustum(rdMat4 *p, double left, double right, double bottom, double top,
                        double zNear, double zFar)
 {
-	mx_Zero(p);
+	mx_Zero(p);
+
+	p->m[0][0] =  (2 * zNear) / (right - left);
+	p->m[0][2] =  (right + left) / (right - left);
+	p->m[1][1] =  (2 * zNear) / (top - bottom);
+	p->m[1][2] =  (top + bottom) / (top - bottom);
+	p->m[2][2] = -((zFar + zNear) / (zFar - zNear));
+	p->m[2][3] = -((2 * zFar * zNear) / (zFar - zNear));
+	p->m[3][2] = -1.0f;
+}
+
+static void mx_InvertFrustum(rdMat4 *p)
+{
+	rdMat4 tmp;
+
+	double a = p->m[0][0];
+	double b = p->m[1][1];
+	double c = p->m[2][2];
+	double d = p->m[2][3];
+	double e = p->m[3][2];
+
+	mx_Zero(&tmp);
+
+	tmp.m[0][0] = 1.0f / a;
+	tmp.m[1][1] = 1.0f / b;
+	tmp.m[3][2] = 1.0f / d;
+	tmp.m[2][3] = 1.0f / e;
+	tmp.m[3][3] = -c / (d * e);
+
+	*p = tmp;
+}
+
+/* Inverse of a rotation and translation, such as a view matrix */
+static void mx_InvertRigid(rdMat4 *out, const rdMat4 *in)
+{
+	mx_Identity(out);
+
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++)
+			out->m[i][j] = in->m[j][i];
+	}
+
+	for (int i = 0; i < 3; i++) {
+		out->m[i][3] = -(out->m[i][0] * in->m[0][3] + out->m[i][1] * in->m[1][3] +
+		                 out->m[i][2] * in->m[2][3]);
+	}
+}
+#if 0
+static void mx_Ortho(rdMat4 *o, double left, double right, double bottom, double top, double near,
+                     double far)
+{
+	mx_Identity(o);
+
+	o->m[0][0] = 2 / (right - left);
+	o->m[0][3] = - (right + left) / (right - left);
+	o->m[1][1] = 2 / (top - bottom);
+	o->m[1][3] = - (top + bottom) / (top - bottom);
+	o->m[2][2] = -2 / (far - near);
+	o->m[2][3] = - (far + near) / (far - near);
+}
+#endif
+static void mx_MultiAB(rdMat4 *out, const rdMat4 *a, const rdMat4 *b)
+{
+	out->m[0][0] = a->m[0][0] * b->m[0][0] + a->m[0][1] * b->m[1][0] + a->m[0][2] * b->m[2][0] + a->m[0][3] * b->m[3][0];
+	out->m[0][1] = a->m[0][0] * b->m[0][1] + a->m[0][1] * b->m[1][1] + a->m[0][2] * b->m[2][1] + a->m[0][3] * b->m[3][1];
+	out->m[0][2] = a->m[0][0] * b->m[0][2] + a->m[0][1] * b->m[1][2] + a->m[0][2] * b->m[2][2] + a->m[0][3] * b->m[3][2];
+	out->m[0][3] = a->m[0][0] * b->m[0][3] + a->m[0][1] * b->m[1][3] + a->m[0][2] * b->m[2][3] + a->m[0][3] * b->m[3][3];
+
+	out->m[1][0] = a->m[1][0] * b->m[0][0] + a->m[1][1] * b->m[1][0] + a->m[1][2] * b->m[2][0] + a->m[1][3] * b->m[3][0];
+	out->m[1][1] = a->m[1][0] * b->m[0][1] + a->m[1][1] * b->m[1][1] + a->m[1][2] * b->m[2][1] + a->m[1][3] * b->m[3][1];
+	out->m[1][2] = a->m[1][0] * b->m[0][2] + a->m[1][1] * b->m[1][2] + a->m[1][2] * b->m[2][2] + a->m[1][3] * b->m[3][2];
+	out->m[1][3] = a->m[1][0] * b->m[0][3] + a->m[1][1] * b->m[1][3] + a->m[1][2] * b->m[2][3] + a->m[1][3] * b->m[3][3];
+
+	out->m[2][0] = a->m[2][0] * b->m[0][0] + a->m[2][1] * b->m[1][0] + a->m[2][2] * b->m[2][0] + a->m[2][3] * b->m[3][0];
+	out->m[2][1] = a->m[2][0] * b->m[0][1] + a->m[2][1] * b->m[1][1] + a->m[2][2] * b->m[2][1] + a->m[2][3] * b->m[3][1];
+	out->m[2][2] = a->m[2][0] * b->m[0][2] + a->m[2][1] * b->m[1][2] + a->m[2][2] * b->m[2][2] + a->m[2][3] * b->m[3][2];
+	out->m[2][3] = a->m[2][0] * b->m[0][3] + a->m[2][1] * b->m[1][3] + a->m[2][2] * b->m[2][3] + a->m[2][3] * b->m[3][3];
+
+	out->m[3][0] = a->m[3][0] * b->m[0][0] + a->m[3][1] * b->m[1][0] + a->m[3][2] * b->m[2][0] + a->m[3][3] * b->m[3][0];
+	out->m[3][1] = a->m[3][0] * b->m[0][1] + a->m[3][1] * b->m[1][1] + a->m[3][2] * b->m[2][1] + a->m[3][3] * b->m[3][1];
+	out->m[3][2] = a->m[3][0] * b->m[0][2] + a->m[3][1] * b->m[1][2] + a->m[3][2] * b->m[2][2] + a->m[3][3] * b->m[3][2];
+	out->m[3][3] = a->m[3][0] * b->m[0][3] + a->m[3][1] * b->m[1][3] + a->m[3][2] * b->m[2][3] + a->m[3][3] * b->m[3][3];
+}
+
+static void mx_MultiABC(rdMat4 *out, const rdMat4 *a, const rdMat4 *b, const rdMat4 *c)
+{
+	rdMat4 tmp;
+
+	mx_MultiAB(&tmp, a, b);
+	mx_MultiAB(out, &tmp, c);
+}
+
+static rdVec3 mx_MultiVector3(const rdMat3 *mat, const rdVec3 *vec)
+{
+	rdVec3 ret;
+
+	ret.x = mat->m[0][0] * vec->x + mat->m[0][1] * vec->y + mat->m[0][2] * vec->z;
+	ret.y = mat->m[1][0] * vec->x + mat->m[1][1] * vec->y + mat->m[1][2] * vec->z;
+	ret.z = mat->m[2][0] * vec->x + mat->m[2][1] * vec->y + mat->m[2][2] * vec->z;
+
+	return ret;
+}
+
+static rdVec4 mx_MultiVector4(const rdMat4 *mat, const rdVec4 *vec)
+{
+	rdVec4 ret;
+
+	ret.x = mat->m[0][0] * vec->x + mat->m[0][1] * vec->y + mat->m[0][2] * vec->z + mat->m[0][3] * vec->w;
+	ret.y = mat->m[1][0] * vec->x + mat->m[1][1] * vec->y + mat->m[1][2] * vec->z + mat->m[1][3] * vec->w;
+	ret.z = mat->m[2][0] * vec->x + mat->m[2][1] * vec->y + mat->m[2][2] * vec->z + mat->m[2][3] * vec->w;
+	ret.w = mat->m[3][0] * vec->x + mat->m[3][1] * vec->y + mat->m[3][2] * vec->z + mat->m[3][3] * vec->w;
+
+	return ret;
+}
+
+static rdMat3 mx_Mat3From4(const rdMat4 *src)
+{
+	rdMat3 ret;
+
+	ret.m[0][0] = src->m[0][0];
+	ret.m[0][1] = src->m[0][1];
+	ret.m[0][2] = src->m[0][2];
+	ret.m[1][0] = src->m[1][0];
+	ret.m[1][1] = src->m[1][1];
+	ret.m[1][2] = src->m[1][2];
+	ret.m[2][0] = src->m[2][0];
+	ret.m[2][1] = src->m[2][1];
+	ret.m[2][2] = src->m[2][2];
+
+	return ret;
+}
+
+static void mx_Invert3(rdMat3 *mat)
+{
+	float tmp[3][3];
+	float det, invDet;
+
+    tmp[0][0] = mat->m[1][1] * mat->m[2][2] - mat->m[1][2] * mat->m[2][1];
+    tmp[0][1] = mat->m[0][2] * mat->m[2][1] - mat->m[0][1] * mat->m[2][2];
+    tmp[0][2] = mat->m[0][1] * mat->m[1][2] - mat->m[0][2] * mat->m[1][1];
+    tmp[1][0] = mat->m[1][2] * mat->m[2][0] - mat->m[1][0] * mat->m[2][2];
+    tmp[1][1] = mat->m[0][0] * mat->m[2][2] - mat->m[0][2] * mat->m[2][0];
+    tmp[1][2] = mat->m[0][2] * mat->m[1][0] - mat->m[0][0] * mat->m[1][2];
+    tmp[2][0] = mat->m[1][0] * mat->m[2][1] - mat->m[1][1] * mat->m[2][0];
+    tmp[2][1] = mat->m[0][1] * mat->m[2][0] - mat->m[0][0] * mat->m[2][1];
+    tmp[2][2] = mat->m[0][0] * mat->m[1][1] - mat->m[0][1] * mat->m[1][0];
+
+	det = mat->m[0][0] * tmp[0][0] + mat->m[0][1] * tmp[1][0] + mat->m[0][2] * tmp[2][0];
+
+	if (fabs(det) <= 0.00001f) {
+		return;
+	}
+
+	invDet = 1.0f / det;
+
+    mat->m[0][0] = invDet * tmp[0][0];
+    mat->m[0][1] = invDet * tmp[0][1];
+    mat->m[0][2] = invDet * tmp[0][2];
+    mat->m[1][0] = invDet * tmp[1][0];
+    mat->m[1][1] = invDet * tmp[1][1];
+    mat->m[1][2] = invDet * tmp[1][2];
+    mat->m[2][0] = invDet * tmp[2][0];
+    mat->m[2][1] = invDet * tmp[2][1];
+    mat->m[2][2] = invDet * tmp[2][2];
+}
+
+static void mx_Transpose3(rdMat3 *mat)
+{
+	rdMat3 tmp;
+
+	tmp.m[0][0] = mat->m[0][0];
+	tmp.m[0][1] = mat->m[1][0];
+	tmp.m[0][2] = mat->m[2][0];
+	tmp.m[1][0] = mat->m[0][1];
+	tmp.m[1][1] = mat->m[1][1];
+	tmp.m[1][2] = mat->m[2][1];
+	tmp.m[2][0] = mat->m[0][2];
+	tmp.m[2][1] = mat->m[1][2];
+	tmp.m[2][2] = mat->m[2][2];
+
+	*mat = tmp;
+}
+
+static rdVec2 vc_Vec2(float x, float y)
+{
+	rdVec2 vec;
+
+	vec.x = x;
+	vec.y = y;
+
+	return vec;
+}
+
+static rdVec3 vc_Vec3(float x, float y, float z)
+{
+	rdVec3 vec;
+
+	vec.x = x;
+	vec.y = y;
+	vec.z = z;
+
+	return vec;
+}
+
+static rdVec4 vc_Vec4(float x, float y, float z, float w)
+{
+	rdVec4 vec;
+
+	vec.x = x;
+	vec.y = y;
+	vec.z = z;
+	vec.w = w;
+
+	return vec;
+}
+
+static void vc_Zero(rdVec3 *vec)
+{
+	vec->x = 0.0f;
+	vec->y = 0.0f;
+	vec->z = 0.0f;
+}
+
+static rdVec3 vc_Add(const rdVec3 *a, const rdVec3 *b)
+{
+	rdVec3 vec;
+
+	vec.x = a->x + b->x;
+	vec.y = a->y + b->y;
+	vec.z = a->z + b->z;
+
+	return vec;
+}
+
+static rdVec3 vc_Sub(const rdVec3 *a, const rdVec3 *b)
+{
+	rdVec3 vec;
+
+	vec.x = a->x - b->x;
+	vec.y = a->y - b->y;
+	vec.z = a->z - b->z;
+
+	return vec;
+}
+
+static rdVec3 vc_Multiply(const rdVec3 *a, const rdVec3 *b)
+{
+	rdVec3 vec;
+
+	vec.x = a->x * b->x;
+	vec.y = a->y * b->y;
+	vec.z = a->z * b->z;
+
+	return vec;
+}
+
+/* Unlike fminf and fmaxf these compile to single instructions, NaNs aren't handled */
+static rdVec3 vc_Min(const rdVec3 *a, const rdVec3 *b)
+{
+	rdVec3 vec;
+
+	vec.x = a->x < b->x ? a->x : b->x;
+	vec.y = a->y < b->y ? a->y : b->y;
+	vec.z = a->z < b->z ? a->z : b->z;
+
+	return vec;
+}
+
+static rdVec3 vc_Max(const rdVec3 *a, const rdVec3 *b)
+{
+	rdVec3 vec;
+
+	vec.x = a->x > b->x ? a->x : b->x;
+	vec.y = a->y > b->y ? a->y : b->y;
+	vec.z = a->z > b->z ? a->z : b->z;
+
+	return vec;
+}
+
+static rdVec3 vc_MultiScalar(const rdVec3 *vec, float scalar)
+{
+	rdVec3 ret;
+
+	ret.x = vec->x * scalar;
+	ret.y = vec->y * scalar;
+	ret.z = vec->z * scalar;
+
+	return ret;
+}
+#if 0
+static rdVec3 vc_DivideScalar(const rdVec3 *vec, float scalar)
+{
+	rdVec3 ret;
+
+	ret.x = vec->x / scalar;
+	ret.y = vec->y / scalar;
+	ret.z = vec->z / scalar;
+
+	return ret;
+}
+#endif
+static int vc_Equal(const rdVec3 *a, const rdVec3 *b)
+{
+	if (a->x == b->x && a->y == b->y && a->z == b->z)
+		return 1;
+	return 0;
+}
+
+static void vc_Normalize(rdVec3 *vec)
+{
+	float len;
+
+	len = sqrt((vec->x * vec->x) + (vec->y * vec->y) + (vec->z * vec->z));
+	if (len == 0.0f)
+		return;
+
+	vec->x = vec->x / len;
+	vec->y = vec->y / len;
+	vec->z = vec->z / len;
+}
+
+static void vc_Invert(rdVec3 *vec)
+{
+	if (vec->x != 0.0f)
+		vec->x = -vec->x;
+	if (vec->y != 0.0f)
+		vec->y = -vec->y;
+	if (vec->z != 0.0f)
+		vec->z = -vec->z;
+}
+
+static rdVec3 vc_Cross(const rdVec3 *a, const rdVec3 *b)
+{
+	rdVec3 cross;
+
+	cross.x = (a->y * b->z) - (b->y * a->z);
+	cross.y = (a->z * b->x) - (b->z * a->x);
+	cross.z = (a->x * b->y) - (b->x * a->y);
+	
+	return cross;
+}
+
+static float vc_Dot(const rdVec3 *a, const rdVec3 *b)
+{
+	rdVec3 tmp;
+
+	tmp = vc_Multiply(a, b);
+	return tmp.x + tmp.y + tmp.z;
+}
+
+/* The planes are sums and differences of the rows of a view projection, left, right, bottom, top,
+ * near, far, with the normals pointing inwards. A box is outside a plane if even its corner
+ * furthest along the normal, at distance n.c + |n|.e, is behind it. */
+static void cu_FrustumPlanes(rdVec4 *outPlanes, const rdMat4 *mViewProjection)
+{
+	for (int i = 0; i < 6; i++) {
+		const float  sign = i % 2 == 0 ? 1.0f : -1.0f;
+		const float *row  = mViewProjection->m[i / 2];
+		const float *w    = mViewProjection->m[3];
+
+		rdVec3 normal;
+		float  length;
+
+		normal = vc_Vec3(w[0] + sign * row[0], w[1] + sign * row[1], w[2] + sign * row[2]);
+		length = sqrtf(vc_Dot(&normal, &normal));
+
+		outPlanes[i] = vc_Vec4(normal.x / length, normal.y / length, normal.z / length,
+		                       (w[3] + sign * row[3]) / length);
+	}
+}
+
+/* Unjittered, so the planes don't move from frame to frame */
+static void cu_CameraPlanes(rdVec4 *outPlanes)
+{
+	rdMat4 mViewProjection;
+
+	if (local.defaultCamera.update)
+		cm_SyncViewMatrix(&local.defaultCamera);
+
+	mx_MultiAB(&mViewProjection, &local.mProjection, &local.defaultCamera.mView);
+	cu_FrustumPlanes(outPlanes, &mViewProjection);
+}
+
+/* A caster only matters if it is in the light frustum, and if it lies between the light and some
+ * point the camera sees. The second region is the convex hull of the camera frustum and the light
+ * position: the camera planes the light is inside of, plus a plane through the light and each
+ * silhouette edge, where a plane the light is inside of meets one it is outside of. */
+static int cu_ShadowCasterPlanes(rdVec4 *outPlanes, const rdShadowMap *sm)
+{
+	const rdLight *l = &local.lights[sm->originLightIndex];
+
+	rdVec4 camera[6];
+	rdVec3 corners[8], center, light;
+	int    facing[6];
+	int    numPlanes = 6;
+
+	cu_FrustumPlanes(outPlanes, &sm->mLightspace);
+	cu_CameraPlanes(camera);
+
+	light = vc_Vec3(l->x, l->y, l->z);
+
+	for (int i = 0; i < 6; i++) {
+		facing[i] = camera[i].x * light.x + camera[i].y * light.y + camera[i].z * light.z +
+		            camera[i].w >= 0.0f;
+		if (facing[i])
+			outPlanes[numPlanes++] = camera[i];
+	}
+
+	/* Corner bit 0 picks left/right, bit 1 bottom/top, bit 2 near/far */
+	vc_Zero(&center);
+
+	for (int i = 0; i < 8; i++) {
+		corners[i] = cu_IntersectPlanes(&camera[i & 1], &camera[2 + ((i >> 1) & 1)],
+		                                &camera[4 + ((i >> 2) & 1)]);
+		center = vc_Add(&center, &corners[i]);
+	}
+
+	center = vc_MultiScalar(&center, 1.0f / 8.0f);
+
+	/* Every pair of planes that aren't opposite shares an edge, running along the third axis */
+	for (int a = 0; a < 6; a++) {
+		for (int b = a + 1; b < 6; b++) {
+			const int axis = 3 - a / 2 - b / 2;
+			int       corner;
+			rdVec3    edge, toLight, normal;
+			float     length, d;
+
+			if (a / 2 == b / 2 || facing[a] == facing[b])
+				continue;
+
+			corner = ((a % 2) << (a / 2)) | ((b % 2) << (b / 2));
+
+			edge    = vc_Sub(&corners[corner | 1 << axis], &corners[corner]);
+			toLight = vc_Sub(&light, &corners[corner]);
+			normal  = vc_Cross(&edge, &toLight);
+			length  = sqrtf(vc_Dot(&normal, &normal));
+
+			/* The light is on the edge's line; leaving the plane out only makes the volume
+			 * bigger */
+			if (length < 1.0e-6f)
+				continue;
+
+			normal = vc_MultiScalar(&normal, 1.0f / length);
+			d      = -vc_Dot(&normal, &corners[corner]);
+
+			if (vc_Dot(&normal, &center) + d < 0.0f) {
+				vc_Invert(&normal);
+				d = -d;
+			}
+
+			outPlanes[numPlanes++] = vc_Vec4(normal.x, normal.y, normal.z, d);
+		}
+	}
+
+	return numPlanes;
+}
+
+/* The point where three planes meet */
+static rdVec3 cu_IntersectPlanes(const rdVec4 *a, const rdVec4 *b, const rdVec4 *c)
+{
+	const rdVec3 na = vc_Vec3(a->x, a->y, a->z);
+	const rdVec3 nb = vc_Vec3(b->x, b->y, b->z);
+	const rdVec3 nc = vc_Vec3(c->x, c->y, c->z);
+
+	rdVec3 bc, ca, ab, p;
+	float  det;
+
+	bc  = vc_Cross(&nb, &nc);
+	ca  = vc_Cross(&nc, &na);
+	ab  = vc_Cross(&na, &nb);
+	det = vc_Dot(&na, &bc);
+
+	bc = vc_MultiScalar(&bc, -a->w);
+	ca = vc_MultiScalar(&ca, -b->w);
+	ab = vc_MultiScalar(&ab, -c->w);
+
+	p = vc_Add(&bc, &ca);
+	p = vc_Add(&p, &ab);
+
+	return vc_MultiScalar(&p, 1.0f / det);
+}
+
+static int cu_TestBoxes(const rdCullList *list, const rdVec4 *planes, int numPlanes,
+                        unsigned char *outVisible)
+{
+	int numVisible = 0;
+
+#if RD_CULL_WIDTH == 8
+	__m256 splat[RD_CULL_MAX_PLANES][7];
+#elif RD_CULL_WIDTH == 4
+	__m128 splat[RD_CULL_MAX_PLANES][7];
+#endif
+
+#if RD_CULL_WIDTH == 8
+	for (int i = 0; i < numPlanes; i++) {
+		splat[i][0] = _mm256_set1_ps(planes[i].x);
+		splat[i][1] = _mm256_set1_ps(planes[i].y);
+		splat[i][2] = _mm256_set1_ps(planes[i].z);
+		splat[i][3] = _mm256_set1_ps(planes[i].w);
+		splat[i][4] = _mm256_set1_ps(fabsf(planes[i].x));
+		splat[i][5] = _mm256_set1_ps(fabsf(planes[i].y));
+		splat[i][6] = _mm256_set1_ps(fabsf(planes[i].z));
+	}
+#elif RD_CULL_WIDTH == 4
+	for (int i = 0; i < numPlanes; i++) {
+		splat[i][0] = _mm_set1_ps(planes[i].x);
+		splat[i][1] = _mm_set1_ps(planes[i].y);
+		splat[i][2] = _mm_set1_ps(planes[i].z);
+		splat[i][3] = _mm_set1_ps(planes[i].w);
+		splat[i][4] = _mm_set1_ps(fabsf(planes[i].x));
+		splat[i][5] = _mm_set1_ps(fabsf(planes[i].y));
+		splat[i][6] = _mm_set1_ps(fabsf(planes[i].z));
+	}
+#endif
+
+	for (int first = 0; first < list->numObjects; first += RD_CULL_WIDTH) {
+		unsigned int mask;
+		int          count;
+
+#if RD_CULL_WIDTH == 8
+		const __m256 cx = _mm256_loadu_ps(list->centerX + first);
+		const __m256 cy = _mm256_loadu_ps(list->centerY + first);
+		const __m256 cz = _mm256_loadu_ps(list->centerZ + first);
+		const __m256 ex = _mm256_loadu_ps(list->extentX + first);
+		const __m256 ey = _mm256_loadu_ps(list->extentY + first);
+		const __m256 ez = _mm256_loadu_ps(list->extentZ + first);
+
+		mask = 0xff;
+
+		for (int i = 0; i < numPlanes; i++) {
+			__m256 d;
+
+			d = _mm256_add_ps(_mm256_mul_ps(cx, splat[i][0]), splat[i][3]);
+			d = _mm256_add_ps(d, _mm256_mul_ps(cy, splat[i][1]));
+			d = _mm256_add_ps(d, _mm256_mul_ps(cz, splat[i][2]));
+			d = _mm256_add_ps(d, _mm256_mul_ps(ex, splat[i][4]));
+			d = _mm256_add_ps(d, _mm256_mul_ps(ey, splat[i][5]));
+			d = _mm256_add_ps(d, _mm256_mul_ps(ez, splat[i][6]));
+
+			mask &= _mm256_movemask_ps(_mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_GE_OQ));
+		}
+#elif RD_CULL_WIDTH == 4
+		const __m128 cx = _mm_loadu_ps(list->centerX + first);
+		const __m128 cy = _mm_loadu_ps(list->centerY + first);
+		const __m128 cz = _mm_loadu_ps(list->centerZ + first);
+		const __m128 ex = _mm_loadu_ps(list->extentX + first);
+		const __m128 ey = _mm_loadu_ps(list->extentY + first);
+		const __m128 ez = _mm_loadu_ps(list->extentZ + first);
+
+		mask = 0xf;
+
+		for (int i = 0; i < numPlanes; i++) {
+			__m128 d;
+
+			d = _mm_add_ps(_mm_mul_ps(cx, splat[i][0]), splat[i][3]);
+			d = _mm_add_ps(d, _mm_mul_ps(cy, splat[i][1]));
+			d = _mm_add_ps(d, _mm_mul_ps(cz, splat[i][2]));
+			d = _mm_add_ps(d, _mm_mul_ps(ex, splat[i][4]));
+			d = _mm_add_ps(d, _mm_mul_ps(ey, splat[i][5]));
+			d = _mm_add_ps(d, _mm_mul_ps(ez, splat[i][6]));
+
+			mask &= _mm_movemask_ps(_mm_cmpge_ps(d, _mm_setzero_ps()));
+		}
+#else
+		mask = 1;
+
+		for (int i = 0; i < numPlanes && mask != 0; i++) {
+			float d;
+
+			d = planes[i].x * list->centerX[first] + planes[i].y * list->centerY[first] +
+			    planes[i].z * list->centerZ[first] + planes[i].w +
+			    fabsf(planes[i].x) * list->extentX[first] +
+			    fabsf(planes[i].y) * list->extentY[first] +
+			    fabsf(planes[i].z) * list->extentZ[first];
+
+			mask = d >= 0.0f;
+		}
+#endif
+
+		count = list->numObjects - first < RD_CULL_WIDTH ? list->numObjects - first
+		                                                 : RD_CULL_WIDTH;
+
+		for (int i = 0; i < count; i++) {
+			outVisible[first + i] = (mask >> i) & 1;
+			numVisible += outVisible[first + i];
+		}
+	}
+
+	return numVisible;
+}
+
+static void cu_StoreBounds(rdCullList *list, int index, const rdObject *obj)
+{
+	list->centerX[index] = obj->worldCenter.x;
+	list->centerY[index] = obj->worldCenter.y;
+	list->centerZ[index] = obj->worldCenter.z;
+	list->extentX[index] = obj->worldExtent.x;
+	list->extentY[index] = obj->worldExtent.y;
+	list->extentZ[index] = obj->worldExtent.z;
+
+	cu_MarkDirty(list, index, index + 1);
+}
+
+/* Box around the objects of a list that have geometry, 0 if none do */
+static int cu_ListBounds(const rdCullList *list, rdVec3 *outCenter, rdVec3 *outExtent)
+{
+	rdVec3 boxMin = vc_Vec3(HUGE_VALF, HUGE_VALF, HUGE_VALF);
+	rdVec3 boxMax = vc_Vec3(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF);
+	int    found  = 0;
+
+	for (int i = 0; i < list->numObjects; i++) {
+		if (list->extentX[i] < 0.0f)
+			continue;
+
+		found = 1;
+		boxMin.x = fminf(boxMin.x, list->centerX[i] - list->extentX[i]);
+		boxMin.y = fminf(boxMin.y, list->centerY[i] - list->extentY[i]);
+		boxMin.z = fminf(boxMin.z, list->centerZ[i] - list->extentZ[i]);
+		boxMax.x = fmaxf(boxMax.x, list->centerX[i] + list->extentX[i]);
+		boxMax.y = fmaxf(boxMax.y, list->centerY[i] + list->extentY[i]);
+		boxMax.z = fmaxf(boxMax.z, list->centerZ[i] + list->extentZ[i]);
+	}
+
+	if (!found)
+		return 0;
+
+	*outCenter = vc_Vec3(0.5f * (boxMin.x + boxMax.x), 0.5f * (boxMin.y + boxMax.y),
+	                     0.5f * (boxMin.z + boxMax.z));
+	*outExtent = vc_Vec3(0.5f * (boxMax.x - boxMin.x), 0.5f * (boxMax.y - boxMin.y),
+	                     0.5f * (boxMax.z - boxMin.z));
+	return 1;
+}
+
+/* Box around the list's objects for an occlusion test, 0 if there is nothing to test */
+static int cu_OcclusionBox(const rdCullList *list, rdVec3 *outCenter, rdVec3 *outExtent)
+{
+	rdVec4 planes[6];
+
+	/* Nothing resident yet, so nothing would be drawn anyway */
+	if (!cu_ListBounds(list, outCenter, outExtent))
+		return 0;
+
+	/* Clipped by the near plane the box covers less of the screen than the objects, which is
+	 * what happens to the box around the camera itself */
+	cu_CameraPlanes(planes);
+	if (planes[4].x * outCenter->x + planes[4].y * outCenter->y + planes[4].z * outCenter->z +
+	    planes[4].w < fabsf(planes[4].x) * outExtent->x + fabsf(planes[4].y) * outExtent->y +
+	                  fabsf(planes[4].z) * outExtent->z)
+		return 0;
+
+	return 1;
+}
+
+/* Draws the box into the prepass depth with a query around it, and leaves the depth
+ * velocity framebuffer and the depth only program bound. Returns the query, 0 if this frame's
+ * queries are used up and nothing was drawn. */
+static GLuint cu_DrawOcclusionBox(const rdVec3 *center, const rdVec3 *extent, int numObjects)
+{
+	const int frame = local.frameIndex % RD_OCCLUSION_FRAMES;
+
+	rdMat4 mBox, mMVP;
+	GLuint query;
+
+	if (local.numOcclusionTests[frame] == RD_OCCLUSION_TESTS)
+		return 0;
+
+	query = local.occlusionQueries[frame][local.numOcclusionTests[frame]];
+	local.occlusionObjects[frame][local.numOcclusionTests[frame]] = numObjects;
+	local.numOcclusionTests[frame]++;
+
+	mx_Identity(&mBox);
+	mBox.m[0][0] = extent->x;
+	mBox.m[1][1] = extent->y;
+	mBox.m[2][2] = extent->z;
+	mBox.m[0][3] = center->x;
+	mBox.m[1][3] = center->y;
+	mBox.m[2][3] = center->z;
+
+	/* The jittered projection the depth prepass was drawn with */
+	mx_MultiABC(&mMVP, &local.mProjectionJitter, &local.defaultCamera.mView, &mBox);
+
+	st_StopTimer();
+
+	gl.BindFramebuffer(GL_FRAMEBUFFER, local.depthVelocityBuffer.framebuf);
+	gl.ColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	gl.DepthMask(GL_FALSE);
+	gl.DepthFunc(GL_LEQUAL);
+	gl.Disable(GL_CULL_FACE);
+
+	gl.UseProgram(local.depthOnlyShader.shaderProgram);
+	gl.UniformMatrix4fv(local.depthOnlyShader.uniforms[0], 1, GL_TRUE, &mMVP.m[0][0]);
+	gh_BindVertexArray(local.occlusionBox.vertexArray);
+
+	gl.BeginQuery(GL_ANY_SAMPLES_PASSED, query);
+	gl.DrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, NULL);
+	gl.EndQuery(GL_ANY_SAMPLES_PASSED);
+
+	gl.Enable(GL_CULL_FACE);
+	gl.DepthFunc(GL_LESS);
+	gl.DepthMask(GL_TRUE);
+	gl.ColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+	return query;
+}
+
+static void cu_MarkDirty(rdCullList *list, int first, int end)
+{
+	if (list->dirtyFirst == list->dirtyEnd) {
+		list->dirtyFirst = first;
+		list->dirtyEnd   = end;
+		return;
+	}
+
+	if (first < list->dirtyFirst)
+		list->dirtyFirst = first;
+	if (end > list->dirtyEnd)
+		list->dirtyEnd = end;
+}
+
+/* Records are attributes of one point per object; the commands come back through transform
+ * feedback into a buffer that is bound for indirect draws after */
+static int cu_SetupGpuList(rdCullList *list)
+{
+	const GLsizei stride = sizeof (rdGpuCullRecord);
+
+	list->records = mem.alloc(list->capacity * sizeof (rdGpuCullRecord));
+	if (list->records == NULL)
+		return 0;
+
+	gl.GenBuffers(1, &list->recordBuffer);
+	gl.BindBuffer(GL_ARRAY_BUFFER, list->recordBuffer);
+	gl.BufferData(GL_ARRAY_BUFFER, list->capacity * sizeof (rdGpuCullRecord), NULL,
+	              GL_DYNAMIC_DRAW);
+
+	gl.GenBuffers(1, &list->commandBuffer);
+	gl.BindBuffer(GL_TRANSFORM_FEEDBACK_BUFFER, list->commandBuffer);
+	gl.BufferData(GL_TRANSFORM_FEEDBACK_BUFFER, list->capacity * sizeof (rdDrawCommand), NULL,
+	              GL_DYNAMIC_COPY);
+	gl.BindBuffer(GL_TRANSFORM_FEEDBACK_BUFFER, 0);
+
+	gl.GenVertexArrays(1, &list->vertexArray);
+	gh_BindVertexArray(list->vertexArray);
+
+	gl.VertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, stride,
+	                       (GLvoid *) offsetof(rdGpuCullRecord, center));
+	gl.VertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, stride,
+	                       (GLvoid *) offsetof(rdGpuCullRecord, extent));
+	gl.VertexAttribPointer(2, RD_MAX_LODS, GL_FLOAT, GL_FALSE, stride,
+	                       (GLvoid *) offsetof(rdGpuCullRecord, lodErrors));
+	gl.VertexAttribIPointer(3, RD_MAX_LODS, GL_UNSIGNED_INT, stride,
+	                        (GLvoid *) offsetof(rdGpuCullRecord, lodCounts));
+	gl.VertexAttribIPointer(4, RD_MAX_LODS, GL_UNSIGNED_INT, stride,
+	                        (GLvoid *) offsetof(rdGpuCullRecord, lodFirsts));
+	gl.VertexAttribIPointer(5, 2, GL_INT, stride, (GLvoid *) offsetof(rdGpuCullRecord, numLods));
+
+	for (int i = 0; i < 6; i++)
+		gl.EnableVertexAttribArray(i);
+
+	list->geometryMoves = local.geometryMoves;
+	cu_MarkDirty(list, 0, list->numObjects);
+	return 1;
+}
+
+static void cu_FillRecord(rdGpuCullRecord *record, const rdObject *obj)
+{
+	const rdGeometry *geo = obj->geometry;
+
+	record->center[0] = obj->worldCenter.x;
+	record->center[1] = obj->worldCenter.y;
+	record->center[2] = obj->worldCenter.z;
+	record->center[3] = obj->worldRadius;
+	record->extent[0] = obj->worldExtent.x;
+	record->extent[1] = obj->worldExtent.y;
+	record->extent[2] = obj->worldExtent.z;
+	record->extent[3] = obj->scale;
+
+	memset(record->lodErrors, 0, sizeof (record->lodErrors));
+	memset(record->lodCounts, 0, sizeof (record->lodCounts));
+	memset(record->lodFirsts, 0, sizeof (record->lodFirsts));
+	record->numLods    = 0;
+	record->baseVertex = 0;
+
+	if (obj->status != RD_OBJECT_RESIDENT)
+		return;
+
+	if (obj->isIndexed) {
+		const size_t indexSize = geo->indexType == GL_UNSIGNED_INT ? sizeof (GLuint)
+		                                                           : sizeof (GLushort);
+
+		for (int i = 0; i < geo->numLods; i++) {
+			record->lodErrors[i] = geo->lods[i].error;
+			record->lodCounts[i] = geo->lods[i].numIndices;
+			record->lodFirsts[i] = geo->indexOffset / indexSize + geo->lods[i].firstIndex;
+		}
+
+		record->numLods    = geo->numLods;
+		record->baseVertex = geo->baseVertex;
+	} else {
+		record->lodCounts[0] = obj->numVertices;
+		record->lodFirsts[0] = geo->baseVertex;
+		record->numLods      = 1;
+	}
+}
+
+static rdOccluderMesh *oc_CreateMesh(int numVertices, const rdVertex *vertices, int numIndices,
+                                     const void *indices, rdIndexFormat indexFormat)
+{
+	rdOccluderMesh *mesh;
+
+	if (indices == NULL)
+		numIndices = numVertices;
+
+	mesh = mem.alloc(sizeof (*mesh) + numVertices * sizeof (rdVec3) +
+	                 numIndices * sizeof (rdIndex32));
+	if (mesh == NULL)
+		return NULL;
+
+	mesh->numVertices = numVertices;
+	mesh->numIndices  = numIndices;
+	mesh->vertices    = (rdVec3 *) (mesh + 1);
+	mesh->indices     = (rdIndex32 *) (mesh->vertices + numVertices);
+
+	memcpy(mesh->vertices, vertices, numVertices * sizeof (rdVec3));
+
+	if (indices != NULL) {
+		for (int i = 0; i < numIndices; i++)
+			mesh->indices[i] = me_Index(indices, indexFormat, i);
+	} else {
+		for (int i = 0; i < numIndices; i++)
+			mesh->indices[i] = i;
+	}
+
+	return mesh;
+}
+
+/* The buffers and the workers are only set up once something is rasterized */
+static int oc_Start(rdOccluders *oc)
+{
+	const int numPixels = RD_OCCLUDER_WIDTH * RD_OCCLUDER_HEIGHT;
+
+	if (oc->depth != NULL)
+		return 1;
+
+	oc->depth   = mem.alloc(numPixels * sizeof (float));
+	oc->tileMax = mem.alloc(numPixels / (RD_OCCLUDER_TILE * RD_OCCLUDER_TILE) * sizeof (float));
+
+	if (oc->depth == NULL || oc->tileMax == NULL) {
+		mem.free(oc->depth);
+		mem.free(oc->tileMax);
+		oc->depth   = NULL;
+		oc->tileMax = NULL;
+		return 0;
+	}
+
+	/* Workers wait for the generation to move on from 0, so they can't miss the first one;
+	 * any that fail to start leave more bands to the render thread */
+	for (oc->numThreads = 0; oc->numThreads < RD_OCCLUDER_THREADS; oc->numThreads++) {
+		if (pthread_create(&oc->threads[oc->numThreads], NULL, oc_WorkerThread, oc) != 0)
+			break;
+	}
+
+	return 1;
+}
+
+static void oc_Stop(rdOccluders *oc)
+{
+	pthread_mutex_lock(&oc->lock);
+	oc->quit = 1;
+	pthread_cond_broadcast(&oc->wake);
+	pthread_mutex_unlock(&oc->lock);
+
+	for (int i = 0; i < oc->numThreads; i++)
+		pthread_join(oc->threads[i], NULL);
+	oc->numThreads = 0;
+
+	mem.free(oc->depth);
+	mem.free(oc->tileMax);
+	mem.free(oc->triangles);
+	mem.free(oc->queued);
+	oc->depth     = NULL;
+	oc->tileMax   = NULL;
+	oc->triangles = NULL;
+	oc->queued    = NULL;
+}
+
+/* Transforms an occluder into clip space, clips it against the near plane and appends its
+ * triangles in screen space. Triangles outside any other plane are dropped, the rest are left
+ * to the bounding box clamp of the rasterizer. */
+static void oc_AddTriangles(rdOccluders *oc, const rdObject *obj)
+{
+	const rdOccluderMesh *mesh = obj->geometry->occluder;
+
+	rdMat4  mMVP;
+	rdVec4 *clip;
+
+	mx_MultiAB(&mMVP, &oc->mViewProjection, &obj->mModel);
+
+	clip = ar_Alloc(&local.scratch, mesh->numVertices * sizeof (*clip));
+	if (clip == NULL)
+		return;
+
+	for (int i = 0; i < mesh->numVertices; i++) {
+		rdVec4 v = vc_Vec4(mesh->vertices[i].x, mesh->vertices[i].y, mesh->vertices[i].z, 1.0f);
+
+		clip[i] = mx_MultiVector4(&mMVP, &v);
+	}
+
+	for (int i = 0; i + 2 < mesh->numIndices; i += 3) {
+		const rdVec4 *c[3];
+		rdVec4        polygon[4];
+		rdVec3        screen[4];
+		int           numCorners = 0;
+
+		c[0] = &clip[mesh->indices[i]];
+		c[1] = &clip[mesh->indices[i + 1]];
+		c[2] = &clip[mesh->indices[i + 2]];
+
+		if ((c[0]->x >  c[0]->w && c[1]->x >  c[1]->w && c[2]->x >  c[2]->w) ||
+		    (c[0]->x < -c[0]->w && c[1]->x < -c[1]->w && c[2]->x < -c[2]->w) ||
+		    (c[0]->y >  c[0]->w && c[1]->y >  c[1]->w && c[2]->y >  c[2]->w) ||
+		    (c[0]->y < -c[0]->w && c[1]->y < -c[1]->w && c[2]->y < -c[2]->w) ||
+		    (c[0]->z >  c[0]->w && c[1]->z >  c[1]->w && c[2]->z >  c[2]->w))
+			continue;
+
+		/* Near plane, z >= -w */
+		for (int k = 0; k < 3; k++) {
+			const rdVec4 *a  = c[k];
+			const rdVec4 *b  = c[(k + 1) % 3];
+			const float   da = a->z + a->w;
+			const float   db = b->z + b->w;
+
+			if (da >= 0.0f)
+				polygon[numCorners++] = *a;
+
+			if ((da >= 0.0f) != (db >= 0.0f)) {
+				const float t = da / (da - db);
+
+				polygon[numCorners++] = vc_Vec4(a->x + t * (b->x - a->x),
+				                                a->y + t * (b->y - a->y),
+				                                a->z + t * (b->z - a->z),
+				                                a->w + t * (b->w - a->w));
+			}
+		}
+
+		for (int k = 0; k < numCorners; k++) {
+			screen[k].x = (0.5f * polygon[k].x / polygon[k].w + 0.5f) * RD_OCCLUDER_WIDTH;
+			screen[k].y = (0.5f * polygon[k].y / polygon[k].w + 0.5f) * RD_OCCLUDER_HEIGHT;
+			screen[k].z = polygon[k].z / polygon[k].w;
+		}
+
+		for (int k = 1; k + 1 < numCorners; k++)
+			oc_PushTriangle(oc, &screen[0], &screen[k], &screen[k + 1]);
+	}
+}
+
+/* Drops triangles that cover no pixel centers, and sets up the rest counter-clockwise */
+static void oc_PushTriangle(rdOccluders *oc, const rdVec3 *a, const rdVec3 *b, const rdVec3 *c)
+{
+	rdOccluderTriangle *t;
+
+	int   firstX, lastX, firstY, lastY;
+	float area;
+
+	firstX = (int) ceilf(fminf(a->x, fminf(b->x, c->x)) - 0.5f);
+	lastX  = (int) floorf(fmaxf(a->x, fmaxf(b->x, c->x)) - 0.5f);
+	firstY = (int) ceilf(fminf(a->y, fminf(b->y, c->y)) - 0.5f);
+	lastY  = (int) floorf(fmaxf(a->y, fmaxf(b->y, c->y)) - 0.5f);
+
+	firstX = firstX > 0 ? firstX : 0;
+	firstY = firstY > 0 ? firstY : 0;
+	lastX  = lastX < RD_OCCLUDER_WIDTH - 1 ? lastX : RD_OCCLUDER_WIDTH - 1;
+	lastY  = lastY < RD_OCCLUDER_HEIGHT - 1 ? lastY : RD_OCCLUDER_HEIGHT - 1;
+
+	if (firstX > lastX || firstY > lastY)
+		return;
+
+	area = (b->x - a->x) * (c->y - a->y) - (c->x - a->x) * (b->y - a->y);
+	if (fabsf(area) < 1.0e-6f)
+		return;
+
+	if (area < 0.0f) {
+		const rdVec3 *tmp = b;
+
+		b    = c;
+		c    = tmp;
+		area = -area;
+	}
+
+	if (oc->numTriangles == oc->triangleCapacity) {
+		const int           capacity = oc->triangleCapacity > 0 ? 2 * oc->triangleCapacity : 1024;
+		rdOccluderTriangle *triangles;
+
+		/* Dropping triangles only makes culling less effective */
+		triangles = mem.alloc(capacity * sizeof (*triangles));
+		if (triangles == NULL)
+			return;
+
+		if (oc->numTriangles > 0)
+			memcpy(triangles, oc->triangles, oc->numTriangles * sizeof (*triangles));
+		mem.free(oc->triangles);
+
+		oc->triangles        = triangles;
+		oc->triangleCapacity = capacity;
+	}
+
+	t = &oc->triangles[oc->numTriangles++];
+
+	t->firstX = firstX - firstX % RD_CULL_WIDTH;
+	t->lastX  = lastX;
+	t->firstY = firstY;
+	t->lastY  = lastY;
+
+	t->a[0] = a->y - b->y; t->b[0] = b->x - a->x; t->c[0] = -(t->a[0] * a->x + t->b[0] * a->y);
+	t->a[1] = b->y - c->y; t->b[1] = c->x - b->x; t->c[1] = -(t->a[1] * b->x + t->b[1] * b->y);
+	t->a[2] = c->y - a->y; t->b[2] = a->x - c->x; t->c[2] = -(t->a[2] * c->x + t->b[2] * c->y);
+
+	t->dzdx = ((b->z - a->z) * (c->y - a->y) - (c->z - a->z) * (b->y - a->y)) / area;
+	t->dzdy = ((c->z - a->z) * (b->x - a->x) - (b->z - a->z) * (c->x - a->x)) / area;
+	t->z    = a->z - t->dzdx * a->x - t->dzdy * a->y;
+}
+
+static void *oc_WorkerThread(void *arg)
+{
+	rdOccluders *oc = arg;
+
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&oc->lock);
+
+	for (;;) {
+		while (!oc->quit && oc->generation == seen)
+			pthread_cond_wait(&oc->wake, &oc->lock);
+
+		if (oc->quit)
+			break;
+
+		seen = oc->generation;
+		pthread_mutex_unlock(&oc->lock);
+
+		oc_RasterizeBands(oc);
+
+		pthread_mutex_lock(&oc->lock);
+		if (--oc->pending == 0)
+			pthread_cond_signal(&oc->done);
+	}
+
+	pthread_mutex_unlock(&oc->lock);
+
+	return NULL;
+}
+
+static void oc_RasterizeBands(rdOccluders *oc)
+{
+	const int numBands = RD_OCCLUDER_HEIGHT / RD_OCCLUDER_BAND;
+
+	for (;;) {
+		int band = -1;
+
+		pthread_mutex_lock(&oc->lock);
+		if (oc->nextBand < numBands)
+			band = oc->nextBand++;
+		pthread_mutex_unlock(&oc->lock);
+
+		if (band < 0)
+			return;
+
+		oc_RasterizeBand(oc, band);
+	}
+}
+
+/* Clears a band, draws every triangle that reaches into it keeping the nearest depth, then
+ * updates the band's tiles. Pixels are covered if their center is inside the triangle (both
+ * windings count, interiors are seen from inside). */
+static void oc_RasterizeBand(rdOccluders *oc, int band)
+{
+	const int firstRow = band * RD_OCCLUDER_BAND;
+	const int lastRow  = firstRow + RD_OCCLUDER_BAND - 1;
+
+#if RD_CULL_WIDTH == 8
+	const __m256 lanes = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+#elif RD_CULL_WIDTH == 4
+	const __m128 lanes = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+#endif
+
+	for (int i = firstRow * RD_OCCLUDER_WIDTH; i < (lastRow + 1) * RD_OCCLUDER_WIDTH; i++)
+		oc->depth[i] = 1.0f;
+
+	for (int i = 0; i < oc->numTriangles; i++) {
+		const rdOccluderTriangle *t = &oc->triangles[i];
+
+		const float *a = t->a, *b = t->b, *c = t->c;
+		const float  dzdx = t->dzdx;
+		const int    firstX = t->firstX, lastX = t->lastX;
+		const int    firstY = t->firstY > firstRow ? t->firstY : firstRow;
+		const int    lastY  = t->lastY < lastRow ? t->lastY : lastRow;
+
+		for (int y = firstY; y <= lastY; y++) {
+			float *row = oc->depth + y * RD_OCCLUDER_WIDTH;
+
+			const float px = firstX + 0.5f;
+			const float py = y + 0.5f;
+			const float e0 = a[0] * px + b[0] * py + c[0];
+			const float e1 = a[1] * px + b[1] * py + c[1];
+			const float e2 = a[2] * px + b[2] * py + c[2];
+			const float z  = t->z + dzdx * px + t->dzdy * py;
+
+#if RD_CULL_WIDTH == 8
+			const __m256 step0 = _mm256_set1_ps(8.0f * a[0]);
+			const __m256 step1 = _mm256_set1_ps(8.0f * a[1]);
+			const __m256 step2 = _mm256_set1_ps(8.0f * a[2]);
+			const __m256 stepZ = _mm256_set1_ps(8.0f * dzdx);
+			const __m256 zero  = _mm256_setzero_ps();
+
+			__m256 ve0 = _mm256_add_ps(_mm256_set1_ps(e0), _mm256_mul_ps(lanes, _mm256_set1_ps(a[0])));
+			__m256 ve1 = _mm256_add_ps(_mm256_set1_ps(e1), _mm256_mul_ps(lanes, _mm256_set1_ps(a[1])));
+			__m256 ve2 = _mm256_add_ps(_mm256_set1_ps(e2), _mm256_mul_ps(lanes, _mm256_set1_ps(a[2])));
+			__m256 vz  = _mm256_add_ps(_mm256_set1_ps(z), _mm256_mul_ps(lanes, _mm256_set1_ps(dzdx)));
+
+			for (int x = firstX; x <= lastX; x += 8) {
+				__m256 inside, d;
+
+				inside = _mm256_and_ps(_mm256_cmp_ps(ve0, zero, _CMP_GE_OQ),
+				                       _mm256_cmp_ps(ve1, zero, _CMP_GE_OQ));
+				inside = _mm256_and_ps(inside, _mm256_cmp_ps(ve2, zero, _CMP_GE_OQ));
+
+				d = _mm256_loadu_ps(row + x);
+				d = _mm256_blendv_ps(d, _mm256_min_ps(d, vz), inside);
+				_mm256_storeu_ps(row + x, d);
+
+				ve0 = _mm256_add_ps(ve0, step0);
+				ve1 = _mm256_add_ps(ve1, step1);
+				ve2 = _mm256_add_ps(ve2, step2);
+				vz  = _mm256_add_ps(vz, stepZ);
+			}
+#elif RD_CULL_WIDTH == 4
+			const __m128 step0 = _mm_set1_ps(4.0f * a[0]);
+			const __m128 step1 = _mm_set1_ps(4.0f * a[1]);
+			const __m128 step2 = _mm_set1_ps(4.0f * a[2]);
+			const __m128 stepZ = _mm_set1_ps(4.0f * dzdx);
+			const __m128 zero  = _mm_setzero_ps();
+
+			__m128 ve0 = _mm_add_ps(_mm_set1_ps(e0), _mm_mul_ps(lanes, _mm_set1_ps(a[0])));
+			__m128 ve1 = _mm_add_ps(_mm_set1_ps(e1), _mm_mul_ps(lanes, _mm_set1_ps(a[1])));
+			__m128 ve2 = _mm_add_ps(_mm_set1_ps(e2), _mm_mul_ps(lanes, _mm_set1_ps(a[2])));
+			__m128 vz  = _mm_add_ps(_mm_set1_ps(z), _mm_mul_ps(lanes, _mm_set1_ps(dzdx)));
+
+			for (int x = firstX; x <= lastX; x += 4) {
+				__m128 inside, d;
+
+				inside = _mm_and_ps(_mm_cmpge_ps(ve0, zero), _mm_cmpge_ps(ve1, zero));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(ve2, zero));
+
+				d = _mm_loadu_ps(row + x);
+				d = _mm_or_ps(_mm_and_ps(inside, _mm_min_ps(d, vz)), _mm_andnot_ps(inside, d));
+				_mm_storeu_ps(row + x, d);
+
+				ve0 = _mm_add_ps(ve0, step0);
+				ve1 = _mm_add_ps(ve1, step1);
+				ve2 = _mm_add_ps(ve2, step2);
+				vz  = _mm_add_ps(vz, stepZ);
+			}
+#else
+			for (int x = firstX; x <= lastX; x++) {
+				const float dx = (float) (x - firstX);
+
+				if (e0 + a[0] * dx >= 0.0f && e1 + a[1] * dx >= 0.0f && e2 + a[2] * dx >= 0.0f)
+					row[x] = fminf(row[x], z + dzdx * dx);
+			}
+#endif
+		}
+	}
+
+	for (int ty = firstRow / RD_OCCLUDER_TILE; ty <= lastRow / RD_OCCLUDER_TILE; ty++) {
+		for (int tx = 0; tx < RD_OCCLUDER_WIDTH / RD_OCCLUDER_TILE; tx++) {
+			float farthest = 0.0f;
+
+			for (int y = ty * RD_OCCLUDER_TILE; y < (ty + 1) * RD_OCCLUDER_TILE; y++) {
+				const float *row = oc->depth + y * RD_OCCLUDER_WIDTH + tx * RD_OCCLUDER_TILE;
+
+				for (int x = 0; x < RD_OCCLUDER_TILE; x++)
+					farthest = fmaxf(farthest, row[x]);
+			}
+
+			oc->tileMax[ty * (RD_OCCLUDER_WIDTH / RD_OCCLUDER_TILE) + tx] = farthest;
+		}
+	}
+}
+
+/* A box is hidden if every pixel its screen rectangle touches holds something nearer than its
+ * nearest corner. Boxes reaching past the near plane never are. */
+static int oc_IsOccluded(const rdOccluders *oc, const rdVec3 *center, const rdVec3 *extent)
+{
+	const int tilesPerRow = RD_OCCLUDER_WIDTH / RD_OCCLUDER_TILE;
+
+	float minX = HUGE_VALF, minY = HUGE_VALF, minZ = HUGE_VALF;
+	float maxX = -HUGE_VALF, maxY = -HUGE_VALF;
+	int   firstX, lastX, firstY, lastY;
+
+	for (int i = 0; i < 8; i++) {
+		rdVec4 corner, p;
+
+		corner = vc_Vec4(center->x + (i & 1 ? extent->x : -extent->x),
+		                 center->y + (i & 2 ? extent->y : -extent->y),
+		                 center->z + (i & 4 ? extent->z : -extent->z), 1.0f);
+		p = mx_MultiVector4(&oc->mViewProjection, &corner);
+
+		if (p.z < -p.w)
+			return 0;
+
+		minX = fminf(minX, p.x / p.w);
+		maxX = fmaxf(maxX, p.x / p.w);
+		minY = fminf(minY, p.y / p.w);
+		maxY = fmaxf(maxY, p.y / p.w);
+		minZ = fminf(minZ, p.z / p.w);
+	}
+
+	/* Every pixel the rectangle overlaps, not just the ones whose centers it covers */
+	firstX = (int) floorf((0.5f * minX + 0.5f) * RD_OCCLUDER_WIDTH);
+	lastX  = (int) floorf((0.5f * maxX + 0.5f) * RD_OCCLUDER_WIDTH);
+	firstY = (int) floorf((0.5f * minY + 0.5f) * RD_OCCLUDER_HEIGHT);
+	lastY  = (int) floorf((0.5f * maxY + 0.5f) * RD_OCCLUDER_HEIGHT);
+
+	firstX = firstX > 0 ? firstX : 0;
+	firstY = firstY > 0 ? firstY : 0;
+	lastX  = lastX < RD_OCCLUDER_WIDTH - 1 ? lastX : RD_OCCLUDER_WIDTH - 1;
+	lastY  = lastY < RD_OCCLUDER_HEIGHT - 1 ? lastY : RD_OCCLUDER_HEIGHT - 1;
+
+	for (int ty = firstY / RD_OCCLUDER_TILE; ty <= lastY / RD_OCCLUDER_TILE; ty++) {
+		for (int tx = firstX / RD_OCCLUDER_TILE; tx <= lastX / RD_OCCLUDER_TILE; tx++) {
+			int x0, x1, y0, y1;
+
+			if (oc->tileMax[ty * tilesPerRow + tx] < minZ)
+				continue;
+
+			x0 = tx * RD_OCCLUDER_TILE > firstX ? tx * RD_OCCLUDER_TILE : firstX;
+			y0 = ty * RD_OCCLUDER_TILE > firstY ? ty * RD_OCCLUDER_TILE : firstY;
+			x1 = (tx + 1) * RD_OCCLUDER_TILE - 1 < lastX ? (tx + 1) * RD_OCCLUDER_TILE - 1 : lastX;
+			y1 = (ty + 1) * RD_OCCLUDER_TILE - 1 < lastY ? (ty + 1) * RD_OCCLUDER_TILE - 1 : lastY;
+
+			for (int y = y0; y <= y1; y++) {
+				const float *row = oc->depth + y * RD_OCCLUDER_WIDTH;
+
+				for (int x = x0; x <= x1; x++) {
+					if (row[x] >= minZ)
+						return 0;
+				}
+			}
+		}
+	}
+
+	return 1;
+}
+
+/* Arrays are in one block that starts with the nodes. The tree isn't carried over. */
+static int bv_Reserve(rdBvh *bvh, int capacity)
+{
+	rdBvhNode *nodes;
+	char      *p;
+
+	nodes = mem.alloc(2 * capacity * sizeof (rdBvhNode) + capacity * sizeof (rdObject *) +
+	                  2 * capacity * sizeof (rdVec3) + 4 * capacity * sizeof (int) +
+	                  (RD_BVH_REFIT_WORDS(capacity) + RD_BVH_REFIT_TOP(capacity)) *
+	                  sizeof (unsigned int) +
+	                  capacity * sizeof (unsigned char));
+	if (nodes == NULL)
+		return 0;
+
+	p = (char *) (nodes + 2 * capacity);
+
+	if (bvh->numObjects > 0) {
+		memcpy(p, bvh->objects, bvh->numObjects * sizeof (rdObject *));
+		memcpy(p + capacity * sizeof (rdObject *), bvh->boxMin, bvh->numObjects * sizeof (rdVec3));
+		memcpy(p + capacity * (sizeof (rdObject *) + sizeof (rdVec3)), bvh->boxMax,
+		       bvh->numObjects * sizeof (rdVec3));
+	}
+
+	mem.free(bvh->nodes);
+
+	bvh->nodes   = nodes;
+	bvh->objects = (rdObject **) p;
+	bvh->boxMin  = (rdVec3 *) (bvh->objects + capacity);
+	bvh->boxMax  = bvh->boxMin + capacity;
+	bvh->leafOf  = (int *) (bvh->boxMax + capacity);
+	bvh->dirty   = bvh->leafOf + capacity;
+	bvh->parents = bvh->dirty + capacity;
+	bvh->refit   = (unsigned int *) (bvh->parents + 2 * capacity);
+	bvh->refitWords = bvh->refit + RD_BVH_REFIT_WORDS(capacity);
+	bvh->moved   = (unsigned char *) (bvh->refitWords + RD_BVH_REFIT_TOP(capacity));
+
+	memset(bvh->refit, 0, (RD_BVH_REFIT_WORDS(capacity) + RD_BVH_REFIT_TOP(capacity)) *
+	                      sizeof (unsigned int));
+	memset(bvh->moved, 0, capacity);
+
+	bvh->capacity = capacity;
+	bvh->numNodes = 0;
+	bvh->numDirty = 0;
+	bvh->rebuild  = 1;
+
+	return 1;
+}
+
+/* Objects without geometry yet get a box with min above max, which nothing overlaps */
+static void bv_StoreBounds(rdBvh *bvh, int index, const rdObject *obj)
+{
+	bvh->boxMin[index] = vc_Sub(&obj->worldCenter, &obj->worldExtent);
+	bvh->boxMax[index] = vc_Add(&obj->worldCenter, &obj->worldExtent);
+
+	if (!bvh->rebuild && !bvh->moved[index]) {
+		bvh->moved[index] = 1;
+		bvh->dirty[bvh->numDirty++] = index;
+	}
+}
+
+static void bv_Update(rdBvh *bvh)
+{
+	if (bvh->rebuild)
+		bv_Build(bvh);
+	else if (bvh->numDirty > 0)
+		bv_Refit(bvh);
+}
+
+/* Top down, splitting each node where the surface area heuristic says */
+static void bv_Build(rdBvh *bvh)
+{
+	int stack[RD_BVH_STACK], depths[RD_BVH_STACK];
+	int top = 0;
+
+	for (int i = 0; i < bvh->numDirty; i++)
+		bvh->moved[bvh->dirty[i]] = 0;
+
+	bvh->numDirty = 0;
+	bvh->rebuild  = 0;
+	bvh->numNodes = 0;
+	bvh->cost     = 0.0f;
+
+	if (bvh->numObjects == 0) {
+		bvh->builtCost = 0.0f;
+		return;
+	}
+
+	bvh->nodes[0].first = 0;
+	bvh->nodes[0].count = bvh->numObjects;
+	bvh->parents[0]     = -1;
+	bvh->numNodes       = 1;
+
+	stack[top]  = 0;
+	depths[top] = 0;
+	top++;
+
+	/* A node holds its range of objects until it is split */
+	while (top > 0) {
+		const int node  = stack[--top];
+		const int depth = depths[top];
+
+		bv_FitNode(bvh, node);
+		bvh->cost += bv_Area(&bvh->nodes[node].min, &bvh->nodes[node].max);
+
+		if (bvh->nodes[node].count <= RD_BVH_LEAF_SIZE || !bv_SplitNode(bvh, node, depth)) {
+			const int first = bvh->nodes[node].first;
+
+			for (int i = first; i < first + bvh->nodes[node].count; i++) {
+				bvh->leafOf[i]            = node;
+				bvh->objects[i]->bvhIndex = i;
+			}
+
+			continue;
+		}
+
+		assert(top + 2 <= RD_BVH_STACK);
+
+		stack[top]  = bvh->nodes[node].first + 1;
+		depths[top] = depth + 1;
+		top++;
+		stack[top]  = bvh->nodes[node].first;
+		depths[top] = depth + 1;
+		top++;
+	}
+
+	bvh->builtCost = bvh->cost;
+}
+
+/* Bins the objects' centers along the longest axis and partitions them at the cheapest bin
+ * boundary, or in half if that leaves a side empty or the node is deep already. Turns the node
+ * into an inner node over two new ones; returns 0 if it has to stay a leaf. */
+static int bv_SplitNode(rdBvh *bvh, int node, int depth)
+{
+	const int first = bvh->nodes[node].first;
+	const int count = bvh->nodes[node].count;
+
+	rdObject **objects = bvh->objects + first;
+	rdVec3    *boxMin  = bvh->boxMin + first;
+	rdVec3    *boxMax  = bvh->boxMax + first;
+
+	int mid = count / 2;
+	int left;
+
+	if (bvh->numNodes + 2 > 2 * bvh->capacity)
+		return 0;
+
+	if (depth < RD_BVH_MAX_DEPTH) {
+		rdVec3 binMin[RD_BVH_BINS], binMax[RD_BVH_BINS];
+		int    binCount[RD_BVH_BINS];
+		float  rightArea[RD_BVH_BINS];
+		int    rightCount[RD_BVH_BINS];
+
+		rdVec3 centerMin = vc_Vec3(HUGE_VALF, HUGE_VALF, HUGE_VALF);
+		rdVec3 centerMax = vc_Vec3(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF);
+		float  lo[3], hi[3];
+		float  scale, bestCost = HUGE_VALF;
+		int    axis = 0, best = -1;
+
+		/* Centers doubled, to save the halving */
+		for (int i = 0; i < count; i++) {
+			const rdVec3 c = vc_Add(&boxMin[i], &boxMax[i]);
+
+			centerMin = vc_Min(&centerMin, &c);
+			centerMax = vc_Max(&centerMax, &c);
+		}
+
+		lo[0] = centerMin.x; lo[1] = centerMin.y; lo[2] = centerMin.z;
+		hi[0] = centerMax.x; hi[1] = centerMax.y; hi[2] = centerMax.z;
+
+		if (hi[1] - lo[1] > hi[axis] - lo[axis])
+			axis = 1;
+		if (hi[2] - lo[2] > hi[axis] - lo[axis])
+			axis = 2;
+
+		if (hi[axis] - lo[axis] > 0.0f) {
+			scale = RD_BVH_BINS * 0.9999f / (hi[axis] - lo[axis]);
+
+			for (int b = 0; b < RD_BVH_BINS; b++) {
+				binMin[b]   = vc_Vec3(HUGE_VALF, HUGE_VALF, HUGE_VALF);
+				binMax[b]   = vc_Vec3(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF);
+				binCount[b] = 0;
+			}
+
+			for (int i = 0; i < count; i++) {
+				const rdVec3 *a = &boxMin[i];
+				const rdVec3 *c = &boxMax[i];
+				const float  *af = &a->x, *cf = &c->x;
+				const int     b = (int) ((af[axis] + cf[axis] - lo[axis]) * scale);
+
+				binMin[b] = vc_Min(&binMin[b], a);
+				binMax[b] = vc_Max(&binMax[b], c);
+				binCount[b]++;
+			}
+
+			/* Sweep from the right for the right sides' costs, then from the left */
+			{
+				rdVec3 min = binMin[RD_BVH_BINS - 1], max = binMax[RD_BVH_BINS - 1];
+				int    n = binCount[RD_BVH_BINS - 1];
+
+				for (int b = RD_BVH_BINS - 1; b > 0; b--) {
+					if (b < RD_BVH_BINS - 1) {
+						min = vc_Min(&min, &binMin[b]);
+						max = vc_Max(&max, &binMax[b]);
+						n += binCount[b];
+					}
+
+					rightArea[b]  = bv_Area(&min, &max);
+					rightCount[b] = n;
+				}
+			}
+
+			{
+				rdVec3 min = binMin[0], max = binMax[0];
+				int    n = binCount[0];
+
+				for (int b = 1; b < RD_BVH_BINS; b++) {
+					const float cost = n * bv_Area(&min, &max) + rightCount[b] * rightArea[b];
+
+					if (n > 0 && rightCount[b] > 0 && cost < bestCost) {
+						bestCost = cost;
+						best     = b;
+					}
+
+					min = vc_Min(&min, &binMin[b]);
+					max = vc_Max(&max, &binMax[b]);
+					n += binCount[b];
+				}
+			}
+
+			if (best > 0) {
+				int i = 0, j = count - 1;
+
+				while (i <= j) {
+					const float *a = &boxMin[i].x;
+					const float *c = &boxMax[i].x;
+
+					if ((int) ((a[axis] + c[axis] - lo[axis]) * scale) < best)
+						i++;
+					else {
+						rdObject *obj = objects[i];
+						rdVec3    min = boxMin[i];
+						rdVec3    max = boxMax[i];
+
+						objects[i] = objects[j];
+						boxMin[i]  = boxMin[j];
+						boxMax[i]  = boxMax[j];
+						objects[j] = obj;
+						boxMin[j]  = min;
+						boxMax[j]  = max;
+						j--;
+					}
+				}
+
+				if (i > 0 && i < count)
+					mid = i;
+			}
+		}
+	}
+
+	left = bvh->numNodes;
+	bvh->numNodes += 2;
+
+	bvh->nodes[left].first     = first;
+	bvh->nodes[left].count     = mid;
+	bvh->nodes[left + 1].first = first + mid;
+	bvh->nodes[left + 1].count = count - mid;
+	bvh->parents[left]         = node;
+	bvh->parents[left + 1]     = node;
+
+	bvh->nodes[node].first = left;
+	bvh->nodes[node].count = 0;
+
+	return 1;
+}
+
+/* Past a point it is cheaper to refit every node, children before parents, which the build order
+ * makes a backward loop. Below it, moved objects mark their leaves and every node that changes
+ * marks its parent; the marks are taken from the highest node down, so each node is fit once,
+ * after its children, and in memory order. */
+static void bv_Refit(rdBvh *bvh)
+{
+	for (int i = 0; i < bvh->numDirty; i++)
+		bvh->moved[bvh->dirty[i]] = 0;
+
+	if (bvh->numDirty * RD_BVH_REFIT_ALL > bvh->numObjects) {
+		bvh->cost = 0.0f;
+
+		for (int node = bvh->numNodes - 1; node >= 0; node--) {
+			bv_FitNode(bvh, node);
+			bvh->cost += bv_Area(&bvh->nodes[node].min, &bvh->nodes[node].max);
+		}
+	} else {
+		for (int i = 0; i < bvh->numDirty; i++)
+			bv_Mark(bvh, bvh->leafOf[bvh->dirty[i]]);
+
+		/* A parent can be in the same word as the node that marked it, or the same group of
+		 * words, but always below */
+		for (int top = (bvh->numNodes - 1) / 1024; top >= 0; top--) {
+			unsigned int words;
+
+			while ((words = bvh->refitWords[top]) != 0) {
+				const int    word = top * 32 + bv_HighestBit(words);
+				unsigned int bits;
+
+				while ((bits = bvh->refit[word]) != 0) {
+					const int   node   = word * 32 + bv_HighestBit(bits);
+					const float before = bv_Area(&bvh->nodes[node].min, &bvh->nodes[node].max);
+
+					bvh->refit[word] = bits & ~(1u << node % 32);
+
+					if (!bv_FitNode(bvh, node))
+						continue;
+
+					bvh->cost += bv_Area(&bvh->nodes[node].min, &bvh->nodes[node].max) - before;
+					if (node > 0)
+						bv_Mark(bvh, bvh->parents[node]);
+				}
+
+				bvh->refitWords[top] &= ~(1u << word % 32);
+			}
+		}
+	}
+
+	bvh->numDirty = 0;
+
+	if (bvh->builtCost > 0.0f && bvh->cost > RD_BVH_REBUILD_COST * bvh->builtCost)
+		bv_Build(bvh);
+}
+
+static void bv_Mark(rdBvh *bvh, int node)
+{
+	bvh->refit[node / 32]        |= 1u << node % 32;
+	bvh->refitWords[node / 1024] |= 1u << node / 32 % 32;
+}
+
+static int bv_HighestBit(unsigned int bits)
+{
+#if defined(__GNUC__)
+	return 31 - __builtin_clz(bits);
+#else
+	int bit = 0;
+
+	while (bits >>= 1)
+		bit++;
+	return bit;
+#endif
+}
+
+/* Bounds of a leaf's objects or an inner node's children. Returns whether they changed; the
+ * compares are combined without branching, as after a few moves a node is as likely to keep its
+ * box as not. Vector loads take the int after each box along, and only store the first three
+ * lanes back. */
+static int bv_FitNode(rdBvh *bvh, int node)
+{
+	rdBvhNode *n = &bvh->nodes[node];
+
+#if RD_CULL_WIDTH > 1
+	const __m128 keep = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+
+	__m128 min, max, oldMin, oldMax;
+	int    changed;
+
+	if (n->count > 0) {
+		min = _mm_loadu_ps(&bvh->boxMin[n->first].x);
+		max = _mm_loadu_ps(&bvh->boxMax[n->first].x);
+
+		for (int i = n->first + 1; i < n->first + n->count; i++) {
+			min = _mm_min_ps(min, _mm_loadu_ps(&bvh->boxMin[i].x));
+			max = _mm_max_ps(max, _mm_loadu_ps(&bvh->boxMax[i].x));
+		}
+	} else {
+		const rdBvhNode *l = &bvh->nodes[n->first];
+
+		min = _mm_min_ps(_mm_loadu_ps(&l[0].min.x), _mm_loadu_ps(&l[1].min.x));
+		max = _mm_max_ps(_mm_loadu_ps(&l[0].max.x), _mm_loadu_ps(&l[1].max.x));
+	}
+
+	oldMin  = _mm_loadu_ps(&n->min.x);
+	oldMax  = _mm_loadu_ps(&n->max.x);
+	changed = (_mm_movemask_ps(_mm_cmpneq_ps(min, oldMin)) |
+	           _mm_movemask_ps(_mm_cmpneq_ps(max, oldMax))) & 7;
+
+	_mm_storeu_ps(&n->min.x, _mm_or_ps(_mm_and_ps(keep, oldMin), _mm_andnot_ps(keep, min)));
+	_mm_storeu_ps(&n->max.x, _mm_or_ps(_mm_and_ps(keep, oldMax), _mm_andnot_ps(keep, max)));
+
+	return changed != 0;
+#else
+	rdVec3 min = vc_Vec3(HUGE_VALF, HUGE_VALF, HUGE_VALF);
+	rdVec3 max = vc_Vec3(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF);
+	int    changed;
+
+	if (n->count > 0) {
+		for (int i = n->first; i < n->first + n->count; i++) {
+			min = vc_Min(&min, &bvh->boxMin[i]);
+			max = vc_Max(&max, &bvh->boxMax[i]);
+		}
+	} else {
+		const rdBvhNode *l = &bvh->nodes[n->first];
+		const rdBvhNode *r = &bvh->nodes[n->first + 1];
+
+		min = vc_Min(&l->min, &r->min);
+		max = vc_Max(&l->max, &r->max);
+	}
+
+	changed = (min.x != n->min.x) | (min.y != n->min.y) | (min.z != n->min.z) |
+	          (max.x != n->max.x) | (max.y != n->max.y) | (max.z != n->max.z);
+
+	n->min = min;
+	n->max = max;
+
+	return changed;
+#endif
+}
+
+/* Half the surface area, 0 for empty boxes */
+static float bv_Area(const rdVec3 *min, const rdVec3 *max)
+{
+	const float dx = max->x - min->x;
+	const float dy = max->y - min->y;
+	const float dz = max->z - min->z;
+
+	if (dx < 0.0f || dy < 0.0f || dz < 0.0f)
+		return 0.0f;
+
+	return dx * dy + dy * dz + dz * dx;
+}
+
+/* Subtrees entirely inside the shape are pushed complemented and taken without further tests */
+static int bv_Query(rdBvh *bvh, const rdBvhQuery *q, rdObject **outObjects, int maxObjects)
+{
+	int stack[RD_BVH_STACK];
+	int top = 0, found = 0;
+
+	bv_Update(bvh);
+
+	if (bvh->numNodes == 0)
+		return 0;
+
+	stack[top++] = 0;
+
+	while (top > 0) {
+		const rdBvhNode *n;
+
+		int entry  = stack[--top];
+		int inside = entry < 0;
+
+		n = &bvh->nodes[inside ? ~entry : entry];
+
+		if (!inside) {
+			const int result = bv_Test(q, &n->min, &n->max);
+
+			if (result == 0)
+				continue;
+
+			inside = result == 2;
+		}
+
+		if (n->count > 0) {
+			for (int i = n->first; i < n->first + n->count; i++) {
+				if (bvh->boxMin[i].x > bvh->boxMax[i].x)
+					continue;
+				if (!inside && bv_Test(q, &bvh->boxMin[i], &bvh->boxMax[i]) == 0)
+					continue;
+
+				if (found < maxObjects)
+					outObjects[found] = bvh->objects[i];
+				found++;
+			}
+		} else {
+			assert(top + 2 <= RD_BVH_STACK);
+
+			stack[top++] = inside ? ~(n->first + 1) : n->first + 1;
+			stack[top++] = inside ? ~n->first : n->first;
+		}
+	}
+
+	return found;
+}
+
+/* 0 if the box is outside the shape, 2 if inside it, 1 if it straddles the boundary */
+static int bv_Test(const rdBvhQuery *q, const rdVec3 *min, const rdVec3 *max)
+{
+	switch (q->shape) {
+	case RD_BVH_FRUSTUM: {
+		const rdVec3 c = vc_Vec3(0.5f * (min->x + max->x), 0.5f * (min->y + max->y),
+		                         0.5f * (min->z + max->z));
+		const rdVec3 e = vc_Vec3(0.5f * (max->x - min->x), 0.5f * (max->y - min->y),
+		                         0.5f * (max->z - min->z));
+
+		int result = 2;
+
+		for (int i = 0; i < 6; i++) {
+			const rdVec4 *p = &q->planes[i];
+			const float   d = p->x * c.x + p->y * c.y + p->z * c.z + p->w;
+			const float   r = fabsf(p->x) * e.x + fabsf(p->y) * e.y + fabsf(p->z) * e.z;
+
+			if (d + r < 0.0f)
+				return 0;
+			if (d - r < 0.0f)
+				result = 1;
+		}
+
+		return result;
+	}
+	case RD_BVH_BOX:
+		if (min->x > q->max.x || min->y > q->max.y || min->z > q->max.z ||
+		    max->x < q->min.x || max->y < q->min.y || max->z < q->min.z)
+			return 0;
+
+		if (min->x >= q->min.x && min->y >= q->min.y && min->z >= q->min.z &&
+		    max->x <= q->max.x && max->y <= q->max.y && max->z <= q->max.z)
+			return 2;
+
+		return 1;
+	case RD_BVH_SPHERE: {
+		const rdVec3 *c = &q->min;
+
+		float nearest = 0.0f, farthest = 0.0f, d;
+
+		if (min->x > max->x)
+			return 0;
+
+		d = fmaxf(fmaxf(min->x - c->x, c->x - max->x), 0.0f); nearest += d * d;
+		d = fmaxf(fmaxf(min->y - c->y, c->y - max->y), 0.0f); nearest += d * d;
+		d = fmaxf(fmaxf(min->z - c->z, c->z - max->z), 0.0f); nearest += d * d;
+
+		if (nearest > q->radius * q->radius)
+			return 0;
+
+		d = fmaxf(c->x - min->x, max->x - c->x); farthest += d * d;
+		d = fmaxf(c->y - min->y, max->y - c->y); farthest += d * d;
+		d = fmaxf(c->z - min->z, max->z - c->z); farthest += d * d;
+
+		return farthest <= q->radius * q->radius ? 2 : 1;
+	}
+	}
+
+	return 0;
+}
+
+/* Nearer children are visited first, and subtrees beyond the nearest hit so far are skipped. Hits
+ * are against the objects' boxes. */
+static rdObject *bv_Raycast(rdBvh *bvh, const rdVec3 *origin, const rdVec3 *dir,
+                            float maxDistance, float *outDistance)
+{
+	rdObject *hit = NULL;
+	rdVec3    unit, invDir;
+	float     length, t;
+	int       stack[RD_BVH_STACK];
+	float     entered[RD_BVH_STACK];
+	int       top = 0;
+
+	bv_Update(bvh);
+
+	length = sqrtf(vc_Dot(dir, dir));
+	if (bvh->numNodes == 0 || length == 0.0f)
+		return NULL;
+
+	unit   = vc_MultiScalar(dir, 1.0f / length);
+	invDir = vc_Vec3(1.0f / unit.x, 1.0f / unit.y, 1.0f / unit.z);
+
+	if (!bv_RayBox(origin, &invDir, &bvh->nodes[0].min, &bvh->nodes[0].max, maxDistance, &t))
+		return NULL;
+
+	stack[top]   = 0;
+	entered[top] = t;
+	top++;
+
+	while (top > 0) {
+		const rdBvhNode *n = &bvh->nodes[stack[--top]];
+
+		/* A nearer hit may have been found since the node was pushed */
+		if (entered[top] > maxDistance)
+			continue;
+
+		if (n->count > 0) {
+			for (int i = n->first; i < n->first + n->count; i++) {
+				if (bv_RayBox(origin, &invDir, &bvh->boxMin[i], &bvh->boxMax[i], maxDistance,
+				              &t)) {
+					maxDistance = t;
+					hit         = bvh->objects[i];
+				}
+			}
+		} else {
+			const rdBvhNode *l = &bvh->nodes[n->first];
+			const rdBvhNode *r = &bvh->nodes[n->first + 1];
+
+			float tl, tr;
+			int   hitL, hitR;
+
+			hitL = bv_RayBox(origin, &invDir, &l->min, &l->max, maxDistance, &tl);
+			hitR = bv_RayBox(origin, &invDir, &r->min, &r->max, maxDistance, &tr);
+
+			assert(top + 2 <= RD_BVH_STACK);
+
+			/* The farther one first, so the nearer one is popped first */
+			if (hitL && hitR && tl < tr) {
+				stack[top] = n->first + 1; entered[top] = tr; top++;
+				stack[top] = n->first;     entered[top] = tl; top++;
+			} else if (hitL && hitR) {
+				stack[top] = n->first;     entered[top] = tl; top++;
+				stack[top] = n->first + 1; entered[top] = tr; top++;
+			} else if (hitL) {
+				stack[top] = n->first;     entered[top] = tl; top++;
+			} else if (hitR) {
+				stack[top] = n->first + 1; entered[top] = tr; top++;
+			}
+		}
+	}
+
+	if (hit != NULL && outDistance != NULL)
+		*outDistance = maxDistance;
+
+	return hit;
+}
+
+/* Slab test. Axes the ray runs parallel to give infinities, and NaNs where it runs along a slab
+ * face, which fminf and fmaxf pass over. */
+static int bv_RayBox(const rdVec3 *origin, const rdVec3 *invDir, const rdVec3 *min,
+                     const rdVec3 *max, float maxDistance, float *outDistance)
+{
+	float t1, t2, tNear, tFar;
+
+	if (min->x > max->x)
+		return 0;
+
+	t1 = (min->x - origin->x) * invDir->x;
+	t2 = (max->x - origin->x) * invDir->x;
+	tNear = fminf(t1, t2);
+	tFar  = fmaxf(t1, t2);
+
+	t1 = (min->y - origin->y) * invDir->y;
+	t2 = (max->y - origin->y) * invDir->y;
+	tNear = fmaxf(tNear, fminf(t1, t2));
+	tFar  = fminf(tFar, fmaxf(t1, t2));
+
+	t1 = (min->z - origin->z) * invDir->z;
+	t2 = (max->z - origin->z) * invDir->z;
+	tNear = fmaxf(tNear, fminf(t1, t2));
+	tFar  = fminf(tFar, fmaxf(t1, t2));
+
+	tNear = fmaxf(tNear, 0.0f);
+
+	if (tNear > tFar || tNear > maxDistance)
+		return 0;
+
+	*outDistance = tNear;
+
+	return 1;
+}
+
+/* Adds a draw to the queue, 0 if the queue couldn't grow */
+static int qu_Push(rdDrawType draw, rdObject *obj)
+{
+	rdQueue     *q = &local.queue;
+	rdQueueItem *item;
+
+	if (q->numItems == q->capacity) {
+		const int    capacity = q->capacity > 0 ? 2 * q->capacity : 256;
+		rdQueueItem *items;
+
+		items = mem.alloc(capacity * sizeof (*items));
+		if (items == NULL)
+			return 0;
+
+		if (q->numItems > 0)
+			memcpy(items, q->items, q->numItems * sizeof (*items));
+
+		if (q->items != NULL)
+			mem.free(q->items);
+		q->items    = items;
+		q->capacity = capacity;
+	}
+
+	item = &q->items[q->numItems];
+	item->key   = qu_Key(draw, obj);
+	item->order = q->numItems;
+	item->batch = item->order;
+	item->draw  = draw;
+	item->obj   = obj;
+
+	qu_Batch(item);
+
+	q->numItems++;
+
+	return 1;
+}
+
+/* Sorts by pass, then by occlusion test, so each test's conditional rendering is switched once
+ * per pass; then by what is costly to change. The prepass and shadow maps are sorted front to
+ * back ahead of the vertex array and raster state, so early depth tests reject the most. */
+static uint64_t qu_Key(rdDrawType draw, const rdObject *obj)
+{
+	/* The prepass first: qu_Execute draws the occlusion boxes against its depth. Then the shadow
+	 * maps, which share no state with the camera passes, and the G-buffer last. */
+	static const int passOrder[] = { 0, 1, 4, 2, 3 };
+
+	const int hasShadowMap = draw == RD_DRAW_SHADOWMAP;
+	const int depthFirst   = draw == RD_DRAW_DEPTHVELOCITY || draw == RD_DRAW_SHADOWMAP;
+
+	uint64_t key;
+	uint64_t state;
+	int      raster;
+	int      material;
+
+	raster = (obj->objectType == RD_OBJECT_INTERIOR) << 1 |
+	         (draw == RD_DRAW_SHADOWMAP && obj->isFlatShaded);
+
+	material = draw == RD_DRAW_GBUFFER ?
+	           (obj->materialID & 63) << 1 | (obj->materialType == RD_MATERIAL_PAINTJOB) : 0;
+
+	state = qu_VertexArrayNumber(obj->geometry->page->vertexArray);
+	state = state << RD_QUEUE_RASTER_BITS   | raster;
+	state = state << RD_QUEUE_MATERIAL_BITS | material;
+
+	key = passOrder[draw];
+	key = key << RD_QUEUE_TEST_BITS      | local.queue.testing;
+	key = key << RD_QUEUE_SHADOWMAP_BITS | (hasShadowMap ? qu_ShadowMapNumber(obj->sm) : 0);
+
+	if (depthFirst) {
+		key = key << RD_QUEUE_DEPTH_BITS | qu_Depth(draw, obj);
+		key = key << (RD_QUEUE_ARRAY_BITS + RD_QUEUE_RASTER_BITS + RD_QUEUE_MATERIAL_BITS) | state;
+	} else {
+		key = key << (RD_QUEUE_ARRAY_BITS + RD_QUEUE_RASTER_BITS + RD_QUEUE_MATERIAL_BITS) | state;
+		key = key << RD_QUEUE_DEPTH_BITS | qu_Depth(draw, obj);
+	}
+
+	return key;
+}
+
+/* Nearest view depth of the object's box for the prepass, the depth of its center in the light's
+ * view for shadow maps. The other passes test for equal depth, so the order doesn't matter. */
+static uint32_t qu_Depth(rdDrawType draw, const rdObject *obj)
+{
+	const rdVec3 *c = &obj->worldCenter;
+	const rdVec3 *e = &obj->worldExtent;
+
+	float    depth = 0.0f;
+	uint32_t bits;
+
+	if (draw == RD_DRAW_DEPTHVELOCITY) {
+		const rdMat4 *v = &local.defaultCamera.mView;
+
+		if (local.defaultCamera.update)
+			cm_SyncViewMatrix(&local.defaultCamera);
+
+		/* The camera looks down -z */
+		depth = -(v->m[2][0] * c->x + v->m[2][1] * c->y + v->m[2][2] * c->z + v->m[2][3]) -
+		        (fabsf(v->m[2][0]) * e->x + fabsf(v->m[2][1]) * e->y + fabsf(v->m[2][2]) * e->z);
+	} else if (draw == RD_DRAW_SHADOWMAP) {
+		rdVec4 center = vc_Vec4(c->x, c->y, c->z, 1.0f);
+		rdVec4 clip   = mx_MultiVector4(&obj->sm->mLightspace, &center);
+
+		if (clip.w > 0.0f)
+			depth = clip.z / clip.w + 1.0f;
+	}
+
+	/* Anything in front of the camera sorts first */
+	if (!(depth > 0.0f))
+		return 0;
+
+	memcpy(&bits, &depth, sizeof (bits));
+
+	return bits >> (32 - RD_QUEUE_DEPTH_BITS);
+}
+
+static int qu_ShadowMapNumber(const rdShadowMap *sm)
+{
+	rdQueue *q = &local.queue;
+
+	for (int i = 0; i < q->numShadowMaps; i++) {
+		if (q->shadowMaps[i] == sm)
+			return i;
+	}
+
+	if (q->numShadowMaps == 1 << RD_QUEUE_SHADOWMAP_BITS)
+		return q->numShadowMaps - 1;
+
+	q->shadowMaps[q->numShadowMaps] = sm;
+	return q->numShadowMaps++;
+}
+
+static int qu_VertexArrayNumber(GLuint vertexArray)
+{
+	rdQueue *q = &local.queue;
+
+	for (int i = 0; i < q->numVertexArrays; i++) {
+		if (q->vertexArrays[i] == vertexArray)
+			return i;
+	}
+
+	if (q->numVertexArrays == 1 << RD_QUEUE_ARRAY_BITS)
+		return q->numVertexArrays - 1;
+
+	q->vertexArrays[q->numVertexArrays] = vertexArray;
+	return q->numVertexArrays++;
+}
+
+/* Puts the item into the batch of the first clone of its geometry submitted to the pass, when
+ * they can be drawn with the same state. It takes that item's key, so it is drawn in that item's
+ * place in the order. */
+static void qu_Batch(rdQueueItem *item)
+{
+	rdQueue    *q   = &local.queue;
+	rdGeometry *geo = item->obj->geometry;
+	int         first;
+
+	if (geo->refCount < 2)
+		return;
+
+	if (geo->batchGeneration != q->generation) {
+		for (int i = 0; i <= RD_DRAW_BLOOM; i++)
+			geo->batchItems[i] = -1;
+		geo->batchGeneration = q->generation;
+	}
+
+	first = geo->batchItems[item->draw];
+
+	if (first >= 0 && q->items[first].obj != NULL && qu_CanBatch(&q->items[first], item)) {
+		item->key   = q->items[first].key;
+		item->batch = first;
+		return;
+	}
+
+	/* Later clones go with this one instead */
+	geo->batchItems[item->draw] = item->order;
+}
+
+/* Clones can only differ in their transform and material ID */
+static int qu_CanBatch(const rdQueueItem *first, const rdQueueItem *item)
+{
+	const rdObject *a = first->obj;
+	const rdObject *b = item->obj;
+
+	if (qu_KeyTest(first->key) != local.queue.testing)
+		return 0;
+	if (a->materialType != b->materialType || a->objectType != b->objectType)
+		return 0;
+	if (item->draw == RD_DRAW_SHADOWMAP)
+		return a->sm == b->sm && a->isFlatShaded == b->isFlatShaded;
+
+	return 1;
+}
+
+/* Occlusion test an item is under, 0 for none */
+static int qu_KeyTest(uint64_t key)
+{
+	return (int) (key >> (RD_QUEUE_SHADOWMAP_BITS + RD_QUEUE_ARRAY_BITS + RD_QUEUE_RASTER_BITS +
+	                      RD_QUEUE_MATERIAL_BITS + RD_QUEUE_DEPTH_BITS) &
+	              ((1 << RD_QUEUE_TEST_BITS) - 1));
+}
+
+static int qu_CompareItems(const void *a, const void *b)
+{
+	const rdQueueItem *itemA = a;
+	const rdQueueItem *itemB = b;
+
+	if (itemA->key != itemB->key)
+		return itemA->key < itemB->key ? -1 : 1;
+	if (itemA->batch != itemB->batch)
+		return itemA->batch - itemB->batch;
+	return itemA->order - itemB->order;
+}
+
+static void qu_Execute(void)
+{
+	rdQueue    *q = &local.queue;
+	rdDrawState state;
+	int         test = 0; /* Whose conditional rendering is on */
+
+	if (q->numItems == 0) {
+		qu_Clear();
+		return;
+	}
+
+	/* The boxes are drawn with the projection of the frame's draws */
+	if (local.renderState == RD_RENDERSTATE_FRESH)
+		cm_AdvanceJitter();
+
+	/* Every object's matrices at once, however many passes it is drawn in */
+	tr_UpdateQueued(q);
+
+	qsort(q->items, q->numItems, sizeof (*q->items), qu_CompareItems);
+
+	qu_ForgetState(&state);
+
+	for (int i = 0, next; i < q->numItems; i = next) {
+		const rdQueueItem *item = &q->items[i];
+		const int          slot = qu_KeyTest(item->key);
+
+		int numObjects = item->obj != NULL;
+
+		/* A clone batch sorts as one run of items */
+		for (next = i + 1; next < q->numItems; next++) {
+			if (q->items[next].key != item->key || q->items[next].batch != item->batch)
+				break;
+			numObjects += q->items[next].obj != NULL;
+		}
+
+		if (numObjects == 0)
+			continue;
+
+		if (slot != test) {
+			if (test != 0 && q->tests[test - 1].query != 0) {
+				gl.EndConditionalRender();
+				local.frameStats.stateChanges++;
+			}
+
+			test = slot;
+
+			if (test != 0) {
+				rdQueueTest *t = &q->tests[test - 1];
+
+				if (!t->issued) {
+					qu_ResetState(&state);
+					t->query  = cu_DrawOcclusionBox(&t->center, &t->extent, t->numObjects);
+					t->issued = 1;
+
+					if (t->query != 0) {
+						state.framebuf = local.depthVelocityBuffer.framebuf;
+						state.program  = local.depthOnlyShader.shaderProgram;
+					}
+				}
+
+				if (t->query != 0) {
+					gl.BeginConditionalRender(t->query, GL_QUERY_WAIT);
+					local.frameStats.stateChanges++;
+				}
+			}
+		}
+
+		if (next - i > 1)
+			qu_DrawInstances(item, next - i, &state);
+		else
+			qu_DrawObject(item->draw, item->obj, &state);
+	}
+
+	if (test != 0 && q->tests[test - 1].query != 0)
+		gl.EndConditionalRender();
+
+	qu_ResetState(&state);
+	qu_Clear();
+}
+
+/* Empties the queue and the frame's tables, keeping the memory */
+static void qu_Clear(void)
+{
+	local.queue.numItems        = 0;
+	local.queue.numTests        = 0;
+	local.queue.testing         = 0;
+	local.queue.numShadowMaps   = 0;
+	local.queue.numVertexArrays = 0;
+	local.queue.generation++;
+}
+
+/* Draws an object into a pass, changing only the state that differs from what the draws before
+ * left. The state is updated to match. */
+static void qu_DrawObject(rdDrawType draw, rdObject *obj, rdDrawState *state)
+{
+	rdDrawSetup setup;
+
+	if (!qu_SetupObject(draw, obj, &setup))
+		return;
+
+	qu_SetPassState(draw, obj, setup.singlePass, 0, state);
+
+	switch (draw) {
+	case RD_DRAW_DEPTHVELOCITY:
+		if (setup.singlePass) {
+			const rdShader *sh = &local.geometryVelocityShader;
+
+			gl.UniformMatrix4fv(sh->uniforms[0], 1, GL_TRUE, &obj->mMVP.m[0][0]);
+			gl.UniformMatrix4fv(sh->uniforms[1], 1, GL_TRUE, &setup.mPrevMVP->m[0][0]);
+			gl.Uniform2fv(sh->uniforms[2], 1, &local.currJitter.x);
+			gl.Uniform2fv(sh->uniforms[3], 1, &local.prevJitter.x);
+			gl.UniformMatrix3fv(sh->uniforms[4], 1, GL_TRUE, &obj->mNormal.m[0][0]);
+			gl.Uniform1i(sh->uniforms[5], obj->materialType == RD_MATERIAL_PAINTJOB);
+			gl.Uniform1i(sh->uniforms[6], obj->materialID);
+			break;
+		}
+		gl.UniformMatrix4fv(local.depthVelocityShader.uniforms[0], 1, GL_TRUE, &obj->mMVP.m[0][0]);
+		gl.UniformMatrix4fv(local.depthVelocityShader.uniforms[1], 1, GL_TRUE,
+		                    &setup.mPrevMVP->m[0][0]);
+		gl.Uniform2fv(local.depthVelocityShader.uniforms[2], 1, &local.currJitter.x);
+		gl.Uniform2fv(local.depthVelocityShader.uniforms[3], 1, &local.prevJitter.x);
+		break;
+	case RD_DRAW_SHADOWMAP:
+		gl.UniformMatrix4fv(local.depthOnlyShader.uniforms[0], 1, GL_TRUE,
+		                    &obj->mModelLightspace.m[0][0]);
+		break;
+	case RD_DRAW_GBUFFER:
+		gl.UniformMatrix4fv(local.geometryShader.uniforms[0], 1, GL_TRUE,
+		                    &obj->mModelView.m[0][0]);
+		gl.UniformMatrix4fv(local.geometryShader.uniforms[1], 1, GL_TRUE, &obj->mMVP.m[0][0]);
+		gl.UniformMatrix3fv(local.geometryShader.uniforms[2], 1, GL_TRUE, &obj->mNormal.m[0][0]);
+		gl.Uniform1i(local.geometryShader.uniforms[3], obj->materialType == RD_MATERIAL_PAINTJOB);
+		gl.Uniform1i(local.geometryShader.uniforms[4], obj->materialID);
+		break;
+	case RD_DRAW_BLOOM:
+		gl.UniformMatrix4fv(local.bloomShader.uniforms[0], 1, GL_TRUE, &obj->mMVP.m[0][0]);
+		break;
+	default:
+		return;
+	}
+
+	if (local.boundVertexArray != obj->geometry->page->vertexArray)
+		local.frameStats.stateChanges++;
+	gh_BindVertexArray(obj->geometry->page->vertexArray);
+
+	if (setup.indirect) {
+		const GLvoid *command = (GLvoid *) (obj->cullIndex * sizeof (rdDrawCommand));
+
+		gl.BindBuffer(GL_DRAW_INDIRECT_BUFFER, obj->cullList->commandBuffer);
+		if (obj->isIndexed)
+			gl.DrawElementsIndirect(GL_TRIANGLES, obj->geometry->indexType, command);
+		else
+			gl.DrawArraysIndirect(GL_TRIANGLES, command);
+	} else if (obj->isIndexed) {
+		const rdGeometry *geo       = obj->geometry;
+		const size_t      indexSize = geo->indexType == GL_UNSIGNED_INT ? sizeof (GLuint)
+		                                                                : sizeof (GLushort);
+
+		gl.DrawElementsBaseVertex(GL_TRIANGLES, geo->lods[setup.lod].numIndices, geo->indexType,
+		                          (GLvoid *) (geo->indexOffset +
+		                                      geo->lods[setup.lod].firstIndex * indexSize),
+		                          geo->baseVertex);
+	} else {
+		gl.DrawArrays(GL_TRIANGLES, obj->geometry->baseVertex, obj->numVertices);
+	}
+	local.frameStats.objectDraws++;
+
+	qu_FinishObject(draw, obj, setup.lod);
+}
+
+/* Draws a clone batch with one instanced draw per level of detail its objects are at. Objects
+ * whose cull list was culled on the GPU have their own indirect draws, and go one by one. */
+static void qu_DrawInstances(const rdQueueItem *items, int numItems, rdDrawState *state)
+{
+	const rdDrawType draw = items[0].draw;
+
+	rdInstances *in = &local.instances;
+	rdDrawSetup  setup;
+	rdObject    *obj = NULL;
+	int          singlePass = 0;
+	int          numInstances = 0;
+	int          numAtLod[RD_MAX_LODS] = { 0 };
+
+	if (!qu_ReserveInstances(in, numItems)) {
+		for (int i = 0; i < numItems; i++) {
+			if (items[i].obj != NULL)
+				qu_DrawObject(draw, items[i].obj, state);
+		}
+		return;
+	}
+
+	for (int i = 0; i < numItems; i++) {
+		if (items[i].obj == NULL || !qu_SetupObject(draw, items[i].obj, &setup))
+			continue;
+
+		if (setup.indirect) {
+			qu_DrawObject(draw, items[i].obj, state);
+			continue;
+		}
+
+		obj        = items[i].obj;
+		singlePass = setup.singlePass;
+
+		qu_StoreInstance(draw, obj, &setup, &in->data[numInstances]);
+		in->objects[numInstances] = obj;
+		in->lods[numInstances]    = (unsigned char) setup.lod;
+		numAtLod[setup.lod]++;
+		numInstances++;
+	}
+
+	if (numInstances == 0)
+		return;
+
+	qu_SetPassState(draw, obj, singlePass, 1, state);
+
+	switch (draw) {
+	case RD_DRAW_DEPTHVELOCITY:
+		if (singlePass) {
+			const rdShader *sh = &local.geometryVelocityInstancedShader;
+
+			gl.Uniform2fv(sh->uniforms[0], 1, &local.currJitter.x);
+			gl.Uniform2fv(sh->uniforms[1], 1, &local.prevJitter.x);
+			gl.Uniform1i(sh->uniforms[2], obj->materialType == RD_MATERIAL_PAINTJOB);
+			break;
+		}
+		gl.Uniform2fv(local.depthVelocityInstancedShader.uniforms[0], 1, &local.currJitter.x);
+		gl.Uniform2fv(local.depthVelocityInstancedShader.uniforms[1], 1, &local.prevJitter.x);
+		break;
+	case RD_DRAW_GBUFFER:
+		gl.Uniform1i(local.geometryInstancedShader.uniforms[0],
+		             obj->materialType == RD_MATERIAL_PAINTJOB);
+		break;
+	default:
+		break;
+	}
+
+	if (local.boundVertexArray != obj->geometry->page->vertexArray)
+		local.frameStats.stateChanges++;
+	gh_BindVertexArray(obj->geometry->page->vertexArray);
+
+	for (int lod = 0; lod < RD_MAX_LODS; lod++) {
+		const rdGeometry *geo = obj->geometry;
+
+		int n = 0;
+
+		if (numAtLod[lod] == 0)
+			continue;
+
+		for (int i = 0; i < numInstances; i++) {
+			if (in->lods[i] == lod)
+				in->packed[n++] = in->data[i];
+		}
+		qu_UploadInstances(in, n);
+
+		if (obj->isIndexed) {
+			const size_t indexSize = geo->indexType == GL_UNSIGNED_INT ? sizeof (GLuint)
+			                                                           : sizeof (GLushort);
+
+			gl.DrawElementsInstancedBaseVertex(GL_TRIANGLES, geo->lods[lod].numIndices,
+			                                   geo->indexType,
+			                                   (GLvoid *) (geo->indexOffset +
+			                                               geo->lods[lod].firstIndex * indexSize),
+			                                   n, geo->baseVertex);
+		} else {
+			gl.DrawArraysInstanced(GL_TRIANGLES, geo->baseVertex, obj->numVertices, n);
+		}
+		local.frameStats.objectDraws++;
+		local.frameStats.instancedObjects += n;
+	}
+
+	for (int i = 0; i < numInstances; i++)
+		qu_FinishObject(draw, in->objects[i], in->lods[i]);
+}
+
+/* Works out the object's matrices and level of detail for a pass. Returns 0 if there is nothing
+ * to draw. */
+static int qu_SetupObject(rdDrawType draw, rdObject *obj, rdDrawSetup *setup)
+{
+	/* Shadows are resolved by rd_Frame, and the debug draws cover the screen */
+	if (draw == RD_DRAW_SHADOWS || draw > RD_DRAW_BLOOM)
+		return 0;
+
+	if (draw == RD_DRAW_SHADOWMAP)
+		assert(obj->sm != NULL);
+
+	/* Whether the object's depth-velocity draw writes the G-buffer along */
+	setup->singlePass = tr_WritesGBuffer(RD_DRAW_DEPTHVELOCITY, obj);
+
+	/* The depth-velocity draw wrote the G-buffer along */
+	if (draw == RD_DRAW_GBUFFER && setup->singlePass)
+		return 0;
+
+	if (local.renderState == RD_RENDERSTATE_FRESH)
+		cm_AdvanceJitter();
+
+	/* Queued objects are already up to date, the ones rd_Draw draws are brought up to date here */
+	tr_UpdateObject(obj, tr_WritesGBuffer(draw, obj));
+
+	/* A list culled on the GPU this frame holds the camera passes' draws, level included */
+	setup->indirect = draw != RD_DRAW_SHADOWMAP && obj->cullList != NULL &&
+	                  obj->cullList->gpuCullFrame == local.frameIndex + 1 &&
+	                  obj->cullIndex < obj->cullList->gpuCullObjects;
+
+	/* Every camera pass of a frame has to pick the same level, or the GL_EQUAL depth tests
+	 * after the prepass would fail */
+	setup->lod = setup->indirect ? 0 : lo_SelectLod(obj, draw == RD_DRAW_SHADOWMAP ?
+	                                                     RD_LOD_SHADOW_BIAS : 0);
+
+	/* After frames of being culled the previous MVP is stale, so there's no velocity */
+	if (obj->mPrevMVP && obj->velocityFrame + 1 == local.frameIndex)
+		setup->mPrevMVP = obj->mPrevMVP;
+	else
+		setup->mPrevMVP = &obj->mMVP;
+
+	return 1;
+}
+
+/* Switches to the framebuffer, viewport, depth test, culling and program the object is drawn with
+ * in the pass, and starts or stops the pass's timer */
+static void qu_SetPassState(rdDrawType draw, const rdObject *obj, int singlePass, int instanced,
+                            rdDrawState *state)
+{
+	int    depthEqual;
+	int    cullEnabled;
+	GLuint framebuf;
+	GLenum cullMode;
+
+	const rdShadowMap *viewport;
+	const rdShader    *shader;
+
+	depthEqual = draw == RD_DRAW_GBUFFER || draw == RD_DRAW_BLOOM;
+	viewport   = draw == RD_DRAW_SHADOWMAP ? obj->sm : NULL;
+
+	cullEnabled = obj->objectType != RD_OBJECT_INTERIOR;
+	cullMode    = draw == RD_DRAW_SHADOWMAP && obj->isFlatShaded ? GL_FRONT : GL_BACK;
+
+	switch (draw) {
+	case RD_DRAW_DEPTHVELOCITY:
+		if (singlePass) {
+			framebuf = local.gBuffer.framebufSinglePass;
+			shader   = instanced ? &local.geometryVelocityInstancedShader
+			                     : &local.geometryVelocityShader;
+		} else {
+			framebuf = local.depthVelocityBuffer.framebuf;
+			shader   = instanced ? &local.depthVelocityInstancedShader
+			                     : &local.depthVelocityShader;
+		}
+		break;
+	case RD_DRAW_SHADOWMAP:
+		framebuf = obj->sm->framebuf;
+		shader   = instanced ? &local.depthOnlyInstancedShader : &local.depthOnlyShader;
+		break;
+	case RD_DRAW_GBUFFER:
+		framebuf = local.gBuffer.framebuf;
+		shader   = instanced ? &local.geometryInstancedShader : &local.geometryShader;
+		break;
+	case RD_DRAW_BLOOM:
+		framebuf = local.bloomBuffer.framebufRaw;
+		shader   = instanced ? &local.bloomInstancedShader : &local.bloomShader;
+		break;
+	default:
+		return;
+	}
+
+	/* Consecutive draws of a timed pass are timed as one run */
+	if (draw == RD_DRAW_SHADOWMAP)
+		st_StartTimer(RD_TIMER_SHADOWMAP);
+	else if (draw == RD_DRAW_DEPTHVELOCITY)
+		st_StartTimer(RD_TIMER_DEPTH);
+	else if (draw == RD_DRAW_GBUFFER)
+		st_StartTimer(RD_TIMER_GBUFFER);
+	else
+		st_StopTimer();
+
+	if (state->framebuf != framebuf) {
+		gl.BindFramebuffer(GL_FRAMEBUFFER, framebuf);
+		state->framebuf = framebuf;
+		local.frameStats.stateChanges++;
+	}
+
+	if (state->viewport != viewport) {
+		if (viewport != NULL)
+			gl.Viewport(0, 0, viewport->pixWidth, viewport->pixHeight);
+		else
+			gl.Viewport(0, 0, local.screenWidth, local.screenHeight);
+		state->viewport = viewport;
+		local.frameStats.stateChanges++;
+	}
+
+	qu_SetDepthEqual(state, depthEqual);
+	qu_SetCulling(state, cullEnabled, cullMode);
+
+	if (state->program != shader->shaderProgram) {
+		gl.UseProgram(shader->shaderProgram);
+		state->program = shader->shaderProgram;
+		local.frameStats.stateChanges++;
+	}
+}
+
+/* Counts the object's draw and keeps what the next one compares against */
+static void qu_FinishObject(rdDrawType draw, rdObject *obj, int lod)
+{
+	if (draw == RD_DRAW_SHADOWMAP)
+		local.frameStats.shadowMapDraws++;
 
-	p->m[0][0] =  (2 * zNear) / (right - left);
-	p->m[0][2] =  (right + left) / (right - left);
-	p->m[1][1] =  (2 * zNear) / (top - bottom);
-	p->m[1][2] =  (top + bottom) / (top - bottom);
-	p->m[2][2] = -((zFar + zNear) / (zFar - zNear));
-	p->m[2][3] = -((2 * zFar * zNear) / (zFar - zNear));
-	p->m[3][2] = -1.0f;
+	if (draw == RD_DRAW_DEPTHVELOCITY || draw == RD_DRAW_GBUFFER) {
+		if (obj->isIndexed)
+			local.frameStats.gBufferVertices += obj->geometry->lods[lod].numIndices;
+		else
+			local.frameStats.gBufferVertices += obj->numVertices;
+	}
+
+	if (draw == RD_DRAW_DEPTHVELOCITY) {
+		obj->_mPrevMVP = obj->mMVP;
+		obj->mPrevMVP = &obj->_mPrevMVP;
+		obj->velocityFrame = local.frameIndex;
+	}
+
+	local.renderState = RD_RENDERSTATE_PARTIAL;
 }
 
-static void mx_InvertFrustum(rdMat4 *p)
+/* Fills in the instance attributes the pass's instanced program reads */
+static void qu_StoreInstance(rdDrawType draw, const rdObject *obj, const rdDrawSetup *setup,
+                             rdInstance *instance)
 {
-	rdMat4 tmp;
+	const rdMat4 *mMVP   = draw == RD_DRAW_SHADOWMAP ? &obj->mModelLightspace : &obj->mMVP;
+	const rdMat4 *mOther = draw == RD_DRAW_GBUFFER ? &obj->mModelView : setup->mPrevMVP;
 
-	double a = p->m[0][0];
-	double b = p->m[1][1];
-	double c = p->m[2][2];
-	double d = p->m[2][3];
-	double e = p->m[3][2];
+	for (int col = 0; col < 4; col++) {
+		for (int row = 0; row < 4; row++) {
+			instance->mMVP[col * 4 + row]   = mMVP->m[row][col];
+			instance->mOther[col * 4 + row] = mOther->m[row][col];
+		}
+	}
 
-	mx_Zero(&tmp);
+	if (tr_WritesGBuffer(draw, obj)) {
+		for (int col = 0; col < 3; col++) {
+			for (int row = 0; row < 3; row++)
+				instance->mNormal[col * 3 + row] = obj->mNormal.m[row][col];
+		}
+	} else {
+		memset(instance->mNormal, 0, sizeof (instance->mNormal));
+	}
 
-	tmp.m[0][0] = 1.0f / a;
-	tmp.m[1][1] = 1.0f / b;
-	tmp.m[3][2] = 1.0f / d;
-	tmp.m[2][3] = 1.0f / e;
-	tmp.m[3][3] = -c / (d * e);
+	instance->materialID = obj->materialID;
+}
 
-	*p = tmp;
+/* Room for a batch of capacity objects. Returns 0 when out of memory. */
+static int qu_ReserveInstances(rdInstances *in, int capacity)
+{
+	const size_t perInstance = sizeof (*in->objects) + 2 * sizeof (*in->data) + sizeof (*in->lods);
+
+	unsigned char *block;
+
+	if (capacity <= in->capacity)
+		return 1;
+
+	if (capacity < 2 * in->capacity)
+		capacity = 2 * in->capacity;
+
+	/* Pointers first, so every array is aligned */
+	block = mem.alloc(capacity * perInstance);
+	if (block == NULL)
+		return 0;
+
+	if (in->objects != NULL)
+		mem.free(in->objects);
+
+	in->objects  = (rdObject **) block;
+	in->data     = (rdInstance *) (in->objects + capacity);
+	in->packed   = in->data + capacity;
+	in->lods     = (unsigned char *) (in->packed + capacity);
+	in->capacity = capacity;
+
+	return 1;
 }
-#if 0
-static void mx_Ortho(rdMat4 *o, double left, double right, double bottom, double top, double near,
-                     double far)
+
+/* Replaces the instance buffer's contents with the packed instances. The old storage is orphaned
+ * rather than overwritten, so the draws still reading it don't stall the upload. */
+static void qu_UploadInstances(rdInstances *in, int numInstances)
 {
-	mx_Identity(o);
+	const size_t size = numInstances * sizeof (rdInstance);
 
-	o->m[0][0] = 2 / (right - left);
-	o->m[0][3] = - (right + left) / (right - left);
-	o->m[1][1] = 2 / (top - bottom);
-	o->m[1][3] = - (top + bottom) / (top - bottom);
-	o->m[2][2] = -2 / (far - near);
-	o->m[2][3] = - (far + near) / (far - near);
+	while (in->bufferSize < size)
+		in->bufferSize *= 2;
+
+	gl.BindBuffer(GL_ARRAY_BUFFER, in->buffer);
+	gl.BufferData(GL_ARRAY_BUFFER, in->bufferSize, NULL, GL_STREAM_DRAW);
+	gl.BufferSubData(GL_ARRAY_BUFFER, 0, size, in->packed);
 }
-#endif
-static void mx_MultiAB(rdMat4 *out, const rdMat4 *a, const rdMat4 *b)
+
+static void qu_SetupInstances(rdInstances *in)
 {
-	out->m[0][0] = a->m[0][0] * b->m[0][0] + a->m[0][1] * b->m[1][0] + a->m[0][2] * b->m[2][0] + a->m[0][3] * b->m[3][0];
-	out->m[0][1] = a->m[0][0] * b->m[0][1] + a->m[0][1] * b->m[1][1] + a->m[0][2] * b->m[2][1] + a->m[0][3] * b->m[3][1];
-	out->m[0][2] = a->m[0][0] * b->m[0][2] + a->m[0][1] * b->m[1][2] + a->m[0][2] * b->m[2][2] + a->m[0][3] * b->m[3][2];
-	out->m[0][3] = a->m[0][0] * b->m[0][3] + a->m[0][1] * b->m[1][3] + a->m[0][2] * b->m[2][3] + a->m[0][3] * b->m[3][3];
+	in->bufferSize = RD_INSTANCE_BUFFER_SIZE;
 
-	out->m[1][0] = a->m[1][0] * b->m[0][0] + a->m[1][1] * b->m[1][0] + a->m[1][2] * b->m[2][0] + a->m[1][3] * b->m[3][0];
-	out->m[1][1] = a->m[1][0] * b->m[0][1] + a->m[1][1] * b->m[1][1] + a->m[1][2] * b->m[2][1] + a->m[1][3] * b->m[3][1];
-	out->m[1][2] = a->m[1][0] * b->m[0][2] + a->m[1][1] * b->m[1][2] + a->m[1][2] * b->m[2][2] + a->m[1][3] * b->m[3][2];
-	out->m[1][3] = a->m[1][0] * b->m[0][3] + a->m[1][1] * b->m[1][3] + a->m[1][2] * b->m[2][3] + a->m[1][3] * b->m[3][3];
+	gl.GenBuffers(1, &in->buffer);
+	gl.BindBuffer(GL_ARRAY_BUFFER, in->buffer);
+	gl.BufferData(GL_ARRAY_BUFFER, in->bufferSize, NULL, GL_STREAM_DRAW);
 
-	out->m[2][0] = a->m[2][0] * b->m[0][0] + a->m[2][1] * b->m[1][0] + a->m[2][2] * b->m[2][0] + a->m[2][3] * b->m[3][0];
-	out->m[2][1] = a->m[2][0] * b->m[0][1] + a->m[2][1] * b->m[1][1] + a->m[2][2] * b->m[2][1] + a->m[2][3] * b->m[3][1];
-	out->m[2][2] = a->m[2][0] * b->m[0][2] + a->m[2][1] * b->m[1][2] + a->m[2][2] * b->m[2][2] + a->m[2][3] * b->m[3][2];
-	out->m[2][3] = a->m[2][0] * b->m[0][3] + a->m[2][1] * b->m[1][3] + a->m[2][2] * b->m[2][3] + a->m[2][3] * b->m[3][3];
+	in->objects  = NULL;
+	in->lods     = NULL;
+	in->data     = NULL;
+	in->packed   = NULL;
+	in->capacity = 0;
+}
 
-	out->m[3][0] = a->m[3][0] * b->m[0][0] + a->m[3][1] * b->m[1][0] + a->m[3][2] * b->m[2][0] + a->m[3][3] * b->m[3][0];
-	out->m[3][1] = a->m[3][0] * b->m[0][1] + a->m[3][1] * b->m[1][1] + a->m[3][2] * b->m[2][1] + a->m[3][3] * b->m[3][1];
-	out->m[3][2] = a->m[3][0] * b->m[0][2] + a->m[3][1] * b->m[1][2] + a->m[3][2] * b->m[2][2] + a->m[3][3] * b->m[3][2];
-	out->m[3][3] = a->m[3][0] * b->m[0][3] + a->m[3][1] * b->m[1][3] + a->m[3][2] * b->m[2][3] + a->m[3][3] * b->m[3][3];
+static void qu_DestroyInstances(rdInstances *in)
+{
+	gl.DeleteBuffers(1, &in->buffer);
+
+	if (in->objects != NULL)
+		mem.free(in->objects);
+	in->objects  = NULL;
+	in->capacity = 0;
 }
 
-static void mx_MultiABC(rdMat4 *out, const rdMat4 *a, const rdMat4 *b, const rdMat4 *c)
+/* Framebuffer and program become unknown, the rest is taken to be the way the frame
+ * leaves it between draws */
+static void qu_ForgetState(rdDrawState *state)
 {
-	rdMat4 tmp;
+	state->framebuf    = 0;
+	state->program     = 0;
+	state->depthEqual  = 0;
+	state->cullEnabled = 1;
+	state->cullMode    = GL_BACK;
+	state->viewport    = NULL;
+}
 
-	mx_MultiAB(&tmp, a, b);
-	mx_MultiAB(out, &tmp, c);
+/* Back to the way the frame leaves the state between draws */
+static void qu_ResetState(rdDrawState *state)
+{
+	qu_SetDepthEqual(state, 0);
+	qu_SetCulling(state, 1, GL_BACK);
+
+	if (state->viewport != NULL) {
+		gl.Viewport(0, 0, local.screenWidth, local.screenHeight);
+		state->viewport = NULL;
+		local.frameStats.stateChanges++;
+	}
+}
+
+static void qu_SetDepthEqual(rdDrawState *state, int depthEqual)
+{
+	if (state->depthEqual == depthEqual)
+		return;
+
+	gl.DepthFunc(depthEqual ? GL_EQUAL : GL_LESS);
+	gl.DepthMask(depthEqual ? GL_FALSE : GL_TRUE);
+	state->depthEqual = depthEqual;
+	local.frameStats.stateChanges++;
+}
+
+static void qu_SetCulling(rdDrawState *state, int cullEnabled, GLenum cullMode)
+{
+	if (state->cullEnabled != cullEnabled) {
+		if (cullEnabled)
+			gl.Enable(GL_CULL_FACE);
+		else
+			gl.Disable(GL_CULL_FACE);
+		state->cullEnabled = cullEnabled;
+		local.frameStats.stateChanges++;
+	}
+
+	if (cullEnabled && state->cullMode != cullMode) {
+		gl.CullFace(cullMode);
+		state->cullMode = cullMode;
+		local.frameStats.stateChanges++;
+	}
+}
+
+/* Points the table the renderer calls at the wrappers below, which pass on to glDriver what
+ * changes something */
+static void gs_Install(rdGL *table)
+{
+	table->Enable             = gs_Enable;
+	table->Disable            = gs_Disable;
+	table->DepthFunc          = gs_DepthFunc;
+	table->DepthMask          = gs_DepthMask;
+	table->CullFace           = gs_CullFace;
+	table->Viewport           = gs_Viewport;
+	table->ColorMask          = gs_ColorMask;
+	table->BindFramebuffer    = gs_BindFramebuffer;
+	table->BindVertexArray    = gs_BindVertexArray;
+	table->ActiveTexture      = gs_ActiveTexture;
+	table->BindTexture        = gs_BindTexture;
+	table->UseProgram         = gs_UseProgram;
+	table->LinkProgram        = gs_LinkProgram;
+	table->DeleteProgram      = gs_DeleteProgram;
+	table->DeleteFramebuffers = gs_DeleteFramebuffers;
+	table->DeleteVertexArrays = gs_DeleteVertexArrays;
+	table->DeleteTextures     = gs_DeleteTextures;
+	table->Uniform1i          = gs_Uniform1i;
+	table->Uniform1f          = gs_Uniform1f;
+	table->Uniform1fv         = gs_Uniform1fv;
+	table->Uniform2fv         = gs_Uniform2fv;
+	table->Uniform3fv         = gs_Uniform3fv;
+	table->Uniform4fv         = gs_Uniform4fv;
+	table->UniformMatrix3fv   = gs_UniformMatrix3fv;
+	table->UniformMatrix4fv   = gs_UniformMatrix4fv;
+}
+
+/* Nothing is known about the driver's state after this */
+static void gs_Forget(void)
+{
+	rdGLState *s = &local.glState;
+
+	s->framebufKnown      = 0;
+	s->programKnown       = 0;
+	s->vertexArrayKnown   = 0;
+	s->activeTextureKnown = 0;
+	s->depthFuncKnown     = 0;
+	s->depthMaskKnown     = 0;
+	s->cullFaceKnown      = 0;
+	s->viewportKnown      = 0;
+	s->colorMaskKnown     = 0;
+
+	memset(s->capsKnown, 0, sizeof (s->capsKnown));
+	memset(s->texturesKnown, 0, sizeof (s->texturesKnown));
+
+	for (int i = 0; i < s->numPrograms; i++)
+		memset(s->programs[i].uniforms, 0, sizeof (s->programs[i].uniforms));
+}
+
+/* Counts the call as issued or filtered, returns whether it goes through */
+static int gs_Count(int changes)
+{
+	if (changes || !local.glState.filtering) {
+		local.frameStats.glCallsIssued++;
+		return 1;
+	}
+
+	local.frameStats.glCallsFiltered++;
+	return 0;
+}
+
+static int gs_CapIndex(GLenum cap)
+{
+	switch (cap) {
+	case GL_DEPTH_TEST:          return 0;
+	case GL_CULL_FACE:           return 1;
+	case GL_BLEND:               return 2;
+	case GL_RASTERIZER_DISCARD:  return 3;
+	default:                     return -1;
+	}
+}
+
+static void APIENTRY gs_Enable(GLenum cap)
+{
+	rdGLState *s = &local.glState;
+	const int  i = gs_CapIndex(cap);
+
+	if (i < 0) {
+		gs_Count(1);
+		glDriver.Enable(cap);
+		return;
+	}
+
+	if (gs_Count(!s->capsKnown[i] || !s->caps[i]))
+		glDriver.Enable(cap);
+	s->caps[i]      = 1;
+	s->capsKnown[i] = 1;
+}
+
+static void APIENTRY gs_Disable(GLenum cap)
+{
+	rdGLState *s = &local.glState;
+	const int  i = gs_CapIndex(cap);
+
+	if (i < 0) {
+		gs_Count(1);
+		glDriver.Disable(cap);
+		return;
+	}
+
+	if (gs_Count(!s->capsKnown[i] || s->caps[i]))
+		glDriver.Disable(cap);
+	s->caps[i]      = 0;
+	s->capsKnown[i] = 1;
+}
+
+static void APIENTRY gs_DepthFunc(GLenum func)
+{
+	rdGLState *s = &local.glState;
+
+	if (gs_Count(!s->depthFuncKnown || s->depthFunc != func))
+		glDriver.DepthFunc(func);
+	s->depthFunc      = func;
+	s->depthFuncKnown = 1;
+}
+
+static void APIENTRY gs_DepthMask(GLboolean flag)
+{
+	rdGLState *s = &local.glState;
+
+	if (gs_Count(!s->depthMaskKnown || s->depthMask != flag))
+		glDriver.DepthMask(flag);
+	s->depthMask      = flag;
+	s->depthMaskKnown = 1;
+}
+
+static void APIENTRY gs_CullFace(GLenum mode)
+{
+	rdGLState *s = &local.glState;
+
+	if (gs_Count(!s->cullFaceKnown || s->cullFace != mode))
+		glDriver.CullFace(mode);
+	s->cullFace      = mode;
+	s->cullFaceKnown = 1;
+}
+
+static void APIENTRY gs_Viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+	rdGLState *s = &local.glState;
+
+	if (gs_Count(!s->viewportKnown || s->viewport[0] != x || s->viewport[1] != y ||
+	               s->viewport[2] != width || s->viewport[3] != height))
+		glDriver.Viewport(x, y, width, height);
+	s->viewport[0]   = x;
+	s->viewport[1]   = y;
+	s->viewport[2]   = width;
+	s->viewport[3]   = height;
+	s->viewportKnown = 1;
+}
+
+static void APIENTRY gs_ColorMask(GLboolean red, GLboolean green, GLboolean blue,
+                                  GLboolean alpha)
+{
+	rdGLState *s = &local.glState;
+
+	if (gs_Count(!s->colorMaskKnown || s->colorMask[0] != red || s->colorMask[1] != green ||
+	               s->colorMask[2] != blue || s->colorMask[3] != alpha))
+		glDriver.ColorMask(red, green, blue, alpha);
+	s->colorMask[0]   = red;
+	s->colorMask[1]   = green;
+	s->colorMask[2]   = blue;
+	s->colorMask[3]   = alpha;
+	s->colorMaskKnown = 1;
+}
+
+/* Only GL_FRAMEBUFFER, which binds both the draw and the read framebuffer, is tracked */
+static void APIENTRY gs_BindFramebuffer(GLenum target, GLuint framebuf)
+{
+	rdGLState *s = &local.glState;
+
+	if (target != GL_FRAMEBUFFER) {
+		gs_Count(1);
+		glDriver.BindFramebuffer(target, framebuf);
+		s->framebufKnown = 0;
+		return;
+	}
+
+	if (gs_Count(!s->framebufKnown || s->framebuf != framebuf))
+		glDriver.BindFramebuffer(target, framebuf);
+	s->framebuf      = framebuf;
+	s->framebufKnown = 1;
+}
+
+static void APIENTRY gs_BindVertexArray(GLuint vertexArray)
+{
+	rdGLState *s = &local.glState;
+
+	if (gs_Count(!s->vertexArrayKnown || s->vertexArray != vertexArray))
+		glDriver.BindVertexArray(vertexArray);
+	s->vertexArray      = vertexArray;
+	s->vertexArrayKnown = 1;
+}
+
+static void APIENTRY gs_ActiveTexture(GLenum texture)
+{
+	rdGLState *s = &local.glState;
+
+	if (gs_Count(!s->activeTextureKnown || s->activeTexture != texture))
+		glDriver.ActiveTexture(texture);
+	s->activeTexture      = texture;
+	s->activeTextureKnown = 1;
+}
+
+/* GL_TEXTURE_2D on the first RD_GL_TEXTURE_UNITS units is tracked */
+static void APIENTRY gs_BindTexture(GLenum target, GLuint texture)
+{
+	rdGLState *s = &local.glState;
+	int        unit;
+
+	unit = s->activeTextureKnown ? (int) (s->activeTexture - GL_TEXTURE0) : -1;
+
+	if (target != GL_TEXTURE_2D || unit < 0 || unit >= RD_GL_TEXTURE_UNITS) {
+		gs_Count(1);
+		glDriver.BindTexture(target, texture);
+		return;
+	}
+
+	if (gs_Count(!s->texturesKnown[unit] || s->textures[unit] != texture))
+		glDriver.BindTexture(target, texture);
+	s->textures[unit]      = texture;
+	s->texturesKnown[unit] = 1;
+}
+
+static void APIENTRY gs_UseProgram(GLuint program)
+{
+	rdGLState *s = &local.glState;
+
+	if (gs_Count(!s->programKnown || s->program != program))
+		glDriver.UseProgram(program);
+	s->program      = program;
+	s->programKnown = 1;
+	s->programCache = gs_FindProgram(program);
+}
+
+/* Linking resets the uniforms */
+static void APIENTRY gs_LinkProgram(GLuint program)
+{
+	rdGLProgram *cache = gs_FindProgram(program);
+
+	glDriver.LinkProgram(program);
+	if (cache != NULL)
+		memset(cache->uniforms, 0, sizeof (cache->uniforms));
+}
+
+/* The name may come back for another program */
+static void APIENTRY gs_DeleteProgram(GLuint program)
+{
+	rdGLState   *s     = &local.glState;
+	rdGLProgram *cache = gs_FindProgram(program);
+
+	glDriver.DeleteProgram(program);
+	if (cache != NULL)
+		cache->program = 0;
+	if (s->programKnown && s->program == program) {
+		s->programKnown = 0;
+		s->programCache = NULL;
+	}
+}
+
+/* Deleting what is bound binds 0 in its place */
+static void APIENTRY gs_DeleteFramebuffers(GLsizei n, GLuint *framebufs)
+{
+	rdGLState *s = &local.glState;
+
+	glDriver.DeleteFramebuffers(n, framebufs);
+	for (GLsizei i = 0; i < n; i++) {
+		if (s->framebufKnown && s->framebuf == framebufs[i])
+			s->framebuf = 0;
+	}
+}
+
+static void APIENTRY gs_DeleteVertexArrays(GLsizei n, GLuint *vertexArrays)
+{
+	rdGLState *s = &local.glState;
+
+	glDriver.DeleteVertexArrays(n, vertexArrays);
+	for (GLsizei i = 0; i < n; i++) {
+		if (s->vertexArrayKnown && s->vertexArray == vertexArrays[i])
+			s->vertexArray = 0;
+	}
+}
+
+static void APIENTRY gs_DeleteTextures(GLsizei n, const GLuint *textures)
+{
+	rdGLState *s = &local.glState;
+
+	glDriver.DeleteTextures(n, textures);
+	for (GLsizei i = 0; i < n; i++) {
+		for (int unit = 0; unit < RD_GL_TEXTURE_UNITS; unit++) {
+			if (s->texturesKnown[unit] && s->textures[unit] == textures[i])
+				s->textures[unit] = 0;
+		}
+	}
+}
+
+/* The cache of a program, taking a free one the first time it is used. NULL for program 0, or
+ * once all are taken. */
+static rdGLProgram *gs_FindProgram(GLuint program)
+{
+	rdGLState   *s    = &local.glState;
+	rdGLProgram *unused = NULL;
+
+	if (program == 0)
+		return NULL;
+
+	for (int i = 0; i < s->numPrograms; i++) {
+		if (s->programs[i].program == program)
+			return &s->programs[i];
+		if (s->programs[i].program == 0 && unused == NULL)
+			unused = &s->programs[i];
+	}
+
+	if (unused == NULL && s->numPrograms < RD_GL_PROGRAMS)
+		unused = &s->programs[s->numPrograms++];
+	if (unused == NULL)
+		return NULL;
+
+	unused->program = program;
+	memset(unused->uniforms, 0, sizeof (unused->uniforms));
+	return unused;
+}
+
+/* Whether the uniform of the current program already holds the value, remembering it if not.
+ * An array takes a location per element; only its first keeps the value, if it fits in a 4x4
+ * matrix. */
+static int gs_UniformChanges(GLint location, GLsizei count, int kind, const void *value,
+                             size_t size)
+{
+	rdGLState   *s     = &local.glState;
+	rdGLProgram *cache = s->programKnown ? s->programCache : NULL;
+	rdGLUniform *u;
+
+	if (cache == NULL || location < 0 || location >= RD_GL_UNIFORMS)
+		return gs_Count(1);
+
+	for (GLint i = location + 1; i < location + count && i < RD_GL_UNIFORMS; i++)
+		cache->uniforms[i].kind = RD_GL_UNIFORM_UNKNOWN;
+
+	u = &cache->uniforms[location];
+
+	if (size > sizeof (u->value)) {
+		u->kind = RD_GL_UNIFORM_UNKNOWN;
+		return gs_Count(1);
+	}
+
+	if (u->kind == kind && memcmp(u->value, value, size) == 0)
+		return gs_Count(0);
+
+	u->kind = kind;
+	memcpy(u->value, value, size);
+	return gs_Count(1);
+}
+
+static void APIENTRY gs_Uniform1i(GLint location, GLint v0)
+{
+	if (gs_UniformChanges(location, 1, RD_GL_UNIFORM_1I, &v0, sizeof (v0)))
+		glDriver.Uniform1i(location, v0);
+}
+
+static void APIENTRY gs_Uniform1f(GLint location, GLfloat v0)
+{
+	if (gs_UniformChanges(location, 1, RD_GL_UNIFORM_1F, &v0, sizeof (v0)))
+		glDriver.Uniform1f(location, v0);
 }
 
-static rdVec3 mx_MultiVector3(const rdMat3 *mat, const rdVec3 *vec)
+static void APIENTRY gs_Uniform1fv(GLint location, GLsizei count, const GLfloat *value)
 {
-	rdVec3 ret;
+	if (gs_UniformChanges(location, count, RD_GL_UNIFORM_1F, value, count * sizeof (GLfloat)))
+		glDriver.Uniform1fv(location, count, value);
+}
 
-	ret.x = mat->m[0][0] * vec->x + mat->m[0][1] * vec->y + mat->m[0][2] * vec->z;
-	ret.y = mat->m[1][0] * vec->x + mat->m[1][1] * vec->y + mat->m[1][2] * vec->z;
-	ret.z = mat->m[2][0] * vec->x + mat->m[2][1] * vec->y + mat->m[2][2] * vec->z;
+static void APIENTRY gs_Uniform2fv(GLint location, GLsizei count, const GLfloat *value)
+{
+	if (gs_UniformChanges(location, count, RD_GL_UNIFORM_2F, value, count * 2 * sizeof (GLfloat)))
+		glDriver.Uniform2fv(location, count, value);
+}
 
-	return ret;
+static void APIENTRY gs_Uniform3fv(GLint location, GLsizei count, const GLfloat *value)
+{
+	if (gs_UniformChanges(location, count, RD_GL_UNIFORM_3F, value, count * 3 * sizeof (GLfloat)))
+		glDriver.Uniform3fv(location, count, value);
 }
 
-static rdVec4 mx_MultiVector4(const rdMat4 *mat, const rdVec4 *vec)
+static void APIENTRY gs_Uniform4fv(GLint location, GLsizei count, const GLfloat *value)
 {
-	rdVec4 ret;
+	if (gs_UniformChanges(location, count, RD_GL_UNIFORM_4F, value, count * 4 * sizeof (GLfloat)))
+		glDriver.Uniform4fv(location, count, value);
+}
 
-	ret.x = mat->m[0][0] * vec->x + mat->m[0][1] * vec->y + mat->m[0][2] * vec->z + mat->m[0][3] * vec->w;
-	ret.y = mat->m[1][0] * vec->x + mat->m[1][1] * vec->y + mat->m[1][2] * vec->z + mat->m[1][3] * vec->w;
-	ret.z = mat->m[2][0] * vec->x + mat->m[2][1] * vec->y + mat->m[2][2] * vec->z + mat->m[2][3] * vec->w;
-	ret.w = mat->m[3][0] * vec->x + mat->m[3][1] * vec->y + mat->m[3][2] * vec->z + mat->m[3][3] * vec->w;
+/* The transposed and plain uploads of the same floats are different values */
+static void APIENTRY gs_UniformMatrix3fv(GLint location, GLsizei count, GLboolean transpose,
+                                         const GLfloat *value)
+{
+	const int kind = transpose ? RD_GL_UNIFORM_MATRIX3_TRANSPOSED : RD_GL_UNIFORM_MATRIX3;
 
-	return ret;
+	if (gs_UniformChanges(location, count, kind, value, count * 9 * sizeof (GLfloat)))
+		glDriver.UniformMatrix3fv(location, count, transpose, value);
 }
 
-static rdMat3 mx_Mat3From4(const rdMat4 *src)
+static void APIENTRY gs_UniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose,
+                                         const GLfloat *value)
 {
-	rdMat3 ret;
-
-	ret.m[0][0] = src->m[0][0];
-	ret.m[0][1] = src->m[0][1];
-	ret.m[0][2] = src->m[0][2];
-	ret.m[1][0] = src->m[1][0];
-	ret.m[1][1] = src->m[1][1];
-	ret.m[1][2] = src->m[1][2];
-	ret.m[2][0] = src->m[2][0];
-	ret.m[2][1] = src->m[2][1];
-	ret.m[2][2] = src->m[2][2];
+	const int kind = transpose ? RD_GL_UNIFORM_MATRIX4_TRANSPOSED : RD_GL_UNIFORM_MATRIX4;
 
-	return ret;
+	if (gs_UniformChanges(location, count, kind, value, count * 16 * sizeof (GLfloat)))
+		glDriver.UniformMatrix4fv(location, count, transpose, value);
 }
 
-static void mx_Invert3(rdMat3 *mat)
+static void st_StartTimer(rdTimerRun run)
 {
-	float tmp[3][3];
-	float det, invDet;
+	rdTimerFrame *tf = &local.timerFrames[local.frameIndex % RD_TIMER_FRAMES];
 
-    tmp[0][0] = mat->m[1][1] * mat->m[2][2] - mat->m[1][2] * mat->m[2][1];
-    tmp[0][1] = mat->m[0][2] * mat->m[2][1] - mat->m[0][1] * mat->m[2][2];
-    tmp[0][2] = mat->m[0][1] * mat->m[1][2] - mat->m[0][2] * mat->m[1][1];
-    tmp[1][0] = mat->m[1][2] * mat->m[2][0] - mat->m[1][0] * mat->m[2][2];
-    tmp[1][1] = mat->m[0][0] * mat->m[2][2] - mat->m[0][2] * mat->m[2][0];
-    tmp[1][2] = mat->m[0][2] * mat->m[1][0] - mat->m[0][0] * mat->m[1][2];
-    tmp[2][0] = mat->m[1][0] * mat->m[2][1] - mat->m[1][1] * mat->m[2][0];
-    tmp[2][1] = mat->m[0][1] * mat->m[2][0] - mat->m[0][0] * mat->m[2][1];
-    tmp[2][2] = mat->m[0][0] * mat->m[1][1] - mat->m[0][1] * mat->m[1][0];
+	if (local.timerRunning == run)
+		return;
 
-	det = mat->m[0][0] * tmp[0][0] + mat->m[0][1] * tmp[1][0] + mat->m[0][2] * tmp[2][0];
+	st_StopTimer();
 
-	if (fabs(det) <= 0.00001f) {
+	/* Runs past the last query go untimed */
+	if (tf->numRuns == RD_TIMER_RUNS) {
+		tf->partial = 1;
 		return;
 	}
 
-	invDet = 1.0f / det;
-
-    mat->m[0][0] = invDet * tmp[0][0];
-    mat->m[0][1] = invDet * tmp[0][1];
-    mat->m[0][2] = invDet * tmp[0][2];
-    mat->m[1][0] = invDet * tmp[1][0];
-    mat->m[1][1] = invDet * tmp[1][1];
-    mat->m[1][2] = invDet * tmp[1][2];
-    mat->m[2][0] = invDet * tmp[2][0];
-    mat->m[2][1] = invDet * tmp[2][1];
-    mat->m[2][2] = invDet * tmp[2][2];
+	gl.BeginQuery(GL_TIME_ELAPSED, tf->timeQueries[tf->numRuns]);
+	if (run != RD_TIMER_SHADOWMAP)
+		gl.BeginQuery(GL_SAMPLES_PASSED, tf->sampleQueries[tf->numRuns]);
+	tf->runs[tf->numRuns++] = run;
+	local.timerRunning = run;
 }
 
-static void mx_Transpose3(rdMat3 *mat)
+static void st_StopTimer(void)
 {
-	rdMat3 tmp;
-
-	tmp.m[0][0] = mat->m[0][0];
-	tmp.m[0][1] = mat->m[1][0];
-	tmp.m[0][2] = mat->m[2][0];
-	tmp.m[1][0] = mat->m[0][1];
-	tmp.m[1][1] = mat->m[1][1];
-	tmp.m[1][2] = mat->m[2][1];
-	tmp.m[2][0] = mat->m[0][2];
-	tmp.m[2][1] = mat->m[1][2];
-	tmp.m[2][2] = mat->m[2][2];
+	if (local.timerRunning == RD_TIMER_NONE)
+		return;
 
-	*mat = tmp;
+	gl.EndQuery(GL_TIME_ELAPSED);
+	if (local.timerRunning != RD_TIMER_SHADOWMAP)
+		gl.EndQuery(GL_SAMPLES_PASSED);
+	local.timerRunning = RD_TIMER_NONE;
 }
 
-static rdVec2 vc_Vec2(float x, float y)
+/* Publishes the counts of the frame that just ended, and the GPU time of the frame whose queries
+ * are about to be reused, RD_TIMER_FRAMES - 1 frames earlier. The samples of that frame update
+ * the overdraw the next frame's G-buffer mode is chosen by. */
+static void st_EndFrame(void)
 {
-	rdVec2 vec;
+	rdTimerFrame *tf = &local.timerFrames[local.frameIndex % RD_TIMER_FRAMES];
 
-	vec.x = x;
-	vec.y = y;
+	GLuint64 shadowMapTime  = 0;
+	GLuint64 gBufferTime    = 0;
+	GLuint64 depthSamples   = 0;
+	GLuint64 visibleSamples = 0;
 
-	return vec;
-}
+	local.stats = local.frameStats;
+	local.stats.gBufferSinglePass = local.singlePass;
 
-static rdVec3 vc_Vec3(float x, float y, float z)
-{
-	rdVec3 vec;
+	for (int i = 0; i < tf->numRuns; i++) {
+		GLuint64 elapsed;
+		GLuint64 samples;
 
-	vec.x = x;
-	vec.y = y;
-	vec.z = z;
+		gl.GetQueryObjectui64v(tf->timeQueries[i], GL_QUERY_RESULT, &elapsed);
+		if (tf->runs[i] == RD_TIMER_SHADOWMAP) {
+			shadowMapTime += elapsed;
+			continue;
+		}
 
-	return vec;
-}
+		gl.GetQueryObjectui64v(tf->sampleQueries[i], GL_QUERY_RESULT, &samples);
+		gBufferTime += elapsed;
+		if (tf->runs[i] == RD_TIMER_DEPTH)
+			depthSamples += samples;
+		else
+			visibleSamples += samples;
+	}
 
-static rdVec4 vc_Vec4(float x, float y, float z, float w)
-{
-	rdVec4 vec;
+	local.stats.shadowMapMilliseconds = shadowMapTime / 1.0e6;
+	local.stats.gBufferMilliseconds   = gBufferTime / 1.0e6;
+
+	/* A single pass leaves nothing to count the visible samples by, so the last prepass's stand
+	 * in for them. A frame that can't be measured drops the estimate, and adaptive goes back to
+	 * the prepass until a whole frame measures it again. */
+	if (tf->partial) {
+		local.gBufferOverdraw    = 0.0f;
+		local.visibleSamples     = 0;
+		local.adaptiveSinglePass = 0;
+	} else if (depthSamples > 0) {
+		if (!tf->singlePass)
+			local.visibleSamples = visibleSamples;
+		if (local.visibleSamples > 0)
+			local.gBufferOverdraw = (float) depthSamples / local.visibleSamples;
+	}
+	local.stats.gBufferOverdraw = local.gBufferOverdraw;
 
-	vec.x = x;
-	vec.y = y;
-	vec.z = z;
-	vec.w = w;
+	local.singlePass = st_ChooseSinglePass();
+	tf->numRuns    = 0;
+	tf->singlePass = local.singlePass;
+	tf->partial    = 0;
 
-	return vec;
-}
+	/* The occlusion tests of the frame before the one that just ended */
+	const int occlusionFrame = local.frameIndex % RD_OCCLUSION_FRAMES;
 
-static void vc_Zero(rdVec3 *vec)
-{
-	vec->x = 0.0f;
-	vec->y = 0.0f;
-	vec->z = 0.0f;
-}
+	for (int i = 0; i < local.numOcclusionTests[occlusionFrame]; i++) {
+		GLuint passed;
 
-static rdVec3 vc_Add(const rdVec3 *a, const rdVec3 *b)
-{
-	rdVec3 vec;
+		gl.GetQueryObjectuiv(local.occlusionQueries[occlusionFrame][i], GL_QUERY_RESULT, &passed);
+		if (!passed) {
+			local.stats.occlusionCulled++;
+			local.stats.occlusionObjectsCulled += local.occlusionObjects[occlusionFrame][i];
+		}
+	}
 
-	vec.x = a->x + b->x;
-	vec.y = a->y + b->y;
-	vec.z = a->z + b->z;
+	local.stats.occlusionTests = local.numOcclusionTests[occlusionFrame];
+	local.numOcclusionTests[occlusionFrame] = 0;
 
-	return vec;
+	memset(&local.frameStats, 0, sizeof (local.frameStats));
 }
 
-static rdVec3 vc_Sub(const rdVec3 *a, const rdVec3 *b)
+/* How the next frame draws the G-buffer. Adaptively a single pass is kept while the overdraw
+ * stays low, with a prepass frame now and then to count the visible samples again. */
+static int st_ChooseSinglePass(void)
 {
-	rdVec3 vec;
+	if (local.gBufferMode == RD_GBUFFER_PREPASS)
+		return 0;
+	if (local.gBufferMode == RD_GBUFFER_SINGLE_PASS)
+		return 1;
 
-	vec.x = a->x - b->x;
-	vec.y = a->y - b->y;
-	vec.z = a->z - b->z;
+	if (local.gBufferOverdraw > 0.0f) {
+		if (local.adaptiveSinglePass && local.gBufferOverdraw > RD_GBUFFER_OVERDRAW_HIGH)
+			local.adaptiveSinglePass = 0;
+		else if (!local.adaptiveSinglePass && local.gBufferOverdraw < RD_GBUFFER_OVERDRAW_LOW)
+			local.adaptiveSinglePass = 1;
+	}
 
-	return vec;
+	if (!local.adaptiveSinglePass)
+		return 0;
+
+	return ++local.singlePassFrames % RD_GBUFFER_PROBE_FRAMES != 0;
 }
 
-static rdVec3 vc_Multiply(const rdVec3 *a, const rdVec3 *b)
+/* Grows the box of receivers of the object's shadow map, for the resolve pass. Maps past the
+ * ones the pass samples cast no shadows. */
+static void sd_AddReceiver(const rdObject *obj)
 {
-	rdVec3 vec;
+	rdShadowReceivers *r = &local.shadowReceivers;
+	rdVec3             min, max;
+	int                i;
 
-	vec.x = a->x * b->x;
-	vec.y = a->y * b->y;
-	vec.z = a->z * b->z;
+	assert(obj->sm != NULL);
 
-	return vec;
+	min = vc_Sub(&obj->worldCenter, &obj->worldExtent);
+	max = vc_Add(&obj->worldCenter, &obj->worldExtent);
+
+	for (i = 0; i < r->numMaps; i++) {
+		if (r->maps[i] == obj->sm)
+			break;
+	}
+
+	if (i == r->numMaps) {
+		if (r->numMaps == RD_SHADOW_RESOLVE_MAPS)
+			return;
+
+		r->maps[i] = obj->sm;
+		r->min[i]  = min;
+		r->max[i]  = max;
+		r->numMaps++;
+		return;
+	}
+
+	r->min[i] = vc_Min(&r->min[i], &min);
+	r->max[i] = vc_Max(&r->max[i], &max);
 }
 
-static rdVec3 vc_MultiScalar(const rdVec3 *vec, float scalar)
+/* Rebuilds what the passes read of the object that its transform, the camera or the jitter
+ * changed since the last time, the view space matrices only if asked for. Each changes at most
+ * once a frame, so the object's other passes find everything current. */
+static void tr_UpdateObject(rdObject *obj, int viewspace)
 {
-	rdVec3 ret;
+	const rdCamera *cam = &local.defaultCamera;
 
-	ret.x = vec->x * scalar;
-	ret.y = vec->y * scalar;
-	ret.z = vec->z * scalar;
+	if (local.defaultCamera.update) {
+		cm_SyncViewMatrix(&local.defaultCamera);
+		local.defaultCamera.update = 0;
+	}
 
-	return ret;
+	/* mModel itself is rebuilt as soon as the transform changes, to keep the bounds current */
+	if (obj->update) {
+		obj->update = 0;
+		if (obj->sm != NULL)
+			mx_MultiAB(&obj->mModelLightspace, &obj->sm->mLightspace, &obj->mModel);
+		obj->cameraVersion    = 0;
+		obj->viewspaceVersion = 0;
+	}
+
+	if (obj->cameraVersion != cam->version || obj->mPrevMVP == NULL ||
+	    obj->jitterIndex != local.jitterIndex) {
+		mx_MultiABC(&obj->mMVP, &local.mProjectionJitter, &cam->mView, &obj->mModel);
+		obj->cameraVersion = cam->version;
+		obj->jitterIndex   = local.jitterIndex;
+	}
+
+	if (viewspace && obj->viewspaceVersion != cam->version) {
+		rdMat3 mInvModelView3;
+
+		mx_MultiAB(&obj->mModelView, &cam->mView, &obj->mModel);
+		mInvModelView3 = mx_Mat3From4(&obj->mModelView);
+		mx_Invert3(&mInvModelView3);
+		obj->mNormal = mInvModelView3;
+		mx_Transpose3(&obj->mNormal);
+
+		obj->viewspaceVersion = cam->version;
+	}
 }
-#if 0
-static rdVec3 vc_DivideScalar(const rdVec3 *vec, float scalar)
-{
-	rdVec3 ret;
 
-	ret.x = vec->x / scalar;
-	ret.y = vec->y / scalar;
-	ret.z = vec->z / scalar;
+/* Brings the objects of the queue up to date in one go, so the draws only read them. Items
+ * after an object's first cost a few compares. */
+static void tr_UpdateQueued(const rdQueue *q)
+{
+	for (int i = 0; i < q->numItems; i++) {
+		const rdQueueItem *item = &q->items[i];
 
-	return ret;
+		if (item->obj != NULL)
+			tr_UpdateObject(item->obj, tr_WritesGBuffer(item->draw, item->obj));
+	}
 }
-#endif
-static int vc_Equal(const rdVec3 *a, const rdVec3 *b)
+
+/* Whether the draw needs the model-view and normal matrices */
+static int tr_WritesGBuffer(rdDrawType draw, const rdObject *obj)
 {
-	if (a->x == b->x && a->y == b->y && a->z == b->z)
-		return 1;
-	return 0;
+	/* Bloom materials aren't lit, so they only ever write depth and velocity */
+	if (draw == RD_DRAW_DEPTHVELOCITY)
+		return local.singlePass && obj->materialType != RD_MATERIAL_BLOOM;
+	return draw == RD_DRAW_GBUFFER;
 }
 
-static void vc_Normalize(rdVec3 *vec)
+static void ub_Setup(rdUniformBlocks *ub)
 {
-	float len;
+	const GLsizeiptr sizes[RD_BLOCKS] = {
+		sizeof (rdFrameBlock), sizeof (rdLightBlock), sizeof (rdMaterialBlock)
+	};
 
-	len = sqrt((vec->x * vec->x) + (vec->y * vec->y) + (vec->z * vec->z));
-	if (len == 0.0f)
-		return;
+	gl.GenBuffers(RD_BLOCKS, ub->buffers);
+	for (int i = 0; i < RD_BLOCKS; i++) {
+		gl.BindBuffer(GL_UNIFORM_BUFFER, ub->buffers[i]);
+		gl.BufferData(GL_UNIFORM_BUFFER, sizes[i], NULL, GL_DYNAMIC_DRAW);
+		gl.BindBufferBase(GL_UNIFORM_BUFFER, i, ub->buffers[i]);
+	}
+	gl.BindBuffer(GL_UNIFORM_BUFFER, 0);
 
-	vec->x = vec->x / len;
-	vec->y = vec->y / len;
-	vec->z = vec->z / len;
+	ub->dirty         = (1u << RD_BLOCKS) - 1;
+	ub->cameraVersion = 0;
 }
 
-static void vc_Invert(rdVec3 *vec)
+static void ub_Destroy(rdUniformBlocks *ub)
 {
-	if (vec->x != 0.0f)
-		vec->x = -vec->x;
-	if (vec->y != 0.0f)
-		vec->y = -vec->y;
-	if (vec->z != 0.0f)
-		vec->z = -vec->z;
+	gl.DeleteBuffers(RD_BLOCKS, ub->buffers);
 }
 
-static rdVec3 vc_Cross(const rdVec3 *a, const rdVec3 *b)
+/* Uploads the blocks marked dirty, once per frame before the passes that read them */
+static void ub_Update(rdUniformBlocks *ub)
 {
-	rdVec3 cross;
+	const rdCamera *cam = &local.defaultCamera;
 
-	cross.x = (a->y * b->z) - (b->y * a->z);
-	cross.y = (a->z * b->x) - (b->z * a->x);
-	cross.z = (a->x * b->y) - (b->x * a->y);
-	
-	return cross;
+	if (local.defaultCamera.update) {
+		cm_SyncViewMatrix(&local.defaultCamera);
+		local.defaultCamera.update = 0;
+	}
+
+	if (ub->cameraVersion != cam->version) {
+		ub->dirty |= 1u << RD_BLOCK_FRAME | 1u << RD_BLOCK_LIGHTS;
+		ub->cameraVersion = cam->version;
+	}
+
+	if (ub->dirty & 1u << RD_BLOCK_FRAME) {
+		rdFrameBlock block;
+		rdMat3       mNormal;
+		rdVec3       up = vc_Vec3(0.0, 1.0f, 0.0f);
+
+		mNormal = mx_Mat3From4(&cam->mView);
+		mx_Invert3(&mNormal);
+		mx_Transpose3(&mNormal);
+		up = mx_MultiVector3(&mNormal, &up);
+
+		block.mProjection    = local.mProjection;
+		block.mInvProjection = local.mInvProjection;
+		block.viewspaceUp[0] = up.x;
+		block.viewspaceUp[1] = up.y;
+		block.viewspaceUp[2] = up.z;
+		block.viewspaceUp[3] = 0.0f;
+
+		ub_Upload(ub->buffers[RD_BLOCK_FRAME], sizeof (block), &block);
+	}
+
+	if (ub->dirty & 1u << RD_BLOCK_LIGHTS) {
+		rdLightBlock block;
+
+		memset(&block, 0, sizeof (block));
+
+		for (int i = 0; i < 64; i++) {
+			const rdLight *l = &local.lights[i];
+			int            n = block.numLights;
+			rdVec4         tmp, tmp2;
+
+			if (!l->enabled)
+				continue;
+
+			tmp  = vc_Vec4(l->x, l->y, l->z, 1.0f);
+			tmp2 = mx_MultiVector4(&cam->mView, &tmp);
+
+			block.positions[n][0] = tmp2.x;
+			block.positions[n][1] = tmp2.y;
+			block.positions[n][2] = tmp2.z;
+
+			block.colors[n][0] = l->red;
+			block.colors[n][1] = l->green;
+			block.colors[n][2] = l->blue;
+
+			block.properties[n][0] = l->intensity;
+			block.properties[n][1] = l->cutoffRadius;
+			block.properties[n][2] = l->upward;
+
+			block.numLights++;
+		}
+
+		ub_Upload(ub->buffers[RD_BLOCK_LIGHTS], sizeof (block), &block);
+	}
+
+	if (ub->dirty & 1u << RD_BLOCK_MATERIALS) {
+		rdMaterialBlock block;
+
+		memset(&block, 0, sizeof (block));
+
+		for (int i = 0; i < 64; i++) {
+			const rdMaterial *m = &local.materials[i];
+
+			block.colors[i][0] = m->red;
+			block.colors[i][1] = m->green;
+			block.colors[i][2] = m->blue;
+
+			block.properties[i][0] = m->metalness;
+			block.properties[i][1] = m->roughness;
+			block.properties[i][2] = m->ambient;
+			block.properties[i][3] = m->reflectance;
+		}
+
+		ub_Upload(ub->buffers[RD_BLOCK_MATERIALS], sizeof (block), &block);
+	}
+
+	ub->dirty = 0;
 }
 
-static float vc_Dot(const rdVec3 *a, const rdVec3 *b)
+static void ub_Upload(GLuint buffer, GLsizeiptr size, const void *data)
 {
-	rdVec3 tmp;
-
-	tmp = vc_Multiply(a, b);
-	return tmp.x + tmp.y + tmp.z;
+	gl.BindBuffer(GL_UNIFORM_BUFFER, buffer);
+	gl.BufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+	gl.BindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
 static float ma_ToRadians(float degrees)
@@ -2725,3 +9285,53 @@ static float ma_Halton(unsigned int i, unsigned int base)
 
 	return r;
 }
+
+static unsigned short ma_FloatToHalf(float f)
+{
+	unsigned int bits, sign, mantissa, half, rest;
+	int          exponent;
+
+	memcpy(&bits, &f, sizeof (bits));
+
+	sign     = (bits >> 16) & 0x8000u;
+	exponent = (int) ((bits >> 23) & 0xffu) - 127 + 15;
+	mantissa = bits & 0x7fffffu;
+
+	if (((bits >> 23) & 0xffu) == 0xffu)
+		return sign | 0x7c00u | (mantissa ? 0x200u : 0u);
+	if (exponent >= 31)
+		return sign | 0x7c00u;
+
+	if (exponent <= 0) {
+		int shift = 14 - exponent;
+
+		if (exponent < -10)
+			return sign;
+
+		mantissa |= 0x800000u;
+		half = mantissa >> shift;
+		rest = mantissa & ((1u << shift) - 1);
+
+		/* Round to nearest even, like the F16C conversion */
+		if (rest > 1u << (shift - 1) || (rest == 1u << (shift - 1) && (half & 1)))
+			half++;
+		return sign | half;
+	}
+
+	half = ((unsigned int) exponent << 10) | (mantissa >> 13);
+	rest = mantissa & 0x1fffu;
+
+	/* A carry out of the mantissa correctly bumps the exponent, up to infinity */
+	if (rest > 0x1000u || (rest == 0x1000u && (half & 1)))
+		half++;
+	return sign | half;
+}
+
+static GLuint ma_PackNormal(const rdVec3 *normal)
+{
+	const int x = (int) roundf(ma_Clamp(normal->x, -1.0f, 1.0f) * 511.0f);
+	const int y = (int) roundf(ma_Clamp(normal->y, -1.0f, 1.0f) * 511.0f);
+	const int z = (int) roundf(ma_Clamp(normal->z, -1.0f, 1.0f) * 511.0f);
+
+	return ((GLuint) x & 0x3ffu) | (((GLuint) y & 0x3ffu) << 10) | (((GLuint) z & 0x3ffu) << 20);
+}
@@ -27,6 +27,30 @@ typedef enum rdDrawType
 	RD_DRAW_DEBUG_REFLECTIONS
 } rdDrawType;
 
+/* Passes an object is submitted to, drawn into by rd_Frame. The shadows pass draws nothing per
+ * object: rd_Frame shades the whole screen in one pass with each shadow map the objects were
+ * drawn or submitted to it with, where the pixels fall in the box around those objects. */
+typedef enum rdPass
+{
+	RD_PASS_DEPTHVELOCITY = 1 << RD_DRAW_DEPTHVELOCITY,
+	RD_PASS_SHADOWMAP     = 1 << RD_DRAW_SHADOWMAP,
+	RD_PASS_GBUFFER       = 1 << RD_DRAW_GBUFFER,
+	RD_PASS_SHADOWS       = 1 << RD_DRAW_SHADOWS,
+	RD_PASS_BLOOM         = 1 << RD_DRAW_BLOOM
+} rdPass;
+
+/* How the depth, velocity, material and normal targets are written. After a prepass the G-buffer
+ * pass only shades the visible fragment of each pixel; a single pass writes all of them at once,
+ * drawing the geometry once but shading what is later covered. Adaptive picks one per frame from
+ * the overdraw measured on the submitted draws. A frame it can't measure, such as one with camera
+ * passes drawn through rd_Draw, drops the measure, and the prepass is used until one can. */
+typedef enum rdGBufferMode
+{
+	RD_GBUFFER_PREPASS,
+	RD_GBUFFER_SINGLE_PASS,
+	RD_GBUFFER_ADAPTIVE
+} rdGBufferMode;
+
 typedef enum rdObjectType
 {
 	RD_OBJECT_EXTERIOR,
@@ -40,6 +64,25 @@ typedef enum rdMaterialType
 	RD_MATERIAL_BLOOM
 } rdMaterialType;
 
+typedef enum rdPositionFormat
+{
+	RD_POSITION_FLOAT,
+	RD_POSITION_HALF
+} rdPositionFormat;
+
+typedef enum rdIndexFormat
+{
+	RD_INDEX_16, /* rdIndex */
+	RD_INDEX_32  /* rdIndex32, for meshes with more than 65536 vertices */
+} rdIndexFormat;
+
+typedef enum rdObjectStatus
+{
+	RD_OBJECT_PENDING,
+	RD_OBJECT_RESIDENT,
+	RD_OBJECT_FAILED
+} rdObjectStatus;
+
 typedef struct rdVertex rdVertex;
 struct rdVertex
 {
@@ -48,13 +91,56 @@ struct rdVertex
 	float z;
 };
 
+/* Counts cover the last complete frame. GPU time comes from timer queries that are read a few
+ * frames later, so it lags behind the counts; occlusion results are read one frame later. */
+typedef struct rdStats rdStats;
+struct rdStats
+{
+	int    shadowMapDraws;
+	int    shadowCastersTested;
+	int    shadowCastersCulled;
+	double shadowMapMilliseconds;
+
+	int occlusionTests;
+	int occlusionCulled;        /* Tests that found their box hidden */
+	int occlusionObjectsCulled; /* Objects in the cull lists of those */
+
+	int    occluderTriangles;     /* Clipped, and covering at least one pixel */
+	int    occluderObjectsTested;
+	int    occluderObjectsCulled;
+	double occluderMilliseconds;  /* CPU time, rasterizing only */
+
+	int gpuCullObjects; /* Tested by rd_CullObjectsOnGpu; what it culled is only known there */
+
+	int objectDraws;      /* Object draws sent to the GPU, including conditional ones and the
+	                       * empty ones of objects culled on the GPU; clones batched together
+	                       * take one draw per level of detail */
+	int instancedObjects; /* Objects drawn as instances within those */
+	int stateChanges;     /* Framebuffer, viewport, depth, culling, program, texture, vertex
+	                       * array and conditional rendering switches between object draws */
+
+	int glCallsIssued;   /* State and uniform calls that reached the driver */
+	int glCallsFiltered; /* Left out because they would have changed nothing */
+
+	int    gBufferSinglePass;    /* The frame drew the G-buffer in a single pass */
+	int    gBufferVertices;      /* Submitted by the passes that write the G-buffer; indirect
+	                              * draws count at their finest level */
+	double gBufferMilliseconds;  /* GPU time of those passes, occlusion boxes between them aside */
+	float  gBufferOverdraw;      /* Fragments passing the depth test while depth was written, per
+	                              * visible one; 0 until a prepass frame measured the visible ones */
+};
+
 typedef void *rdAlloc(size_t);
 typedef void  rdFree(void *);
 
+/* Indices are uploaded in the format they are given in, which also becomes the GL index type */
 typedef unsigned short rdIndex;
+typedef unsigned int   rdIndex32;
 
 typedef struct rdShadowMap rdShadowMap;
 typedef struct rdObject    rdObject;
+typedef struct rdCullList  rdCullList;
+typedef struct rdBvh       rdBvh;
 
 void rd_Init(rdGL gl_init, int width, int height);
 void rd_Shutdown(void);
@@ -63,8 +149,26 @@ void rd_Viewport(int width, int height);
 void rd_Clear(rdClearType clear);
 void rd_ClearShadowMap(const rdShadowMap *sw);
 void rd_Draw(rdDrawType draw, rdObject *obj);
+/* Queues the object for each pass in passes, a set of rdPass flags. rd_Frame draws the queue
+ * sorted pass by pass to change as little state as it can; the prepass and shadow maps go front
+ * to back. The object's transform and the camera are read when it is drawn, its position and
+ * shadow map also when it is submitted. */
+void rd_Submit(rdObject *obj, unsigned int passes);
 void rd_Frame(void);
 
+size_t rd_GetScratchHighWater(void);
+void   rd_GetStats(rdStats *outStats);
+void   rd_SetUploadBudget(size_t bytesPerFrame);
+/* State binds and uniform uploads that would change nothing are left out of the GL calls, unless
+ * this is turned off; on by default */
+void   rd_SetStateFiltering(int enabled);
+/* Takes effect from the next frame; RD_GBUFFER_PREPASS by default */
+void   rd_SetGBufferMode(rdGBufferMode mode);
+
+int rd_GenerateNormals(rdVertex *outNormals, int numVertices, const rdVertex *vertices,
+                       int numIndices, const void *indices, rdIndexFormat indexFormat,
+                       rdObjectType objectType);
+
 void rd_SetLight(int index, float x, float y, float z, float red, float green, float blue,
                  float intensity, float cutoffRadius, float upward);
 void rd_EnableLight(int index);
@@ -80,17 +184,102 @@ void         rd_DestroyShadowMap(rdShadowMap *sm);
 void         rd_AttachShadowMap(rdObject *obj, rdShadowMap *sm);
 
 rdObject *rd_CreateObject(int numVertices, const rdVertex *vertices, int numIndices,
-                          const rdIndex *indices, rdObjectType objectType,
-                          rdMaterialType materialType);
+                          const void *indices, rdIndexFormat indexFormat, rdObjectType objectType,
+                          rdMaterialType materialType, rdPositionFormat positionFormat);
+rdObject *rd_CreateObjectPrecomputed(int numVertices, const rdVertex *vertices,
+                                     const rdVertex *normals, int numIndices, const void *indices,
+                                     rdIndexFormat indexFormat, rdObjectType objectType,
+                                     rdMaterialType materialType, rdPositionFormat positionFormat);
+
+/* Normals, LODs and vertex packing run on a loader thread and the upload is spread over the
+ * following rd_Frame calls; the object isn't drawn until it is resident. The arrays have to stay
+ * valid until the object is no longer pending. */
+rdObject      *rd_CreateObjectAsync(int numVertices, const rdVertex *vertices, int numIndices,
+                                    const void *indices, rdIndexFormat indexFormat,
+                                    rdObjectType objectType, rdMaterialType materialType,
+                                    rdPositionFormat positionFormat);
+rdObject      *rd_CreateObjectPrecomputedAsync(int numVertices, const rdVertex *vertices,
+                                               const rdVertex *normals, int numIndices,
+                                               const void *indices, rdIndexFormat indexFormat,
+                                               rdObjectType objectType,
+                                               rdMaterialType materialType,
+                                               rdPositionFormat positionFormat);
+rdObjectStatus rd_GetObjectStatus(const rdObject *obj);
+
 void      rd_DestroyObject(rdObject *obj);
 rdObject *rd_CloneObject(rdObject *original);
 void      rd_SetObjectMaterial(rdObject *obj, int materialID);
+void      rd_SetObjectFlatShaded(rdObject *obj, int flatShaded);
 void      rd_ResetObject(rdObject *obj);
 void      rd_PositionObject(rdObject *obj, float x, float y, float z);
 void      rd_MoveObject(rdObject *obj, float x, float y, float z);
 void      rd_ScaleObject(rdObject *obj, float scale);
 void      rd_OrientObject(rdObject *obj, float x, float y, float z);
 void      rd_RotateObject(rdObject *obj, float x, float y, float z);
+/* World-space box around the object as it is placed now, 0 while it has no geometry */
+int       rd_GetObjectBounds(const rdObject *obj, float outMin[3], float outMax[3]);
+
+/* Objects in a cull list are tested against the default camera's frustum together, over world
+ * bounds that are kept current as they move. rd_CullObjects writes a flag per object, in the
+ * order they were added, and returns how many are visible. An object is in one list at most. */
+rdCullList *rd_CreateCullList(int capacity);
+void        rd_DestroyCullList(rdCullList *list);
+void        rd_AddToCullList(rdCullList *list, rdObject *obj);
+void        rd_RemoveFromCullList(rdObject *obj);
+int         rd_CullObjects(const rdCullList *list, unsigned char *outVisible);
+/* Same for shadow casters: a caster is kept if it is inside the shadow map's light frustum and
+ * could throw a shadow on something inside the camera frustum */
+int         rd_CullShadowCasters(const rdCullList *list, const rdShadowMap *sm,
+                                 unsigned char *outVisible);
+/* Tests the box around the list's objects against the depth drawn so far this frame. Until
+ * rd_EndOcclusionTest, draws only reach the GPU if some of the box is visible. Returns 0 if the
+ * test was skipped (the box reaches past the near plane, or too many tests this frame). */
+int         rd_BeginOcclusionTest(const rdCullList *list);
+/* Same for objects submitted until rd_EndOcclusionTest. The box is drawn by rd_Frame before the
+ * first of them, against the prepass depth of the objects outside tests and under earlier ones. */
+int         rd_SubmitOcclusionTest(const rdCullList *list);
+void        rd_EndOcclusionTest(void);
+/* Interior objects queued with rd_AddOccluder are drawn by rd_RasterizeOccluders into a small
+ * depth buffer on the CPU, from the default camera. rd_CullOccludedObjects then clears the flags
+ * of the other objects that are completely behind them, and returns how many are still visible.
+ * The buffer is good until the end of the frame. */
+void        rd_AddOccluder(rdObject *obj);
+void        rd_RasterizeOccluders(void);
+int         rd_CullOccludedObjects(const rdCullList *list, unsigned char *inOutVisible);
+/* Culls the list on the GPU instead: against the frustum, and against the depth the previous
+ * frame's prepass left, as seen from that frame's camera. The result, along with the level of
+ * detail, becomes a draw command per object that the camera passes of rd_Draw use for the rest of
+ * the frame. Only the GPU is spared the culled objects: without multi-draw-indirect, each object
+ * still goes through rd_Draw and takes an indirect draw of its own, culled or not, and clones in
+ * the list aren't drawn as instances. Objects that come into view from behind something show up
+ * a frame late. */
+void        rd_CullObjectsOnGpu(rdCullList *list);
+
+/* Bounding volume hierarchy over objects' world bounds, for queries over many objects. Moving an
+ * object marks it; the next query (or rd_UpdateBvh) refits the tree, and rebuilds it if objects
+ * were added or removed or refitting made it too loose. A refit only fits the nodes above the
+ * moved objects, about 0.4 microseconds per move at a million objects, so it stays under a
+ * millisecond up to about two thousand moves per update. Past one object in 16 it fits every
+ * node instead, at about 15 ns each, which is the min/max and the change test rather than the
+ * memory they read: 10 to 14 ms at a million objects (p3d --bench-bvh). The game doesn't use
+ * one: its sectors hold a few objects each behind the portals and the PVS, and the stress field
+ * is a thousand objects that never move, which rd_CullObjects goes through faster than a query.
+ * Queries write at most maxObjects objects and return how many they found; the frustum is the
+ * default camera's. An object is in one BVH at most. */
+rdBvh    *rd_CreateBvh(void);
+void      rd_DestroyBvh(rdBvh *bvh);
+void      rd_AddToBvh(rdBvh *bvh, rdObject *obj);
+void      rd_RemoveFromBvh(rdObject *obj);
+void      rd_UpdateBvh(rdBvh *bvh);
+int       rd_QueryBvhFrustum(rdBvh *bvh, rdObject **outObjects, int maxObjects);
+int       rd_QueryBvhBox(rdBvh *bvh, float minX, float minY, float minZ, float maxX, float maxY,
+                         float maxZ, rdObject **outObjects, int maxObjects);
+int       rd_QueryBvhSphere(rdBvh *bvh, float x, float y, float z, float radius,
+                            rdObject **outObjects, int maxObjects);
+/* The nearest object whose box the ray hits within maxDistance, or NULL. The distance is in world
+ * units along the direction, which needn't be normalized. */
+rdObject *rd_RaycastBvh(rdBvh *bvh, float x, float y, float z, float dirX, float dirY, float dirZ,
+                        float maxDistance, float *outDistance);
 
 void rd_ResetDefaultCamera(void);
 void rd_PositionDefaultCamera(float x, float y, float z);
@@ -100,5 +289,8 @@ void rd_OrientDefaultCamera(float yaw, float pitch);
 void rd_RotateDefaultCamera(float yaw, float pitch);
 void rd_GetDefaultCameraPosition(float *x, float *y, float *z);
 void rd_GetDefaultCameraOrientation(float *yaw, float *pitch);
+/* Left, right, bottom, top, near and far plane, in the coordinates objects and the camera are
+ * positioned in; a point is inside if a * x + b * y + c * z + d >= 0 for all six */
+void rd_GetDefaultCameraFrustum(float outPlanes[6][4]);
 
 #endif
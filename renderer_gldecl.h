@@ -12,6 +12,54 @@
 #include <GL/gl.h>
 #endif
 
+#ifndef GL_HALF_FLOAT
+#define GL_HALF_FLOAT 0x140B
+#endif
+#ifndef GL_INT_2_10_10_10_REV
+#define GL_INT_2_10_10_10_REV 0x8D9F
+#endif
+#ifndef GL_COPY_READ_BUFFER
+#define GL_COPY_READ_BUFFER  0x8F36
+#define GL_COPY_WRITE_BUFFER 0x8F37
+#endif
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+#ifndef GL_QUERY_RESULT
+#define GL_QUERY_RESULT           0x8866
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+#endif
+#ifndef GL_ANY_SAMPLES_PASSED
+#define GL_ANY_SAMPLES_PASSED 0x8C2F
+#endif
+#ifndef GL_SAMPLES_PASSED
+#define GL_SAMPLES_PASSED 0x8914
+#endif
+#ifndef GL_QUERY_WAIT
+#define GL_QUERY_WAIT 0x8E13
+#endif
+#ifndef GL_R32F
+#define GL_R32F 0x822E
+#endif
+#ifndef GL_TEXTURE_BASE_LEVEL
+#define GL_TEXTURE_BASE_LEVEL 0x813C
+#define GL_TEXTURE_MAX_LEVEL  0x813D
+#endif
+#ifndef GL_TRANSFORM_FEEDBACK_BUFFER
+#define GL_TRANSFORM_FEEDBACK_BUFFER 0x8C8E
+#define GL_INTERLEAVED_ATTRIBS       0x8C8C
+#define GL_RASTERIZER_DISCARD        0x8C89
+#endif
+#ifndef GL_DRAW_INDIRECT_BUFFER
+#define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+#endif
+#ifndef GL_UNIFORM_BUFFER
+#define GL_UNIFORM_BUFFER 0x8A11
+#endif
+#ifndef GL_INVALID_INDEX
+#define GL_INVALID_INDEX 0xFFFFFFFFu
+#endif
+
 typedef void      (APIENTRY pglGenBuffers_t)(GLsizei, GLuint *);
 typedef void      (APIENTRY pglDeleteBuffers_t)(GLsizei, GLuint *);
 typedef void      (APIENTRY pglClearColor_t)(GLfloat, GLfloat, GLfloat, GLfloat);
@@ -25,6 +73,8 @@ typedef const GLubyte
 typedef GLenum    (APIENTRY pglGetError_t)(void);
 typedef void      (APIENTRY pglBindBuffer_t)(GLenum, GLuint);
 typedef void      (APIENTRY pglBufferData_t)(GLenum, GLsizeiptr, const GLvoid *, GLenum);
+typedef void      (APIENTRY pglBufferSubData_t)(GLenum, GLintptr, GLsizeiptr, const GLvoid *);
+typedef void      (APIENTRY pglCopyBufferSubData_t)(GLenum, GLenum, GLintptr, GLintptr, GLsizeiptr);
 typedef void      (APIENTRY pglGenVertexArrays_t)(GLsizei, GLuint *);
 typedef void      (APIENTRY pglDeleteVertexArrays_t)(GLsizei, GLuint *);
 typedef void      (APIENTRY pglBindVertexArray_t)(GLuint);
@@ -52,7 +102,9 @@ typedef void      (APIENTRY pglUniform1f_t)(GLint, GLfloat);
 typedef void      (APIENTRY pglUniform1fv_t)(GLint, GLsizei, const GLfloat *);
 typedef void      (APIENTRY pglUniform2fv_t)(GLint, GLsizei, const GLfloat *);
 typedef void      (APIENTRY pglUniform3fv_t)(GLint, GLsizei, const GLfloat *);
+typedef void      (APIENTRY pglUniform4fv_t)(GLint, GLsizei, const GLfloat *);
 typedef void      (APIENTRY pglDrawElements_t)(GLenum, GLsizei, GLenum, const GLvoid *);
+typedef void      (APIENTRY pglDrawElementsBaseVertex_t)(GLenum, GLsizei, GLenum, const GLvoid *, GLint);
 typedef void      (APIENTRY pglViewport_t)(GLint, GLint, GLsizei, GLsizei);
 typedef void      (APIENTRY pglCullFace_t)(GLenum);
 typedef void      (APIENTRY pglGenFramebuffers_t)(GLsizei, GLuint *);
@@ -76,6 +128,28 @@ typedef void      (APIENTRY pglDeleteRenderbuffers_t)(GLsizei, GLuint *);
 typedef void      (APIENTRY pglBindRenderbuffer_t)(GLenum, GLuint);
 typedef void      (APIENTRY pglRenderbufferStorage_t)(GLenum, GLenum, GLsizei, GLsizei);
 typedef void      (APIENTRY pglFramebufferRenderbuffer_t)(GLenum, GLenum, GLenum, GLuint);
+typedef void      (APIENTRY pglGenQueries_t)(GLsizei, GLuint *);
+typedef void      (APIENTRY pglDeleteQueries_t)(GLsizei, const GLuint *);
+typedef void      (APIENTRY pglBeginQuery_t)(GLenum, GLuint);
+typedef void      (APIENTRY pglEndQuery_t)(GLenum);
+typedef void      (APIENTRY pglGetQueryObjectuiv_t)(GLuint, GLenum, GLuint *);
+typedef void      (APIENTRY pglGetQueryObjectui64v_t)(GLuint, GLenum, GLuint64 *);
+typedef void      (APIENTRY pglBeginConditionalRender_t)(GLuint, GLenum);
+typedef void      (APIENTRY pglEndConditionalRender_t)(void);
+typedef void      (APIENTRY pglColorMask_t)(GLboolean, GLboolean, GLboolean, GLboolean);
+typedef void      (APIENTRY pglVertexAttribIPointer_t)(GLuint, GLint, GLenum, GLsizei, const GLvoid *);
+typedef void      (APIENTRY pglTransformFeedbackVaryings_t)(GLuint, GLsizei, const GLchar **, GLenum);
+typedef void      (APIENTRY pglBindBufferBase_t)(GLenum, GLuint, GLuint);
+typedef void      (APIENTRY pglBeginTransformFeedback_t)(GLenum);
+typedef void      (APIENTRY pglEndTransformFeedback_t)(void);
+typedef void      (APIENTRY pglDrawArraysIndirect_t)(GLenum, const GLvoid *);
+typedef void      (APIENTRY pglDrawElementsIndirect_t)(GLenum, GLenum, const GLvoid *);
+typedef void      (APIENTRY pglVertexAttribDivisor_t)(GLuint, GLuint);
+typedef void      (APIENTRY pglDrawArraysInstanced_t)(GLenum, GLint, GLsizei, GLsizei);
+typedef void      (APIENTRY pglDrawElementsInstancedBaseVertex_t)(GLenum, GLsizei, GLenum,
+                                                                 const GLvoid *, GLsizei, GLint);
+typedef GLuint    (APIENTRY pglGetUniformBlockIndex_t)(GLuint, const GLchar *);
+typedef void      (APIENTRY pglUniformBlockBinding_t)(GLuint, GLuint, GLuint);
 
 typedef struct rdGL rdGL;
 struct rdGL
@@ -92,6 +166,8 @@ struct rdGL
 	pglGetError_t                *GetError;
 	pglBindBuffer_t              *BindBuffer;
 	pglBufferData_t              *BufferData;
+	pglBufferSubData_t           *BufferSubData;
+	pglCopyBufferSubData_t       *CopyBufferSubData;
 	pglGenVertexArrays_t         *GenVertexArrays;
 	pglDeleteVertexArrays_t      *DeleteVertexArrays;
 	pglBindVertexArray_t         *BindVertexArray;
@@ -119,7 +195,9 @@ struct rdGL
 	pglUniform1fv_t              *Uniform1fv;
 	pglUniform2fv_t              *Uniform2fv;
 	pglUniform3fv_t              *Uniform3fv;
+	pglUniform4fv_t              *Uniform4fv;
 	pglDrawElements_t            *DrawElements;
+	pglDrawElementsBaseVertex_t  *DrawElementsBaseVertex;
 	pglViewport_t                *Viewport;
 	pglCullFace_t                *CullFace;
 	pglGenFramebuffers_t         *GenFramebuffers;
@@ -143,6 +221,29 @@ struct rdGL
 	pglBindRenderbuffer_t        *BindRenderbuffer;
 	pglRenderbufferStorage_t     *RenderbufferStorage;
 	pglFramebufferRenderbuffer_t *FramebufferRenderbuffer;
+	pglGenQueries_t              *GenQueries;
+	pglDeleteQueries_t           *DeleteQueries;
+	pglBeginQuery_t              *BeginQuery;
+	pglEndQuery_t                *EndQuery;
+	pglGetQueryObjectuiv_t       *GetQueryObjectuiv;
+	pglGetQueryObjectui64v_t     *GetQueryObjectui64v;
+	pglBeginConditionalRender_t  *BeginConditionalRender;
+	pglEndConditionalRender_t    *EndConditionalRender;
+	pglColorMask_t               *ColorMask;
+	pglVertexAttribIPointer_t    *VertexAttribIPointer;
+	pglTransformFeedbackVaryings_t
+	                             *TransformFeedbackVaryings;
+	pglBindBufferBase_t          *BindBufferBase;
+	pglBeginTransformFeedback_t  *BeginTransformFeedback;
+	pglEndTransformFeedback_t    *EndTransformFeedback;
+	pglDrawArraysIndirect_t      *DrawArraysIndirect;
+	pglDrawElementsIndirect_t    *DrawElementsIndirect;
+	pglVertexAttribDivisor_t     *VertexAttribDivisor;
+	pglDrawArraysInstanced_t     *DrawArraysInstanced;
+	pglDrawElementsInstancedBaseVertex_t
+	                             *DrawElementsInstancedBaseVertex;
+	pglGetUniformBlockIndex_t    *GetUniformBlockIndex;
+	pglUniformBlockBinding_t     *UniformBlockBinding;
 };
 
 #endif
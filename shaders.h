@@ -16,6 +16,18 @@ static const char *shaderSourceDepthOnlyVertex = GLSL(410 core,
 	}
 );
 
+/* Instances of a clone batch, for the shadow map and bloom passes. The matrices come from the
+ * instance buffer, one per instance. */
+static const char *shaderSourceDepthOnlyInstancedVertex = GLSL(410 core,
+	layout (location = 0) in vec3 vPosition;
+	layout (location = 2) in mat4 iMVP;
+
+	void main(void)
+	{
+		gl_Position = iMVP * vec4(vPosition, 1.0);
+	}
+);
+
 static const char *shaderSourceDepthOnlyFragment = GLSL(410 core,
 	void main(void)
 	{
@@ -41,6 +53,23 @@ static const char *shaderSourceDepthVelocityVertex = GLSL(410 core,
 	}
 );
 
+static const char *shaderSourceDepthVelocityInstancedVertex = GLSL(410 core,
+	layout (location = 0) in vec3 vPosition;
+	layout (location = 2) in mat4 iMVP;
+	layout (location = 6) in mat4 iPrevMVP;
+
+	out vec4 currPos;
+	out vec4 prevPos;
+
+	void main(void)
+	{
+		currPos = iMVP * vec4(vPosition, 1.0);
+		prevPos = iPrevMVP * vec4(vPosition, 1.0);
+
+		gl_Position = currPos;
+	}
+);
+
 static const char *shaderSourceDepthVelocityFragment = GLSL(410 core,
 	layout (location = 0) out vec2 velocity;
 
@@ -117,6 +146,64 @@ static const char *shaderSourceGeometryVertex = GLSL(410 core,
 	}
 );
 
+static const char *shaderSourceGeometryInstancedVertex = GLSL(410 core,
+	layout(location = 0)  in vec3 vPosition;
+	layout(location = 1)  in vec3 vNormal;
+	layout(location = 2)  in mat4 iMVP;
+	layout(location = 6)  in mat4 iModelView;
+	layout(location = 10) in mat3 iNormal;
+	layout(location = 13) in int  iMaterialID;
+
+	uniform bool paintjob;
+
+	out vec3  uNormal;
+	out vec3  uFragPos;
+	out float uMaterialID;
+
+	int ResolvePaintjob(vec2 n, int materialID);
+	float EncodeMaterialID(int id);
+
+	void main(void)
+	{
+		vec4 viewPos = iModelView * vec4(vPosition, 1.0);
+
+		uFragPos = viewPos.xyz;
+		uNormal = iNormal * vNormal;
+
+		int tmpID;
+
+		if (paintjob)
+			tmpID = ResolvePaintjob(vNormal.xy, iMaterialID);
+		else
+			tmpID = iMaterialID;
+		uMaterialID = EncodeMaterialID(tmpID);
+		gl_Position = iMVP * vec4(vPosition, 1.0);
+	}
+
+	int ResolvePaintjob(vec2 n, int materialID)
+	{
+		int id;
+
+		if (n.y > 0)
+			id = materialID + 0;
+		else if (n.x > 0)
+			id = materialID + 1;
+		else if (n.x < 0)
+			id = materialID + 2;
+		else if (n.y < 0)
+			id = materialID + 4;
+		else
+			id = materialID + 3;
+
+		return id;
+	}
+
+	float EncodeMaterialID(int id)
+	{
+		return float(id) / 255.0;
+	}
+);
+
 static const char *shaderSourceGeometryFragment = GLSL(410 core,
 	layout (location = 0) out float outMaterialID;
 	layout (location = 1) out vec2  outNormal;
@@ -148,6 +235,168 @@ static const char *shaderSourceGeometryFragment = GLSL(410 core,
 	}
 );
 
+/* The depth-velocity and geometry passes in one, writing every G-buffer target from a single
+ * draw */
+static const char *shaderSourceGeometryVelocityVertex = GLSL(410 core,
+	layout(location = 0) in vec3 vPosition;
+	layout(location = 1) in vec3 vNormal;
+
+	uniform mat4 mMVP;
+	uniform mat4 mPrevMVP;
+	uniform mat3 mNormal;
+	uniform bool paintjob;
+	uniform int  materialID;
+
+	out vec3  uNormal;
+	out float uMaterialID;
+	out vec4  currPos;
+	out vec4  prevPos;
+
+	int ResolvePaintjob(vec2 n, int materialID);
+	float EncodeMaterialID(int id);
+
+	void main(void)
+	{
+		uNormal = mNormal * vNormal;
+
+		int tmpID;
+
+		if (paintjob)
+			tmpID = ResolvePaintjob(vNormal.xy, materialID);
+		else
+			tmpID = materialID;
+		uMaterialID = EncodeMaterialID(tmpID);
+
+		currPos = mMVP * vec4(vPosition, 1.0);
+		prevPos = mPrevMVP * vec4(vPosition, 1.0);
+
+		gl_Position = currPos;
+	}
+
+	int ResolvePaintjob(vec2 n, int materialID)
+	{
+		int id;
+
+		if (n.y > 0)
+			id = materialID + 0;
+		else if (n.x > 0)
+			id = materialID + 1;
+		else if (n.x < 0)
+			id = materialID + 2;
+		else if (n.y < 0)
+			id = materialID + 4;
+		else
+			id = materialID + 3;
+
+		return id;
+	}
+
+	float EncodeMaterialID(int id)
+	{
+		return float(id) / 255.0;
+	}
+);
+
+static const char *shaderSourceGeometryVelocityInstancedVertex = GLSL(410 core,
+	layout(location = 0)  in vec3 vPosition;
+	layout(location = 1)  in vec3 vNormal;
+	layout(location = 2)  in mat4 iMVP;
+	layout(location = 6)  in mat4 iPrevMVP;
+	layout(location = 10) in mat3 iNormal;
+	layout(location = 13) in int  iMaterialID;
+
+	uniform bool paintjob;
+
+	out vec3  uNormal;
+	out float uMaterialID;
+	out vec4  currPos;
+	out vec4  prevPos;
+
+	int ResolvePaintjob(vec2 n, int materialID);
+	float EncodeMaterialID(int id);
+
+	void main(void)
+	{
+		uNormal = iNormal * vNormal;
+
+		int tmpID;
+
+		if (paintjob)
+			tmpID = ResolvePaintjob(vNormal.xy, iMaterialID);
+		else
+			tmpID = iMaterialID;
+		uMaterialID = EncodeMaterialID(tmpID);
+
+		currPos = iMVP * vec4(vPosition, 1.0);
+		prevPos = iPrevMVP * vec4(vPosition, 1.0);
+
+		gl_Position = currPos;
+	}
+
+	int ResolvePaintjob(vec2 n, int materialID)
+	{
+		int id;
+
+		if (n.y > 0)
+			id = materialID + 0;
+		else if (n.x > 0)
+			id = materialID + 1;
+		else if (n.x < 0)
+			id = materialID + 2;
+		else if (n.y < 0)
+			id = materialID + 4;
+		else
+			id = materialID + 3;
+
+		return id;
+	}
+
+	float EncodeMaterialID(int id)
+	{
+		return float(id) / 255.0;
+	}
+);
+
+static const char *shaderSourceGeometryVelocityFragment = GLSL(410 core,
+	layout (location = 0) out float outMaterialID;
+	layout (location = 1) out vec2  outNormal;
+	layout (location = 2) out vec2  velocity;
+
+	in vec3  uNormal;
+	in float uMaterialID;
+	in vec4  currPos;
+	in vec4  prevPos;
+
+	uniform vec2 currJitter;
+	uniform vec2 prevJitter;
+
+	vec2 EncodeNormal(vec3 v);
+
+	void main(void)
+	{
+		vec2 currPosNDC = (currPos.xy / currPos.w) * 0.5 + 0.5;
+		vec2 prevPosNDC = (prevPos.xy / prevPos.w) * 0.5 + 0.5;
+
+		outMaterialID = uMaterialID;
+		outNormal = EncodeNormal(uNormal);
+		velocity = (currPosNDC - currJitter) - (prevPosNDC - prevJitter);
+	}
+
+	vec2 EncodeNormal(vec3 v)
+	{
+		float l1norm = abs(v.x) + abs(v.y) + abs(v.z);
+		vec2  result = v.xy * (1.0 / l1norm);
+
+		if (v.z < 0.0) {
+			vec2 snz = vec2(result.x >= 0.0 ? 1.0 : -1.0, result.y >= 0.0 ? 1.0 : -1.0);
+
+			result = (1.0 - abs(result.yx)) * snz;
+		}
+
+		return result;
+	}
+);
+
 static const char *shaderSourceLightingVertex = GLSL(410 core,
 	layout (location = 0) in vec2 vPos;
 	layout (location = 1) in vec2 vUV;
@@ -176,16 +425,26 @@ static const char *shaderSourceLightingFragment = GLSL(410 core,
 	uniform sampler2D bloomRawTexture;
 	uniform sampler2D bloomBlurredTexture;
 
-	uniform mat4 mInvProjection;
-	uniform vec3 viewspaceUp;
+	layout(std140, row_major) uniform FrameBlock
+	{
+		mat4 mProjection;
+		mat4 mInvProjection;
+		vec4 viewspaceUp;
+	};
 
-	uniform vec3 materialColors[64];
-	uniform vec3 materialProperties[64];
+	layout(std140) uniform LightBlock
+	{
+		vec4 lightPositions[64];
+		vec4 lightColors[64];
+		vec4 lightProperties[64];
+		int  numLights;
+	};
 
-	uniform int  numLights;
-	uniform vec3 lightPositions[64];
-	uniform vec3 lightColors[64];
-	uniform vec3 lightProperties[64];
+	layout(std140) uniform MaterialBlock
+	{
+		vec4 materialColors[64];
+		vec4 materialProperties[64];
+	};
 
 	struct Light
 	{
@@ -235,7 +494,7 @@ static const char *shaderSourceLightingFragment = GLSL(410 core,
 
 		Material material;
 
-		material.color     = materialColors[materialID];
+		material.color     = materialColors[materialID].rgb;
 		material.metalness = materialProperties[materialID].x;
 		material.roughness = materialProperties[materialID].y;
 		material.ambient   = materialProperties[materialID].z;
@@ -249,8 +508,8 @@ static const char *shaderSourceLightingFragment = GLSL(410 core,
 		for (int i = 0; i < numLights; i++) {
 			Light light;
 
-			light.position = lightPositions[i];
-			light.color    = lightColors[i];
+			light.position = lightPositions[i].xyz;
+			light.color    = lightColors[i].rgb;
 
 			light.intensity    = lightProperties[i].x;
 			light.cutoffRadius = lightProperties[i].y;
@@ -261,7 +520,7 @@ static const char *shaderSourceLightingFragment = GLSL(410 core,
 			if (distance > light.cutoffRadius)
 				continue;
 
-			vec3 l = mix(normalize(light.position - fragPos), -viewspaceUp, light.upward);
+			vec3 l = mix(normalize(light.position - fragPos), -viewspaceUp.xyz, light.upward);
 			vec3 h = normalize(v + l);
 
 			vec3  illum = Illuminate(light, material, f0, v, n, l, h, distance);
@@ -473,49 +732,68 @@ static const char *shaderSourceSSAOFragment = GLSL(410 core,
 	}
 );
 
-static const char *shaderSourceShadowVertex = GLSL(410 core,
-	layout (location = 0) in vec3 vPosition;
-	layout (location = 1) in vec3 vNormal;
-
-	uniform mat4 mMVP;
-	uniform mat3 mNormal;
-	uniform mat4 mModelView;
-	uniform mat4 mModelLightspace;
+static const char *shaderSourceShadowResolveVertex = GLSL(410 core,
+	layout (location = 0) in vec2 vPos;
+	layout (location = 1) in vec2 vUV;
 
-	out vec3 uNormal;
-	out vec3 uFragPos;
-	out vec4 uFragPosLightspace;
+	out vec2 uUV;
 
 	void main(void)
 	{
-		uNormal = mNormal * vNormal;
-		uFragPos = (mModelView * vec4(vPosition, 1.0)).xyz;
-		uFragPosLightspace = mModelLightspace * vec4(vPosition, 1.0);
-		gl_Position = mMVP * vec4(vPosition, 1.0);
+		uUV = vUV;
+		gl_Position = vec4(vPos.x, vPos.y, 0.0, 1.0);
 	}
 );
 
-static const char *shaderSourceShadowFragment = GLSL(410 core,
-	in  vec3 uNormal;
-	in  vec3 uFragPos;
-	in  vec4 uFragPosLightspace;
+/* Shadows of every shadow map over the pixels inside the box around its receivers. The array
+ * sizes are RD_SHADOW_RESOLVE_MAPS. */
+static const char *shaderSourceShadowResolveFragment = GLSL(410 core,
+	in  vec2 uUV;
 	out float outValue;
 
-	uniform sampler2D shadowMapTexture;
+	uniform sampler2D depthTexture;
+	uniform sampler2D normalTexture;
+	uniform sampler2D shadowMapTextures[8];
+
+	uniform mat4 mInvProjection;
+	uniform mat4 mInvView;
 
-	uniform vec3 actualLightPosition;
+	uniform int  numShadowMaps;
+	uniform mat4 mLightspace[8];
+	uniform vec3 lightPositions[8];
+	uniform vec3 receiverMin[8];
+	uniform vec3 receiverMax[8];
 
-	float Shadow(vec4 fragPosLightspace, float bias);
+	float Shadow(sampler2D shadowMapTexture, vec4 fragPosLightspace, float bias);
+	vec3  PositionFromDepth(float depth, vec2 uv);
+	vec3  DecodeNormal(vec2 f);
 
 	void main(void)
 	{
-		vec3  l    = normalize(actualLightPosition - uFragPos);
-		float bias = max(0.06 * (1.0 - dot(uNormal, l)), 0.005);
+		float depth = texture(depthTexture, uUV).r;
+
+		outValue = 0.0;
+		if (depth == 1.0)
+			return;
+
+		vec3 fragPos      = PositionFromDepth(depth, uUV);
+		vec3 n            = DecodeNormal(texture(normalTexture, uUV).rg);
+		vec4 fragPosWorld = mInvView * vec4(fragPos, 1.0);
+
+		for (int i = 0; i < numShadowMaps; i++) {
+			if (any(lessThan(fragPosWorld.xyz, receiverMin[i])) ||
+			    any(greaterThan(fragPosWorld.xyz, receiverMax[i])))
+				continue;
 
-		outValue = Shadow(uFragPosLightspace, bias);
+			vec3  l    = normalize(lightPositions[i] - fragPos);
+			float bias = max(0.06 * (1.0 - dot(n, l)), 0.005);
+
+			outValue = max(outValue, Shadow(shadowMapTextures[i], mLightspace[i] * fragPosWorld,
+			                                bias));
+		}
 	}
 
-	float Shadow(vec4 fragPosLightspace, float bias)
+	float Shadow(sampler2D shadowMapTexture, vec4 fragPosLightspace, float bias)
 	{
 		float shadow = 0.0;
 
@@ -527,7 +805,6 @@ static const char *shaderSourceShadowFragment = GLSL(410 core,
 
 		projUV = projUV * 0.5 + 0.5;
 
-		float closestDepth = texture(shadowMapTexture, projUV.xy).r;
 		float currentDepth = projUV.z;
 
 		for (int x = -2; x <= 2; x++) {
@@ -540,6 +817,28 @@ static const char *shaderSourceShadowFragment = GLSL(410 core,
 		shadow = shadow / 25.0;
 		return shadow;
 	}
+
+	vec3 PositionFromDepth(float depth, vec2 uv)
+	{
+		float z = depth * 2.0 - 1.0;
+
+		vec4 posClip = vec4(uv * 2.0 - 1.0, z, 1.0);
+		vec4 posView = mInvProjection * posClip;
+
+		posView /= posView.w;
+
+		return posView.xyz;
+	}
+
+	vec3 DecodeNormal(vec2 f)
+	{
+		vec3 v = vec3(f.x, f.y, 1.0 - abs(f.x) - abs(f.y));
+		if (v.z < 0.0) {
+			vec2 snz = vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+			v.xy = (1.0 - abs(v.yx)) * snz;
+		}
+		return normalize(v); 
+	}
 );
 
 static const char *shaderSourceBloomVertex = GLSL(410 core,
@@ -579,8 +878,18 @@ static const char *shaderSourceSSRFragment = GLSL(410 core,
 	in  vec2 uUV;
 	out vec4 outColor;
 
-	uniform mat4 mProjection;
-	uniform mat4 mInvProjection;
+	layout(std140, row_major) uniform FrameBlock
+	{
+		mat4 mProjection;
+		mat4 mInvProjection;
+		vec4 viewspaceUp;
+	};
+
+	layout(std140) uniform MaterialBlock
+	{
+		vec4 materialColors[64];
+		vec4 materialProperties[64];
+	};
 
 	uniform sampler2D depthTexture;
 
@@ -589,8 +898,6 @@ static const char *shaderSourceSSRFragment = GLSL(410 core,
 
 	uniform sampler2D colorTexture;
 
-	uniform float reflectanceProperties[256];
-
 	struct Ray {
 		vec3 o;
 		vec3 oScreen;
@@ -619,7 +926,7 @@ static const char *shaderSourceSSRFragment = GLSL(410 core,
 		Ray   ray;
 
 		int   materialID  = DecodeMaterialId(texture(materialIDTexture, uUV).r);
-		float reflectance = reflectanceProperties[materialID];
+		float reflectance = materialProperties[materialID].w;
 
 		if (reflectance == 0.0) {
 			outColor = vec4(0.0);
@@ -736,14 +1043,18 @@ static const char *shaderSourceCompositeFragment = GLSL(410 core,
 	uniform sampler2D reflectionsTexture;
 	uniform sampler2D materialIDTexture;
 
-	uniform float reflectanceProperties[64];
+	layout(std140) uniform MaterialBlock
+	{
+		vec4 materialColors[64];
+		vec4 materialProperties[64];
+	};
 
 	int DecodeMaterialId(float id);
 
 	void main(void)
 	{
 		int   materialID  = DecodeMaterialId(texture(materialIDTexture, uUV).r);
-		float reflectance = reflectanceProperties[materialID];
+		float reflectance = materialProperties[materialID].w;
 
 		vec3  colorRaw     = texture(colorTexture, uUV).rgb;
 		vec3  colorReflect = texture(reflectionsTexture, uUV).rgb;
@@ -1356,3 +1667,154 @@ static const char *shaderSourceDebugNormalsFragment = GLSL(410 core,
 		return normalize(v); 
 	}
 );
+
+/* Hierarchical-Z shaders:
+
+   Each level of the pyramid keeps the farthest depth of the 2x2 texels below it; at an odd edge
+   the last texel takes in the extra row or column, so every texel of the level below is covered.
+   The cull shader runs once per cull list entry with the rasterizer off, and writes a draw
+   command through transform feedback: an empty one if the box is outside the frustum or behind
+   the depth of the previous frame, otherwise the level of detail lo_SelectLod would pick. The
+   levels are in the attributes, so RD_MAX_LODS can't exceed 4 without changing their types.
+*/
+
+static const char *shaderSourceHiZVertex = GLSL(410 core,
+	layout (location = 0) in vec2 vPosition;
+
+	void main(void)
+	{
+		gl_Position = vec4(vPosition.x, vPosition.y, 0.0, 1.0);
+	}
+);
+
+static const char *shaderSourceHiZFragment = GLSL(410 core,
+	out float outDepth;
+
+	uniform sampler2D inputTexture;
+
+	void main(void)
+	{
+		ivec2 last  = textureSize(inputTexture, 0) - 1;
+		ivec2 texel = ivec2(gl_FragCoord.xy) * 2;
+		ivec2 span  = ivec2(texel.x + 2 == last.x ? 2 : 1, texel.y + 2 == last.y ? 2 : 1);
+		float depth = 0.0;
+
+		for (int y = 0; y <= span.y; y++) {
+			for (int x = 0; x <= span.x; x++)
+				depth = max(depth, texelFetch(inputTexture, min(texel + ivec2(x, y), last), 0).r);
+		}
+
+		outDepth = depth;
+	}
+);
+
+static const char *shaderSourceCullVertex = GLSL(410 core,
+	layout (location = 0) in vec4  vCenter;
+	layout (location = 1) in vec4  vExtent;
+	layout (location = 2) in vec4  vLodErrors;
+	layout (location = 3) in uvec4 vLodCounts;
+	layout (location = 4) in uvec4 vLodFirsts;
+	layout (location = 5) in ivec2 vLodInfo;
+
+	flat out uvec4 command;
+	flat out uint  reserved;
+
+	uniform vec4      planes[6];
+	uniform vec4      viewDepthRow;
+	uniform float     pixelScale;
+	uniform float     maxPixelError;
+	uniform mat4      mPrevViewProjection;
+	uniform sampler2D hiZTexture;
+	uniform int       hiZLevels;
+	uniform vec2      screenSize;
+
+	bool isInFrustum(void)
+	{
+		for (int i = 0; i < 6; i++) {
+			if (dot(planes[i].xyz, vCenter.xyz) + planes[i].w +
+			    dot(abs(planes[i].xyz), vExtent.xyz) < 0.0)
+				return false;
+		}
+
+		return true;
+	}
+
+	bool isOccluded(void)
+	{
+		vec3  ndcMin = vec3(1.0e30);
+		vec3  ndcMax = vec3(-1.0e30);
+		ivec2 pixMin;
+		ivec2 pixMax;
+		ivec2 texMin;
+		ivec2 texMax;
+		ivec2 last;
+		int   span;
+		int   level;
+		float farthest;
+
+		for (int i = 0; i < 8; i++) {
+			vec3 corner = vec3((i & 1) != 0 ? 1.0 : -1.0, (i & 2) != 0 ? 1.0 : -1.0,
+			                   (i & 4) != 0 ? 1.0 : -1.0);
+			vec4 clip   = mPrevViewProjection * vec4(vCenter.xyz + corner * vExtent.xyz, 1.0);
+
+			if (clip.w <= 0.0)
+				return false;
+
+			ndcMin = min(ndcMin, clip.xyz / clip.w);
+			ndcMax = max(ndcMax, clip.xyz / clip.w);
+		}
+
+		if (ndcMin.z < -1.0 || any(lessThan(ndcMax.xy, vec2(-1.0))) ||
+		    any(greaterThan(ndcMin.xy, vec2(1.0))))
+			return false;
+
+		pixMin = ivec2(clamp((ndcMin.xy * 0.5 + 0.5) * screenSize, vec2(0.0), screenSize - 1.0));
+		pixMax = ivec2(clamp((ndcMax.xy * 0.5 + 0.5) * screenSize, vec2(0.0), screenSize - 1.0));
+
+		span  = max(pixMax.x - pixMin.x, pixMax.y - pixMin.y);
+		level = clamp(int(ceil(log2(float(span + 1)))) - 1, 0, hiZLevels - 1);
+
+		last   = textureSize(hiZTexture, level) - 1;
+		texMin = min(pixMin >> (level + 1), last);
+		texMax = min(pixMax >> (level + 1), last);
+
+		farthest = max(max(texelFetch(hiZTexture, texMin, level).r,
+		                   texelFetch(hiZTexture, ivec2(texMax.x, texMin.y), level).r),
+		               max(texelFetch(hiZTexture, ivec2(texMin.x, texMax.y), level).r,
+		                   texelFetch(hiZTexture, texMax, level).r));
+
+		return ndcMin.z * 0.5 + 0.5 > farthest;
+	}
+
+	int selectLod(void)
+	{
+		float depth = -dot(viewDepthRow, vec4(vCenter.xyz, 1.0)) - vCenter.w;
+		int   lod   = 0;
+
+		if (depth > 0.0) {
+			float pixelsPerUnit = pixelScale * vExtent.w / depth;
+
+			for (lod = vLodInfo.x - 1; lod > 0; lod--) {
+				if (vLodErrors[lod] * pixelsPerUnit <= maxPixelError)
+					break;
+			}
+		}
+
+		return lod;
+	}
+
+	void main(void)
+	{
+		int lod;
+
+		reserved = 0u;
+
+		if (vLodInfo.x == 0 || !isInFrustum() || (hiZLevels > 0 && isOccluded())) {
+			command = uvec4(0u);
+			return;
+		}
+
+		lod     = selectLod();
+		command = uvec4(vLodCounts[lod], 1u, vLodFirsts[lod], uint(vLodInfo.y));
+	}
+);